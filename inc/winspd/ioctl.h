@@ -35,7 +35,28 @@ extern "C" {
 #define SPD_IOCTL_BTL_T(Btl)            (((Btl) >> 8) & 0xff)
 #define SPD_IOCTL_BTL_L(Btl)            ((Btl) & 0xff)
 #define SPD_IOCTL_STORAGE_UNIT_CAPACITY 16
-#define SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY 64
+#define SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY 1024
+
+/*
+ * Storage units are numbered by index: index I is target I % 64, LUN I / 64 % 8
+ * and bus I / 512. The first 64 storage units are LUN 0 of the targets of bus 0.
+ */
+#define SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT 64
+#define SPD_IOCTL_STORAGE_UNIT_LUN_COUNT 8
+#define SPD_IOCTL_STORAGE_UNIT_BUS_COUNT \
+    (SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY / \
+        (SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT * SPD_IOCTL_STORAGE_UNIT_LUN_COUNT))
+#define SPD_IOCTL_BTL_FROM_INDEX(I)     SPD_IOCTL_BTL(\
+    (I) / (SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT * SPD_IOCTL_STORAGE_UNIT_LUN_COUNT),\
+    (I) % SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT,\
+    (I) / SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT % SPD_IOCTL_STORAGE_UNIT_LUN_COUNT)
+#define SPD_IOCTL_INDEX_FROM_BTL(Btl)   (\
+    SPD_IOCTL_STORAGE_UNIT_BUS_COUNT > SPD_IOCTL_BTL_B(Btl) &&\
+    SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT > SPD_IOCTL_BTL_T(Btl) &&\
+    SPD_IOCTL_STORAGE_UNIT_LUN_COUNT > SPD_IOCTL_BTL_L(Btl) ?\
+        (SPD_IOCTL_BTL_B(Btl) * SPD_IOCTL_STORAGE_UNIT_LUN_COUNT + SPD_IOCTL_BTL_L(Btl)) *\
+            SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT + SPD_IOCTL_BTL_T(Btl) :\
+        (UINT32)-1)
 
 /* alignment macros */
 #define SPD_IOCTL_ALIGN_UP(x, s)        (((x) + ((s) - 1L)) & ~((s) - 1L))
@@ -49,6 +70,31 @@ extern "C" {
 #define SPD_IOCTL_LIST                  ('l')
 #define SPD_IOCTL_TRANSACT              ('t')
 #define SPD_IOCTL_SET_TRANSACT_PID      ('i')
+#define SPD_IOCTL_TRANSACT_V            ('v')
+#define SPD_IOCTL_REGISTER_BUFFER_POOL  ('b')
+#define SPD_IOCTL_REGISTER_RING         ('r')
+#define SPD_IOCTL_ENTER_RING            ('e')
+#define SPD_IOCTL_GET_STATS             ('s')
+#define SPD_IOCTL_REGISTER_ALLOCATION_MAP ('a')
+
+/* maximum number of responses/requests in a single SPD_IOCTL_TRANSACT_V */
+#define SPD_IOCTL_TRANSACT_V_CAPACITY   16
+
+/* maximum number of entries in a shared-memory ring (SPD_IOCTL_REGISTER_RING) */
+#define SPD_IOCTL_RING_CAPACITY         256
+
+/*
+ * Allocation map (SPD_IOCTL_REGISTER_ALLOCATION_MAP): bit I of the map (bit I % 32 of
+ * UINT32 I / 32) covers blocks [I << BlockShift, (I + 1) << BlockShift); a clear bit
+ * means that none of these blocks is allocated and that they read back as zeroes.
+ */
+#define SPD_IOCTL_ALLOCATION_MAP_SIZE(BlockCount, BlockShift)\
+    (SPD_IOCTL_ALIGN_UP(((UINT64)(BlockCount) + (1ULL << (BlockShift)) - 1) >> (BlockShift), 32) / 8)
+#define SPD_IOCTL_ALLOCATION_MAP_MAX_SIZE (64 * 1024 * 1024)
+
+/* statistics (SPD_IOCTL_GET_STATS) */
+#define SPD_IOCTL_STATS_KIND_CAPACITY   16
+#define SPD_IOCTL_STATS_HISTOGRAM_SIZE  32
 
 /* IOCTL_MINIPORT_PROCESS_SERVICE_IRP marshalling */
 #pragma warning(push)
@@ -60,6 +106,9 @@ enum
     SpdIoctlTransactWriteKind,
     SpdIoctlTransactFlushKind,
     SpdIoctlTransactUnmapKind,
+    SpdIoctlTransactWriteSameKind,
+    SpdIoctlTransactCopyKind,
+    SpdIoctlTransactSetCacheKind,
     SpdIoctlTransactKindCount,
 };
 typedef struct
@@ -74,8 +123,22 @@ typedef struct
     UINT32 CacheSupported:1;
     UINT32 UnmapSupported:1;
     UINT32 EjectDisabled:1;             /* disables UI eject */
+    UINT32 MergeSequential:1;           /* merge queued sequential reads/writes into one request */
+    UINT32 CopySupported:1;             /* offloaded data transfer (POPULATE/WRITE USING TOKEN) */
     UINT32 MaxTransferLength;
-    UINT64 Reserved[8];
+    UINT32 ZeroCopyThreshold;           /* map I/O of at least this length into user mode; 0: never */
+    UINT32 SpinTimeLimit;               /* max microseconds a dispatcher spins for a request; 0: never */
+    UINT8 HighPriorityWeight;           /* dispatch weight of flush/FUA/high priority I/O; 0: default */
+    UINT8 NormalPriorityWeight;         /* dispatch weight of normal priority I/O; 0: default */
+    UINT8 LowPriorityWeight;            /* dispatch weight of low priority I/O and unmap; 0: default */
+    UINT8 Reserved8;
+    UINT32 QueueDepth;                  /* max outstanding SRB's per LUN; 0: StorPort default */
+    UINT32 PhysicalBlockLength;         /* power of 2 multiple of BlockLength; 0: BlockLength */
+    UINT32 OptimalTransferLength;       /* multiple of BlockLength; 0: not reported */
+    UINT32 OptimalTransferGranularity;  /* multiple of BlockLength; 0: PhysicalBlockLength */
+    UINT32 UnmapGranularity;            /* multiple of BlockLength; 0: not reported */
+    UINT32 UnmapGranularityAlignment;   /* first block of an unmap granule; < granule blocks */
+    UINT32 Reserved32[8];
 } SPD_IOCTL_STORAGE_UNIT_PARAMS;
 #if defined(WINSPD_SYS_INTERNAL)
 static_assert(128 == sizeof(SPD_IOCTL_STORAGE_UNIT_PARAMS),
@@ -104,9 +167,43 @@ static_assert(16 == sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR),
     "16 == sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR)");
 #endif
 typedef struct
+{
+    UINT64 BlockAddress;                /* destination */
+    UINT64 SourceBlockAddress;
+    UINT32 BlockCount;
+    UINT32 Reserved;
+} SPD_IOCTL_COPY_DESCRIPTOR;
+#if defined(WINSPD_SYS_INTERNAL)
+static_assert(24 == sizeof(SPD_IOCTL_COPY_DESCRIPTOR),
+    "24 == sizeof(SPD_IOCTL_COPY_DESCRIPTOR)");
+#endif
+/*
+ * Counters are indexed by transact kind. Histogram bucket 0 counts latencies under 1us;
+ * bucket I counts latencies in [2^(I-1), 2^I) us; the last bucket is open ended.
+ */
+typedef struct
+{
+    UINT64 PostCount[SPD_IOCTL_STATS_KIND_CAPACITY];        /* SRB's queued */
+    UINT64 CompleteCount[SPD_IOCTL_STATS_KIND_CAPACITY];    /* SRB's completed (any status) */
+    UINT64 ByteCount[SPD_IOCTL_STATS_KIND_CAPACITY];        /* bytes of successful SRB's */
+    UINT64 ErrorCount;                  /* SRB's completed with an error */
+    UINT64 AbortCount;                  /* SRB's aborted (cancel, reset, unprovision) */
+    UINT64 SplitCount;                  /* chunks dispatched beyond the first of an SRB */
+    UINT64 MergeCount;                  /* SRB's dispatched as part of a preceding SRB's request */
+    UINT32 PendingDepth, PendingDepthMax;   /* SRB's waiting for a dispatcher */
+    UINT32 ProcessDepth, ProcessDepthMax;   /* chunks being processed by dispatchers */
+    UINT64 QueueWaitHistogram[SPD_IOCTL_STATS_HISTOGRAM_SIZE];      /* queued to dispatched */
+    UINT64 ServiceTimeHistogram[SPD_IOCTL_STATS_HISTOGRAM_SIZE];    /* dispatched to response */
+} SPD_IOCTL_STORAGE_UNIT_STATS;
+#if defined(WINSPD_SYS_INTERNAL)
+static_assert(SpdIoctlTransactKindCount <= SPD_IOCTL_STATS_KIND_CAPACITY,
+    "SpdIoctlTransactKindCount <= SPD_IOCTL_STATS_KIND_CAPACITY");
+#endif
+typedef struct
 {
     UINT64 Hint;
     UINT8 Kind;
+    UINT32 PendingDepth;                /* SRB's still waiting for a transact after this one */
     union
     {
         struct
@@ -132,7 +229,24 @@ typedef struct
         {
             UINT32 Count;
         } Unmap;
+        struct
+        {
+            UINT64 BlockAddress;
+            UINT32 BlockCount;
+            UINT32 Unmap:1;             /* blocks may be unmapped if the pattern is all zeroes */
+            UINT32 Reserved:31;
+        } WriteSame;                    /* data buffer holds a single block of pattern data */
+        struct
+        {
+            UINT32 Count;
+        } Copy;                         /* data buffer holds Count copy descriptors */
+        struct
+        {
+            UINT32 WriteCacheEnabled:1; /* 0: write-through; flush any cached data */
+            UINT32 Reserved:31;
+        } SetCache;
     } Op;
+    UINT64 MappedDataBuffer;            /* if not 0: I/O buffer mapped into the process (zero-copy) */
 } SPD_IOCTL_TRANSACT_REQ;
 typedef struct
 {
@@ -181,6 +295,8 @@ typedef struct
     UINT32 Btl;
     UINT32 ReqValid:1;
     UINT32 RspValid:1;
+    UINT32 DataIndexValid:1;            /* DataBuffer is an index into the buffer pool */
+    UINT32 WaitTimeout;                 /* milliseconds to wait for a request; 0: wait forever */
     UINT64 DataBuffer;
     union
     {
@@ -189,11 +305,114 @@ typedef struct
     } Dir;
 } SPD_IOCTL_TRANSACT_PARAMS;
 typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT16 RspCount;                    /* in: responses in Dir */
+    UINT16 ReqCount;                    /* in: max requests wanted; out: requests in Dir */
+    UINT32 DataIndexValid:1;            /* DataBuffer is an index into the buffer pool */
+    UINT64 DataBuffer;                  /* data slot I at DataBuffer + I * MaxTransferLength */
+    union
+    {
+        SPD_IOCTL_TRANSACT_REQ Req;
+        SPD_IOCTL_TRANSACT_RSP Rsp;
+    } Dir[SPD_IOCTL_TRANSACT_V_CAPACITY];
+} SPD_IOCTL_TRANSACT_V_PARAMS;
+typedef struct
 {
     SPD_IOCTL_BASE_PARAMS Base;
     UINT32 Btl;
     UINT32 ProcessId;
 } SPD_IOCTL_SET_TRANSACT_PID_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 BufferCount;                 /* 0 to unregister */
+    UINT64 Buffer;                      /* buffer I at Buffer + I * MaxTransferLength */
+} SPD_IOCTL_REGISTER_BUFFER_POOL_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 EntryCount;                  /* power of 2 up to SPD_IOCTL_RING_CAPACITY; 0 to unregister */
+    UINT64 Buffer;                      /* SPD_IOCTL_RING_SIZE(EntryCount, MaxTransferLength) bytes */
+} SPD_IOCTL_REGISTER_RING_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Wait:1;                      /* wait for a request if the request ring is empty */
+} SPD_IOCTL_ENTER_RING_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    union
+    {
+        struct
+        {
+            UINT32 Btl;
+        } Par;
+        struct
+        {
+            SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+        } Ret;
+    } Dir;
+} SPD_IOCTL_GET_STATS_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 BlockShift;                  /* each bit covers 2^BlockShift blocks */
+    UINT64 Buffer;                      /* SPD_IOCTL_ALLOCATION_MAP_SIZE bytes; 0 to unregister */
+} SPD_IOCTL_REGISTER_ALLOCATION_MAP_PARAMS;
+
+/*
+ * Shared-memory ring layout:
+ *
+ * - SPD_IOCTL_RING_HEADER
+ * - SPD_IOCTL_RING_REQ[EntryCount]: produced by the driver; consumed by the dispatcher
+ * - SPD_IOCTL_RING_RSP[EntryCount]: produced by the dispatcher; consumed by the driver
+ * - data slots at SPD_IOCTL_RING_DATA_OFFSET; slot I is MaxTransferLength bytes at
+ *   SPD_IOCTL_RING_DATA_OFFSET + I * MaxTransferLength
+ *
+ * Heads and tails are free running counters; counter C refers to entry C % EntryCount.
+ * A request names its data slot in DataIndex; the response must name the same slot.
+ */
+typedef struct
+{
+    volatile UINT32 ReqHead;            /* written by the driver */
+    UINT32 Reserved0[15];
+    volatile UINT32 ReqTail;            /* written by the dispatcher */
+    UINT32 Reserved1[15];
+    volatile UINT32 RspHead;            /* written by the dispatcher */
+    UINT32 Reserved2[15];
+    volatile UINT32 RspTail;            /* written by the driver */
+    UINT32 Reserved3[15];
+} SPD_IOCTL_RING_HEADER;
+typedef struct
+{
+    SPD_IOCTL_TRANSACT_REQ Req;
+    UINT32 DataIndex;
+    UINT32 Reserved;
+} SPD_IOCTL_RING_REQ;
+typedef struct
+{
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    UINT32 DataIndex;
+    UINT32 Reserved;
+} SPD_IOCTL_RING_RSP;
+#if defined(WINSPD_SYS_INTERNAL)
+static_assert(256 == sizeof(SPD_IOCTL_RING_HEADER),
+    "256 == sizeof(SPD_IOCTL_RING_HEADER)");
+#endif
+#define SPD_IOCTL_RING_REQ_OFFSET       sizeof(SPD_IOCTL_RING_HEADER)
+#define SPD_IOCTL_RING_RSP_OFFSET(N)    \
+    (SPD_IOCTL_RING_REQ_OFFSET + (N) * sizeof(SPD_IOCTL_RING_REQ))
+#define SPD_IOCTL_RING_DATA_OFFSET(N)   \
+    SPD_IOCTL_ALIGN_UP(SPD_IOCTL_RING_RSP_OFFSET(N) + (N) * sizeof(SPD_IOCTL_RING_RSP), 4096)
+#define SPD_IOCTL_RING_SIZE(N, L)       \
+    (SPD_IOCTL_RING_DATA_OFFSET(N) + (N) * (L))
 #pragma warning(pop)
 
 #if !defined(WINSPD_SYS_INTERNAL)
@@ -217,9 +436,61 @@ DWORD SpdIoctlTransact(HANDLE DeviceHandle,
     SPD_IOCTL_TRANSACT_REQ *Req,
     PVOID DataBuffer,
     OVERLAPPED *Overlapped);
+DWORD SpdIoctlTransactV(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    PVOID DataBuffer,
+    OVERLAPPED *Overlapped);
+DWORD SpdIoctlTransactIndex(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT32 DataIndex,
+    OVERLAPPED *Overlapped);
+DWORD SpdIoctlTransactVIndex(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    UINT32 DataIndex,
+    OVERLAPPED *Overlapped);
+DWORD SpdIoctlTransactWait(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    UINT32 WaitTimeout,
+    OVERLAPPED *Overlapped);
+DWORD SpdIoctlTransactBegin(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    BOOLEAN ReqValid,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    SPD_IOCTL_TRANSACT_PARAMS *Params,
+    PDWORD PBytesTransferred,
+    OVERLAPPED *Overlapped);
+VOID SpdIoctlTransactEnd(SPD_IOCTL_TRANSACT_PARAMS *Params,
+    DWORD BytesTransferred,
+    SPD_IOCTL_TRANSACT_REQ *Req);
 DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
     UINT32 Btl,
     ULONG ProcessId);
+DWORD SpdIoctlRegisterBufferPool(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BufferCount);
+DWORD SpdIoctlRegisterRing(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 EntryCount);
+DWORD SpdIoctlEnterRing(HANDLE DeviceHandle,
+    UINT32 Btl,
+    BOOLEAN Wait,
+    OVERLAPPED *Overlapped);
+DWORD SpdIoctlGetStatistics(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_STORAGE_UNIT_STATS *Stats);
+DWORD SpdIoctlRegisterAllocationMap(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BlockShift);
 #endif
 
 #ifdef __cplusplus
@@ -39,6 +39,15 @@ extern "C" {
 typedef SPD_IOCTL_STORAGE_UNIT_PARAMS SPD_STORAGE_UNIT_PARAMS;
 typedef SPD_IOCTL_STORAGE_UNIT_STATUS SPD_STORAGE_UNIT_STATUS;
 typedef SPD_IOCTL_UNMAP_DESCRIPTOR SPD_UNMAP_DESCRIPTOR;
+typedef SPD_IOCTL_COPY_DESCRIPTOR SPD_COPY_DESCRIPTOR;
+typedef struct _SPD_IO_DESCRIPTOR
+{
+    PVOID Buffer;
+    UINT64 BlockAddress;
+    UINT32 BlockCount;
+    BOOLEAN Flush;
+    SPD_STORAGE_UNIT_STATUS Status;     /* out */
+} SPD_IO_DESCRIPTOR;
 
 /**
  * @class SPD_STORAGE_UNIT_INTERFACE
@@ -59,12 +68,53 @@ typedef struct _SPD_STORAGE_UNIT_INTERFACE
     BOOLEAN (*Unmap)(SPD_STORAGE_UNIT *StorageUnit,
         SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
         SPD_STORAGE_UNIT_STATUS *Status);
+    /*
+     * Optional. Buffer holds a single block that is to be written to every block in the range.
+     * If Unmap is TRUE the blocks may be unmapped instead, provided that they read back as the
+     * pattern. When WriteSame is 0 the DLL carries out the request using Write (or Unmap for an
+     * all-zeroes pattern); in this case these operations must complete synchronously.
+     */
+    BOOLEAN (*WriteSame)(SPD_STORAGE_UNIT *StorageUnit,
+        PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Unmap,
+        SPD_STORAGE_UNIT_STATUS *Status);
+    /*
+     * Optional. Copies blocks within the storage unit (offloaded data transfer); each descriptor
+     * names a destination, a source and a block count. Sources and destinations may overlap; the
+     * source data is that prior to the copy. When Copy is 0 the DLL carries out the request using
+     * Read and Write, which must then complete synchronously.
+     */
+    BOOLEAN (*Copy)(SPD_STORAGE_UNIT *StorageUnit,
+        SPD_COPY_DESCRIPTOR Descriptors[], UINT32 Count,
+        SPD_STORAGE_UNIT_STATUS *Status);
+    /*
+     * Optional. Notifies the storage unit that the initiator has enabled or disabled its write
+     * cache (MODE SELECT). When the cache is disabled all cached data must be flushed and
+     * subsequent reads and writes arrive with Flush set. StorageUnit->WriteCacheEnabled holds
+     * the old setting during the call; the DLL changes it when the call completes successfully.
+     * A SetCache that completes asynchronously must change it itself before it sends the
+     * response. When SetCache is 0 the DLL calls Flush when the cache is disabled.
+     */
+    BOOLEAN (*SetCache)(SPD_STORAGE_UNIT *StorageUnit,
+        BOOLEAN WriteCacheEnabled,
+        SPD_STORAGE_UNIT_STATUS *Status);
+    /*
+     * Optional. Vectored Read and Write: the dispatcher hands over all reads (writes) that it
+     * fetched in one transaction (see SpdStorageUnitSetDispatcherBatchCount), so that they can be
+     * submitted together. Each descriptor carries the arguments of one Read (Write) and receives
+     * its status; all operations must complete before the call returns. Read and Write are still
+     * used in ring and async mode, by a shared dispatcher and for WRITE SAME and copies that the
+     * DLL carries out, so they must be implemented as well.
+     */
+    VOID (*ReadV)(SPD_STORAGE_UNIT *StorageUnit,
+        SPD_IO_DESCRIPTOR Descriptors[], UINT32 Count);
+    VOID (*WriteV)(SPD_STORAGE_UNIT *StorageUnit,
+        SPD_IO_DESCRIPTOR Descriptors[], UINT32 Count);
 
     /*
      * This ensures that this interface will always contain 16 function pointers.
      * Please update when changing the interface as it is important for future compatibility.
      */
-    BOOLEAN (*Reserved[12])();
+    BOOLEAN (*Reserved[7])();
 } SPD_STORAGE_UNIT_INTERFACE;
 typedef struct _SPD_STORAGE_UNIT
 {
@@ -81,6 +131,19 @@ typedef struct _SPD_STORAGE_UNIT
     ULONG DispatcherThreadCount;
     DWORD DispatcherError;
     UINT32 DebugLog;
+    ULONG DispatcherBatchCount;
+    PVOID DispatcherBufferPool;
+    LONG DispatcherBufferPoolIndex;
+    ULONG DispatcherFlags;
+    PVOID DispatcherRing;
+    PVOID AllocationMap;
+    UINT32 AllocationMapShift;
+    BOOLEAN WriteCacheEnabled;          /* initially CacheSupported; changed by MODE SELECT */
+    ULONG DispatcherAsyncDepth;
+    PVOID DispatcherAsync;
+    PVOID DispatcherPlacement;
+    ULONG DispatcherIdleTimeout;
+    PVOID DispatcherElastic;
 } SPD_STORAGE_UNIT;
 typedef struct _SPD_STORAGE_UNIT_OPERATION_CONTEXT
 {
@@ -135,6 +198,145 @@ VOID SpdStorageUnitShutdown(SPD_STORAGE_UNIT *StorageUnit);
  *     ERROR_SUCCESS or error code.
  */
 DWORD SpdStorageUnitStartDispatcher(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount);
+#define SPD_STORAGE_UNIT_DISPATCHER_RING 0x00000001
+#define SPD_STORAGE_UNIT_DISPATCHER_POLL 0x00000002
+#define SPD_STORAGE_UNIT_DISPATCHER_ASYNC 0x00000004
+#define SPD_STORAGE_UNIT_DISPATCHER_ELASTIC 0x00000008
+/**
+ * Start the storage unit dispatcher with options.
+ *
+ * The flag SPD_STORAGE_UNIT_DISPATCHER_RING makes the dispatcher exchange requests and
+ * responses with the kernel through rings in memory shared with the driver, rather than
+ * with a system call per transaction. The driver places requests in the ring as soon as
+ * they arrive; the dispatcher enters the kernel only to return responses or to wait when
+ * there is no work. If rings are not available (e.g. pipe transport) the dispatcher falls
+ * back to the regular transact mode.
+ *
+ * The flag SPD_STORAGE_UNIT_DISPATCHER_POLL (used with SPD_STORAGE_UNIT_DISPATCHER_RING)
+ * makes idle dispatcher threads poll the request ring for a while before waiting in the
+ * kernel. The polling period adapts to how often polling finds new requests.
+ *
+ * The flag SPD_STORAGE_UNIT_DISPATCHER_ASYNC makes every dispatcher thread keep a pool of
+ * request contexts (see SpdStorageUnitSetDispatcherAsyncDepth), each with its own request,
+ * response and data buffer. When an operation returns FALSE its context stays with the request
+ * and the thread goes on fetching new requests with another context, so that a few threads
+ * can keep many requests in flight. The operation context returned by
+ * SpdStorageUnitGetOperationContext during the operation remains valid until the response is
+ * sent; its Response is the handle that SpdStorageUnitSendResponse uses to return the context
+ * to its pool. The dispatcher does not stop before all such responses have been sent. This
+ * flag is ignored in ring mode, where requests may already remain outstanding.
+ *
+ * The flag SPD_STORAGE_UNIT_DISPATCHER_ELASTIC makes ThreadCount the maximum number of
+ * dispatcher threads rather than a fixed number. The dispatcher starts with a single thread
+ * and adds another when every thread is busy in an operation and the driver reports requests
+ * still waiting (SPD_IOCTL_TRANSACT_REQ::PendingDepth). Added threads exit after waiting in the
+ * driver without a request for the idle timeout (see SpdStorageUnitSetDispatcherIdleTimeout).
+ * An elastic dispatcher fetches one request per transaction and ignores the batch count. The
+ * pipe transport reports no waiting requests, so there the dispatcher keeps a single thread.
+ * This flag is ignored in ring and async mode.
+ *
+ * In ring and async mode a response for a request that was not completed synchronously must
+ * be sent using SpdStorageUnitSendResponse.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param ThreadCount
+ *     The number of threads for the dispatcher. A value of 0 will create a default
+ *     number of threads and should be chosen in most cases.
+ * @param Flags
+ *     Zero or more SPD_STORAGE_UNIT_DISPATCHER_* flags.
+ * @return
+ *     ERROR_SUCCESS or error code.
+ */
+DWORD SpdStorageUnitStartDispatcherEx(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount,
+    ULONG Flags);
+typedef struct _SPD_STORAGE_UNIT_PLACEMENT
+{
+    ULONG Policy;                       /* SPD_STORAGE_UNIT_PLACEMENT_* */
+    USHORT Node;                        /* PLACEMENT_NODE: NUMA node */
+    ULONG CpuSetCount;                  /* PLACEMENT_CPUSET: number of CpuSet entries */
+    const GROUP_AFFINITY *CpuSet;       /* PLACEMENT_CPUSET: processors of each thread */
+} SPD_STORAGE_UNIT_PLACEMENT;
+#define SPD_STORAGE_UNIT_PLACEMENT_SPREAD 1
+#define SPD_STORAGE_UNIT_PLACEMENT_NODE 2
+#define SPD_STORAGE_UNIT_PLACEMENT_CPUSET 3
+/**
+ * Start the storage unit dispatcher with options and a thread placement policy.
+ *
+ * SPD_STORAGE_UNIT_PLACEMENT_SPREAD places the dispatcher threads round robin on the NUMA
+ * nodes that have processors. SPD_STORAGE_UNIT_PLACEMENT_NODE places all dispatcher threads
+ * on the processors of Placement->Node. SPD_STORAGE_UNIT_PLACEMENT_CPUSET gives dispatcher
+ * thread I the processors of Placement->CpuSet[I % Placement->CpuSetCount]; one entry per
+ * processor pins one thread to each processor, while a single entry confines all threads
+ * to a set of processors.
+ *
+ * The data buffers of each dispatcher thread are allocated on the node of its processors
+ * (with VirtualAllocExNuma rather than the buffer allocator of the storage unit), so that
+ * buffer pages stay local to the thread that touches them. In ring mode only the threads
+ * are placed, because all threads share the ring.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param ThreadCount
+ *     The number of threads for the dispatcher. A value of 0 will create one thread per
+ *     processor of the placement (or of the process if Placement is 0).
+ * @param Flags
+ *     Zero or more SPD_STORAGE_UNIT_DISPATCHER_* flags.
+ * @param Placement
+ *     The placement policy or 0 to let the system place the dispatcher threads.
+ * @return
+ *     ERROR_SUCCESS or error code.
+ */
+DWORD SpdStorageUnitStartDispatcherPlaced(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount,
+    ULONG Flags, const SPD_STORAGE_UNIT_PLACEMENT *Placement);
+typedef struct _SPD_DISPATCHER SPD_DISPATCHER;
+/**
+ * Create a dispatcher that is shared by many storage units.
+ *
+ * A process that hosts many storage units need not start dispatcher threads for each one.
+ * Storage units started with SpdStorageUnitStartDispatcherShared have their device handles
+ * bound to the I/O completion port of the shared dispatcher, whose threads take requests from
+ * all of them in arrival order. Each storage unit has at most as many transacts waiting for
+ * requests as the shared dispatcher has threads, so that a busy storage unit cannot crowd out
+ * the others. The port lets only ThreadCount threads run at a time; operations should not
+ * block but rather complete asynchronously (see SPD_STORAGE_UNIT_DISPATCHER_ASYNC).
+ *
+ * @param ThreadCount
+ *     The number of threads of the shared dispatcher. A value of 0 will create one thread
+ *     per processor of the process.
+ * @param PDispatcher [out]
+ *     Pointer that will receive the dispatcher created on successful return from this call.
+ * @return
+ *     ERROR_SUCCESS or error code.
+ */
+DWORD SpdDispatcherCreate(ULONG ThreadCount, SPD_DISPATCHER **PDispatcher);
+/**
+ * Delete a shared dispatcher.
+ *
+ * All storage units started on the shared dispatcher must have stopped
+ * (SpdStorageUnitWaitDispatcher).
+ *
+ * @param Dispatcher
+ *     The shared dispatcher.
+ */
+VOID SpdDispatcherDelete(SPD_DISPATCHER *Dispatcher);
+/**
+ * Start the storage unit dispatcher on a shared dispatcher.
+ *
+ * The storage unit gets no threads of its own. Its requests are dispatched in async mode
+ * (SPD_STORAGE_UNIT_DISPATCHER_ASYNC) by the threads of the shared dispatcher, using a single
+ * pool of request contexts (SpdStorageUnitSetDispatcherAsyncDepth). The storage unit stops
+ * as usual and SpdStorageUnitWaitDispatcher waits for it.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param Dispatcher
+ *     The shared dispatcher.
+ * @return
+ *     ERROR_SUCCESS or error code. The pipe transport returns ERROR_NOT_SUPPORTED.
+ */
+DWORD SpdStorageUnitStartDispatcherShared(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_DISPATCHER *Dispatcher);
 /**
  * Wait for the storage unit dispatcher to stop.
  *
@@ -148,12 +350,56 @@ VOID SpdStorageUnitWaitDispatcher(SPD_STORAGE_UNIT *StorageUnit);
  * @param StorageUnit
  *     The storage unit object.
  * @param Response
- *     The response buffer.
+ *     The response buffer. In async mode this should be the Response of the operation
+ *     context of the request, so that the data buffer can be sent without locking and the
+ *     context can be reused; a copy is matched to its context by Hint.
  * @param DataBuffer
- *     The response data buffer.
+ *     The response data buffer. It is ignored if the request was zero-copy
+ *     (Request->MappedDataBuffer not 0), because the data are already in place.
  */
 VOID SpdStorageUnitSendResponse(SPD_STORAGE_UNIT *StorageUnit,
     SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer);
+/**
+ * Enable the allocation map of the storage unit.
+ *
+ * The allocation map is a bitmap shared with the driver; each bit covers 2^BlockShift blocks.
+ * A clear bit means that none of its blocks is allocated: the driver answers reads of such
+ * blocks with zeroes without dispatching them and reports them as deallocated through
+ * GET LBA STATUS. The driver sets bits as it posts writes and clears them as it posts an
+ * Unmap (or a WriteSame of zeroes), so that reads that follow are not dispatched; if the
+ * Unmap (WriteSame) fails the driver sets the bits again. A storage unit that enables the map
+ * must therefore read back unmapped blocks as zeroes.
+ *
+ * All bits are initially set. A storage unit that knows which of its blocks are unallocated
+ * should clear them with SpdStorageUnitSetAllocationMap before it starts the dispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param BlockShift
+ *     The base 2 logarithm of the number of blocks that each bit covers. The resulting map
+ *     (SPD_IOCTL_ALLOCATION_MAP_SIZE) may not exceed SPD_IOCTL_ALLOCATION_MAP_MAX_SIZE.
+ * @return
+ *     ERROR_SUCCESS or error code. The pipe transport returns ERROR_NOT_SUPPORTED.
+ */
+DWORD SpdStorageUnitEnableAllocationMap(SPD_STORAGE_UNIT *StorageUnit, UINT32 BlockShift);
+/**
+ * Mark a range of blocks as allocated or unallocated in the allocation map.
+ *
+ * Marking a range as unallocated only clears the bits whose blocks are all in the range.
+ * Must not be used for blocks that have I/O in flight. It is a no-op if the allocation map
+ * is not enabled.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param BlockAddress
+ *     The first block of the range.
+ * @param BlockCount
+ *     The number of blocks in the range.
+ * @param Allocated
+ *     TRUE to mark the range as allocated; FALSE to mark it as unallocated.
+ */
+VOID SpdStorageUnitSetAllocationMap(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount, BOOLEAN Allocated);
 /**
  * Get the current operation context.
  *
@@ -204,6 +450,72 @@ VOID SpdStorageUnitSetDebugLog(SPD_STORAGE_UNIT *StorageUnit,
 }
 VOID SpdStorageUnitSetDebugLogF(SPD_STORAGE_UNIT *StorageUnit,
     UINT32 DebugLog);
+/**
+ * Set the number of requests that each dispatcher thread fetches per kernel transaction.
+ *
+ * A value greater than 1 makes the dispatcher use vectored transactions (SpdIoctlTransactV),
+ * which return multiple responses and fetch multiple requests in a single round trip. Each
+ * dispatcher thread then allocates BatchCount data buffers of MaxTransferLength bytes.
+ * The batch count is also the most operations that a ReadV or WriteV call receives.
+ * Must be called prior to SpdStorageUnitStartDispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param BatchCount
+ *     The number of requests per transaction (1 to SPD_IOCTL_TRANSACT_V_CAPACITY).
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherBatchCount(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchCount)
+{
+    StorageUnit->DispatcherBatchCount = BatchCount;
+}
+VOID SpdStorageUnitSetDispatcherBatchCountF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchCount);
+#define SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH 64
+#define SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH_MAX 1024
+/**
+ * Set the number of request contexts of each dispatcher thread in async mode.
+ *
+ * This is the number of requests that a dispatcher thread can have in flight at a time
+ * (SPD_STORAGE_UNIT_DISPATCHER_ASYNC). Each context has a data buffer of MaxTransferLength
+ * bytes. Async mode fetches one request per transaction and ignores the batch count.
+ * Must be called prior to SpdStorageUnitStartDispatcherEx.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param AsyncDepth
+ *     The number of request contexts per thread (1 to SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH_MAX)
+ *     or 0 for SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH.
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherAsyncDepth(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth)
+{
+    StorageUnit->DispatcherAsyncDepth = AsyncDepth;
+}
+VOID SpdStorageUnitSetDispatcherAsyncDepthF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth);
+#define SPD_STORAGE_UNIT_DISPATCHER_IDLE_TIMEOUT 5000
+/**
+ * Set how long an added thread of an elastic dispatcher waits for a request before it exits.
+ *
+ * The first dispatcher thread never exits while the storage unit runs
+ * (SPD_STORAGE_UNIT_DISPATCHER_ELASTIC). Must be called prior to SpdStorageUnitStartDispatcherEx.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param IdleTimeout
+ *     The idle timeout in milliseconds or 0 for SPD_STORAGE_UNIT_DISPATCHER_IDLE_TIMEOUT.
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherIdleTimeout(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG IdleTimeout)
+{
+    StorageUnit->DispatcherIdleTimeout = IdleTimeout;
+}
+VOID SpdStorageUnitSetDispatcherIdleTimeoutF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG IdleTimeout);
 
 /*
  * Helpers
@@ -216,6 +528,48 @@ typedef struct _SPD_PARTITION
 } SPD_PARTITION;
 DWORD SpdDefinePartitionTable(
     SPD_PARTITION Partitions[4], ULONG Count, UINT8 Buffer[512]);
+/**
+ * Define a partition table with aligned partitions.
+ *
+ * The start of every partition is moved up to the next multiple of AlignmentBlockCount;
+ * the partition end is kept. The Partitions array is updated with the actual ranges.
+ *
+ * @param Partitions
+ *     The partitions to define (up to 4).
+ * @param Count
+ *     The number of partitions.
+ * @param AlignmentBlockCount
+ *     The partition alignment in blocks. Usually computed by SpdPartitionAlignmentBlockCount.
+ * @param Buffer
+ *     The buffer that receives the partition table (master boot record).
+ * @return
+ *     ERROR_SUCCESS or error code.
+ */
+DWORD SpdDefinePartitionTableEx(
+    SPD_PARTITION Partitions[4], ULONG Count, UINT32 AlignmentBlockCount, UINT8 Buffer[512]);
+/**
+ * Get the partition alignment for a storage unit.
+ *
+ * This is the largest of the physical block length, optimal transfer length granularity
+ * and unmap granularity of the storage unit, in blocks.
+ *
+ * @param StorageUnitParams
+ *     The storage unit parameters.
+ * @return
+ *     The partition alignment in blocks.
+ */
+static inline
+UINT32 SpdPartitionAlignmentBlockCount(const SPD_STORAGE_UNIT_PARAMS *StorageUnitParams)
+{
+    UINT32 AlignmentLength = StorageUnitParams->BlockLength;
+    if (AlignmentLength < StorageUnitParams->PhysicalBlockLength)
+        AlignmentLength = StorageUnitParams->PhysicalBlockLength;
+    if (AlignmentLength < StorageUnitParams->OptimalTransferGranularity)
+        AlignmentLength = StorageUnitParams->OptimalTransferGranularity;
+    if (AlignmentLength < StorageUnitParams->UnmapGranularity)
+        AlignmentLength = StorageUnitParams->UnmapGranularity;
+    return AlignmentLength / StorageUnitParams->BlockLength;
+}
 static inline
 VOID SpdStorageUnitStatusSetSense(SPD_STORAGE_UNIT_STATUS *Status,
     UINT8 SenseKey, UINT8 ASC, PUINT64 PInformation)
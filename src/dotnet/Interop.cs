@@ -37,6 +37,8 @@ namespace Spd.Interop
         internal const UInt32 CacheSupported = 0x00000002;
         internal const UInt32 UnmapSupported = 0x00000004;
         internal const UInt32 EjectDisabled = 0x00000008;
+        internal const UInt32 MergeSequential = 0x00000010;
+        internal const UInt32 CopySupported = 0x00000020;
         internal const int GuidSize = 16;
         internal const int ProductIdSize = 16;
         internal const int ProductRevisionLevelSize = 4;
@@ -49,7 +51,19 @@ namespace Spd.Interop
         internal Byte DeviceType;
         internal UInt32 Flags;
         internal UInt32 MaxTransferLength;
-        internal unsafe fixed UInt64 Reserved[8];
+        internal UInt32 ZeroCopyThreshold;
+        internal UInt32 SpinTimeLimit;
+        internal Byte HighPriorityWeight;
+        internal Byte NormalPriorityWeight;
+        internal Byte LowPriorityWeight;
+        internal Byte Reserved8;
+        internal UInt32 QueueDepth;
+        internal UInt32 PhysicalBlockLength;
+        internal UInt32 OptimalTransferLength;
+        internal UInt32 OptimalTransferGranularity;
+        internal UInt32 UnmapGranularity;
+        internal UInt32 UnmapGranularityAlignment;
+        internal unsafe fixed UInt32 Reserved32[8];
 
         internal unsafe System.Guid GetGuid()
         {
@@ -190,7 +204,12 @@ namespace Spd.Interop
         internal Proto.Write Write;
         internal Proto.Flush Flush;
         internal Proto.Unmap Unmap;
-        /* BOOLEAN (*Reserved[12])(); */
+        internal IntPtr WriteSame;      /* left 0: the DLL expands WRITE SAME into Write/Unmap */
+        internal IntPtr Copy;           /* left 0: the DLL carries out copies using Read/Write */
+        internal IntPtr SetCache;       /* left 0: the DLL flushes when the write cache is disabled */
+        internal IntPtr ReadV;          /* left 0: the DLL dispatches reads one at a time */
+        internal IntPtr WriteV;         /* left 0: the DLL dispatches writes one at a time */
+        /* BOOLEAN (*Reserved[7])(); */
     }
 
     [SuppressUnmanagedCodeSecurity]
@@ -232,6 +251,9 @@ namespace Spd.Interop
             [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
             internal delegate int SpdDefinePartitionTable(
                 IntPtr Partitions, UInt32 Count, IntPtr Buffer);
+            [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+            internal delegate int SpdDefinePartitionTableEx(
+                IntPtr Partitions, UInt32 Count, UInt32 AlignmentBlockCount, IntPtr Buffer);
 
             /* logging */
             [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
@@ -277,6 +299,7 @@ namespace Spd.Interop
         internal static Proto.SpdStorageUnitSetBufferAllocatorF SpdStorageUnitSetBufferAllocator;
         internal static Proto.SpdStorageUnitSetDebugLogF SpdStorageUnitSetDebugLog;
         internal static Proto.SpdDefinePartitionTable _SpdDefinePartitionTable;
+        internal static Proto.SpdDefinePartitionTableEx _SpdDefinePartitionTableEx;
         internal static Proto.SpdPrintLog SpdPrintLog;
         internal static Proto.SpdEventLog SpdEventLog;
         internal static Proto.SpdServiceLog SpdServiceLog;
@@ -332,6 +355,17 @@ namespace Spd.Interop
                 fixed (Byte *B = Buffer)
                     return _SpdDefinePartitionTable((IntPtr)P, (UInt32)Partitions.Length, (IntPtr)B);
         }
+        internal unsafe static int SpdDefinePartitionTable(Partition[] Partitions,
+            UInt32 AlignmentBlockCount, Byte[] Buffer)
+        {
+            if (4 < Partitions.Length || 512 > Buffer.Length)
+                return 87/*ERROR_INVALID_PARAMETER*/;
+
+            fixed (Partition *P = Partitions)
+                fixed (Byte *B = Buffer)
+                    return _SpdDefinePartitionTableEx((IntPtr)P, (UInt32)Partitions.Length,
+                        AlignmentBlockCount, (IntPtr)B);
+        }
 
         internal static int SetDebugLogFile(String FileName)
         {
@@ -388,6 +422,7 @@ namespace Spd.Interop
             SpdStorageUnitSetBufferAllocator = GetEntryPoint<Proto.SpdStorageUnitSetBufferAllocatorF>(Module);
             SpdStorageUnitSetDebugLog = GetEntryPoint<Proto.SpdStorageUnitSetDebugLogF>(Module);
             _SpdDefinePartitionTable = GetEntryPoint<Proto.SpdDefinePartitionTable>(Module);
+            _SpdDefinePartitionTableEx = GetEntryPoint<Proto.SpdDefinePartitionTableEx>(Module);
             SpdPrintLog = GetEntryPoint<Proto.SpdPrintLog>(Module);
             SpdEventLog = GetEntryPoint<Proto.SpdEventLog>(Module);
             SpdServiceLog = GetEntryPoint<Proto.SpdServiceLog>(Module);
@@ -173,6 +173,24 @@ namespace Spd
             set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.EjectDisabled : 0); }
         }
         /// <summary>
+        /// Gets or sets a value that determines whether queued sequential reads or writes
+        /// are merged into a single request, up to the maximum transfer length.
+        /// </summary>
+        public Boolean MergeSequential
+        {
+            get { return 0 != (_StorageUnitParams.Flags & StorageUnitParams.MergeSequential); }
+            set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.MergeSequential : 0); }
+        }
+        /// <summary>
+        /// Gets or sets a value that determines whether the storage unit supports
+        /// offloaded data transfer (copies within the storage unit).
+        /// </summary>
+        public Boolean CopySupported
+        {
+            get { return 0 != (_StorageUnitParams.Flags & StorageUnitParams.CopySupported); }
+            set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.CopySupported : 0); }
+        }
+        /// <summary>
         /// Gets or sets the storage unit maximum transfer length for a single operation.
         /// </summary>
         public UInt32 MaxTransferLength
@@ -180,6 +198,103 @@ namespace Spd
             get { return _StorageUnitParams.MaxTransferLength; }
             set { _StorageUnitParams.MaxTransferLength = value; }
         }
+        /// <summary>
+        /// Gets or sets the minimum transfer length for which the I/O buffer is mapped
+        /// directly into the storage unit process rather than copied. A value of 0
+        /// disables zero-copy I/O.
+        /// </summary>
+        public UInt32 ZeroCopyThreshold
+        {
+            get { return _StorageUnitParams.ZeroCopyThreshold; }
+            set { _StorageUnitParams.ZeroCopyThreshold = value; }
+        }
+        /// <summary>
+        /// Gets or sets the maximum time in microseconds that a dispatcher thread spins
+        /// waiting for a new request before it goes to sleep. A value of 0 disables spinning.
+        /// </summary>
+        public UInt32 SpinTimeLimit
+        {
+            get { return _StorageUnitParams.SpinTimeLimit; }
+            set { _StorageUnitParams.SpinTimeLimit = value; }
+        }
+        /// <summary>
+        /// Gets or sets the dispatch weight of flush, force unit access and high priority I/O.
+        /// A value of 0 selects the default weight.
+        /// </summary>
+        public Byte HighPriorityWeight
+        {
+            get { return _StorageUnitParams.HighPriorityWeight; }
+            set { _StorageUnitParams.HighPriorityWeight = value; }
+        }
+        /// <summary>
+        /// Gets or sets the dispatch weight of normal priority I/O.
+        /// A value of 0 selects the default weight.
+        /// </summary>
+        public Byte NormalPriorityWeight
+        {
+            get { return _StorageUnitParams.NormalPriorityWeight; }
+            set { _StorageUnitParams.NormalPriorityWeight = value; }
+        }
+        /// <summary>
+        /// Gets or sets the dispatch weight of low priority (background) I/O and unmap.
+        /// A value of 0 selects the default weight.
+        /// </summary>
+        public Byte LowPriorityWeight
+        {
+            get { return _StorageUnitParams.LowPriorityWeight; }
+            set { _StorageUnitParams.LowPriorityWeight = value; }
+        }
+        /// <summary>
+        /// Gets or sets the maximum number of outstanding requests that the storage port
+        /// sends to the storage unit. A value of 0 selects the storage port default.
+        /// </summary>
+        public UInt32 QueueDepth
+        {
+            get { return _StorageUnitParams.QueueDepth; }
+            set { _StorageUnitParams.QueueDepth = value; }
+        }
+        /// <summary>
+        /// Gets or sets the physical block length. Must be a power of 2 multiple of the
+        /// block length. A value of 0 selects the block length.
+        /// </summary>
+        public UInt32 PhysicalBlockLength
+        {
+            get { return _StorageUnitParams.PhysicalBlockLength; }
+            set { _StorageUnitParams.PhysicalBlockLength = value; }
+        }
+        /// <summary>
+        /// Gets or sets the optimal transfer length in bytes. A value of 0 is not reported.
+        /// </summary>
+        public UInt32 OptimalTransferLength
+        {
+            get { return _StorageUnitParams.OptimalTransferLength; }
+            set { _StorageUnitParams.OptimalTransferLength = value; }
+        }
+        /// <summary>
+        /// Gets or sets the optimal transfer length granularity in bytes.
+        /// A value of 0 selects the physical block length.
+        /// </summary>
+        public UInt32 OptimalTransferGranularity
+        {
+            get { return _StorageUnitParams.OptimalTransferGranularity; }
+            set { _StorageUnitParams.OptimalTransferGranularity = value; }
+        }
+        /// <summary>
+        /// Gets or sets the optimal unmap granularity in bytes. A value of 0 is not reported.
+        /// </summary>
+        public UInt32 UnmapGranularity
+        {
+            get { return _StorageUnitParams.UnmapGranularity; }
+            set { _StorageUnitParams.UnmapGranularity = value; }
+        }
+        /// <summary>
+        /// Gets or sets the first block of an unmap granule.
+        /// </summary>
+        public UInt32 UnmapGranularityAlignment
+        {
+            get { return _StorageUnitParams.UnmapGranularityAlignment; }
+            set { _StorageUnitParams.UnmapGranularityAlignment = value; }
+        }
 
         /* control */
         /// <summary>
@@ -285,6 +400,11 @@ namespace Spd
         {
             return Api.SpdDefinePartitionTable(Partitions, Buffer);
         }
+        public static int SpdDefinePartitionTable(Partition[] Partitions,
+            UInt32 AlignmentBlockCount, Byte[] Buffer)
+        {
+            return Api.SpdDefinePartitionTable(Partitions, AlignmentBlockCount, Buffer);
+        }
         public static void Log(UInt32 Type, String Message)
         {
             Api.SpdServiceLog(Type, "%s", Message);
@@ -308,7 +308,8 @@ static int inquiry_vpdb0(int argc, wchar_t **argv)
         "u5  PERIPHERAL DEVICE TYPE\n"
         "u8  PAGE CODE (B0h)\n"
         "u16 PAGE LENGTH (003Ch)\n"
-        "u8  Reserved\n"
+        "u7  Reserved\n"
+        "u1  WSNZ\n"
         "u8  MAXIMUM COMPARE AND WRITE LENGTH\n"
         "u16 OPTIMAL TRANSFER LENGTH GRANULARITY\n"
         "u32 MAXIMUM TRANSFER LENGTH\n"
@@ -319,7 +320,8 @@ static int inquiry_vpdb0(int argc, wchar_t **argv)
         "u32 OPTIMAL UNMAP GRANULARITY\n"
         "u1  UGAVALID\n"
         "u31 UNMAP GRANULARITY ALIGNMENT\n"
-        "X28 Reserved\n";
+        "u64 MAXIMUM WRITE SAME LENGTH\n"
+        "X20 Reserved\n";
 
     return ScsiDataInAndPrint(argc, argv, &Cdb, VPD_MAX_BUFFER_SIZE, Format);
 }
@@ -343,7 +345,8 @@ static int inquiry_vpdb2(int argc, wchar_t **argv)
         "u8  THRESHOLD EXPONENT\n"
         "u1  LBPU\n"
         "u1  LBPWS\n"
-        "u4  Reserved\n"
+        "u1  LBPWS10\n"
+        "u3  Reserved\n"
         "u1  ANC_SUP\n"
         "u1  DP\n"
         "u5  Reserved\n"
@@ -85,6 +85,26 @@ VOID SpdDebugLogRequest(SPD_IOCTL_TRANSACT_REQ *Request)
             SpdDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
             (unsigned)Request->Op.Unmap.Count);
         break;
+    case SpdIoctlTransactWriteSameKind:
+        SpdDebugLog("%S[TID=%04lx]: %p: >>WSame "
+            "BlockAddress=%lx:%lx, BlockCount=%u, Unmap=%u\n",
+            SpdDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
+            MAKE_UINT32_PAIR(Request->Op.WriteSame.BlockAddress),
+            (unsigned)Request->Op.WriteSame.BlockCount,
+            (unsigned)Request->Op.WriteSame.Unmap);
+        break;
+    case SpdIoctlTransactCopyKind:
+        SpdDebugLog("%S[TID=%04lx]: %p: >>Copy  "
+            "Count=%u\n",
+            SpdDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
+            (unsigned)Request->Op.Copy.Count);
+        break;
+    case SpdIoctlTransactSetCacheKind:
+        SpdDebugLog("%S[TID=%04lx]: %p: >>Cache "
+            "WriteCacheEnabled=%u\n",
+            SpdDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint,
+            (unsigned)Request->Op.SetCache.WriteCacheEnabled);
+        break;
     default:
         SpdDebugLog("%S[TID=%04lx]: %p: >>INVLD\n",
             SpdDiagIdent(), GetCurrentThreadId(), (PVOID)Request->Hint);
@@ -193,6 +213,15 @@ VOID SpdDebugLogResponse(SPD_IOCTL_TRANSACT_RSP *Response)
     case SpdIoctlTransactUnmapKind:
         SpdDebugLogResponseStatus(Response, "Unmap");
         break;
+    case SpdIoctlTransactWriteSameKind:
+        SpdDebugLogResponseStatus(Response, "WSame");
+        break;
+    case SpdIoctlTransactCopyKind:
+        SpdDebugLogResponseStatus(Response, "Copy ");
+        break;
+    case SpdIoctlTransactSetCacheKind:
+        SpdDebugLogResponseStatus(Response, "Cache");
+        break;
     default:
         SpdDebugLogResponseStatus(Response, "INVLD");
         break;
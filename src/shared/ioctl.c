@@ -408,27 +408,40 @@ exit:
     return Error;
 }
 
-DWORD SpdIoctlTransact(HANDLE DeviceHandle,
+static VOID SpdIoctlTransactPrepare(SPD_IOCTL_TRANSACT_PARAMS *Params,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    BOOLEAN ReqValid,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    UINT32 WaitTimeout)
+{
+    memset(Params, 0, sizeof *Params);
+    Params->Base.Size = sizeof *Params;
+    Params->Base.Code = SPD_IOCTL_TRANSACT;
+    Params->Btl = Btl;
+    Params->ReqValid = ReqValid;
+    Params->RspValid = 0 != Rsp;
+    Params->DataIndexValid = DataIndexValid;
+    Params->WaitTimeout = WaitTimeout;
+    Params->DataBuffer = DataBuffer;
+
+    if (Params->RspValid)
+        memcpy(&Params->Dir.Rsp, Rsp, sizeof *Rsp);
+}
+
+static DWORD SpdIoctlTransactInternal(HANDLE DeviceHandle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    UINT32 WaitTimeout,
     OVERLAPPED *Overlapped)
 {
     SPD_IOCTL_TRANSACT_PARAMS Params;
     DWORD BytesTransferred;
     DWORD Error;
 
-    memset(&Params, 0, sizeof Params);
-    Params.Base.Size = sizeof Params;
-    Params.Base.Code = SPD_IOCTL_TRANSACT;
-    Params.Btl = Btl;
-    Params.ReqValid = 0 != Req;
-    Params.RspValid = 0 != Rsp;
-    Params.DataBuffer = (UINT64)(UINT_PTR)DataBuffer;
-
-    if (Params.RspValid)
-        memcpy(&Params.Dir.Rsp, Rsp, sizeof *Rsp);
+    SpdIoctlTransactPrepare(&Params, Btl, Rsp, 0 != Req, DataBuffer, DataIndexValid, WaitTimeout);
 
     /*
      * Our DeviceHandle is opened with FILE_FLAG_OVERLAPPED, but we call
@@ -476,10 +489,145 @@ DWORD SpdIoctlTransact(HANDLE DeviceHandle,
     }
 
     if (0 != Req)
-        if (sizeof Params == BytesTransferred && Params.ReqValid)
-            memcpy(Req, &Params.Dir.Req, sizeof *Req);
+        SpdIoctlTransactEnd(&Params, BytesTransferred, Req);
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlTransactBegin(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    BOOLEAN ReqValid,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    SPD_IOCTL_TRANSACT_PARAMS *Params,
+    PDWORD PBytesTransferred,
+    OVERLAPPED *Overlapped)
+{
+    SpdIoctlTransactPrepare(Params, Btl, Rsp, ReqValid, DataBuffer, DataIndexValid, 0);
+
+    /* unlike SpdIoctlTransact do not wait; a pending transact completes through Overlapped */
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Params, sizeof *Params,
+        Params, sizeof *Params,
+        PBytesTransferred, Overlapped))
+        return GetLastError();
+
+    return ERROR_SUCCESS;
+}
+
+VOID SpdIoctlTransactEnd(SPD_IOCTL_TRANSACT_PARAMS *Params,
+    DWORD BytesTransferred,
+    SPD_IOCTL_TRANSACT_REQ *Req)
+{
+    if (sizeof *Params == BytesTransferred && Params->ReqValid)
+        memcpy(Req, &Params->Dir.Req, sizeof *Req);
+    else
+        memset(Req, 0, sizeof *Req);
+}
+
+DWORD SpdIoctlTransact(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer,
+    OVERLAPPED *Overlapped)
+{
+    return SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE, 0, Overlapped);
+}
+
+DWORD SpdIoctlTransactIndex(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT32 DataIndex,
+    OVERLAPPED *Overlapped)
+{
+    return SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+        DataIndex, TRUE, 0, Overlapped);
+}
+
+DWORD SpdIoctlTransactWait(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    UINT32 WaitTimeout,
+    OVERLAPPED *Overlapped)
+{
+    /* if no request arrives within WaitTimeout the transact succeeds with a zeroed Req */
+    return SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+        DataBuffer, DataIndexValid, WaitTimeout, Overlapped);
+}
+
+static DWORD SpdIoctlTransactVInternal(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    UINT64 DataBuffer, BOOLEAN DataIndexValid,
+    OVERLAPPED *Overlapped)
+{
+    SPD_IOCTL_TRANSACT_V_PARAMS Params;
+    UINT32 ReqCount = 0 != PReqCount ? *PReqCount : 0;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    if (0 != PReqCount)
+        *PReqCount = 0;
+
+    if (SPD_IOCTL_TRANSACT_V_CAPACITY < RspCount ||
+        SPD_IOCTL_TRANSACT_V_CAPACITY < ReqCount)
+        return ERROR_INVALID_PARAMETER;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_TRANSACT_V;
+    Params.Btl = Btl;
+    Params.RspCount = (UINT16)RspCount;
+    Params.ReqCount = (UINT16)ReqCount;
+    Params.DataIndexValid = DataIndexValid;
+    Params.DataBuffer = DataBuffer;
+
+    for (UINT32 I = 0; RspCount > I; I++)
+        memcpy(&Params.Dir[I].Rsp, &Rsp[I], sizeof *Rsp);
+
+    /* see SpdIoctlTransact for a discussion of FILE_FLAG_OVERLAPPED and this DeviceIoControl */
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        &Params, sizeof Params,
+        &BytesTransferred, Overlapped))
+    {
+        Error = GetLastError();
+        if (ERROR_IO_PENDING == Error)
+        {
+            if (!GetOverlappedResult(DeviceHandle, Overlapped,
+                &BytesTransferred, TRUE))
+            {
+                Error = GetLastError();
+                goto exit;
+            }
+        }
+        else
+        {
+            goto exit;
+        }
+    }
+
+    if (0 != ReqCount)
+    {
+        if (sizeof Params == BytesTransferred && ReqCount >= Params.ReqCount)
+            ReqCount = Params.ReqCount;
         else
-            memset(Req, 0, sizeof *Req);
+            ReqCount = 0;
+
+        for (UINT32 I = 0; ReqCount > I; I++)
+            memcpy(&Req[I], &Params.Dir[I].Req, sizeof *Req);
+
+        *PReqCount = ReqCount;
+    }
 
     Error = ERROR_SUCCESS;
 
@@ -487,6 +635,28 @@ exit:
     return Error;
 }
 
+DWORD SpdIoctlTransactV(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    PVOID DataBuffer,
+    OVERLAPPED *Overlapped)
+{
+    return SpdIoctlTransactVInternal(DeviceHandle, Btl, Rsp, RspCount, Req, PReqCount,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE, Overlapped);
+}
+
+DWORD SpdIoctlTransactVIndex(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    UINT32 DataIndex,
+    OVERLAPPED *Overlapped)
+{
+    return SpdIoctlTransactVInternal(DeviceHandle, Btl, Rsp, RspCount, Req, PReqCount,
+        DataIndex, TRUE, Overlapped);
+}
+
 DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
     UINT32 Btl,
     ULONG ProcessId)
@@ -515,3 +685,167 @@ DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
 exit:
     return Error;
 }
+
+DWORD SpdIoctlRegisterBufferPool(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BufferCount)
+{
+    SPD_IOCTL_REGISTER_BUFFER_POOL_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_REGISTER_BUFFER_POOL;
+    Params.Btl = Btl;
+    Params.BufferCount = BufferCount;
+    Params.Buffer = (UINT64)(UINT_PTR)Buffer;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlRegisterRing(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 EntryCount)
+{
+    SPD_IOCTL_REGISTER_RING_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_REGISTER_RING;
+    Params.Btl = Btl;
+    Params.EntryCount = EntryCount;
+    Params.Buffer = (UINT64)(UINT_PTR)Buffer;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlEnterRing(HANDLE DeviceHandle,
+    UINT32 Btl,
+    BOOLEAN Wait,
+    OVERLAPPED *Overlapped)
+{
+    SPD_IOCTL_ENTER_RING_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_ENTER_RING;
+    Params.Btl = Btl;
+    Params.Wait = !!Wait;
+
+    /* see SpdIoctlTransactInternal for a discussion of the Overlapped parameter */
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, Overlapped))
+    {
+        Error = GetLastError();
+        if (ERROR_IO_PENDING == Error)
+        {
+            if (!GetOverlappedResult(DeviceHandle, Overlapped,
+                &BytesTransferred, TRUE))
+            {
+                Error = GetLastError();
+                goto exit;
+            }
+        }
+        else
+        {
+            goto exit;
+        }
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlGetStatistics(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_STORAGE_UNIT_STATS *Stats)
+{
+    SPD_IOCTL_GET_STATS_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(Stats, 0, sizeof *Stats);
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_GET_STATS;
+    Params.Dir.Par.Btl = Btl;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        &Params, sizeof Params,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    memcpy(Stats, &Params.Dir.Ret.Stats, sizeof *Stats);
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlRegisterAllocationMap(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BlockShift)
+{
+    SPD_IOCTL_REGISTER_ALLOCATION_MAP_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_REGISTER_ALLOCATION_MAP;
+    Params.Btl = Btl;
+    Params.BlockShift = BlockShift;
+    Params.Buffer = (UINT64)(UINT_PTR)Buffer;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
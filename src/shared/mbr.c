@@ -80,13 +80,19 @@ static struct SPD_MBR SpdMbr =
 };
 
 DWORD SpdDefinePartitionTable(
-    SPD_PARTITION Partitions[4], ULONG Count, UINT8 Buffer0[512])
+    SPD_PARTITION Partitions[4], ULONG Count, UINT8 Buffer[512])
+{
+    return SpdDefinePartitionTableEx(Partitions, Count, 1, Buffer);
+}
+
+DWORD SpdDefinePartitionTableEx(
+    SPD_PARTITION Partitions[4], ULONG Count, UINT32 AlignmentBlockCount, UINT8 Buffer0[512])
 {
     struct SPD_MBR *Buffer = (PVOID)Buffer0;
     UINT64 BlockAddress, EndBlockAddress;
     UINT32 C, H, S;
 
-    if (4 < Count)
+    if (4 < Count || 0 == AlignmentBlockCount)
         return ERROR_INVALID_PARAMETER;
 
     for (ULONG I = 0; Count > I; I++)
@@ -95,6 +101,22 @@ DWORD SpdDefinePartitionTable(
         EndBlockAddress = BlockAddress + Partitions[I].BlockCount;
         if (EndBlockAddress <= BlockAddress || EndBlockAddress > (UINT32)-1)
             return ERROR_INVALID_PARAMETER;
+
+        /* move the partition start up to the alignment; keep the partition end */
+        BlockAddress = (BlockAddress + AlignmentBlockCount - 1) / AlignmentBlockCount *
+            AlignmentBlockCount;
+        if (EndBlockAddress <= BlockAddress)
+            return ERROR_INVALID_PARAMETER;
+    }
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        BlockAddress = Partitions[I].BlockAddress;
+        EndBlockAddress = BlockAddress + Partitions[I].BlockCount;
+        BlockAddress = (BlockAddress + AlignmentBlockCount - 1) / AlignmentBlockCount *
+            AlignmentBlockCount;
+        Partitions[I].BlockAddress = BlockAddress;
+        Partitions[I].BlockCount = EndBlockAddress - BlockAddress;
     }
 
     memcpy(Buffer, &SpdMbr, 512);
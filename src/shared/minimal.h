@@ -184,12 +184,20 @@ static inline DWORD SpdOverlappedInit(OVERLAPPED *Overlapped)
 {
     memset(Overlapped, 0, sizeof *Overlapped);
     Overlapped->hEvent = CreateEventW(0, TRUE, TRUE, 0);
-    return 0 != Overlapped->hEvent ? ERROR_SUCCESS : GetLastError();
+    if (0 == Overlapped->hEvent)
+        return GetLastError();
+
+    /*
+     * We always wait on the event. Set its low bit, so that the operation is never
+     * queued to an I/O completion port that the handle is bound to (SPD_DISPATCHER).
+     */
+    Overlapped->hEvent = (HANDLE)((UINT_PTR)Overlapped->hEvent | 1);
+    return ERROR_SUCCESS;
 }
 static inline VOID SpdOverlappedFini(OVERLAPPED *Overlapped)
 {
     if (0 != Overlapped->hEvent)
-        CloseHandle(Overlapped->hEvent);
+        CloseHandle((HANDLE)((UINT_PTR)Overlapped->hEvent & ~(UINT_PTR)1));
 }
 static inline DWORD SpdOverlappedWaitResult(BOOL Success,
     HANDLE Handle, OVERLAPPED *Overlapped, PDWORD PBytesTransferred)
@@ -21,8 +21,8 @@
 
 #include <shared/shared.h>
 
-#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_BTL_T(Btl)
-#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL(0, Idx, 0)
+#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_INDEX_FROM_BTL(Btl)
+#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL_FROM_INDEX(Idx)
 
 #define IsPipeHandle(Handle)            (((UINT_PTR)(Handle)) & 1)
 #define GetPipeHandle(Handle)           ((HANDLE)((UINT_PTR)(Handle) & ~1))
@@ -293,7 +293,8 @@ static DWORD SpdStorageUnitHandleTransactPipe(HANDLE Handle,
         return ERROR_INVALID_PARAMETER;
 
     AcquireSRWLockShared(&StorageUnitLock);
-    Error = StorageUnit == StorageUnits[SPD_INDEX_FROM_BTL(Btl)] ?
+    Error = SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY > SPD_INDEX_FROM_BTL(Btl) &&
+        StorageUnit == StorageUnits[SPD_INDEX_FROM_BTL(Btl)] ?
         ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
     ReleaseSRWLockShared(&StorageUnitLock);
     if (ERROR_SUCCESS != Error)
@@ -405,6 +406,30 @@ static DWORD SpdStorageUnitHandleTransactPipe(HANDLE Handle,
             memcpy(DataBuffer, Msg + 1, BytesTransferred);
             memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
         }
+        else if (SpdIoctlTransactCopyKind == Msg->Req.Kind)
+        {
+            DataLength = Msg->Req.Op.Copy.Count *
+                sizeof(SPD_IOCTL_COPY_DESCRIPTOR);
+            if (DataLength > StorageUnit->StorageUnitParams.MaxTransferLength)
+                goto zeroout;
+
+            BytesTransferred -= sizeof(TRANSACT_MSG);
+            if (BytesTransferred > DataLength)
+                BytesTransferred = DataLength;
+            memcpy(DataBuffer, Msg + 1, BytesTransferred);
+            memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
+        }
+        else if (SpdIoctlTransactWriteSameKind == Msg->Req.Kind)
+        {
+            /* a single block of pattern data */
+            DataLength = StorageUnit->StorageUnitParams.BlockLength;
+
+            BytesTransferred -= sizeof(TRANSACT_MSG);
+            if (BytesTransferred > DataLength)
+                BytesTransferred = DataLength;
+            memcpy(DataBuffer, Msg + 1, BytesTransferred);
+            memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
+        }
 
         memcpy(Req, &Msg->Req, sizeof *Req);
     }
@@ -538,7 +563,7 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer,
+    PVOID DataBuffer, UINT32 DataIndex,
     OVERLAPPED *Overlapped)
 {
     OVERLAPPED TempOverlapped = { 0 };
@@ -555,6 +580,8 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
 
     if (IsPipeHandle(Handle))
         Error = SpdStorageUnitHandleTransactPipe(GetPipeHandle(Handle), Btl, Rsp, Req, DataBuffer, Overlapped);
+    else if ((UINT32)-1 != DataIndex)
+        Error = SpdIoctlTransactIndex(GetDeviceHandle(Handle), Btl, Rsp, Req, DataIndex, Overlapped);
     else
         Error = SpdIoctlTransact(GetDeviceHandle(Handle), Btl, Rsp, Req, DataBuffer, Overlapped);
 
@@ -563,6 +590,187 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
     return Error;
 }
 
+DWORD SpdStorageUnitHandleTransactWait(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer, UINT32 DataIndex,
+    UINT32 WaitTimeout,
+    OVERLAPPED *Overlapped)
+{
+    OVERLAPPED TempOverlapped = { 0 };
+    DWORD Error;
+
+    /* the pipe transport has no wait timeout; its transact simply waits forever */
+    if (IsPipeHandle(Handle) || 0 == WaitTimeout)
+        return SpdStorageUnitHandleTransact(Handle, Btl, Rsp, Req, DataBuffer, DataIndex, Overlapped);
+
+    if (Overlapped == NULL)
+    {
+        Error = SpdOverlappedInit(&TempOverlapped);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+
+        Overlapped = &TempOverlapped;
+    }
+
+    if ((UINT32)-1 != DataIndex)
+        Error = SpdIoctlTransactWait(GetDeviceHandle(Handle), Btl, Rsp, Req,
+            DataIndex, TRUE, WaitTimeout, Overlapped);
+    else
+        Error = SpdIoctlTransactWait(GetDeviceHandle(Handle), Btl, Rsp, Req,
+            (UINT64)(UINT_PTR)DataBuffer, FALSE, WaitTimeout, Overlapped);
+
+    SpdOverlappedFini(&TempOverlapped);
+
+    return Error;
+}
+
+DWORD SpdStorageUnitHandleTransactV(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    PVOID DataBuffer, UINT32 DataSlotLength, UINT32 DataIndex,
+    OVERLAPPED *Overlapped)
+{
+    OVERLAPPED TempOverlapped = { 0 };
+    UINT32 ReqCount = 0 != PReqCount ? *PReqCount : 0;
+    DWORD Error;
+
+    if (Overlapped == NULL)
+    {
+        Error = SpdOverlappedInit(&TempOverlapped);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+
+        Overlapped = &TempOverlapped;
+    }
+
+    if (IsPipeHandle(Handle))
+    {
+        /*
+         * The pipe transport has no vectored message. Emulate by sending the
+         * responses one at a time and then fetching a single request.
+         */
+        if (0 != PReqCount)
+            *PReqCount = 0;
+
+        Error = ERROR_SUCCESS;
+        for (UINT32 I = 0; RspCount > I && ERROR_SUCCESS == Error; I++)
+            if (0 != Rsp[I].Hint)
+                Error = SpdStorageUnitHandleTransactPipe(GetPipeHandle(Handle), Btl,
+                    &Rsp[I], 0, 0 != DataBuffer ? (PUINT8)DataBuffer + I * DataSlotLength : 0,
+                    Overlapped);
+        if (ERROR_SUCCESS == Error && 0 != ReqCount)
+        {
+            Error = SpdStorageUnitHandleTransactPipe(GetPipeHandle(Handle), Btl,
+                0, &Req[0], DataBuffer, Overlapped);
+            *PReqCount = ERROR_SUCCESS == Error && 0 != Req[0].Hint ? 1 : 0;
+        }
+    }
+    else if ((UINT32)-1 != DataIndex)
+        Error = SpdIoctlTransactVIndex(GetDeviceHandle(Handle), Btl,
+            Rsp, RspCount, Req, PReqCount, DataIndex, Overlapped);
+    else
+        Error = SpdIoctlTransactV(GetDeviceHandle(Handle), Btl,
+            Rsp, RspCount, Req, PReqCount, DataBuffer, Overlapped);
+
+    SpdOverlappedFini(&TempOverlapped);
+
+    return Error;
+}
+
+DWORD SpdStorageUnitHandleTransactBegin(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_PARAMS *Params,
+    PVOID DataBuffer, UINT32 DataIndex,
+    PDWORD PBytesTransferred,
+    OVERLAPPED *Overlapped)
+{
+    /* the pipe transport writes the response and reads the request in one blocking call */
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    if ((UINT32)-1 != DataIndex)
+        return SpdIoctlTransactBegin(GetDeviceHandle(Handle), Btl, Rsp, TRUE,
+            DataIndex, TRUE, Params, PBytesTransferred, Overlapped);
+    else
+        return SpdIoctlTransactBegin(GetDeviceHandle(Handle), Btl, Rsp, TRUE,
+            (UINT64)(UINT_PTR)DataBuffer, FALSE, Params, PBytesTransferred, Overlapped);
+}
+
+VOID SpdStorageUnitHandleTransactEnd(SPD_IOCTL_TRANSACT_PARAMS *Params,
+    DWORD BytesTransferred,
+    SPD_IOCTL_TRANSACT_REQ *Req)
+{
+    SpdIoctlTransactEnd(Params, BytesTransferred, Req);
+}
+
+DWORD SpdStorageUnitHandleBindCompletionPort(HANDLE Handle,
+    HANDLE Port, ULONG_PTR Key)
+{
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    if (0 == CreateIoCompletionPort(GetDeviceHandle(Handle), Port, Key, 0))
+        return GetLastError();
+
+    /*
+     * Transacts that complete immediately (e.g. responses) are not queued to the port;
+     * only transacts that wait in the driver for a request are.
+     */
+    if (!SetFileCompletionNotificationModes(GetDeviceHandle(Handle),
+        FILE_SKIP_COMPLETION_PORT_ON_SUCCESS))
+        return GetLastError();
+
+    return ERROR_SUCCESS;
+}
+
+DWORD SpdStorageUnitHandleRegisterBufferPool(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BufferCount)
+{
+    /* the pipe transport copies data through the pipe; there is nothing to register */
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    return SpdIoctlRegisterBufferPool(GetDeviceHandle(Handle), Btl, Buffer, BufferCount);
+}
+
+DWORD SpdStorageUnitHandleRegisterRing(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 EntryCount)
+{
+    /* the pipe transport has no shared memory with its peer */
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    return SpdIoctlRegisterRing(GetDeviceHandle(Handle), Btl, Buffer, EntryCount);
+}
+
+DWORD SpdStorageUnitHandleEnterRing(HANDLE Handle,
+    UINT32 Btl,
+    BOOLEAN Wait,
+    OVERLAPPED *Overlapped)
+{
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    return SpdIoctlEnterRing(GetDeviceHandle(Handle), Btl, Wait, Overlapped);
+}
+
+DWORD SpdStorageUnitHandleRegisterAllocationMap(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BlockShift)
+{
+    /* the pipe transport has no driver to answer reads of unallocated blocks */
+    if (IsPipeHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+
+    return SpdIoctlRegisterAllocationMap(GetDeviceHandle(Handle), Btl, Buffer, BlockShift);
+}
+
 DWORD SpdStorageUnitHandleShutdown(HANDLE Handle,
     const GUID *Guid)
 {
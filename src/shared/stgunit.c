@@ -28,14 +28,159 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer,
+    PVOID DataBuffer, UINT32 DataIndex,
     OVERLAPPED *Overlapped);
+DWORD SpdStorageUnitHandleTransactWait(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer, UINT32 DataIndex,
+    UINT32 WaitTimeout,
+    OVERLAPPED *Overlapped);
+DWORD SpdStorageUnitHandleTransactV(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, UINT32 RspCount,
+    SPD_IOCTL_TRANSACT_REQ *Req, PUINT32 PReqCount,
+    PVOID DataBuffer, UINT32 DataSlotLength, UINT32 DataIndex,
+    OVERLAPPED *Overlapped);
+DWORD SpdStorageUnitHandleTransactBegin(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_PARAMS *Params,
+    PVOID DataBuffer, UINT32 DataIndex,
+    PDWORD PBytesTransferred,
+    OVERLAPPED *Overlapped);
+VOID SpdStorageUnitHandleTransactEnd(SPD_IOCTL_TRANSACT_PARAMS *Params,
+    DWORD BytesTransferred,
+    SPD_IOCTL_TRANSACT_REQ *Req);
+DWORD SpdStorageUnitHandleBindCompletionPort(HANDLE Handle,
+    HANDLE Port, ULONG_PTR Key);
+DWORD SpdStorageUnitHandleRegisterBufferPool(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BufferCount);
+DWORD SpdStorageUnitHandleRegisterRing(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 EntryCount);
+DWORD SpdStorageUnitHandleEnterRing(HANDLE Handle,
+    UINT32 Btl,
+    BOOLEAN Wait,
+    OVERLAPPED *Overlapped);
+DWORD SpdStorageUnitHandleRegisterAllocationMap(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer, UINT32 BlockShift);
 DWORD SpdStorageUnitHandleShutdown(HANDLE Handle,
     const GUID *Guid);
 DWORD SpdStorageUnitHandleClose(HANDLE Handle);
 
 static SPD_STORAGE_UNIT_INTERFACE SpdStorageUnitNullInterface;
 
+/*
+ * Shared-memory ring used by SPD_STORAGE_UNIT_DISPATCHER_RING. All dispatcher threads
+ * share one ring: ReqLock serializes the consumers of the request ring and RspLock
+ * serializes the producers of the response ring.
+ */
+typedef struct
+{
+    PVOID Buffer;
+    SPD_IOCTL_RING_HEADER *Header;
+    SPD_IOCTL_RING_REQ *Req;
+    SPD_IOCTL_RING_RSP *Rsp;
+    PUINT8 Data;
+    UINT32 EntryCount;
+    SRWLOCK ReqLock, RspLock;
+    PUINT64 Hints;                      /* hint of the last request in each data slot */
+} SPD_STORAGE_UNIT_RING;
+#define SPD_STORAGE_UNIT_RING_SPIN_MIN  64
+#define SPD_STORAGE_UNIT_RING_SPIN_MAX  (64 * 1024)
+
+/*
+ * Request contexts used by SPD_STORAGE_UNIT_DISPATCHER_ASYNC. Every dispatcher thread owns
+ * Depth contexts, each with its own request, response and data slot. A context whose request
+ * is not completed synchronously stays with the request until SpdStorageUnitSendResponse
+ * returns it to the free list of its thread.
+ *
+ * A storage unit on a shared dispatcher (SPD_DISPATCHER) has a single list of contexts. Up to
+ * FetchLimit of them wait in the driver for requests with a transact that completes to the
+ * port of the shared dispatcher; PendingCount then also counts these transacts.
+ */
+typedef struct
+{
+    SLIST_HEADER FreeList;
+    HANDLE Event;                       /* auto-reset; set when a context is freed */
+    LONG volatile Waiting;              /* the thread waits on Event for a free context */
+} SPD_STORAGE_UNIT_ASYNC_THREAD;
+typedef struct
+{
+    SLIST_ENTRY ListEntry;              /* must be first */
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT OperationContext;
+    SPD_IOCTL_TRANSACT_REQ Request;
+    SPD_IOCTL_TRANSACT_RSP Response;
+    SPD_IOCTL_TRANSACT_PARAMS Params;   /* shared dispatcher: transact in flight */
+    OVERLAPPED Overlapped;
+    SPD_STORAGE_UNIT_ASYNC_THREAD *Thread;
+    PVOID DataSlot;
+    UINT32 DataIndex;                   /* slot in the registered buffer pool or -1 */
+    LONG volatile Pending;              /* request is being dispatched or is in flight */
+} SPD_STORAGE_UNIT_ASYNC_CONTEXT;
+typedef struct
+{
+    SPD_STORAGE_UNIT_ASYNC_THREAD *Threads;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Contexts;
+    ULONG ThreadCount, Depth;
+    LONG ThreadIndex;
+    PVOID DataBuffer;                   /* data slots if there is no registered buffer pool */
+    LONG volatile PendingCount;         /* biased by 1 until the dispatcher drains */
+    HANDLE DrainEvent;
+    SPD_DISPATCHER *Dispatcher;
+    LONG volatile FetchCount;
+    LONG FetchLimit;
+    LONG volatile Stopping;
+} SPD_STORAGE_UNIT_ASYNC;
+
+/*
+ * Dispatcher thread placement (SpdStorageUnitStartDispatcherPlaced). Dispatcher thread I
+ * runs on the processors of entry I % EntryCount and has its buffers on its node.
+ */
+typedef struct
+{
+    GROUP_AFFINITY Affinity;
+    USHORT Node;
+} SPD_STORAGE_UNIT_PLACEMENT_ENTRY;
+typedef struct
+{
+    ULONG EntryCount;
+    SPD_STORAGE_UNIT_PLACEMENT_ENTRY *Entries;
+} SPD_STORAGE_UNIT_PLACEMENT_TABLE;
+
+/*
+ * Elastic dispatcher (SPD_STORAGE_UNIT_DISPATCHER_ELASTIC). ThreadCount counts the running
+ * dispatcher threads (up to ThreadMax) and BusyCount those in an operation. Slots[I] is
+ * nonzero while a thread uses thread index I, i.e. slot I of the buffer pool and entry I of
+ * the placement; a thread reserves its place in ThreadCount before it is created and releases
+ * its slot before it leaves ThreadCount, so there is always a free slot for a new thread.
+ */
+typedef struct
+{
+    ULONG ThreadMax;
+    ULONG IdleTimeout;
+    LONG volatile ThreadCount;
+    LONG volatile BusyCount;
+    HANDLE DoneEvent;                   /* set when the last thread is done */
+    LONG volatile *Slots;
+} SPD_STORAGE_UNIT_ELASTIC;
+
+/*
+ * Process-wide dispatcher shared by many storage units. The device handles of the storage
+ * units are bound to one I/O completion port, so that a few threads serve all of them.
+ */
+struct _SPD_DISPATCHER
+{
+    HANDLE Port;
+    ULONG ThreadCount;
+    HANDLE *Threads;
+};
+#define SPD_DISPATCHER_KEY_FETCH        1   /* or'ed into the key of a posted fetch */
+
 static DWORD SpdStorageUnitTlsCount = 0;
 static SRWLOCK SpdStorageUnitTlsLock = SRWLOCK_INIT;
 static DWORD SpdStorageUnitTlsKey = TLS_OUT_OF_INDEXES;
@@ -98,6 +243,7 @@ DWORD SpdStorageUnitCreate(
 
     memcpy(&StorageUnit->StorageUnitParams, StorageUnitParams, sizeof *StorageUnitParams);
     StorageUnit->Interface = Interface;
+    StorageUnit->WriteCacheEnabled = !!StorageUnitParams->CacheSupported;
     StorageUnit->Handle = Handle;
     StorageUnit->Btl = Btl;
     SpdStorageUnitSetBufferAllocator(StorageUnit, MemAlloc, MemFree);
@@ -118,8 +264,12 @@ exit:
 
 VOID SpdStorageUnitDelete(SPD_STORAGE_UNIT *StorageUnit)
 {
+    if (0 != StorageUnit->AllocationMap)
+        SpdStorageUnitHandleRegisterAllocationMap(StorageUnit->Handle, StorageUnit->Btl, 0, 0);
     SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
     SpdStorageUnitHandleClose(StorageUnit->Handle);
+    if (0 != StorageUnit->AllocationMap)
+        VirtualFree(StorageUnit->AllocationMap, 0, MEM_RELEASE);
     MemFree(StorageUnit);
     SpdStorageUnitTlsFini();
 }
@@ -129,262 +279,2124 @@ VOID SpdStorageUnitShutdown(SPD_STORAGE_UNIT *StorageUnit)
     SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
 }
 
-static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0)
+static BOOLEAN SpdStorageUnitWriteSame(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_REQ *Request, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
 {
-    SPD_STORAGE_UNIT *StorageUnit = StorageUnit0;
-    SPD_IOCTL_TRANSACT_REQ RequestBuf, *Request = &RequestBuf;
-    SPD_IOCTL_TRANSACT_RSP ResponseBuf, *Response;
-    SPD_STORAGE_UNIT_OPERATION_CONTEXT OperationContext;
-    PVOID DataBuffer = 0;
-    OVERLAPPED Overlapped;
-    HANDLE DispatcherThread = 0;
-    BOOLEAN Complete;
-    DWORD Error;
+    /*
+     * The storage unit has no WriteSame. An all-zeroes pattern that may be unmapped becomes
+     * a single Unmap. Otherwise the pattern is replicated throughout the data buffer, which
+     * is then written as many times as it takes to cover the range.
+     */
+    UINT32 BlockLength = StorageUnit->StorageUnitParams.BlockLength;
+    UINT64 BlockAddress = Request->Op.WriteSame.BlockAddress;
+    UINT32 BlockCount = Request->Op.WriteSame.BlockCount;
+    UINT32 WriteBlockCount;
+    ULONG Length, CopyLength;
+    BOOLEAN Complete = TRUE;
 
-    DataBuffer = StorageUnit->BufferAlloc(StorageUnit->StorageUnitParams.MaxTransferLength);
-    if (0 == DataBuffer)
+    if (Request->Op.WriteSame.Unmap && 0 != StorageUnit->Interface->Unmap)
     {
-        Error = ERROR_NO_SYSTEM_RESOURCES;
-        goto exit;
+        for (Length = 0; BlockLength > Length; Length++)
+            if (0 != ((PUINT8)DataBuffer)[Length])
+                break;
+        if (BlockLength == Length)
+        {
+            SPD_UNMAP_DESCRIPTOR Descriptor;
+
+            Descriptor.BlockAddress = BlockAddress;
+            Descriptor.BlockCount = BlockCount;
+            Descriptor.Reserved = 0;
+            return StorageUnit->Interface->Unmap(
+                StorageUnit,
+                &Descriptor,
+                1,
+                &Response->Status);
+        }
     }
 
-    Error = SpdOverlappedInit(&Overlapped);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    if (0 == StorageUnit->Interface->Write)
+    {
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
+        return TRUE;
+    }
 
-    OperationContext.Request = &RequestBuf;
-    OperationContext.Response = &ResponseBuf;
-    OperationContext.DataBuffer = DataBuffer;
-    TlsSetValue(SpdStorageUnitTlsKey, &OperationContext);
+    WriteBlockCount = StorageUnit->StorageUnitParams.MaxTransferLength / BlockLength;
+    if (WriteBlockCount > BlockCount)
+        WriteBlockCount = BlockCount;
+    for (Length = BlockLength; WriteBlockCount * BlockLength > Length; Length += CopyLength)
+    {
+        CopyLength = WriteBlockCount * BlockLength - Length;
+        if (CopyLength > Length)
+            CopyLength = Length;
+        memcpy((PUINT8)DataBuffer + Length, DataBuffer, CopyLength);
+    }
 
-    if (1 < StorageUnit->DispatcherThreadCount)
+    while (0 < BlockCount)
     {
-        StorageUnit->DispatcherThreadCount--;
-        DispatcherThread = CreateThread(0, 0, SpdStorageUnitDispatcherThread, StorageUnit, 0, 0);
-        if (0 == DispatcherThread)
-        {
-            Error = GetLastError();
-            goto exit;
-        }
+        if (WriteBlockCount > BlockCount)
+            WriteBlockCount = BlockCount;
+        Complete = StorageUnit->Interface->Write(
+            StorageUnit,
+            DataBuffer,
+            BlockAddress,
+            WriteBlockCount,
+            !StorageUnit->WriteCacheEnabled,
+            &Response->Status);
+        if (!Complete || SCSISTAT_GOOD != Response->Status.ScsiStatus)
+            break;
+        BlockAddress += WriteBlockCount;
+        BlockCount -= WriteBlockCount;
     }
 
-    Response = 0;
-    for (;;)
+    return Complete;
+}
+
+static BOOLEAN SpdStorageUnitCopy(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_REQ *Request, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    /*
+     * The storage unit has no Copy. The descriptors are moved out of the data buffer, which
+     * is then used to Read and Write each range. A range whose destination overlaps the end
+     * of its source is copied back to front, so that no source block is overwritten before
+     * it is read.
+     */
+    UINT32 MaxBlockCount = StorageUnit->StorageUnitParams.MaxTransferLength /
+        StorageUnit->StorageUnitParams.BlockLength;
+    UINT32 Count = Request->Op.Copy.Count;
+    SPD_IOCTL_COPY_DESCRIPTOR *Descriptors = 0;
+    BOOLEAN Complete = TRUE;
+
+    if (0 == StorageUnit->Interface->Read || 0 == StorageUnit->Interface->Write)
     {
-        if (!ResetEvent(Overlapped.hEvent))
-        {
-            Error = GetLastError();
-            goto exit;
-        }
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
+        goto exit;
+    }
 
-        memset(Request, 0, sizeof *Request);
-        Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
-            StorageUnit->Btl, Response, Request, DataBuffer, &Overlapped);
-        if (ERROR_SUCCESS != Error)
-            goto exit;
+    if (0 == Count)
+        goto exit;
 
-        if (0 == Request->Hint)
-        {
-            Response = 0;
-            continue;
-        }
+    /* the descriptors come in a single data buffer; do not trust a count that exceeds it */
+    if (StorageUnit->StorageUnitParams.MaxTransferLength / sizeof *Descriptors < Count)
+    {
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST, 0);
+        goto exit;
+    }
 
-        if (StorageUnit->DebugLog)
-        {
-            if (SpdIoctlTransactKindCount <= Request->Kind ||
-                (StorageUnit->DebugLog & (1 << Request->Kind)))
-                SpdDebugLogRequest(Request);
-        }
+    Descriptors = MemAlloc(Count * sizeof *Descriptors);
+    if (0 == Descriptors)
+    {
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_MEDIUM_ERROR, SCSI_ADSENSE_WRITE_ERROR, 0);
+        goto exit;
+    }
+    memcpy(Descriptors, DataBuffer, Count * sizeof *Descriptors);
 
-        Response = &ResponseBuf;
-        memset(Response, 0, sizeof *Response);
-        Response->Hint = Request->Hint;
-        Response->Kind = Request->Kind;
-        switch (Request->Kind)
+    for (UINT32 I = 0; Count > I; I++)
+    {
+        UINT64 BlockAddress = Descriptors[I].BlockAddress;
+        UINT64 SourceBlockAddress = Descriptors[I].SourceBlockAddress;
+        UINT32 BlockCount = Descriptors[I].BlockCount;
+        BOOLEAN Backward = SourceBlockAddress < BlockAddress &&
+            BlockAddress < SourceBlockAddress + BlockCount;
+
+        while (0 < BlockCount)
         {
-        case SpdIoctlTransactReadKind:
-            if (0 == StorageUnit->Interface->Read)
-                goto invalid;
+            UINT32 CopyCount = MaxBlockCount < BlockCount ? MaxBlockCount : BlockCount;
+            UINT32 Offset = Backward ? BlockCount - CopyCount : 0;
+
             Complete = StorageUnit->Interface->Read(
                 StorageUnit,
                 DataBuffer,
-                Request->Op.Read.BlockAddress,
-                Request->Op.Read.BlockCount,
-                Request->Op.Read.ForceUnitAccess,
+                SourceBlockAddress + Offset,
+                CopyCount,
+                FALSE,
                 &Response->Status);
-            break;
-        case SpdIoctlTransactWriteKind:
-            if (0 == StorageUnit->Interface->Write)
-                goto invalid;
+            if (!Complete || SCSISTAT_GOOD != Response->Status.ScsiStatus)
+                goto exit;
+
             Complete = StorageUnit->Interface->Write(
                 StorageUnit,
                 DataBuffer,
-                Request->Op.Write.BlockAddress,
-                Request->Op.Write.BlockCount,
-                Request->Op.Write.ForceUnitAccess,
-                &Response->Status);
-            break;
-        case SpdIoctlTransactFlushKind:
-            if (0 == StorageUnit->Interface->Flush)
-                goto invalid;
-            Complete = StorageUnit->Interface->Flush(
-                StorageUnit,
-                Request->Op.Flush.BlockAddress,
-                Request->Op.Flush.BlockCount,
-                &Response->Status);
-            break;
-        case SpdIoctlTransactUnmapKind:
-            if (0 == StorageUnit->Interface->Unmap)
-                goto invalid;
-            Complete = StorageUnit->Interface->Unmap(
-                StorageUnit,
-                DataBuffer,
-                Request->Op.Unmap.Count,
+                BlockAddress + Offset,
+                CopyCount,
+                !StorageUnit->WriteCacheEnabled,
                 &Response->Status);
-            break;
-        default:
-        invalid:
-            SpdStorageUnitStatusSetSense(&Response->Status,
-                SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
-            Complete = TRUE;
-            break;
-        }
+            if (!Complete || SCSISTAT_GOOD != Response->Status.ScsiStatus)
+                goto exit;
 
-        if (Complete && StorageUnit->DebugLog)
-        {
-            if (SpdIoctlTransactKindCount <= Response->Kind ||
-                (StorageUnit->DebugLog & (1 << Response->Kind)))
-                SpdDebugLogResponse(Response);
+            if (!Backward)
+            {
+                BlockAddress += CopyCount;
+                SourceBlockAddress += CopyCount;
+            }
+            BlockCount -= CopyCount;
         }
-
-        if (!Complete)
-            Response = 0;
     }
 
 exit:
-    SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+    MemFree(Descriptors);
 
-    SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+    return Complete;
+}
 
-    if (0 != DispatcherThread)
+static BOOLEAN SpdStorageUnitSetCache(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_REQ *Request, SPD_IOCTL_TRANSACT_RSP *Response)
+{
+    /* write-through from now on; data cached so far must reach the medium */
+    if (!Request->Op.SetCache.WriteCacheEnabled && 0 != StorageUnit->Interface->Flush)
+        return StorageUnit->Interface->Flush(
+            StorageUnit,
+            0,
+            0,
+            &Response->Status);
+
+    return TRUE;
+}
+
+static BOOLEAN SpdStorageUnitDispatchRequest(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_REQ *Request, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    BOOLEAN Complete;
+
+    if (StorageUnit->DebugLog)
     {
-        WaitForSingleObject(DispatcherThread, INFINITE);
-        CloseHandle(DispatcherThread);
+        if (SpdIoctlTransactKindCount <= Request->Kind ||
+            (StorageUnit->DebugLog & (1 << Request->Kind)))
+            SpdDebugLogRequest(Request);
     }
 
-    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    if (0 != Request->MappedDataBuffer)
+    {
+        /* zero-copy: the driver has mapped the original I/O buffer into our process */
+        SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext = SpdStorageUnitGetOperationContext();
+
+        DataBuffer = (PVOID)(UINT_PTR)Request->MappedDataBuffer;
+        if (0 != OperationContext)
+            OperationContext->DataBuffer = DataBuffer;
+    }
+
+    memset(Response, 0, sizeof *Response);
+    Response->Hint = Request->Hint;
+    Response->Kind = Request->Kind;
+    switch (Request->Kind)
     {
-        if (StorageUnit->StorageUnitParams.CacheSupported && 0 != StorageUnit->Interface->Flush)
+    case SpdIoctlTransactReadKind:
+        if (0 == StorageUnit->Interface->Read)
+            goto invalid;
+        Complete = StorageUnit->Interface->Read(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Read.BlockAddress,
+            Request->Op.Read.BlockCount,
+            Request->Op.Read.ForceUnitAccess,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactWriteKind:
+        if (0 == StorageUnit->Interface->Write)
+            goto invalid;
+        Complete = StorageUnit->Interface->Write(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Write.BlockAddress,
+            Request->Op.Write.BlockCount,
+            Request->Op.Write.ForceUnitAccess,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactFlushKind:
+        if (0 == StorageUnit->Interface->Flush)
+            goto invalid;
+        Complete = StorageUnit->Interface->Flush(
+            StorageUnit,
+            Request->Op.Flush.BlockAddress,
+            Request->Op.Flush.BlockCount,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactUnmapKind:
+        if (0 == StorageUnit->Interface->Unmap)
+            goto invalid;
+        Complete = StorageUnit->Interface->Unmap(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Unmap.Count,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactWriteSameKind:
+        if (0 == StorageUnit->Interface->WriteSame)
+        {
+            Complete = SpdStorageUnitWriteSame(StorageUnit, Request, Response, DataBuffer);
+            break;
+        }
+        Complete = StorageUnit->Interface->WriteSame(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.WriteSame.BlockAddress,
+            Request->Op.WriteSame.BlockCount,
+            Request->Op.WriteSame.Unmap,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactCopyKind:
+        if (0 == StorageUnit->Interface->Copy)
         {
-            Response = &ResponseBuf;
-            memset(Request, 0, sizeof *Request);
-            memset(Response, 0, sizeof *Response);
-            StorageUnit->Interface->Flush(
+            Complete = SpdStorageUnitCopy(StorageUnit, Request, Response, DataBuffer);
+            break;
+        }
+        Complete = StorageUnit->Interface->Copy(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Copy.Count,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactSetCacheKind:
+        /* other threads keep using the old setting until the storage unit has switched */
+        if (0 == StorageUnit->Interface->SetCache)
+            Complete = SpdStorageUnitSetCache(StorageUnit, Request, Response);
+        else
+            Complete = StorageUnit->Interface->SetCache(
                 StorageUnit,
-                0,
-                0,
+                !!Request->Op.SetCache.WriteCacheEnabled,
                 &Response->Status);
-        }
+        if (Complete && SCSISTAT_GOOD == Response->Status.ScsiStatus)
+            StorageUnit->WriteCacheEnabled = !!Request->Op.SetCache.WriteCacheEnabled;
+        break;
+    default:
+    invalid:
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
+        Complete = TRUE;
+        break;
     }
 
-    TlsSetValue(SpdStorageUnitTlsKey, 0);
-
-    SpdOverlappedFini(&Overlapped);
-
-    StorageUnit->BufferFree(DataBuffer);
+    if (Complete && StorageUnit->DebugLog)
+    {
+        if (SpdIoctlTransactKindCount <= Response->Kind ||
+            (StorageUnit->DebugLog & (1 << Response->Kind)))
+            SpdDebugLogResponse(Response);
+    }
 
-    return Error;
+    return Complete;
 }
 
-DWORD SpdStorageUnitStartDispatcher(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount)
+static VOID SpdStorageUnitDispatchRequestsV(SPD_STORAGE_UNIT *StorageUnit,
+    UINT8 Kind,
+    SPD_IOCTL_TRANSACT_REQ *Requests, SPD_IOCTL_TRANSACT_RSP *Responses, UINT32 Count,
+    PVOID DataBuffer, ULONG DataSlotLength,
+    PBOOLEAN Dispatched)
 {
-    if (0 != StorageUnit->DispatcherThread)
-        return ERROR_INVALID_PARAMETER;
+    VOID (*Operation)(SPD_STORAGE_UNIT *, SPD_IO_DESCRIPTOR [], UINT32);
+    SPD_IO_DESCRIPTOR Descriptors[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    UINT32 Indices[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    SPD_IO_DESCRIPTOR *Descriptor;
+    SPD_IOCTL_TRANSACT_REQ *Request;
+    SPD_IOCTL_TRANSACT_RSP *Response;
+    UINT32 DescriptorCount = 0;
 
-    if (0 == ThreadCount)
+    Operation = SpdIoctlTransactReadKind == Kind ?
+        StorageUnit->Interface->ReadV : StorageUnit->Interface->WriteV;
+    if (0 == Operation)
+        return;
+
+    for (UINT32 I = 0; Count > I; I++)
     {
-        DWORD_PTR ProcessMask, SystemMask;
+        Request = &Requests[I];
+        if (Kind != Request->Kind)
+            continue;
 
-        if (!GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask))
-            return GetLastError();
+        if (StorageUnit->DebugLog && (StorageUnit->DebugLog & (1 << Request->Kind)))
+            SpdDebugLogRequest(Request);
+
+        Descriptor = &Descriptors[DescriptorCount];
+        memset(Descriptor, 0, sizeof *Descriptor);
+        /* zero-copy: the driver has mapped the original I/O buffer into our process */
+        Descriptor->Buffer = 0 != Request->MappedDataBuffer ?
+            (PVOID)(UINT_PTR)Request->MappedDataBuffer : (PUINT8)DataBuffer + I * DataSlotLength;
+        if (SpdIoctlTransactReadKind == Kind)
+        {
+            Descriptor->BlockAddress = Request->Op.Read.BlockAddress;
+            Descriptor->BlockCount = Request->Op.Read.BlockCount;
+            Descriptor->Flush = Request->Op.Read.ForceUnitAccess;
+        }
+        else
+        {
+            Descriptor->BlockAddress = Request->Op.Write.BlockAddress;
+            Descriptor->BlockCount = Request->Op.Write.BlockCount;
+            Descriptor->Flush = Request->Op.Write.ForceUnitAccess;
+        }
 
-        for (ThreadCount = 0; 0 != ProcessMask; ProcessMask >>= 1)
-            ThreadCount += ProcessMask & 1;
+        Indices[DescriptorCount++] = I;
     }
 
-    StorageUnit->DispatcherThreadCount = ThreadCount;
-    StorageUnit->DispatcherThread = CreateThread(0, 0,
-        SpdStorageUnitDispatcherThread, StorageUnit, CREATE_SUSPENDED,
-        &StorageUnit->DispatcherThreadId);
-    if (0 == StorageUnit->DispatcherThread)
-        return GetLastError();
-    if (!ResumeThread(StorageUnit->DispatcherThread))
+    if (0 == DescriptorCount)
+        return;
+
+    Operation(StorageUnit, Descriptors, DescriptorCount);
+
+    for (UINT32 J = 0; DescriptorCount > J; J++)
     {
-        CloseHandle(StorageUnit->DispatcherThread);
-        return GetLastError();
+        Request = &Requests[Indices[J]];
+        Response = &Responses[Indices[J]];
+
+        memset(Response, 0, sizeof *Response);
+        Response->Hint = Request->Hint;
+        Response->Kind = Request->Kind;
+        memcpy(&Response->Status, &Descriptors[J].Status, sizeof Response->Status);
+
+        if (StorageUnit->DebugLog && (StorageUnit->DebugLog & (1 << Response->Kind)))
+            SpdDebugLogResponse(Response);
+
+        Dispatched[Indices[J]] = TRUE;
     }
+}
 
-    return ERROR_SUCCESS;
+static ULONG SpdStorageUnitGetDispatcherBatchCount(SPD_STORAGE_UNIT *StorageUnit)
+{
+    ULONG BatchCount = StorageUnit->DispatcherBatchCount;
+
+    /* elastic threads wait for requests with a timeout, which only single transacts have */
+    if (1 > BatchCount || 0 != StorageUnit->DispatcherElastic)
+        BatchCount = 1;
+    else if (SPD_IOCTL_TRANSACT_V_CAPACITY < BatchCount)
+        BatchCount = SPD_IOCTL_TRANSACT_V_CAPACITY;
+
+    return BatchCount;
 }
 
-VOID SpdStorageUnitWaitDispatcher(SPD_STORAGE_UNIT *StorageUnit)
+static ULONG SpdStorageUnitGetDispatcherAsyncDepth(SPD_STORAGE_UNIT *StorageUnit)
 {
-    if (0 == StorageUnit->DispatcherThread)
-        return;
+    ULONG AsyncDepth = StorageUnit->DispatcherAsyncDepth;
 
-    WaitForSingleObject(StorageUnit->DispatcherThread, INFINITE);
-    CloseHandle(StorageUnit->DispatcherThread);
-    StorageUnit->DispatcherThread = 0;
+    if (0 == AsyncDepth)
+        AsyncDepth = SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH;
+    else if (SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH_MAX < AsyncDepth)
+        AsyncDepth = SPD_STORAGE_UNIT_DISPATCHER_ASYNC_DEPTH_MAX;
+
+    return AsyncDepth;
 }
 
-VOID SpdStorageUnitSendResponse(SPD_STORAGE_UNIT *StorageUnit,
-    SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+static DWORD SpdStorageUnitCreateDispatcherPlacement(SPD_STORAGE_UNIT *StorageUnit,
+    const SPD_STORAGE_UNIT_PLACEMENT *Placement)
 {
+    SPD_STORAGE_UNIT_PLACEMENT_TABLE *Table = 0;
+    SPD_STORAGE_UNIT_PLACEMENT_ENTRY *Entry;
+    PROCESSOR_NUMBER ProcessorNumber;
+    GROUP_AFFINITY Affinity;
+    ULONG HighestNode, EntryCount;
+    USHORT Node;
     DWORD Error;
 
-    if (StorageUnit->DebugLog)
+    StorageUnit->DispatcherPlacement = 0;
+
+    if (0 == Placement)
+        return ERROR_SUCCESS;
+
+    switch (Placement->Policy)
     {
-        if (SpdIoctlTransactKindCount <= Response->Kind ||
-            (StorageUnit->DebugLog & (1 << Response->Kind)))
-            SpdDebugLogResponse(Response);
+    case SPD_STORAGE_UNIT_PLACEMENT_SPREAD:
+        if (!GetNumaHighestNodeNumber(&HighestNode))
+            return GetLastError();
+        EntryCount = HighestNode + 1;
+        break;
+    case SPD_STORAGE_UNIT_PLACEMENT_NODE:
+        EntryCount = 1;
+        break;
+    case SPD_STORAGE_UNIT_PLACEMENT_CPUSET:
+        if (0 == Placement->CpuSetCount || 0 == Placement->CpuSet)
+            return ERROR_INVALID_PARAMETER;
+        EntryCount = Placement->CpuSetCount;
+        break;
+    default:
+        return ERROR_INVALID_PARAMETER;
     }
 
-    Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
-        StorageUnit->Btl, Response, 0, DataBuffer, NULL);
-    if (ERROR_SUCCESS != Error)
+    Table = MemAlloc(sizeof *Table + EntryCount * sizeof *Entry);
+    if (0 == Table)
     {
-        SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Table, 0, sizeof *Table + EntryCount * sizeof *Entry);
+    Table->Entries = (PVOID)(Table + 1);
 
-        SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+    switch (Placement->Policy)
+    {
+    case SPD_STORAGE_UNIT_PLACEMENT_SPREAD:
+        /* one entry per node that has processors; threads go round robin across them */
+        for (ULONG I = 0; HighestNode >= I; I++)
+            if (GetNumaNodeProcessorMaskEx((USHORT)I, &Affinity) && 0 != Affinity.Mask)
+            {
+                Entry = &Table->Entries[Table->EntryCount++];
+                Entry->Affinity = Affinity;
+                Entry->Node = (USHORT)I;
+            }
+        break;
+    case SPD_STORAGE_UNIT_PLACEMENT_NODE:
+        if (GetNumaNodeProcessorMaskEx(Placement->Node, &Affinity) && 0 != Affinity.Mask)
+        {
+            Entry = &Table->Entries[Table->EntryCount++];
+            Entry->Affinity = Affinity;
+            Entry->Node = Placement->Node;
+        }
+        break;
+    case SPD_STORAGE_UNIT_PLACEMENT_CPUSET:
+        for (ULONG I = 0; Placement->CpuSetCount > I; I++)
+        {
+            if (0 == Placement->CpuSet[I].Mask)
+            {
+                Error = ERROR_INVALID_PARAMETER;
+                goto exit;
+            }
+
+            /* the buffers of a thread go to the node of the first processor of its set */
+            memset(&ProcessorNumber, 0, sizeof ProcessorNumber);
+            ProcessorNumber.Group = Placement->CpuSet[I].Group;
+            while (0 == (Placement->CpuSet[I].Mask & ((KAFFINITY)1 << ProcessorNumber.Number)))
+                ProcessorNumber.Number++;
+            if (!GetNumaProcessorNodeEx(&ProcessorNumber, &Node))
+            {
+                Error = GetLastError();
+                goto exit;
+            }
+
+            Entry = &Table->Entries[Table->EntryCount++];
+            Entry->Affinity = Placement->CpuSet[I];
+            memset(Entry->Affinity.Reserved, 0, sizeof Entry->Affinity.Reserved);
+            Entry->Node = Node;
+        }
+        break;
     }
-}
 
-SPD_STORAGE_UNIT_OPERATION_CONTEXT *SpdStorageUnitGetOperationContext(VOID)
-{
-    return (SPD_STORAGE_UNIT_OPERATION_CONTEXT *)TlsGetValue(SpdStorageUnitTlsKey);
+    if (0 == Table->EntryCount)
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit->DispatcherPlacement = Table;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+        MemFree(Table);
+
+    return Error;
 }
 
-VOID SpdStorageUnitSetBufferAllocatorF(SPD_STORAGE_UNIT *StorageUnit,
-    PVOID(*BufferAlloc)(size_t),
-    VOID(*BufferFree)(PVOID))
+static VOID SpdStorageUnitDeleteDispatcherPlacement(SPD_STORAGE_UNIT *StorageUnit)
 {
-    SpdStorageUnitSetBufferAllocator(StorageUnit, BufferAlloc, BufferFree);
+    MemFree(StorageUnit->DispatcherPlacement);
+    StorageUnit->DispatcherPlacement = 0;
 }
 
-VOID SpdStorageUnitGetDispatcherErrorF(SPD_STORAGE_UNIT *StorageUnit,
-    DWORD *PDispatcherError)
+static ULONG SpdStorageUnitGetDispatcherPlacementProcessorCount(SPD_STORAGE_UNIT *StorageUnit)
 {
-    SpdStorageUnitGetDispatcherError(StorageUnit, PDispatcherError);
+    SPD_STORAGE_UNIT_PLACEMENT_TABLE *Table = StorageUnit->DispatcherPlacement;
+    ULONG ProcessorCount = 0;
+
+    for (ULONG I = 0; Table->EntryCount > I; I++)
+        for (KAFFINITY Mask = Table->Entries[I].Affinity.Mask; 0 != Mask; Mask >>= 1)
+            ProcessorCount += Mask & 1;
+
+    return ProcessorCount;
 }
 
-VOID SpdStorageUnitSetDispatcherErrorF(SPD_STORAGE_UNIT *StorageUnit,
-    DWORD DispatcherError)
+static VOID SpdStorageUnitPlaceDispatcherThread(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadIndex)
 {
-    SpdStorageUnitSetDispatcherError(StorageUnit, DispatcherError);
+    SPD_STORAGE_UNIT_PLACEMENT_TABLE *Table = StorageUnit->DispatcherPlacement;
+
+    if (0 == Table)
+        return;
+
+    /* best effort: a thread that cannot be placed runs wherever the system puts it */
+    SetThreadGroupAffinity(GetCurrentThread(),
+        &Table->Entries[ThreadIndex % Table->EntryCount].Affinity, 0);
 }
 
-VOID SpdStorageUnitSetDebugLogF(SPD_STORAGE_UNIT *StorageUnit,
-    UINT32 DebugLog)
+static PVOID SpdStorageUnitAllocDispatcherBuffer(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadIndex, ULONG ThreadCount, SIZE_T ThreadSize)
 {
-    SpdStorageUnitSetDebugLog(StorageUnit, DebugLog);
+    SPD_STORAGE_UNIT_PLACEMENT_TABLE *Table = StorageUnit->DispatcherPlacement;
+    PUINT8 Buffer;
+
+    if (0 == Table)
+        return StorageUnit->BufferAlloc(ThreadCount * ThreadSize);
+
+    /*
+     * Reserve the buffer, then commit the part of each thread on the node of the thread.
+     * Pages come from the node of their range when they are first touched, which is when
+     * the driver locks a registered buffer pool or when the thread first uses its part.
+     */
+    Buffer = VirtualAlloc(0, ThreadCount * ThreadSize, MEM_RESERVE, PAGE_READWRITE);
+    if (0 == Buffer)
+        return 0;
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+        if (0 == VirtualAllocExNuma(GetCurrentProcess(),
+            Buffer + I * ThreadSize, ThreadSize, MEM_COMMIT, PAGE_READWRITE,
+            Table->Entries[(ThreadIndex + I) % Table->EntryCount].Node))
+        {
+            VirtualFree(Buffer, 0, MEM_RELEASE);
+            return 0;
+        }
+
+    return Buffer;
+}
+
+static VOID SpdStorageUnitFreeDispatcherBuffer(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer)
+{
+    if (0 == StorageUnit->DispatcherPlacement)
+        StorageUnit->BufferFree(Buffer);
+    else if (0 != Buffer)
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+static VOID SpdStorageUnitRegisterDispatcherBufferPool(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadCount, ULONG SlotCount)
+{
+    /*
+     * Register the data buffers of all dispatcher threads with the kernel once, so that
+     * transacts do not have to lock and unlock pages every time. If this is not possible
+     * (e.g. pipe transport) every dispatcher thread allocates its own buffer.
+     *
+     * The pool has SlotCount slots for every thread; thread I uses the slots starting at
+     * I * SlotCount.
+     */
+    ULONG PoolCount = ThreadCount * SlotCount;
+    PVOID BufferPool;
+
+    StorageUnit->DispatcherBufferPool = 0;
+
+    BufferPool = SpdStorageUnitAllocDispatcherBuffer(StorageUnit, 0, ThreadCount,
+        (SIZE_T)SlotCount * StorageUnit->StorageUnitParams.MaxTransferLength);
+    if (0 == BufferPool)
+        return;
+
+    if (ERROR_SUCCESS != SpdStorageUnitHandleRegisterBufferPool(
+        StorageUnit->Handle, StorageUnit->Btl, BufferPool, PoolCount))
+    {
+        SpdStorageUnitFreeDispatcherBuffer(StorageUnit, BufferPool);
+        return;
+    }
+
+    StorageUnit->DispatcherBufferPool = BufferPool;
+}
+
+static VOID SpdStorageUnitUnregisterDispatcherBufferPool(SPD_STORAGE_UNIT *StorageUnit)
+{
+    if (0 == StorageUnit->DispatcherBufferPool)
+        return;
+
+    SpdStorageUnitHandleRegisterBufferPool(StorageUnit->Handle, StorageUnit->Btl, 0, 0);
+    SpdStorageUnitFreeDispatcherBuffer(StorageUnit, StorageUnit->DispatcherBufferPool);
+    StorageUnit->DispatcherBufferPool = 0;
+}
+
+static VOID SpdStorageUnitDispatcherFlush(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext)
+{
+    if (StorageUnit->StorageUnitParams.CacheSupported && 0 != StorageUnit->Interface->Flush)
+    {
+        memset(OperationContext->Request, 0, sizeof *OperationContext->Request);
+        memset(OperationContext->Response, 0, sizeof *OperationContext->Response);
+        StorageUnit->Interface->Flush(
+            StorageUnit,
+            0,
+            0,
+            &OperationContext->Response->Status);
+    }
+}
+
+static DWORD SpdStorageUnitCreateDispatcherElastic(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadMax)
+{
+    SPD_STORAGE_UNIT_ELASTIC *Elastic;
+    DWORD Error;
+
+    Elastic = MemAlloc(sizeof *Elastic + ThreadMax * sizeof Elastic->Slots[0]);
+    if (0 == Elastic)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    memset(Elastic, 0, sizeof *Elastic + ThreadMax * sizeof Elastic->Slots[0]);
+    Elastic->ThreadMax = ThreadMax;
+    Elastic->IdleTimeout = 0 != StorageUnit->DispatcherIdleTimeout ?
+        StorageUnit->DispatcherIdleTimeout : SPD_STORAGE_UNIT_DISPATCHER_IDLE_TIMEOUT;
+    Elastic->ThreadCount = 1;           /* the first thread */
+    Elastic->Slots = (PVOID)(Elastic + 1);
+
+    Elastic->DoneEvent = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Elastic->DoneEvent)
+    {
+        Error = GetLastError();
+        MemFree(Elastic);
+        return Error;
+    }
+
+    StorageUnit->DispatcherElastic = Elastic;
+
+    return ERROR_SUCCESS;
+}
+
+static VOID SpdStorageUnitDeleteDispatcherElastic(SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_STORAGE_UNIT_ELASTIC *Elastic = StorageUnit->DispatcherElastic;
+
+    if (0 == Elastic)
+        return;
+
+    CloseHandle(Elastic->DoneEvent);
+    MemFree(Elastic);
+    StorageUnit->DispatcherElastic = 0;
+}
+
+static ULONG SpdStorageUnitElasticClaimIndex(SPD_STORAGE_UNIT_ELASTIC *Elastic)
+{
+    for (;;)
+        for (ULONG I = 0; Elastic->ThreadMax > I; I++)
+            if (0 == InterlockedCompareExchange(&Elastic->Slots[I], 1, 0))
+                return I;
+}
+
+static VOID SpdStorageUnitElasticExit(SPD_STORAGE_UNIT_ELASTIC *Elastic)
+{
+    if (0 == InterlockedDecrement(&Elastic->ThreadCount))
+        SetEvent(Elastic->DoneEvent);
+}
+
+static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0);
+
+static VOID SpdStorageUnitElasticEnter(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ELASTIC *Elastic, UINT32 PendingDepth)
+{
+    LONG BusyCount, ThreadCount;
+    DWORD DispatcherError;
+    HANDLE Thread;
+
+    BusyCount = InterlockedIncrement(&Elastic->BusyCount);
+
+    /* add a thread only if requests are waiting and no thread is free to fetch them */
+    ThreadCount = Elastic->ThreadCount;
+    if (0 == PendingDepth || BusyCount < ThreadCount || (LONG)Elastic->ThreadMax <= ThreadCount)
+        return;
+
+    SpdStorageUnitGetDispatcherError(StorageUnit, &DispatcherError);
+    if (ERROR_SUCCESS != DispatcherError)
+        return;
+
+    if (ThreadCount != InterlockedCompareExchange(&Elastic->ThreadCount,
+        ThreadCount + 1, ThreadCount))
+        return;                         /* another thread has just added one */
+
+    Thread = CreateThread(0, 0, SpdStorageUnitDispatcherThread, StorageUnit, 0, 0);
+    if (0 == Thread)
+    {
+        /* not fatal; we keep going with the threads we have */
+        SpdStorageUnitElasticExit(Elastic);
+        return;
+    }
+
+    CloseHandle(Thread);
+}
+
+static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0)
+{
+    SPD_STORAGE_UNIT *StorageUnit = StorageUnit0;
+    SPD_STORAGE_UNIT_ELASTIC *Elastic = StorageUnit->DispatcherElastic;
+    SPD_IOCTL_TRANSACT_REQ Requests[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    SPD_IOCTL_TRANSACT_RSP Responses[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    BOOLEAN Dispatched[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT OperationContext;
+    ULONG BatchCount, MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    UINT32 RspCount, ReqCount, DataIndex = (UINT32)-1;
+    UINT32 WaitTimeout = 0;
+    PVOID DataBuffer = 0, DataSlot;
+    ULONG ThreadIndex;
+    OVERLAPPED Overlapped;
+    HANDLE DispatcherThread = 0;
+    DWORD Error;
+
+    BatchCount = SpdStorageUnitGetDispatcherBatchCount(StorageUnit);
+
+    if (0 != Elastic)
+    {
+        ThreadIndex = SpdStorageUnitElasticClaimIndex(Elastic);
+
+        /* only threads added by the elastic dispatcher give up when idle */
+        if (GetCurrentThreadId() != StorageUnit->DispatcherThreadId)
+            WaitTimeout = Elastic->IdleTimeout;
+    }
+    else
+        ThreadIndex = InterlockedIncrement(&StorageUnit->DispatcherBufferPoolIndex) - 1;
+    SpdStorageUnitPlaceDispatcherThread(StorageUnit, ThreadIndex);
+
+    if (0 != StorageUnit->DispatcherBufferPool)
+    {
+        /* use our own slice of the registered (kernel locked) buffer pool */
+        DataIndex = ThreadIndex * BatchCount;
+        DataBuffer = (PUINT8)StorageUnit->DispatcherBufferPool + DataIndex * MaxTransferLength;
+    }
+    else
+    {
+        DataBuffer = SpdStorageUnitAllocDispatcherBuffer(StorageUnit, ThreadIndex, 1,
+            (SIZE_T)BatchCount * MaxTransferLength);
+        if (0 == DataBuffer)
+        {
+            Error = ERROR_NO_SYSTEM_RESOURCES;
+            goto exit;
+        }
+    }
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    OperationContext.Request = &Requests[0];
+    OperationContext.Response = &Responses[0];
+    OperationContext.DataBuffer = DataBuffer;
+    TlsSetValue(SpdStorageUnitTlsKey, &OperationContext);
+
+    if (1 < StorageUnit->DispatcherThreadCount)
+    {
+        StorageUnit->DispatcherThreadCount--;
+        DispatcherThread = CreateThread(0, 0, SpdStorageUnitDispatcherThread, StorageUnit, 0, 0);
+        if (0 == DispatcherThread)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+
+    RspCount = 0;
+    for (;;)
+    {
+        if (!ResetEvent(Overlapped.hEvent))
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        if (1 == BatchCount)
+        {
+            memset(&Requests[0], 0, sizeof Requests[0]);
+            Error = SpdStorageUnitHandleTransactWait(StorageUnit->Handle,
+                StorageUnit->Btl, 0 != RspCount ? &Responses[0] : 0, &Requests[0],
+                DataBuffer, DataIndex, WaitTimeout, &Overlapped);
+            ReqCount = 0 != Requests[0].Hint ? 1 : 0;
+        }
+        else
+        {
+            ReqCount = BatchCount;
+            Error = SpdStorageUnitHandleTransactV(StorageUnit->Handle,
+                StorageUnit->Btl, Responses, RspCount, Requests, &ReqCount,
+                DataBuffer, MaxTransferLength, DataIndex, &Overlapped);
+        }
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+
+        if (0 != Elastic)
+        {
+            /* no request within the idle timeout: there are more threads than work */
+            if (0 == ReqCount && 0 != WaitTimeout)
+                goto retire;
+
+            SpdStorageUnitElasticEnter(StorageUnit, Elastic, Requests[0].PendingDepth);
+        }
+
+        /* hand reads and writes over to the vectored operations, if any, in one call each */
+        memset(Dispatched, 0, sizeof Dispatched);
+        SpdStorageUnitDispatchRequestsV(StorageUnit, SpdIoctlTransactReadKind,
+            Requests, Responses, ReqCount, DataBuffer, MaxTransferLength, Dispatched);
+        SpdStorageUnitDispatchRequestsV(StorageUnit, SpdIoctlTransactWriteKind,
+            Requests, Responses, ReqCount, DataBuffer, MaxTransferLength, Dispatched);
+
+        /*
+         * Response I carries the data for Request I in data slot I. Requests that
+         * are not completed synchronously leave a hole (zero Hint) in the responses.
+         */
+        RspCount = 0;
+        for (UINT32 I = 0; ReqCount > I; I++)
+        {
+            if (Dispatched[I])
+            {
+                RspCount = I + 1;
+                continue;
+            }
+
+            DataSlot = (PUINT8)DataBuffer + I * MaxTransferLength;
+
+            OperationContext.Request = &Requests[I];
+            OperationContext.Response = &Responses[I];
+            OperationContext.DataBuffer = DataSlot;
+
+            if (SpdStorageUnitDispatchRequest(StorageUnit,
+                &Requests[I], &Responses[I], DataSlot))
+                RspCount = I + 1;
+            else
+                Responses[I].Hint = 0;
+        }
+
+        if (0 != Elastic)
+            InterlockedDecrement(&Elastic->BusyCount);
+    }
+
+exit:
+    SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+
+    SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+
+retire:
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    if (0 != Elastic && GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        /* wait for the threads that the elastic dispatcher has added */
+        SpdStorageUnitElasticExit(Elastic);
+        WaitForSingleObject(Elastic->DoneEvent, INFINITE);
+    }
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        OperationContext.Request = &Requests[0];
+        OperationContext.Response = &Responses[0];
+        OperationContext.DataBuffer = DataBuffer;
+        SpdStorageUnitDispatcherFlush(StorageUnit, &OperationContext);
+    }
+
+    TlsSetValue(SpdStorageUnitTlsKey, 0);
+
+    SpdOverlappedFini(&Overlapped);
+
+    if ((UINT32)-1 == DataIndex)
+        SpdStorageUnitFreeDispatcherBuffer(StorageUnit, DataBuffer);
+    else if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+        /* all other dispatcher threads are done; release the buffer pool */
+        SpdStorageUnitUnregisterDispatcherBufferPool(StorageUnit);
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        SpdStorageUnitDeleteDispatcherElastic(StorageUnit);
+        SpdStorageUnitDeleteDispatcherPlacement(StorageUnit);
+    }
+    else if (0 != Elastic)
+    {
+        /* the first thread may delete Elastic as soon as we leave */
+        InterlockedExchange(&Elastic->Slots[ThreadIndex], 0);
+        SpdStorageUnitElasticExit(Elastic);
+    }
+
+    return Error;
+}
+
+static DWORD SpdStorageUnitRegisterDispatcherRing(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadCount)
+{
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    ULONG WantCount = 2 * ThreadCount * SpdStorageUnitGetDispatcherBatchCount(StorageUnit);
+    SPD_STORAGE_UNIT_RING *Ring = 0;
+    UINT32 EntryCount;
+    UINT64 RingSize;
+    DWORD Error;
+
+    StorageUnit->DispatcherRing = 0;
+
+    /* room for the requests being dispatched and as many again waiting in the ring */
+    for (EntryCount = 1; WantCount > EntryCount && SPD_IOCTL_RING_CAPACITY > EntryCount;)
+        EntryCount <<= 1;
+
+    RingSize = SPD_IOCTL_RING_SIZE((UINT64)EntryCount, (UINT64)MaxTransferLength);
+    if (MAXULONG < RingSize)
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Ring = MemAlloc(sizeof *Ring + EntryCount * sizeof(UINT64));
+    if (0 == Ring)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Ring, 0, sizeof *Ring + EntryCount * sizeof(UINT64));
+    Ring->Hints = (PUINT64)(Ring + 1);
+
+    /* page aligned and zeroed; the driver locks it for the lifetime of the ring */
+    Ring->Buffer = VirtualAlloc(0, (SIZE_T)RingSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == Ring->Buffer)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = SpdStorageUnitHandleRegisterRing(StorageUnit->Handle, StorageUnit->Btl,
+        Ring->Buffer, EntryCount);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Ring->Header = Ring->Buffer;
+    Ring->Req = (PVOID)((PUINT8)Ring->Buffer + SPD_IOCTL_RING_REQ_OFFSET);
+    Ring->Rsp = (PVOID)((PUINT8)Ring->Buffer + SPD_IOCTL_RING_RSP_OFFSET(EntryCount));
+    Ring->Data = (PUINT8)Ring->Buffer + SPD_IOCTL_RING_DATA_OFFSET(EntryCount);
+    Ring->EntryCount = EntryCount;
+    InitializeSRWLock(&Ring->ReqLock);
+    InitializeSRWLock(&Ring->RspLock);
+
+    StorageUnit->DispatcherRing = Ring;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error && 0 != Ring)
+    {
+        if (0 != Ring->Buffer)
+            VirtualFree(Ring->Buffer, 0, MEM_RELEASE);
+        MemFree(Ring);
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitUnregisterDispatcherRing(SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_STORAGE_UNIT_RING *Ring = StorageUnit->DispatcherRing;
+
+    if (0 == Ring)
+        return;
+
+    SpdStorageUnitHandleRegisterRing(StorageUnit->Handle, StorageUnit->Btl, 0, 0);
+    VirtualFree(Ring->Buffer, 0, MEM_RELEASE);
+    MemFree(Ring);
+    StorageUnit->DispatcherRing = 0;
+}
+
+static BOOLEAN SpdStorageUnitRingPopRequest(SPD_STORAGE_UNIT_RING *Ring,
+    SPD_IOCTL_RING_REQ *Request)
+{
+    UINT32 ReqTail;
+    BOOLEAN Result = FALSE;
+
+    /* unlocked peek; keeps polling threads off the lock */
+    if (Ring->Header->ReqTail == Ring->Header->ReqHead)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&Ring->ReqLock);
+    ReqTail = Ring->Header->ReqTail;
+    if (ReqTail != Ring->Header->ReqHead)
+    {
+        /* read the entry only after the head that published it */
+        MemoryBarrier();
+        memcpy(Request, &Ring->Req[ReqTail & (Ring->EntryCount - 1)], sizeof *Request);
+        Ring->Header->ReqTail = ReqTail + 1;
+        Result = TRUE;
+    }
+    ReleaseSRWLockExclusive(&Ring->ReqLock);
+
+    return Result;
+}
+
+static VOID SpdStorageUnitRingPushResponse(SPD_STORAGE_UNIT_RING *Ring,
+    SPD_IOCTL_TRANSACT_RSP *Response, UINT32 DataIndex)
+{
+    SPD_IOCTL_RING_RSP *Entry;
+    UINT32 RspHead;
+
+    AcquireSRWLockExclusive(&Ring->RspLock);
+    RspHead = Ring->Header->RspHead;
+    Entry = &Ring->Rsp[RspHead & (Ring->EntryCount - 1)];
+    memcpy(&Entry->Rsp, Response, sizeof *Response);
+    Entry->DataIndex = DataIndex;
+    /* the entry must be visible before the new head */
+    MemoryBarrier();
+    Ring->Header->RspHead = RspHead + 1;
+    ReleaseSRWLockExclusive(&Ring->RspLock);
+}
+
+static DWORD SpdStorageUnitRingSendResponse(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_RING *Ring, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    UINT32 DataIndex;
+    PVOID DataSlot;
+    DWORD Error;
+
+    for (DataIndex = 0; Ring->EntryCount > DataIndex; DataIndex++)
+        if (Response->Hint == Ring->Hints[DataIndex])
+            break;
+    if (Ring->EntryCount == DataIndex)
+        return SpdStorageUnitHandleTransact(StorageUnit->Handle,
+            StorageUnit->Btl, Response, 0, DataBuffer, (UINT32)-1, NULL);
+
+    DataSlot = Ring->Data + (SIZE_T)DataIndex * StorageUnit->StorageUnitParams.MaxTransferLength;
+    if (0 != DataBuffer && DataSlot != DataBuffer)
+    {
+        /*
+         * The response data is not in the data slot. Complete the request with a transact;
+         * the ring response below then only frees the data slot as its hint is now stale.
+         */
+        Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
+            StorageUnit->Btl, Response, 0, DataBuffer, (UINT32)-1, NULL);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+    }
+
+    SpdStorageUnitRingPushResponse(Ring, Response, DataIndex);
+
+    /* entering without waiting never pends; see SpdIoctlTransactInternal */
+    return SpdStorageUnitHandleEnterRing(StorageUnit->Handle, StorageUnit->Btl, FALSE, NULL);
+}
+
+static DWORD WINAPI SpdStorageUnitRingDispatcherThread(PVOID StorageUnit0)
+{
+    SPD_STORAGE_UNIT *StorageUnit = StorageUnit0;
+    SPD_STORAGE_UNIT_RING *Ring = StorageUnit->DispatcherRing;
+    SPD_IOCTL_RING_REQ Request;
+    SPD_IOCTL_TRANSACT_RSP Response;
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT OperationContext;
+    ULONG BatchCount, MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    BOOLEAN Poll = 0 != (StorageUnit->DispatcherFlags & SPD_STORAGE_UNIT_DISPATCHER_POLL);
+    ULONG SpinLimit = SPD_STORAGE_UNIT_RING_SPIN_MIN, SpinCount = 0;
+    ULONG Count, RspCount;
+    PVOID DataSlot;
+    OVERLAPPED Overlapped;
+    HANDLE DispatcherThread = 0;
+    DWORD Error;
+
+    BatchCount = SpdStorageUnitGetDispatcherBatchCount(StorageUnit);
+
+    SpdStorageUnitPlaceDispatcherThread(StorageUnit,
+        InterlockedIncrement(&StorageUnit->DispatcherBufferPoolIndex) - 1);
+
+    memset(&Request, 0, sizeof Request);
+    memset(&Response, 0, sizeof Response);
+    OperationContext.Request = &Request.Req;
+    OperationContext.Response = &Response;
+    OperationContext.DataBuffer = Ring->Data;
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    TlsSetValue(SpdStorageUnitTlsKey, &OperationContext);
+
+    if (1 < StorageUnit->DispatcherThreadCount)
+    {
+        StorageUnit->DispatcherThreadCount--;
+        DispatcherThread = CreateThread(0, 0, SpdStorageUnitRingDispatcherThread, StorageUnit, 0, 0);
+        if (0 == DispatcherThread)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+
+    for (;;)
+    {
+        /* dispatch requests that the driver has already placed in the ring; no system call */
+        RspCount = 0;
+        for (Count = 0; BatchCount > Count && SpdStorageUnitRingPopRequest(Ring, &Request); Count++)
+        {
+            DataSlot = Ring->Data + (SIZE_T)Request.DataIndex * MaxTransferLength;
+            Ring->Hints[Request.DataIndex] = Request.Req.Hint;
+
+            OperationContext.DataBuffer = DataSlot;
+
+            if (SpdStorageUnitDispatchRequest(StorageUnit,
+                &Request.Req, &Response, DataSlot))
+            {
+                SpdStorageUnitRingPushResponse(Ring, &Response, Request.DataIndex);
+                RspCount++;
+            }
+        }
+
+        if (0 != Count)
+        {
+            if (0 != SpinCount && SPD_STORAGE_UNIT_RING_SPIN_MAX > SpinLimit)
+                /* polling paid off; poll longer next time */
+                SpinLimit <<= 1;
+            SpinCount = 0;
+
+            if (0 == RspCount)
+                continue;
+
+            /* hand the responses to the driver, which also refills the ring; do not wait */
+            Error = SpdStorageUnitHandleEnterRing(StorageUnit->Handle,
+                StorageUnit->Btl, FALSE, &Overlapped);
+            if (ERROR_SUCCESS != Error)
+                goto exit;
+            continue;
+        }
+
+        if (Poll && SpinLimit > SpinCount)
+        {
+            /* the driver places requests in the ring as they arrive; watch it for a while */
+            SpinCount++;
+            YieldProcessor();
+            continue;
+        }
+
+        if (0 != SpinCount && SPD_STORAGE_UNIT_RING_SPIN_MIN < SpinLimit)
+            /* polling did not pay off; poll less next time */
+            SpinLimit >>= 1;
+        SpinCount = 0;
+
+        if (!ResetEvent(Overlapped.hEvent))
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        /* the ring is empty; wait in the kernel for a request */
+        Error = SpdStorageUnitHandleEnterRing(StorageUnit->Handle,
+            StorageUnit->Btl, TRUE, &Overlapped);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+    }
+
+exit:
+    SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+
+    SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        OperationContext.DataBuffer = Ring->Data;
+        SpdStorageUnitDispatcherFlush(StorageUnit, &OperationContext);
+    }
+
+    TlsSetValue(SpdStorageUnitTlsKey, 0);
+
+    SpdOverlappedFini(&Overlapped);
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        /* all other dispatcher threads are done; release the ring */
+        SpdStorageUnitUnregisterDispatcherRing(StorageUnit);
+        SpdStorageUnitDeleteDispatcherPlacement(StorageUnit);
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitDeleteDispatcherAsync(SPD_STORAGE_UNIT *StorageUnit);
+
+static DWORD SpdStorageUnitCreateDispatcherAsync(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG ThreadCount)
+{
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    ULONG Depth = SpdStorageUnitGetDispatcherAsyncDepth(StorageUnit);
+    ULONG ContextCount;
+    SPD_STORAGE_UNIT_ASYNC *Async = 0;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context;
+    PUINT8 DataBuffer;
+    DWORD Error;
+
+    StorageUnit->DispatcherAsync = 0;
+
+    if (MAXULONG / Depth < ThreadCount)
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+    ContextCount = ThreadCount * Depth;
+
+    Async = MemAlloc(sizeof *Async);
+    if (0 == Async)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Async, 0, sizeof *Async);
+    Async->ThreadCount = ThreadCount;
+    Async->Depth = Depth;
+    Async->PendingCount = 1;
+    StorageUnit->DispatcherAsync = Async;
+
+    /* SLIST_HEADER and SLIST_ENTRY need MEMORY_ALLOCATION_ALIGNMENT, which MemAlloc provides */
+    Async->Threads = MemAlloc(ThreadCount * sizeof *Async->Threads);
+    Async->Contexts = MemAlloc(ContextCount * sizeof *Async->Contexts);
+    if (0 == Async->Threads || 0 == Async->Contexts)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Async->Threads, 0, ThreadCount * sizeof *Async->Threads);
+    memset(Async->Contexts, 0, ContextCount * sizeof *Async->Contexts);
+
+    Async->DrainEvent = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Async->DrainEvent)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        InitializeSListHead(&Async->Threads[I].FreeList);
+        Async->Threads[I].Event = CreateEventW(0, FALSE, FALSE, 0);
+        if (0 == Async->Threads[I].Event)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+
+    SpdStorageUnitRegisterDispatcherBufferPool(StorageUnit, ThreadCount, Depth);
+    if (0 != StorageUnit->DispatcherBufferPool)
+        DataBuffer = StorageUnit->DispatcherBufferPool;
+    else
+    {
+        Async->DataBuffer = SpdStorageUnitAllocDispatcherBuffer(StorageUnit, 0, ThreadCount,
+            (SIZE_T)Depth * MaxTransferLength);
+        if (0 == Async->DataBuffer)
+        {
+            Error = ERROR_NO_SYSTEM_RESOURCES;
+            goto exit;
+        }
+        DataBuffer = Async->DataBuffer;
+    }
+
+    for (ULONG I = 0; ContextCount > I; I++)
+    {
+        Context = &Async->Contexts[I];
+        Context->Thread = &Async->Threads[I / Depth];
+        Context->DataSlot = DataBuffer + (SIZE_T)I * MaxTransferLength;
+        Context->DataIndex = 0 != StorageUnit->DispatcherBufferPool ? I : (UINT32)-1;
+        Context->OperationContext.Request = &Context->Request;
+        Context->OperationContext.Response = &Context->Response;
+        Context->OperationContext.DataBuffer = Context->DataSlot;
+        InterlockedPushEntrySList(&Context->Thread->FreeList, &Context->ListEntry);
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+        SpdStorageUnitDeleteDispatcherAsync(StorageUnit);
+
+    return Error;
+}
+
+static VOID SpdStorageUnitDeleteDispatcherAsync(SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_STORAGE_UNIT_ASYNC *Async = StorageUnit->DispatcherAsync;
+
+    if (0 == Async)
+        return;
+
+    StorageUnit->DispatcherAsync = 0;
+
+    SpdStorageUnitUnregisterDispatcherBufferPool(StorageUnit);
+    if (0 != Async->DataBuffer)
+        SpdStorageUnitFreeDispatcherBuffer(StorageUnit, Async->DataBuffer);
+    if (0 != Async->Threads)
+        for (ULONG I = 0; Async->ThreadCount > I; I++)
+            if (0 != Async->Threads[I].Event)
+                CloseHandle(Async->Threads[I].Event);
+    if (0 != Async->DrainEvent)
+        CloseHandle(Async->DrainEvent);
+    MemFree(Async->Contexts);
+    MemFree(Async->Threads);
+    MemFree(Async);
+}
+
+static SPD_STORAGE_UNIT_ASYNC_CONTEXT *SpdStorageUnitAsyncPopContext(
+    SPD_STORAGE_UNIT_ASYNC_THREAD *Thread)
+{
+    PSLIST_ENTRY ListEntry;
+
+    for (;;)
+    {
+        ListEntry = InterlockedPopEntrySList(&Thread->FreeList);
+        if (0 != ListEntry)
+            return (SPD_STORAGE_UNIT_ASYNC_CONTEXT *)ListEntry;
+
+        /* all our contexts are in flight; announce that we wait, then look once more */
+        InterlockedExchange(&Thread->Waiting, 1);
+        ListEntry = InterlockedPopEntrySList(&Thread->FreeList);
+        if (0 != ListEntry)
+        {
+            InterlockedExchange(&Thread->Waiting, 0);
+            return (SPD_STORAGE_UNIT_ASYNC_CONTEXT *)ListEntry;
+        }
+
+        WaitForSingleObject(Thread->Event, INFINITE);
+    }
+}
+
+static VOID SpdStorageUnitSharedFinish(SPD_STORAGE_UNIT *StorageUnit);
+
+static VOID SpdStorageUnitAsyncRelease(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async)
+{
+    /* must be last: once the count drops to 0 Async may be freed */
+    if (0 != InterlockedDecrement(&Async->PendingCount))
+        return;
+
+    if (0 != Async->Dispatcher)
+        SpdStorageUnitSharedFinish(StorageUnit);
+    else
+        SetEvent(Async->DrainEvent);
+}
+
+static VOID SpdStorageUnitAsyncPushContext(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async, SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context)
+{
+    SPD_STORAGE_UNIT_ASYNC_THREAD *Thread = Context->Thread;
+
+    InterlockedPushEntrySList(&Thread->FreeList, &Context->ListEntry);
+    if (InterlockedExchange(&Thread->Waiting, 0))
+        SetEvent(Thread->Event);
+
+    SpdStorageUnitAsyncRelease(StorageUnit, Async);
+}
+
+static BOOLEAN SpdStorageUnitSharedReserveFetch(SPD_STORAGE_UNIT_ASYNC *Async);
+static VOID SpdStorageUnitSharedPostFetch(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async, SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context);
+
+static VOID SpdStorageUnitAsyncDrain(SPD_STORAGE_UNIT_ASYNC *Async)
+{
+    /* drop the bias and wait for the requests that are still in flight */
+    if (0 != InterlockedDecrement(&Async->PendingCount))
+        WaitForSingleObject(Async->DrainEvent, INFINITE);
+}
+
+static DWORD SpdStorageUnitAsyncSendResponse(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    ULONG ContextCount = Async->ThreadCount * Async->Depth;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context = 0;
+    UINT_PTR Offset;
+    DWORD Error;
+
+    /* the response of an operation context is its handle; look up copies by hint */
+    Offset = (UINT_PTR)Response - (UINT_PTR)Async->Contexts;
+    if (ContextCount * sizeof *Context > Offset &&
+        FIELD_OFFSET(SPD_STORAGE_UNIT_ASYNC_CONTEXT, Response) == Offset % sizeof *Context)
+        Context = &Async->Contexts[Offset / sizeof *Context];
+    else
+        for (ULONG I = 0; ContextCount > I; I++)
+            if (Async->Contexts[I].Pending && Response->Hint == Async->Contexts[I].Request.Hint)
+            {
+                Context = &Async->Contexts[I];
+                break;
+            }
+
+    Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
+        StorageUnit->Btl, Response, 0, DataBuffer,
+        0 != Context && Context->DataSlot == DataBuffer ? Context->DataIndex : (UINT32)-1,
+        NULL);
+
+    /* free the context even on error, so that the dispatcher can drain */
+    if (0 != Context && InterlockedExchange(&Context->Pending, 0))
+    {
+        if (0 != Async->Dispatcher && SpdStorageUnitSharedReserveFetch(Async))
+            /* the context (and its count) goes on to wait for the next request */
+            SpdStorageUnitSharedPostFetch(StorageUnit, Async, Context);
+        else
+            SpdStorageUnitAsyncPushContext(StorageUnit, Async, Context);
+    }
+
+    return Error;
+}
+
+static DWORD WINAPI SpdStorageUnitAsyncDispatcherThread(PVOID StorageUnit0)
+{
+    SPD_STORAGE_UNIT *StorageUnit = StorageUnit0;
+    SPD_STORAGE_UNIT_ASYNC *Async = StorageUnit->DispatcherAsync;
+    SPD_STORAGE_UNIT_ASYNC_THREAD *Thread;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context = 0;
+    BOOLEAN Complete = FALSE;
+    ULONG ThreadIndex;
+    OVERLAPPED Overlapped;
+    HANDLE DispatcherThread = 0;
+    DWORD Error;
+
+    ThreadIndex = InterlockedIncrement(&Async->ThreadIndex) - 1;
+    Thread = &Async->Threads[ThreadIndex];
+    SpdStorageUnitPlaceDispatcherThread(StorageUnit, ThreadIndex);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (1 < StorageUnit->DispatcherThreadCount)
+    {
+        StorageUnit->DispatcherThreadCount--;
+        DispatcherThread = CreateThread(0, 0, SpdStorageUnitAsyncDispatcherThread, StorageUnit, 0, 0);
+        if (0 == DispatcherThread)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+
+    for (;;)
+    {
+        /* a synchronously completed request lends its context to the next one */
+        if (0 == Context)
+            Context = SpdStorageUnitAsyncPopContext(Thread);
+
+        if (!ResetEvent(Overlapped.hEvent))
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        memset(&Context->Request, 0, sizeof Context->Request);
+        Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
+            StorageUnit->Btl, Complete ? &Context->Response : 0, &Context->Request,
+            Context->DataSlot, Context->DataIndex, &Overlapped);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+
+        Complete = FALSE;
+        if (0 == Context->Request.Hint)
+            continue;
+
+        Context->OperationContext.DataBuffer = Context->DataSlot;
+        TlsSetValue(SpdStorageUnitTlsKey, &Context->OperationContext);
+
+        /* mark the context before dispatching; the response may be sent before we return */
+        InterlockedIncrement(&Async->PendingCount);
+        Context->Pending = 1;
+
+        if (SpdStorageUnitDispatchRequest(StorageUnit,
+            &Context->Request, &Context->Response, Context->DataSlot))
+        {
+            Context->Pending = 0;
+            InterlockedDecrement(&Async->PendingCount);
+            Complete = TRUE;
+        }
+        else
+            /* the context now belongs to the request until its response is sent */
+            Context = 0;
+    }
+
+exit:
+    SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+
+    SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+
+    if (0 != Context)
+        InterlockedPushEntrySList(&Thread->FreeList, &Context->ListEntry);
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        /* all other dispatcher threads are done; wait for the requests still in flight */
+        SpdStorageUnitAsyncDrain(Async);
+
+        Context = &Async->Contexts[0];
+        TlsSetValue(SpdStorageUnitTlsKey, &Context->OperationContext);
+        Context->OperationContext.DataBuffer = Context->DataSlot;
+        SpdStorageUnitDispatcherFlush(StorageUnit, &Context->OperationContext);
+    }
+
+    TlsSetValue(SpdStorageUnitTlsKey, 0);
+
+    SpdOverlappedFini(&Overlapped);
+
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
+    {
+        SpdStorageUnitDeleteDispatcherAsync(StorageUnit);
+        SpdStorageUnitDeleteDispatcherPlacement(StorageUnit);
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitSharedFetchError(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async, SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context, DWORD Error)
+{
+    if (!InterlockedExchange(&Async->Stopping, 1))
+    {
+        SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+
+        SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+
+        /* drop the bias; the count of this transact keeps Async alive */
+        InterlockedDecrement(&Async->PendingCount);
+    }
+
+    InterlockedDecrement(&Async->FetchCount);
+    SpdStorageUnitAsyncPushContext(StorageUnit, Async, Context);
+}
+
+static BOOLEAN SpdStorageUnitSharedReserveFetch(SPD_STORAGE_UNIT_ASYNC *Async)
+{
+    LONG FetchCount = Async->FetchCount, PrevFetchCount;
+
+    while (!Async->Stopping && Async->FetchLimit > FetchCount)
+    {
+        PrevFetchCount = InterlockedCompareExchange(&Async->FetchCount, FetchCount + 1, FetchCount);
+        if (PrevFetchCount == FetchCount)
+            return TRUE;
+        FetchCount = PrevFetchCount;
+    }
+
+    return FALSE;
+}
+
+static VOID SpdStorageUnitSharedPostFetch(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC *Async, SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context)
+{
+    /* let a dispatcher thread start the transact; it may dispatch a request right away */
+    if (!PostQueuedCompletionStatus(Async->Dispatcher->Port, 0,
+        (ULONG_PTR)StorageUnit | SPD_DISPATCHER_KEY_FETCH, &Context->Overlapped))
+        SpdStorageUnitSharedFetchError(StorageUnit, Async, Context, GetLastError());
+}
+
+static VOID SpdStorageUnitSharedFetch(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context, BOOLEAN Complete)
+{
+    SPD_STORAGE_UNIT_ASYNC *Async = StorageUnit->DispatcherAsync;
+    DWORD BytesTransferred = 0;
+    DWORD Error;
+
+    memset(&Context->Overlapped, 0, sizeof Context->Overlapped);
+    Error = SpdStorageUnitHandleTransactBegin(StorageUnit->Handle,
+        StorageUnit->Btl, Complete ? &Context->Response : 0, &Context->Params,
+        Context->DataSlot, Context->DataIndex, &BytesTransferred, &Context->Overlapped);
+    if (ERROR_SUCCESS == Error)
+    {
+        /*
+         * The transact completed immediately, so nothing was queued to the port. Queue it
+         * ourselves rather than dispatch it now: every request then goes through the port
+         * in arrival order and a busy storage unit cannot keep a thread to itself.
+         */
+        if (PostQueuedCompletionStatus(Async->Dispatcher->Port, BytesTransferred,
+            (ULONG_PTR)StorageUnit, &Context->Overlapped))
+            return;
+        Error = GetLastError();
+    }
+
+    if (ERROR_IO_PENDING != Error)
+        SpdStorageUnitSharedFetchError(StorageUnit, Async, Context, Error);
+}
+
+static VOID SpdStorageUnitSharedComplete(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context, DWORD Error, DWORD BytesTransferred)
+{
+    SPD_STORAGE_UNIT_ASYNC *Async = StorageUnit->DispatcherAsync;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *NextContext;
+    BOOLEAN Complete;
+
+    if (ERROR_SUCCESS != Error)
+    {
+        SpdStorageUnitSharedFetchError(StorageUnit, Async, Context, Error);
+        return;
+    }
+
+    SpdStorageUnitHandleTransactEnd(&Context->Params, BytesTransferred, &Context->Request);
+    if (0 == Context->Request.Hint)
+    {
+        SpdStorageUnitSharedFetch(StorageUnit, Context, FALSE);
+        return;
+    }
+
+    Context->OperationContext.DataBuffer = Context->DataSlot;
+    TlsSetValue(SpdStorageUnitTlsKey, &Context->OperationContext);
+
+    /* the count of the transact goes to the request; count the next transact now */
+    InterlockedIncrement(&Async->PendingCount);
+    Context->Pending = 1;
+
+    Complete = SpdStorageUnitDispatchRequest(StorageUnit,
+        &Context->Request, &Context->Response, Context->DataSlot);
+
+    TlsSetValue(SpdStorageUnitTlsKey, 0);
+
+    if (Complete)
+    {
+        Context->Pending = 0;
+        InterlockedDecrement(&Async->PendingCount);
+        SpdStorageUnitSharedFetch(StorageUnit, Context, TRUE);
+        return;
+    }
+
+    /* the context now belongs to the request; wait for the next one with a free context */
+    NextContext = (SPD_STORAGE_UNIT_ASYNC_CONTEXT *)InterlockedPopEntrySList(
+        &Context->Thread->FreeList);
+    if (0 == NextContext)
+    {
+        /* SpdStorageUnitSendResponse starts the transact when it frees a context */
+        InterlockedDecrement(&Async->FetchCount);
+        SpdStorageUnitAsyncRelease(StorageUnit, Async);
+        return;
+    }
+
+    SpdStorageUnitSharedFetch(StorageUnit, NextContext, FALSE);
+}
+
+static VOID SpdStorageUnitSharedFinish(SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_STORAGE_UNIT_ASYNC *Async = StorageUnit->DispatcherAsync;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context = &Async->Contexts[0];
+
+    /* no transacts or requests are left; this is where a dispatcher thread would exit */
+    Context->OperationContext.DataBuffer = Context->DataSlot;
+    TlsSetValue(SpdStorageUnitTlsKey, &Context->OperationContext);
+    SpdStorageUnitDispatcherFlush(StorageUnit, &Context->OperationContext);
+    TlsSetValue(SpdStorageUnitTlsKey, 0);
+
+    SpdStorageUnitDeleteDispatcherAsync(StorageUnit);
+
+    /* wakes up SpdStorageUnitWaitDispatcher */
+    SetEvent(StorageUnit->DispatcherThread);
+}
+
+static DWORD WINAPI SpdDispatcherThread(PVOID Dispatcher0)
+{
+    SPD_DISPATCHER *Dispatcher = Dispatcher0;
+    SPD_STORAGE_UNIT *StorageUnit;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context;
+    OVERLAPPED *Overlapped;
+    ULONG_PTR Key;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    for (;;)
+    {
+        Overlapped = 0;
+        Error = GetQueuedCompletionStatus(Dispatcher->Port,
+            &BytesTransferred, &Key, &Overlapped, INFINITE) ? ERROR_SUCCESS : GetLastError();
+        if (0 == Overlapped)
+            /* SpdDispatcherDelete posts an empty packet for every thread */
+            break;
+
+        /*
+         * Only the transacts of our contexts complete to the port: every other overlapped
+         * operation on the handle has an event with the low bit set (SpdOverlappedInit).
+         * Each such transact is counted in PendingCount, so the unit and its Async are alive.
+         */
+        StorageUnit = (SPD_STORAGE_UNIT *)(Key & ~(ULONG_PTR)SPD_DISPATCHER_KEY_FETCH);
+        Context = CONTAINING_RECORD(Overlapped, SPD_STORAGE_UNIT_ASYNC_CONTEXT, Overlapped);
+
+        if (0 != (Key & SPD_DISPATCHER_KEY_FETCH))
+            SpdStorageUnitSharedFetch(StorageUnit, Context, FALSE);
+        else
+            SpdStorageUnitSharedComplete(StorageUnit, Context, Error, BytesTransferred);
+    }
+
+    return 0;
+}
+
+static DWORD SpdGetProcessorCount(PULONG PProcessorCount)
+{
+    DWORD_PTR ProcessMask, SystemMask;
+    ULONG ProcessorCount;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask))
+        return GetLastError();
+
+    for (ProcessorCount = 0; 0 != ProcessMask; ProcessMask >>= 1)
+        ProcessorCount += ProcessMask & 1;
+
+    *PProcessorCount = ProcessorCount;
+
+    return ERROR_SUCCESS;
+}
+
+DWORD SpdDispatcherCreate(ULONG ThreadCount, SPD_DISPATCHER **PDispatcher)
+{
+    SPD_DISPATCHER *Dispatcher = 0;
+    DWORD Error;
+
+    *PDispatcher = 0;
+
+    if (0 == ThreadCount)
+    {
+        Error = SpdGetProcessorCount(&ThreadCount);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+    }
+
+    Dispatcher = MemAlloc(sizeof *Dispatcher + ThreadCount * sizeof(HANDLE));
+    if (0 == Dispatcher)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Dispatcher, 0, sizeof *Dispatcher + ThreadCount * sizeof(HANDLE));
+    Dispatcher->Threads = (HANDLE *)(Dispatcher + 1);
+
+    /* as many threads as the port lets run at once: callbacks should not block */
+    Dispatcher->Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, ThreadCount);
+    if (0 == Dispatcher->Port)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    for (; ThreadCount > Dispatcher->ThreadCount; Dispatcher->ThreadCount++)
+    {
+        Dispatcher->Threads[Dispatcher->ThreadCount] = CreateThread(0, 0,
+            SpdDispatcherThread, Dispatcher, 0, 0);
+        if (0 == Dispatcher->Threads[Dispatcher->ThreadCount])
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+
+    *PDispatcher = Dispatcher;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error && 0 != Dispatcher)
+        SpdDispatcherDelete(Dispatcher);
+
+    return Error;
+}
+
+VOID SpdDispatcherDelete(SPD_DISPATCHER *Dispatcher)
+{
+    for (ULONG I = 0; Dispatcher->ThreadCount > I; I++)
+        PostQueuedCompletionStatus(Dispatcher->Port, 0, 0, 0);
+
+    for (ULONG I = 0; Dispatcher->ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Dispatcher->Threads[I], INFINITE);
+        CloseHandle(Dispatcher->Threads[I]);
+    }
+
+    if (0 != Dispatcher->Port)
+        CloseHandle(Dispatcher->Port);
+
+    MemFree(Dispatcher);
+}
+
+DWORD SpdStorageUnitStartDispatcherShared(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_DISPATCHER *Dispatcher)
+{
+    SPD_STORAGE_UNIT_ASYNC *Async;
+    SPD_STORAGE_UNIT_ASYNC_CONTEXT *Context;
+    HANDLE StopEvent;
+    DWORD Error;
+
+    if (0 != StorageUnit->DispatcherThread)
+        return ERROR_INVALID_PARAMETER;
+
+    StopEvent = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == StopEvent)
+        return GetLastError();
+
+    /* one list of contexts; the threads of the shared dispatcher take turns with them */
+    Error = SpdStorageUnitCreateDispatcherAsync(StorageUnit, 1);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    /* bind last: a handle cannot be unbound, so nothing may fail after this */
+    Error = SpdStorageUnitHandleBindCompletionPort(StorageUnit->Handle,
+        Dispatcher->Port, (ULONG_PTR)StorageUnit);
+    if (ERROR_SUCCESS != Error)
+    {
+        SpdStorageUnitDeleteDispatcherAsync(StorageUnit);
+        goto exit;
+    }
+
+    Async = StorageUnit->DispatcherAsync;
+    Async->Dispatcher = Dispatcher;
+    Async->FetchLimit = (LONG)(Dispatcher->ThreadCount < Async->Depth ?
+        Dispatcher->ThreadCount : Async->Depth);
+
+    StorageUnit->DispatcherThreadCount = 0;
+    StorageUnit->DispatcherFlags = 0;
+    StorageUnit->DispatcherThread = StopEvent;
+
+    /* count ourselves, so that a transact that fails right away cannot finish the unit */
+    InterlockedIncrement(&Async->PendingCount);
+    for (LONG I = 0; Async->FetchLimit > I; I++)
+    {
+        Context = (SPD_STORAGE_UNIT_ASYNC_CONTEXT *)InterlockedPopEntrySList(
+            &Async->Threads[0].FreeList);
+        InterlockedIncrement(&Async->FetchCount);
+        InterlockedIncrement(&Async->PendingCount);
+        SpdStorageUnitSharedPostFetch(StorageUnit, Async, Context);
+    }
+    SpdStorageUnitAsyncRelease(StorageUnit, Async);
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+        CloseHandle(StopEvent);
+
+    return Error;
+}
+
+DWORD SpdStorageUnitStartDispatcher(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount)
+{
+    return SpdStorageUnitStartDispatcherEx(StorageUnit, ThreadCount, 0);
+}
+
+DWORD SpdStorageUnitStartDispatcherEx(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount,
+    ULONG Flags)
+{
+    return SpdStorageUnitStartDispatcherPlaced(StorageUnit, ThreadCount, Flags, 0);
+}
+
+DWORD SpdStorageUnitStartDispatcherPlaced(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadCount,
+    ULONG Flags, const SPD_STORAGE_UNIT_PLACEMENT *Placement)
+{
+    LPTHREAD_START_ROUTINE DispatcherThreadProc = SpdStorageUnitDispatcherThread;
+    DWORD Error;
+
+    if (0 != StorageUnit->DispatcherThread)
+        return ERROR_INVALID_PARAMETER;
+
+    Error = SpdStorageUnitCreateDispatcherPlacement(StorageUnit, Placement);
+    if (ERROR_SUCCESS != Error)
+        return Error;
+
+    if (0 == ThreadCount)
+    {
+        if (0 != StorageUnit->DispatcherPlacement)
+            ThreadCount = SpdStorageUnitGetDispatcherPlacementProcessorCount(StorageUnit);
+        else
+        {
+            Error = SpdGetProcessorCount(&ThreadCount);
+            if (ERROR_SUCCESS != Error)
+                goto exit;
+        }
+    }
+
+    StorageUnit->DispatcherThreadCount = ThreadCount;
+    StorageUnit->DispatcherFlags = Flags;
+    StorageUnit->DispatcherBufferPoolIndex = 0;
+
+    /* use a shared-memory ring if asked to and possible; else transact (with a buffer pool) */
+    if (0 != (Flags & SPD_STORAGE_UNIT_DISPATCHER_RING) &&
+        ERROR_SUCCESS == SpdStorageUnitRegisterDispatcherRing(StorageUnit, ThreadCount))
+        DispatcherThreadProc = SpdStorageUnitRingDispatcherThread;
+    else if (0 != (Flags & SPD_STORAGE_UNIT_DISPATCHER_ASYNC))
+    {
+        Error = SpdStorageUnitCreateDispatcherAsync(StorageUnit, ThreadCount);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+        DispatcherThreadProc = SpdStorageUnitAsyncDispatcherThread;
+    }
+    else
+    {
+        if (0 != (Flags & SPD_STORAGE_UNIT_DISPATCHER_ELASTIC))
+        {
+            /* ThreadCount is the most threads; the dispatcher starts with one */
+            Error = SpdStorageUnitCreateDispatcherElastic(StorageUnit, ThreadCount);
+            if (ERROR_SUCCESS != Error)
+                goto exit;
+            StorageUnit->DispatcherThreadCount = 1;
+        }
+        SpdStorageUnitRegisterDispatcherBufferPool(StorageUnit,
+            ThreadCount, SpdStorageUnitGetDispatcherBatchCount(StorageUnit));
+    }
+
+    StorageUnit->DispatcherThread = CreateThread(0, 0,
+        DispatcherThreadProc, StorageUnit, CREATE_SUSPENDED,
+        &StorageUnit->DispatcherThreadId);
+    if (0 == StorageUnit->DispatcherThread)
+    {
+        Error = GetLastError();
+        SpdStorageUnitUnregisterDispatcherRing(StorageUnit);
+        SpdStorageUnitDeleteDispatcherAsync(StorageUnit);
+        SpdStorageUnitUnregisterDispatcherBufferPool(StorageUnit);
+        SpdStorageUnitDeleteDispatcherElastic(StorageUnit);
+        goto exit;
+    }
+    if (!ResumeThread(StorageUnit->DispatcherThread))
+    {
+        CloseHandle(StorageUnit->DispatcherThread);
+        return GetLastError();
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+        SpdStorageUnitDeleteDispatcherPlacement(StorageUnit);
+
+    return Error;
+}
+
+VOID SpdStorageUnitWaitDispatcher(SPD_STORAGE_UNIT *StorageUnit)
+{
+    if (0 == StorageUnit->DispatcherThread)
+        return;
+
+    WaitForSingleObject(StorageUnit->DispatcherThread, INFINITE);
+    CloseHandle(StorageUnit->DispatcherThread);
+    StorageUnit->DispatcherThread = 0;
+}
+
+VOID SpdStorageUnitSendResponse(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    DWORD Error;
+
+    if (StorageUnit->DebugLog)
+    {
+        if (SpdIoctlTransactKindCount <= Response->Kind ||
+            (StorageUnit->DebugLog & (1 << Response->Kind)))
+            SpdDebugLogResponse(Response);
+    }
+
+    if (0 != StorageUnit->DispatcherRing)
+        Error = SpdStorageUnitRingSendResponse(StorageUnit,
+            StorageUnit->DispatcherRing, Response, DataBuffer);
+    else if (0 != StorageUnit->DispatcherAsync)
+        Error = SpdStorageUnitAsyncSendResponse(StorageUnit,
+            StorageUnit->DispatcherAsync, Response, DataBuffer);
+    else
+        Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
+            StorageUnit->Btl, Response, 0, DataBuffer, (UINT32)-1, NULL);
+    if (ERROR_SUCCESS != Error)
+    {
+        SpdStorageUnitSetDispatcherError(StorageUnit, Error);
+
+        SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
+    }
+}
+
+DWORD SpdStorageUnitEnableAllocationMap(SPD_STORAGE_UNIT *StorageUnit, UINT32 BlockShift)
+{
+    UINT64 MapSize;
+    PVOID AllocationMap;
+    DWORD Error;
+
+    if (0 != StorageUnit->AllocationMap)
+        return ERROR_ALREADY_EXISTS;
+
+    MapSize = 31 >= BlockShift ?
+        SPD_IOCTL_ALLOCATION_MAP_SIZE(StorageUnit->StorageUnitParams.BlockCount, BlockShift) : 0;
+    if (0 == MapSize || SPD_IOCTL_ALLOCATION_MAP_MAX_SIZE < MapSize)
+        return ERROR_INVALID_PARAMETER;
+
+    /* page aligned so that the driver can lock it; every block starts out allocated */
+    AllocationMap = VirtualAlloc(0, (SIZE_T)MapSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == AllocationMap)
+        return GetLastError();
+    memset(AllocationMap, 0xff, (size_t)MapSize);
+
+    Error = SpdStorageUnitHandleRegisterAllocationMap(StorageUnit->Handle, StorageUnit->Btl,
+        AllocationMap, BlockShift);
+    if (ERROR_SUCCESS != Error)
+    {
+        VirtualFree(AllocationMap, 0, MEM_RELEASE);
+        return Error;
+    }
+
+    StorageUnit->AllocationMapShift = BlockShift;
+    StorageUnit->AllocationMap = AllocationMap;
+
+    return ERROR_SUCCESS;
+}
+
+VOID SpdStorageUnitSetAllocationMap(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount, BOOLEAN Allocated)
+{
+    LONG volatile *Bits = StorageUnit->AllocationMap;
+    UINT32 BlockShift = StorageUnit->AllocationMapShift;
+    UINT64 EndBlockAddress = BlockAddress + BlockCount;
+    UINT64 BitCount, Index, EndIndex;
+
+    if (0 == Bits ||
+        EndBlockAddress <= BlockAddress ||
+        EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
+        return;
+
+    BitCount = (StorageUnit->StorageUnitParams.BlockCount + (1ULL << BlockShift) - 1) >> BlockShift;
+    if (Allocated)
+    {
+        /* any bit that covers part of the range */
+        Index = BlockAddress >> BlockShift;
+        EndIndex = ((EndBlockAddress - 1) >> BlockShift) + 1;
+    }
+    else
+    {
+        /* only bits whose blocks are all in the range */
+        Index = (BlockAddress + (1ULL << BlockShift) - 1) >> BlockShift;
+        EndIndex = EndBlockAddress == StorageUnit->StorageUnitParams.BlockCount ?
+            BitCount : EndBlockAddress >> BlockShift;
+    }
+
+    while (Index < EndIndex)
+    {
+        if (0 == (Index & 31) && Index + 32 <= EndIndex)
+        {
+            Bits[Index >> 5] = Allocated ? -1 : 0;
+            Index += 32;
+            continue;
+        }
+
+        if (Allocated)
+            InterlockedOr(&Bits[Index >> 5], (LONG)(1UL << (Index & 31)));
+        else
+            InterlockedAnd(&Bits[Index >> 5], ~(LONG)(1UL << (Index & 31)));
+        Index++;
+    }
+}
+
+SPD_STORAGE_UNIT_OPERATION_CONTEXT *SpdStorageUnitGetOperationContext(VOID)
+{
+    return (SPD_STORAGE_UNIT_OPERATION_CONTEXT *)TlsGetValue(SpdStorageUnitTlsKey);
+}
+
+VOID SpdStorageUnitSetBufferAllocatorF(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID(*BufferAlloc)(size_t),
+    VOID(*BufferFree)(PVOID))
+{
+    SpdStorageUnitSetBufferAllocator(StorageUnit, BufferAlloc, BufferFree);
+}
+
+VOID SpdStorageUnitGetDispatcherErrorF(SPD_STORAGE_UNIT *StorageUnit,
+    DWORD *PDispatcherError)
+{
+    SpdStorageUnitGetDispatcherError(StorageUnit, PDispatcherError);
+}
+
+VOID SpdStorageUnitSetDispatcherErrorF(SPD_STORAGE_UNIT *StorageUnit,
+    DWORD DispatcherError)
+{
+    SpdStorageUnitSetDispatcherError(StorageUnit, DispatcherError);
+}
+
+VOID SpdStorageUnitSetDebugLogF(SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 DebugLog)
+{
+    SpdStorageUnitSetDebugLog(StorageUnit, DebugLog);
+}
+
+VOID SpdStorageUnitSetDispatcherBatchCountF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchCount)
+{
+    SpdStorageUnitSetDispatcherBatchCount(StorageUnit, BatchCount);
+}
+
+VOID SpdStorageUnitSetDispatcherAsyncDepthF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth)
+{
+    SpdStorageUnitSetDispatcherAsyncDepth(StorageUnit, AsyncDepth);
+}
+
+VOID SpdStorageUnitSetDispatcherIdleTimeoutF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG IdleTimeout)
+{
+    SpdStorageUnitSetDispatcherIdleTimeout(StorageUnit, IdleTimeout);
 }
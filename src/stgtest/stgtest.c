@@ -150,6 +150,12 @@ static DWORD StgTransactPipe(HANDLE Handle,
         case SpdIoctlTransactUnmapKind:
             DataLength = Req->Op.Unmap.Count * sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR);
             break;
+        case SpdIoctlTransactWriteSameKind:
+            DataLength = StorageUnitParams->BlockLength;
+            break;
+        case SpdIoctlTransactCopyKind:
+            DataLength = Req->Op.Copy.Count * sizeof(SPD_IOCTL_COPY_DESCRIPTOR);
+            break;
         default:
             break;
         }
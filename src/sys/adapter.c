@@ -37,15 +37,23 @@ ULONG SpdHwFindAdapter(
     SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
     if (NT_SUCCESS(SpdDeviceExtensionInit(DeviceExtension, BusInformation)))
     {
+        /* see SPD_IOCTL_BTL_FROM_INDEX for how storage units map to buses/targets/LUN's */
+        ULONG Capacity = DeviceExtension->StorageUnitCapacity;
+        ULONG TargetCount = SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT;
+        ULONG LunCount = SPD_IOCTL_STORAGE_UNIT_LUN_COUNT;
+
         ConfigInfo->MaximumTransferLength = SP_UNINITIALIZED_VALUE;
         ConfigInfo->NumberOfPhysicalBreaks = SP_UNINITIALIZED_VALUE;
         ConfigInfo->AlignmentMask = FILE_BYTE_ALIGNMENT;
-        ConfigInfo->NumberOfBuses = 1;
+        ConfigInfo->NumberOfBuses = (UCHAR)((Capacity + TargetCount * LunCount - 1) /
+            (TargetCount * LunCount));
         ConfigInfo->ScatterGather = TRUE;
         ConfigInfo->Master = TRUE;
         ConfigInfo->CachesData = TRUE;
-        ConfigInfo->MaximumNumberOfTargets = (UCHAR)DeviceExtension->StorageUnitCapacity;
-        ConfigInfo->MaximumNumberOfLogicalUnits = 1;
+        ConfigInfo->MaximumNumberOfTargets = (UCHAR)(TargetCount < Capacity ?
+            TargetCount : Capacity);
+        ConfigInfo->MaximumNumberOfLogicalUnits = (UCHAR)(LunCount * TargetCount < Capacity ?
+            LunCount : (Capacity + TargetCount - 1) / TargetCount);
         ConfigInfo->WmiDataProvider = FALSE;
         ConfigInfo->SynchronizationModel = StorSynchronizeFullDuplex;
         ConfigInfo->VirtualDevice = TRUE;
@@ -65,6 +73,30 @@ BOOLEAN SpdHwInitialize(PVOID DeviceExtension)
     BOOLEAN Result = TRUE;
     SPD_ENTER(adapter);
 
+    PERF_CONFIGURATION_DATA PerfConfig;
+
+    /*
+     * Ask StorPort to call SpdHwStartIo concurrently on multiple processors and to
+     * complete SRB's on the processor that submitted them. We have no interrupts, so
+     * DPC redirection is the only kind of completion steering that applies to us.
+     * These are optimizations; failure to negotiate them is not an error.
+     */
+    RtlZeroMemory(&PerfConfig, sizeof PerfConfig);
+    PerfConfig.Version = STOR_PERF_VERSION;
+    PerfConfig.Size = sizeof PerfConfig;
+    if (STOR_STATUS_SUCCESS == StorPortInitializePerfOpts(DeviceExtension, TRUE, &PerfConfig))
+    {
+        PerfConfig.Flags &=
+            STOR_PERF_CONCURRENT_CHANNELS |
+#if NTDDI_VERSION >= NTDDI_WIN8
+            STOR_PERF_DPC_REDIRECTION_CURRENT_CPU |
+#endif
+            STOR_PERF_DPC_REDIRECTION;
+        if (FlagOn(PerfConfig.Flags, STOR_PERF_CONCURRENT_CHANNELS))
+            PerfConfig.ConcurrentChannels = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        StorPortInitializePerfOpts(DeviceExtension, FALSE, &PerfConfig);
+    }
+
     SPD_LEAVE(adapter,
         "%p", " = %d",
         DeviceExtension, Result);
@@ -88,14 +120,17 @@ BOOLEAN SpdHwResetBus(PVOID DeviceExtension0, ULONG PathId)
     BOOLEAN Result = FALSE;
     SPD_ENTER(adapter);
 
-    if (0 == PathId)
+    SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
+    ULONG BusUnitCount = SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT * SPD_IOCTL_STORAGE_UNIT_LUN_COUNT;
+    if (DeviceExtension->StorageUnitCapacity > PathId * BusUnitCount)
     {
-        SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
         SPD_STORAGE_UNIT *StorageUnit;
 
-        for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+        /* the storage units of a bus have consecutive indices */
+        for (ULONG I = PathId * BusUnitCount;
+            DeviceExtension->StorageUnitCapacity > I && (PathId + 1) * BusUnitCount > I; I++)
         {
-            StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_IOCTL_BTL(0, I, 0));
+            StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_BTL_FROM_INDEX(I));
             if (0 == StorageUnit)
                 continue;
 
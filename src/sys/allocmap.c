@@ -0,0 +1,339 @@
+/**
+ * @file sys/allocmap.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * An allocation map is a bitmap that the storage unit process shares with the driver.
+ * A clear bit promises that the blocks it covers read back as zeroes, which lets the
+ * driver answer reads of such blocks and GET LBA STATUS without a trip to user mode.
+ *
+ * The driver sets the bits of every range that it posts for writing and clears the
+ * bits of every range that it posts for unmapping (or overwriting with zeroes); both
+ * happen at post time so that the map follows the order in which requests arrive. An
+ * unmap that is not posted, fails or is aborted sets its bits again, which is always
+ * safe. The storage unit process initializes the map and may change it at any other
+ * time; it can only confuse itself by doing so.
+ *
+ * The map is read on the SRB hot path without a lock: readers take AllocationMapRundown
+ * and read the map pointer. A map is published or replaced under the ProvisionMutex
+ * (which serializes replacements); the old map is deleted once the rundown wait shows
+ * that no reader can still see it. A request posted while a map is being replaced may
+ * miss the new map; like any other change to the map while I/O is in flight, this
+ * can only confuse the process that replaces it.
+ *
+ * The bits themselves live in locked user memory and are only accessed with interlocked
+ * operations or plain reads. Updates skip words whose bits already have the desired
+ * value, so that rewriting allocated blocks does not write the shared map.
+ */
+
+/* GET LBA STATUS scans at most this many bits per extent */
+#define SPD_ALLOCATION_MAP_SCAN_LIMIT   (1024 * 1024)
+
+static VOID SpdAllocationMapDelete(SPD_ALLOCATION_MAP *AllocationMap)
+{
+    if (0 != AllocationMap->Mdl)
+        SpdUnlockUserBuffer(AllocationMap->Mdl);
+    SpdFree(AllocationMap, SpdTagAllocationMap);
+}
+
+static SPD_ALLOCATION_MAP *SpdAllocationMapAcquire(SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_ALLOCATION_MAP *AllocationMap;
+
+    /* unlocked peek; most storage units do not have an allocation map */
+    if (0 == ReadPointerNoFence((PVOID *)&StorageUnit->AllocationMap))
+        return 0;
+
+    if (!ExAcquireRundownProtection(&StorageUnit->AllocationMapRundown))
+        return 0;
+    AllocationMap = ReadPointerAcquire((PVOID *)&StorageUnit->AllocationMap);
+    if (0 == AllocationMap)
+        ExReleaseRundownProtection(&StorageUnit->AllocationMapRundown);
+
+    return AllocationMap;
+}
+
+static inline
+VOID SpdAllocationMapRelease(SPD_STORAGE_UNIT *StorageUnit)
+{
+    ExReleaseRundownProtection(&StorageUnit->AllocationMapRundown);
+}
+
+static SPD_ALLOCATION_MAP *SpdStorageUnitReplaceAllocationMap(
+    SPD_STORAGE_UNIT *StorageUnit,
+    SPD_ALLOCATION_MAP *AllocationMap)
+{
+    SPD_ALLOCATION_MAP *OldAllocationMap;
+
+    /* called with the ProvisionMutex held */
+    OldAllocationMap = StorageUnit->AllocationMap;
+    WritePointerRelease((PVOID *)&StorageUnit->AllocationMap, AllocationMap);
+
+    if (0 != OldAllocationMap)
+    {
+        /* wait for readers that may have seen the old map */
+        ExWaitForRundownProtectionRelease(&StorageUnit->AllocationMapRundown);
+        ExReInitializeRundownProtection(&StorageUnit->AllocationMapRundown);
+    }
+
+    return OldAllocationMap;
+}
+
+static UINT64 SpdAllocationMapScan(SPD_ALLOCATION_MAP *AllocationMap,
+    UINT64 Index, UINT64 EndIndex, BOOLEAN Allocated)
+{
+    /* find the first bit in [Index, EndIndex) that equals Allocated; EndIndex if none */
+    while (Index < EndIndex)
+    {
+        ULONG Word = (ULONG)AllocationMap->Bits[Index >> 5];
+        ULONG Bit;
+
+        if (!Allocated)
+            Word = ~Word;
+        Word &= 0xffffffffUL << (Index & 31);
+        if (_BitScanForward(&Bit, Word))
+        {
+            Index = (Index & ~31ULL) + Bit;
+            return Index < EndIndex ? Index : EndIndex;
+        }
+
+        Index = (Index & ~31ULL) + 32;
+    }
+
+    return EndIndex;
+}
+
+NTSTATUS SpdStorageUnitRegisterAllocationMap(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG BlockShift,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    UINT64 BlockCount = StorageUnit->StorageUnitParams.BlockCount;
+    SPD_ALLOCATION_MAP *AllocationMap = 0, *OldAllocationMap;
+    UINT64 MapSize;
+    PVOID SystemBuffer;
+    NTSTATUS Result;
+
+    if (0 != Buffer)
+    {
+        if (31 < BlockShift)
+        {
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        MapSize = SPD_IOCTL_ALLOCATION_MAP_SIZE(BlockCount, BlockShift);
+        if (0 == MapSize || SPD_IOCTL_ALLOCATION_MAP_MAX_SIZE < MapSize)
+        {
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        AllocationMap = SpdAllocNonPaged(sizeof *AllocationMap, SpdTagAllocationMap);
+        if (0 == AllocationMap)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        RtlZeroMemory(AllocationMap, sizeof *AllocationMap);
+        AllocationMap->ProcessId = ProcessId;
+        AllocationMap->BitCount = (BlockCount + (1ULL << BlockShift) - 1) >> BlockShift;
+        AllocationMap->BlockShift = BlockShift;
+
+        /* the map stays locked for its lifetime */
+        Result = SpdLockUserBuffer(Buffer, (ULONG)MapSize, AccessMode,
+            &AllocationMap->Mdl, &SystemBuffer);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+        AllocationMap->Bits = SystemBuffer;
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->ProvisionMutex);
+    OldAllocationMap = SpdStorageUnitReplaceAllocationMap(StorageUnit, AllocationMap);
+    ExReleaseFastMutex(&DeviceExtension->ProvisionMutex);
+
+    if (0 != OldAllocationMap)
+        SpdAllocationMapDelete(OldAllocationMap);
+
+    AllocationMap = 0;
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != AllocationMap)
+        SpdAllocationMapDelete(AllocationMap);
+
+    return Result;
+}
+
+VOID SpdStorageUnitDeleteAllocationMap(
+    SPD_STORAGE_UNIT *StorageUnit)
+{
+    if (0 != StorageUnit->AllocationMap)
+    {
+        SpdAllocationMapDelete(StorageUnit->AllocationMap);
+        StorageUnit->AllocationMap = 0;
+    }
+}
+
+VOID SpdStorageUnitReleaseAllocationMaps(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    /* the ProvisionMutex keeps the units in the slots alive and serializes replacements */
+    ExAcquireFastMutex(&DeviceExtension->ProvisionMutex);
+    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    {
+        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
+        if (0 != Unit &&
+            0 != Unit->AllocationMap && ProcessId == Unit->AllocationMap->ProcessId)
+            SpdAllocationMapDelete(SpdStorageUnitReplaceAllocationMap(Unit, 0));
+    }
+    ExReleaseFastMutex(&DeviceExtension->ProvisionMutex);
+}
+
+BOOLEAN SpdStorageUnitIsUnallocated(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount)
+{
+    SPD_ALLOCATION_MAP *AllocationMap;
+    UINT64 Index, EndIndex;
+    BOOLEAN Result;
+
+    if (0 == BlockCount)
+        return FALSE;
+
+    AllocationMap = SpdAllocationMapAcquire(StorageUnit);
+    if (0 == AllocationMap)
+        return FALSE;
+
+    Index = BlockAddress >> AllocationMap->BlockShift;
+    EndIndex = ((BlockAddress + BlockCount - 1) >> AllocationMap->BlockShift) + 1;
+    Result = EndIndex <= AllocationMap->BitCount &&
+        EndIndex == SpdAllocationMapScan(AllocationMap, Index, EndIndex, TRUE);
+
+    SpdAllocationMapRelease(StorageUnit);
+
+    return Result;
+}
+
+VOID SpdStorageUnitSetAllocated(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount,
+    BOOLEAN Allocated)
+{
+    SPD_ALLOCATION_MAP *AllocationMap;
+    UINT64 Index, EndIndex;
+    ULONG Count, Mask, Word;
+
+    if (0 == BlockCount)
+        return;
+
+    AllocationMap = SpdAllocationMapAcquire(StorageUnit);
+    if (0 == AllocationMap)
+        return;
+
+    if (Allocated)
+    {
+        /* any bit that covers part of the range */
+        Index = BlockAddress >> AllocationMap->BlockShift;
+        EndIndex = ((BlockAddress + BlockCount - 1) >> AllocationMap->BlockShift) + 1;
+    }
+    else
+    {
+        /* only bits whose blocks are all in the range */
+        Index = (BlockAddress + (1ULL << AllocationMap->BlockShift) - 1) >>
+            AllocationMap->BlockShift;
+        EndIndex = (BlockAddress + BlockCount) >> AllocationMap->BlockShift;
+        if (BlockAddress + BlockCount == StorageUnit->StorageUnitParams.BlockCount)
+            EndIndex = AllocationMap->BitCount;
+    }
+    if (EndIndex > AllocationMap->BitCount)
+        EndIndex = AllocationMap->BitCount;
+
+    /* one word at a time; a word whose bits are already right is only read */
+    while (Index < EndIndex)
+    {
+        Count = 32 - (ULONG)(Index & 31);
+        if (Count > EndIndex - Index)
+            Count = (ULONG)(EndIndex - Index);
+        Mask = (0xffffffffUL >> (32 - Count)) << (Index & 31);
+
+        Word = (ULONG)ReadNoFence(&AllocationMap->Bits[Index >> 5]);
+        if (Allocated && Mask != (Word & Mask))
+            InterlockedOr(&AllocationMap->Bits[Index >> 5], Mask);
+        else if (!Allocated && 0 != (Word & Mask))
+            InterlockedAnd(&AllocationMap->Bits[Index >> 5], ~Mask);
+
+        Index += Count;
+    }
+
+    SpdAllocationMapRelease(StorageUnit);
+}
+
+BOOLEAN SpdStorageUnitGetAllocationExtent(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 MaxBlockCount,
+    PBOOLEAN PAllocated, PUINT64 PBlockCount)
+{
+    SPD_ALLOCATION_MAP *AllocationMap;
+    UINT64 Index, EndIndex, EndBlockAddress;
+    BOOLEAN Result = FALSE;
+
+    *PAllocated = TRUE;
+    *PBlockCount = MaxBlockCount;
+
+    if (0 == MaxBlockCount)
+        return FALSE;
+
+    AllocationMap = SpdAllocationMapAcquire(StorageUnit);
+    if (0 == AllocationMap)
+        return FALSE;
+
+    Index = BlockAddress >> AllocationMap->BlockShift;
+    EndIndex = ((BlockAddress + MaxBlockCount - 1) >> AllocationMap->BlockShift) + 1;
+    if (EndIndex > AllocationMap->BitCount)
+        EndIndex = AllocationMap->BitCount;
+    if (EndIndex - Index > SPD_ALLOCATION_MAP_SCAN_LIMIT)
+        EndIndex = Index + SPD_ALLOCATION_MAP_SCAN_LIMIT;
+
+    if (Index < EndIndex)
+    {
+        /* the extent ends where the bits change; a long extent may be reported in pieces */
+        *PAllocated = 0 != ((ULONG)AllocationMap->Bits[Index >> 5] & (1UL << (Index & 31)));
+        EndIndex = SpdAllocationMapScan(AllocationMap, Index + 1, EndIndex, !*PAllocated);
+        EndBlockAddress = EndIndex << AllocationMap->BlockShift;
+        if (EndBlockAddress > BlockAddress + MaxBlockCount)
+            EndBlockAddress = BlockAddress + MaxBlockCount;
+        *PBlockCount = EndBlockAddress - BlockAddress;
+        Result = TRUE;
+    }
+
+    SpdAllocationMapRelease(StorageUnit);
+
+    return Result;
+}
@@ -57,6 +57,19 @@ NTSTATUS DriverEntry(
             SpdStorageUnitCapacity = Value;
     }
 
+    RtlInitUnicodeString(&RegistryValueName, L"IoqShardCount");
+    RegistryValueLength = sizeof RegistryValue;
+    Result = SpdRegistryGetValue(RegistryPath, &RegistryValueName,
+        &RegistryValue.Information, &RegistryValueLength);
+    if (NT_SUCCESS(Result) && REG_DWORD == RegistryValue.Information.Type)
+    {
+        /* 0 means one I/O queue shard per active processor */
+        ULONG Value = *(PULONG)&RegistryValue.Information.Data;
+        if (0 == Value)
+            Value = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        SpdIoqShardCount = SPD_IOQ_SHARD_MAX >= Value ? Value : SPD_IOQ_SHARD_MAX;
+    }
+
     VIRTUAL_HW_INITIALIZATION_DATA Data;
     RtlZeroMemory(&Data, sizeof(Data));
     Data.HwInitializationDataSize = sizeof(VIRTUAL_HW_INITIALIZATION_DATA);
@@ -69,7 +82,7 @@ NTSTATUS DriverEntry(
     Data.HwDmaStarted = 0;
     Data.HwAdapterState = 0;
     Data.DeviceExtensionSize = sizeof(SPD_DEVICE_EXTENSION) +
-        sizeof(SPD_STORAGE_UNIT *) * SpdStorageUnitCapacity;
+        (sizeof(SPD_STORAGE_UNIT *) + sizeof(EX_RUNDOWN_REF)) * SpdStorageUnitCapacity;
     Data.SpecificLuExtensionSize = 0;
     Data.SrbExtensionSize = sizeof(SPD_SRB_EXTENSION);
     Data.MapBuffers = STOR_MAP_NON_READ_WRITE_BUFFERS;
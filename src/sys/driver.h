@@ -140,6 +140,10 @@ const char *SrbStringize(PVOID Srb, char Buffer[], size_t Size);
 #define SpdFree(Pointer, Tag)           ExFreePoolWithTag(Pointer, Tag)
 #define SpdTagStorageUnit               'SdpS'
 #define SpdTagIoq                       'QdpS'
+#define SpdTagBufferPool                'BdpS'
+#define SpdTagRing                      'RdpS'
+#define SpdTagAllocationMap             'AdpS'
+#define SpdTagSrbBuffer                 'OdpS'
 
 /* hash mix */
 /* Based on the MurmurHash3 fmix32/fmix64 function:
@@ -208,8 +212,10 @@ FORCEINLINE VOID SpdSrbComplete(PVOID DeviceExtension, PVOID Srb, UCHAR SrbStatu
     StorPortNotification(RequestComplete, DeviceExtension, Srb);
 }
 UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb);
-VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension, PVOID Context, PVOID DataBuffer);
-UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension, PVOID Context, PVOID DataBuffer);
+VOID SpdSrbExecuteScsiPrepare(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+VOID SpdSrbExecuteScsiPrepareZeroCopy(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+UCHAR SpdSrbExecuteScsiComplete(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+VOID SpdSrbExecuteScsiRollback(PVOID SrbExtension);
 UCHAR SpdSrbAbortCommand(PVOID DeviceExtension, PVOID Srb);
 UCHAR SpdSrbResetBus(PVOID DeviceExtension, PVOID Srb);
 UCHAR SpdSrbResetDevice(PVOID DeviceExtension, PVOID Srb);
@@ -288,12 +294,20 @@ NTSTATUS SpdQeventWait(SPD_QEVENT *Qevent,
 }
 static inline
 NTSTATUS SpdQeventCancellableWait(SPD_QEVENT *Qevent,
-    PLARGE_INTEGER PTimeout, PIRP Irp)
+    UINT64 SpinTime, PLARGE_INTEGER PTimeout, PIRP Irp)
 {
     NTSTATUS Result;
     UINT64 ExpirationTime = 0, InterruptTime;
     if (0 != PTimeout && 0 > PTimeout->QuadPart)
         ExpirationTime = KeQueryInterruptTime() - PTimeout->QuadPart;
+    if (0 != SpinTime && (0 == PTimeout || 0 != PTimeout->QuadPart))
+    {
+        /* poll for a while (SpinTime in performance counter ticks) to avoid a thread wake-up */
+        UINT64 SpinDeadline = KeQueryPerformanceCounter(0).QuadPart + SpinTime;
+        while (0 == KeReadStateQueue(&Qevent->Queue) &&
+            (UINT64)KeQueryPerformanceCounter(0).QuadPart < SpinDeadline)
+            YieldProcessor();
+    }
 retry:
     Result = SpdQeventWait(Qevent, KernelMode, TRUE, PTimeout);
     if (STATUS_ALERTED == Result)
@@ -315,53 +329,235 @@ retry:
 }
 
 /* I/O queue */
+#define SPD_IOQ_SHARD_MAX               64
+enum
+{
+    SpdIoqLaneHigh                      = 0,    /* flush, FUA, high priority */
+    SpdIoqLaneNormal,
+    SpdIoqLaneLow,                              /* low priority, unmap */
+    SpdIoqLaneCount,
+};
+#define SPD_IOQ_LANE_WEIGHT_HIGH        8
+#define SPD_IOQ_LANE_WEIGHT_NORMAL      4
+#define SPD_IOQ_LANE_WEIGHT_LOW         1
+#define SPD_IOQ_SLOT_COUNT              1024
+#define SPD_IOQ_SHARD_SLOT_MIN          64
+typedef struct DECLSPEC_CACHEALIGN
+{
+    KSPIN_LOCK SpinLock;                /* protects the fields below, the shard's slots and their chunks */
+    LIST_ENTRY PendingList[SpdIoqLaneCount];
+    ULONG Credit[SpdIoqLaneCount];      /* chunks a lane may dispatch before credits refill */
+    ULONG SlotFree;                     /* read unsynchronized by waiters */
+    LONG PendingCount;                  /* interlocked (for the barrier); read unsynchronized */
+    LONG PendingCountMax;
+    LONG ProcessCount, ProcessCountMax;
+    LONG WaiterCount;                   /* interlocked; dispatchers waiting on PendingEvent */
+    LONG64 LastPostTime;                /* read unsynchronized */
+    LONG64 PostInterval;                /* read unsynchronized; moving average of inter-arrival time */
+    SPD_QEVENT PendingEvent;
+} SPD_IOQ_SHARD;
+#define SPD_IOQ_SLOT_NONE               ((ULONG)-1)
+typedef struct _SPD_SRB_CHUNK
+{
+    struct _SPD_SRB_EXTENSION *SrbExtension;    /* 0 if the slot is free */
+    UINT64 Hint;                        /* slot index and generation */
+    ULONG State;                        /* protected by the shard lock */
+    ULONG Offset, Length;               /* window into the SRB data buffer */
+    LIST_ENTRY ChunkEntry;              /* in SPD_SRB_EXTENSION::ChunkList */
+    /* merged requests: protected by the shard lock; stable while the head is not InFlight */
+    struct _SPD_SRB_CHUNK *MergeHead;   /* head chunk of the request; 0 if this is the head */
+    struct _SPD_SRB_CHUNK *MergeNext;   /* next chunk merged into the request */
+    ULONG MergeOffset;                  /* offset of the chunk data in the request data buffer */
+    UINT64 StartTime;                   /* performance counter when the chunk went InFlight */
+    /* zero-copy: written by the owner of the chunk (Claimed/Completing); read under the lock */
+    PVOID MappedDataBuffer;             /* user mode address of the chunk data */
+    PMDL MappedMdl;
+    PEPROCESS MappedProcess;
+    LIST_ENTRY MappedEntry;             /* protected by SPD_DEVICE_EXTENSION::SpinLock */
+} SPD_SRB_CHUNK;
+typedef struct DECLSPEC_CACHEALIGN
+{
+    /* cache aligned: dispatchers on different processors work on adjacent slots */
+    SPD_SRB_CHUNK Chunk;
+    ULONG Generation;                   /* never 0; changes every time the slot is freed */
+    ULONG NextFree;
+} SPD_IOQ_SLOT;
+typedef struct DECLSPEC_CACHEALIGN
+{
+    /* per processor; updated with interlocked operations, summed by SpdIoqGetStats */
+    LONG64 PostCount[SPD_IOCTL_STATS_KIND_CAPACITY];
+    LONG64 CompleteCount[SPD_IOCTL_STATS_KIND_CAPACITY];
+    LONG64 ByteCount[SPD_IOCTL_STATS_KIND_CAPACITY];
+    LONG64 ErrorCount;
+    LONG64 AbortCount;
+    LONG64 SplitCount;
+    LONG64 MergeCount;
+    LONG64 QueueWaitHistogram[SPD_IOCTL_STATS_HISTOGRAM_SIZE];
+    LONG64 ServiceTimeHistogram[SPD_IOCTL_STATS_HISTOGRAM_SIZE];
+} SPD_IOQ_STATS;
 typedef struct
 {
     PVOID DeviceExtension;
-    KSPIN_LOCK SpinLock;
-    BOOLEAN Stopped;
-    SPD_QEVENT PendingEvent;
-    LIST_ENTRY PendingList, ProcessList;
-    ULONG ProcessBucketCount;
-    PVOID ProcessBuckets[];
+    BOOLEAN Stopped;                    /* written under all shard locks; read under any */
+    ULONG ShardCount;
+    SPD_IOQ_SHARD *Shards;
+    ULONG SlotCount, ShardSlotCount;    /* shard I owns ShardSlotCount slots from I * ShardSlotCount */
+    SPD_IOQ_SLOT *Slots;
+    ULONG StatsCount;
+    SPD_IOQ_STATS *Stats;
+    UINT64 PerformanceFrequency;
+    UINT64 SpinTimeLimit;               /* performance counter ticks; read-only after creation */
+    ULONG LaneWeight[SpdIoqLaneCount];  /* read-only after creation */
+    BOOLEAN MergeSequential;            /* read-only after creation */
 } SPD_IOQ;
-NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq);
+#define SPD_IOQ_SPIN_TIME_MAX           1000    /* microseconds */
+NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
+    SPD_IOQ **PIoq);
 VOID SpdIoqDelete(SPD_IOQ *Ioq);
 VOID SpdIoqReset(SPD_IOQ *Ioq, BOOLEAN Stop);
 BOOLEAN SpdIoqStopped(SPD_IOQ *Ioq);
+UINT32 SpdIoqPendingDepth(SPD_IOQ *Ioq);
 NTSTATUS SpdIoqCancelSrb(SPD_IOQ *Ioq, PVOID Srb);
 NTSTATUS SpdIoqPostSrb(SPD_IOQ *Ioq, PVOID Srb);
+NTSTATUS SpdIoqWaitSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp);
+NTSTATUS SpdIoqTryStartProcessingSrb(SPD_IOQ *Ioq,
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer);
 NTSTATUS SpdIoqStartProcessingSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp,
-    VOID (*Prepare)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
     PVOID Context, PVOID DataBuffer);
 VOID SpdIoqEndProcessingSrb(SPD_IOQ *Ioq, UINT64 Hint,
-    UCHAR (*Complete)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
     PVOID Context, PVOID DataBuffer);
+BOOLEAN SpdIoqIsChunkMapped(SPD_IOQ *Ioq, UINT64 Hint);
+VOID SpdIoqReleaseMappedChunk(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk);
+VOID SpdIoqGetStats(SPD_IOQ *Ioq, SPD_IOCTL_STORAGE_UNIT_STATS *Stats);
+enum
+{
+    SpdSrbPending                       = 0,    /* in PendingList; has chunks left to claim */
+    SpdSrbDispatched,                           /* all chunks claimed; last chunk to end completes */
+};
+enum
+{
+    SpdChunkClaimed                     = 1,    /* in Slots; Prepare running outside lock */
+    SpdChunkInFlight,                           /* in Slots; owned by user mode */
+    SpdChunkCompleting,                         /* in Slots; Complete running outside lock */
+    SpdChunkAborted,                            /* in Slots; Prepare/Complete owner ends it */
+    SpdChunkAbortedMapped,                      /* in Slots; aborted InFlight; mapping process ends it */
+    SpdChunkMerged,                             /* in Slots; part of the request of MergeHead */
+};
 typedef struct _SPD_SRB_EXTENSION
 {
     struct _SPD_STORAGE_UNIT *StorageUnit;
     LIST_ENTRY ListEntry;
-    PVOID HashNext;
     PVOID Srb;
     PVOID SystemDataBuffer;
     ULONG SystemDataLength;
-    ULONG ChunkOffset;
+    ULONG ChunkLength;                  /* maximum chunk length; 0 if the SRB is not split */
+    ULONG DescriptorCount;              /* UNMAP descriptors validated at post time */
+    /* fields protected by the lock of the SRB's shard; its chunks live in that shard's slots */
+    ULONG State;
+    ULONG ChunkOffset;                  /* offset of the next chunk to claim */
+    ULONG ChunkCount;                   /* chunks claimed and not yet ended */
+    LIST_ENTRY ChunkList;               /* those chunks */
+    BOOLEAN Aborted;
+    UCHAR SrbStatus;                    /* first error reported by any chunk */
+    LONG ErrorReported;                 /* interlocked; only the first failing chunk sets sense data */
+    ULONG Shard;                        /* read-only while the SRB is queued */
+    UINT8 Kind;                         /* transact kind; for statistics */
+    UINT8 Lane;                         /* priority lane; read-only while the SRB is queued */
+    BOOLEAN SystemDataBufferOwned;      /* SystemDataBuffer is pool (SpdTagSrbBuffer) freed on completion */
+    UINT64 PostTime;                    /* performance counter when the SRB was queued */
 } SPD_SRB_EXTENSION;
 #define SpdSrbExtension(Srb)            ((SPD_SRB_EXTENSION *)SrbGetMiniportContext(Srb))
+VOID SpdSrbUnmapDataBuffer(PVOID DeviceExtension, SPD_SRB_CHUNK *Chunk);
+BOOLEAN SpdSrbCanMerge(SPD_SRB_EXTENSION *SrbExtension, SPD_SRB_EXTENSION *NextSrbExtension);
 
 /* storage units */
+typedef struct _SPD_BUFFER_POOL
+{
+    LONG volatile RefCount;             /* interlocked */
+    /* fields below are read-only after construction */
+    ULONG ProcessId;
+    PMDL Mdl;
+    PVOID SystemBuffer;
+    ULONG BufferCount, BufferLength;
+} SPD_BUFFER_POOL;
+typedef struct _SPD_RING
+{
+    LONG volatile RefCount;             /* interlocked */
+    /* fields below are read-only after construction */
+    ULONG ProcessId;
+    PMDL Mdl;
+    SPD_IOCTL_RING_HEADER *Header;      /* shared with user mode; never trusted */
+    SPD_IOCTL_RING_REQ *Req;
+    SPD_IOCTL_RING_RSP *Rsp;
+    PUINT8 Data;
+    ULONG EntryCount, DataLength;
+    /* fields protected by SpinLock; private copies of the shared ring state */
+    KSPIN_LOCK SpinLock;
+    ULONG ReqHead, RspTail;
+    ULONG FreeCount;
+    PULONG FreeList;                    /* free data slots */
+    PUINT64 Hints;                      /* hint of the SRB that owns each data slot; 0 if free */
+} SPD_RING;
+typedef struct _SPD_ALLOCATION_MAP
+{
+    /* fields below are read-only after construction */
+    ULONG ProcessId;
+    PMDL Mdl;
+    LONG volatile *Bits;                /* shared with user mode; never trusted */
+    UINT64 BitCount;
+    ULONG BlockShift;
+} SPD_ALLOCATION_MAP;
 typedef struct _SPD_STORAGE_UNIT SPD_STORAGE_UNIT;
+/* offloaded data transfer: a token names a point-in-time list of block ranges */
+#define SPD_TOKEN_COUNT                 8
+#define SPD_TOKEN_RANGE_COUNT           8
+#define SPD_TOKEN_DEFAULT_TIMEOUT       30      /* seconds of inactivity */
+#define SPD_TOKEN_MAXIMUM_TIMEOUT       300
+typedef struct _SPD_TOKEN
+{
+    UINT64 Id;                          /* 0 if the slot is free */
+    UINT64 ExpirationTime;              /* interrupt time; extended whenever the token is used */
+    UINT64 BlockCount;                  /* total of all ranges */
+    UINT32 ListIdentifier;              /* of the POPULATE TOKEN that created it */
+    UINT32 Timeout;
+    ULONG RangeCount;
+    struct
+    {
+        UINT64 BlockAddress;
+        UINT32 BlockCount;
+    } Ranges[SPD_TOKEN_RANGE_COUNT];
+} SPD_TOKEN;
 typedef struct _SPD_DEVICE_EXTENSION
 {
     KSPIN_LOCK SpinLock;
     PDEVICE_OBJECT DeviceObject;        /* adapter device */
+    LIST_ENTRY MappedList;              /* chunks with data mapped into user mode */
+    FAST_MUTEX ProvisionMutex;          /* serializes storage unit slot reuse and map replacement */
     ULONG StorageUnitCount, StorageUnitCapacity;
-    SPD_STORAGE_UNIT *StorageUnits[];
+    EX_RUNDOWN_REF *StorageUnitRundown; /* per slot; guards lock-free lookups */
+    SPD_STORAGE_UNIT *StorageUnits[];   /* written under SpinLock; read lock-free */
 } SPD_DEVICE_EXTENSION;
 typedef struct _SPD_STORAGE_UNIT
 {
-    /* fields protected by SPD_DEVICE_EXTENSION::SpinLock */
-    ULONG RefCount;
+    LONG volatile RefCount;             /* interlocked */
+    LONG QueueDepthSet;                 /* interlocked; queue depth set (or being set) */
+    LONG QueueDepthFailures;            /* interlocked; StorPortSetDeviceQueueDepth refusals */
+    LONG volatile WriteCacheEnabled;    /* interlocked; changed by MODE SELECT */
+    /* fields protected by BufferSpinLock; both may be peeked without it */
+    KSPIN_LOCK BufferSpinLock;
+    SPD_BUFFER_POOL *BufferPool;
+    SPD_RING *Ring;
+    /* fields protected by TokenSpinLock; TokenCount may be read without it */
+    KSPIN_LOCK TokenSpinLock;
+    LONG volatile TokenCount;
+    UINT64 TokenGeneration;
+    SPD_TOKEN Tokens[SPD_TOKEN_COUNT];
+    /* AllocationMap is replaced under SPD_DEVICE_EXTENSION::ProvisionMutex; read under the rundown */
+    EX_RUNDOWN_REF AllocationMapRundown;
+    SPD_ALLOCATION_MAP *AllocationMap;
     /* fields below are read-only after construction */
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
     CHAR SerialNumber[36];
@@ -390,10 +586,71 @@ SPD_STORAGE_UNIT *SpdStorageUnitReferenceByBtl(
 VOID SpdStorageUnitDereference(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     SPD_STORAGE_UNIT *StorageUnit);
+#define SPD_STORAGE_UNIT_BITMAP_SIZE    (SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY / 8)
 ULONG SpdStorageUnitGetUseBitmap(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PULONG PProcessId,
-    UINT8 Bitmap[32]);
+    UINT8 Bitmap[SPD_STORAGE_UNIT_BITMAP_SIZE]);
+NTSTATUS SpdStorageUnitRegisterBufferPool(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG BufferCount,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId);
+SPD_BUFFER_POOL *SpdStorageUnitReferenceBufferPool(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit);
+VOID SpdBufferPoolDereference(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_BUFFER_POOL *BufferPool);
+VOID SpdStorageUnitReleaseBufferPools(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId);
+NTSTATUS SpdStorageUnitRegisterRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG EntryCount,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId);
+SPD_RING *SpdStorageUnitReferenceRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit);
+VOID SpdRingDereference(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_RING *Ring);
+VOID SpdStorageUnitReleaseRings(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId);
+NTSTATUS SpdStorageUnitRegisterAllocationMap(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG BlockShift,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId);
+VOID SpdStorageUnitDeleteAllocationMap(
+    SPD_STORAGE_UNIT *StorageUnit);
+VOID SpdStorageUnitReleaseAllocationMaps(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId);
+BOOLEAN SpdStorageUnitIsUnallocated(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount);
+VOID SpdStorageUnitSetAllocated(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount,
+    BOOLEAN Allocated);
+BOOLEAN SpdStorageUnitGetAllocationExtent(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 MaxBlockCount,
+    PBOOLEAN PAllocated, PUINT64 PBlockCount);
+VOID SpdStorageUnitReleaseMappedChunks(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId);
+VOID SpdStorageUnitPostRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit);
+NTSTATUS SpdRingEnter(
+    SPD_RING *Ring,
+    SPD_IOQ *Ioq,
+    BOOLEAN Wait,
+    PIRP CancellableIrp);
 NTSTATUS SpdStorageUnitGlobalSetDevice(
     PDEVICE_OBJECT DeviceObject);
 SPD_STORAGE_UNIT *SpdStorageUnitGlobalReferenceByDevice(
@@ -411,8 +668,9 @@ SPD_STORAGE_UNIT *SpdStorageUnitReference(PVOID DeviceExtension, PVOID Srb)
 extern ERESOURCE SpdGlobalDeviceResource;
 extern SPD_DEVICE_EXTENSION *SpdGlobalDeviceExtension;  /* protected by SpdGlobalDeviceResource */
 extern ULONG SpdStorageUnitCapacity;                    /* read-only after DriverLoad */
-#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_BTL_T(Btl)
-#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL(0, Idx, 0)
+extern ULONG SpdIoqShardCount;                          /* read-only after DriverLoad */
+#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_INDEX_FROM_BTL(Btl)
+#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL_FROM_INDEX(Idx)
 
 /* utility */
 NTSTATUS SpdRegistryGetValue(PUNICODE_STRING Path, PUNICODE_STRING ValueName,
@@ -428,6 +686,12 @@ VOID SpdMakeDeviceIoControlRequest(
 NTSTATUS SpdGetScsiAddress(
     PDEVICE_OBJECT DeviceObject,
     PSCSI_ADDRESS ScsiAddress);
+NTSTATUS SpdLockUserBuffer(
+    UINT64 Buffer, ULONG Length,
+    KPROCESSOR_MODE AccessMode,
+    PMDL *PMdl, PVOID *PSystemBuffer);
+VOID SpdUnlockUserBuffer(
+    PMDL Mdl);
 
 /*
  * Fixes
@@ -108,11 +108,9 @@ UCHAR SpdSrbResetBus(PVOID DeviceExtension, PVOID Srb)
     UCHAR PathId, TargetId, Lun;
 
     SrbGetPathTargetLun(Srb, &PathId, &TargetId, &Lun);
-    if (0 != PathId)
+    if (!SpdHwResetBus(DeviceExtension, PathId))
         return SRB_STATUS_NO_DEVICE;
 
-    SpdHwResetBus(DeviceExtension, 0);
-
     return SRB_STATUS_SUCCESS;
 }
 
@@ -120,18 +118,25 @@ UCHAR SpdSrbResetDevice(PVOID DeviceExtension, PVOID Srb)
 {
     SPD_STORAGE_UNIT *StorageUnit;
     UCHAR PathId, TargetId, Lun;
+    BOOLEAN Found = FALSE;
 
+    /* a device (target) reset resets all its LUN's; the Lun in the SRB is invalid */
     SrbGetPathTargetLun(Srb, &PathId, &TargetId, &Lun);
-    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension,
-        SPD_IOCTL_BTL(PathId, TargetId, 0/* Lun is invalid! */));
-    if (0 == StorageUnit)
-        return SRB_STATUS_NO_DEVICE;
+    for (ULONG L = 0; SPD_IOCTL_STORAGE_UNIT_LUN_COUNT > L; L++)
+    {
+        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension,
+            SPD_IOCTL_BTL(PathId, TargetId, L));
+        if (0 == StorageUnit)
+            continue;
 
-    SpdIoqReset(StorageUnit->Ioq, FALSE);
+        SpdIoqReset(StorageUnit->Ioq, FALSE);
 
-    SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 
-    return SRB_STATUS_SUCCESS;
+        Found = TRUE;
+    }
+
+    return Found ? SRB_STATUS_SUCCESS : SRB_STATUS_NO_DEVICE;
 }
 
 UCHAR SpdSrbResetLogicalUnit(PVOID DeviceExtension, PVOID Srb)
@@ -21,6 +21,35 @@
 
 #include <sys/driver.h>
 
+static BOOLEAN SpdIoctlValidateGeometry(SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
+{
+    UINT32 BlockLength = StorageUnitParams->BlockLength;
+    UINT32 Ratio;
+
+    if (0 != StorageUnitParams->PhysicalBlockLength)
+    {
+        /* READ CAPACITY (16) reports the ratio as a 4-bit exponent */
+        if (0 != StorageUnitParams->PhysicalBlockLength % BlockLength)
+            return FALSE;
+        Ratio = StorageUnitParams->PhysicalBlockLength / BlockLength;
+        if (0 != (Ratio & (Ratio - 1)) || (1 << 15) < Ratio)
+            return FALSE;
+    }
+
+    if (0 != StorageUnitParams->OptimalTransferLength % BlockLength ||
+        0 != StorageUnitParams->OptimalTransferGranularity % BlockLength ||
+        0xffff < StorageUnitParams->OptimalTransferGranularity / BlockLength ||
+        0 != StorageUnitParams->UnmapGranularity % BlockLength)
+        return FALSE;
+
+    if (0 != StorageUnitParams->UnmapGranularityAlignment &&
+        StorageUnitParams->UnmapGranularityAlignment >=
+            StorageUnitParams->UnmapGranularity / BlockLength)
+        return FALSE;
+
+    return TRUE;
+}
+
 static VOID SpdIoctlProvision(SPD_DEVICE_EXTENSION *DeviceExtension,
     ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_PROVISION_PARAMS *Params,
     PIRP Irp)
@@ -46,6 +75,12 @@ static VOID SpdIoctlProvision(SPD_DEVICE_EXTENSION *DeviceExtension,
         goto exit;
     }
 
+    if (!SpdIoctlValidateGeometry(&Params->Dir.Par.StorageUnitParams))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
     Irp->IoStatus.Status = SpdStorageUnitProvision(
         DeviceExtension,
         &Params->Dir.Par.StorageUnitParams,
@@ -95,7 +130,7 @@ static VOID SpdIoctlGetList(SPD_DEVICE_EXTENSION *DeviceExtension,
     PUINT32 BtlBgnP = Irp->AssociatedIrp.SystemBuffer;
     PUINT32 BtlEndP = (PVOID)((PUINT8)BtlBgnP + OutputBufferLength);
     PUINT32 BtlP = BtlBgnP;
-    UINT8 Bitmap[32];
+    UINT8 Bitmap[SPD_STORAGE_UNIT_BITMAP_SIZE];
     ULONG Count;
 
     if (sizeof *Params > InputBufferLength)
@@ -125,13 +160,116 @@ static VOID SpdIoctlGetList(SPD_DEVICE_EXTENSION *DeviceExtension,
 exit:;
 }
 
+static NTSTATUS SpdIoctlLockDataBuffer(PIRP Irp, PVOID *PDataBuffer, ULONG Length)
+{
+    PVOID DataBuffer = *PDataBuffer;
+    PMDL Mdl;
+
+    try
+    {
+        ProbeForWrite(DataBuffer, Length, 1);
+
+        /* the MDL is associated with the Irp and is unlocked/freed when the Irp completes */
+        Mdl = IoAllocateMdl(
+            DataBuffer,
+            Length,
+            0 != Irp->MdlAddress,
+            FALSE,
+            Irp);
+        if (0 == Mdl)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
+
+        DataBuffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (0 == DataBuffer)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return GetExceptionCode();
+    }
+
+    *PDataBuffer = DataBuffer;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS SpdIoctlGetDataBuffer(SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit, PIRP Irp,
+    UINT64 DataBuffer0, BOOLEAN DataIndexValid, ULONG SlotCount,
+    PVOID *PDataBuffer, SPD_BUFFER_POOL **PBufferPool)
+{
+    ULONG SlotLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_BUFFER_POOL *BufferPool;
+    PVOID DataBuffer;
+
+    *PDataBuffer = 0;
+    *PBufferPool = 0;
+
+    if (DataIndexValid)
+    {
+        /* registered buffers are already locked and mapped; no per-I/O page locking */
+        BufferPool = SpdStorageUnitReferenceBufferPool(DeviceExtension, StorageUnit);
+        if (0 == BufferPool)
+            return STATUS_INVALID_PARAMETER;
+
+        if (IoGetRequestorProcessId(Irp) != BufferPool->ProcessId ||
+            BufferPool->BufferCount <= DataBuffer0 ||
+            BufferPool->BufferCount - DataBuffer0 < SlotCount)
+        {
+            SpdBufferPoolDereference(DeviceExtension, BufferPool);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        *PDataBuffer = (PUINT8)BufferPool->SystemBuffer + DataBuffer0 * BufferPool->BufferLength;
+        *PBufferPool = BufferPool;
+
+        return STATUS_SUCCESS;
+    }
+
+    DataBuffer = (PVOID)(UINT_PTR)DataBuffer0;
+    if (0 != DataBuffer && UserMode == Irp->RequestorMode)
+    {
+        NTSTATUS Result = SpdIoctlLockDataBuffer(Irp, &DataBuffer, SlotCount * SlotLength);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
+    *PDataBuffer = DataBuffer;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS SpdIoctlGetDataSlot(PIRP Irp,
+    UINT64 UnlockedDataBuffer, ULONG SlotLength, ULONG Index, PVOID *PSlotBuffer)
+{
+    PVOID SlotBuffer;
+    NTSTATUS Result;
+
+    /* slots of registered and kernel buffers are set up front; unlocked ones on first use */
+    if (0 != *PSlotBuffer || 0 == UnlockedDataBuffer)
+        return STATUS_SUCCESS;
+
+    SlotBuffer = (PVOID)(UINT_PTR)(UnlockedDataBuffer + (UINT64)Index * SlotLength);
+    Result = SpdIoctlLockDataBuffer(Irp, &SlotBuffer, SlotLength);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    *PSlotBuffer = SlotBuffer;
+
+    return STATUS_SUCCESS;
+}
+
 static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
     ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_TRANSACT_PARAMS *Params,
     PIRP Irp)
 {
     SPD_STORAGE_UNIT *StorageUnit = 0;
-    PMDL Mdl = 0;
+    SPD_BUFFER_POOL *BufferPool = 0;
     PVOID DataBuffer;
+    LARGE_INTEGER Timeout;
+    VOID (*Prepare)(PVOID, PVOID, PVOID);
 
     if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
     {
@@ -139,10 +277,8 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
         goto exit;
     }
 
-    DataBuffer = (PVOID)(UINT_PTR)Params->DataBuffer;
-
     if ((!Params->ReqValid && !Params->RspValid) ||
-        (Params->ReqValid && 0 == DataBuffer))
+        (Params->ReqValid && !Params->DataIndexValid && 0 == Params->DataBuffer))
     {
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
         goto exit;
@@ -161,42 +297,18 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
         goto exit;
     }
 
-    if (0 != DataBuffer && UserMode == Irp->RequestorMode)
-    {
-        try
-        {
-            ProbeForWrite(DataBuffer, StorageUnit->StorageUnitParams.MaxTransferLength, 1);
-
-            Mdl = IoAllocateMdl(
-                DataBuffer,
-                StorageUnit->StorageUnitParams.MaxTransferLength,
-                0 != Irp->MdlAddress,
-                FALSE,
-                Irp);
-            if (0 == Mdl)
-            {
-                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                leave;
-            }
-
-            MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
-
-            DataBuffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-            if (0 == DataBuffer)
-            {
-                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                leave;
-            }
-        }
-        except (EXCEPTION_EXECUTE_HANDLER)
-        {
-            Irp->IoStatus.Status = GetExceptionCode();
-            goto exit;
-        }
+    /*
+     * A response to a zero-copy request needs no data buffer; its data is already in place.
+     * The buffer passed may even be the mapped one, which cannot be locked again.
+     */
+    if (Params->RspValid && !Params->ReqValid && !Params->DataIndexValid &&
+        SpdIoqIsChunkMapped(StorageUnit->Ioq, Params->Dir.Rsp.Hint))
+        Params->DataBuffer = 0;
 
-        if (!NT_SUCCESS(Irp->IoStatus.Status))
-            goto exit;
-    }
+    Irp->IoStatus.Status = SpdIoctlGetDataBuffer(DeviceExtension, StorageUnit, Irp,
+        Params->DataBuffer, Params->DataIndexValid, 1, &DataBuffer, &BufferPool);
+    if (!NT_SUCCESS(Irp->IoStatus.Status))
+        goto exit;
 
     if (Params->RspValid)
         SpdIoqEndProcessingSrb(StorageUnit->Ioq,
@@ -208,10 +320,15 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
         Params->RspValid = 0;
         RtlZeroMemory(&Params->Dir.Req, sizeof Params->Dir.Req);
 
-        /* wait for an SRB to arrive */
+        /* we run in the context of the transact process; large I/O may be mapped into it */
+        Prepare = UserMode == Irp->RequestorMode ?
+            SpdSrbExecuteScsiPrepareZeroCopy : SpdSrbExecuteScsiPrepare;
+
+        /* wait for an SRB to arrive; an idle dispatcher thread may ask to give up eventually */
+        Timeout.QuadPart = -(LONGLONG)Params->WaitTimeout * 10000;
         while (STATUS_UNSUCCESSFUL == (Irp->IoStatus.Status =
             SpdIoqStartProcessingSrb(StorageUnit->Ioq,
-                0, Irp, SpdSrbExecuteScsiPrepare, &Params->Dir.Req, DataBuffer)))
+                0 != Params->WaitTimeout ? &Timeout : 0, Irp, Prepare, &Params->Dir.Req, DataBuffer)))
         {
             if (SpdIoqStopped(StorageUnit->Ioq))
             {
@@ -229,6 +346,7 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
             goto exit;
         }
 
+        Params->Dir.Req.PendingDepth = SpdIoqPendingDepth(StorageUnit->Ioq);
         Params->ReqValid = 1;
     }
 
@@ -236,6 +354,177 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
     Irp->IoStatus.Information = Params->ReqValid ? sizeof *Params : 0;
 
 exit:;
+    if (0 != BufferPool)
+        SpdBufferPoolDereference(DeviceExtension, BufferPool);
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlTransactV(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_TRANSACT_V_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    SPD_BUFFER_POOL *BufferPool = 0;
+    PVOID DataBuffer = 0, SlotBuffer[SPD_IOCTL_TRANSACT_V_CAPACITY];
+    UINT64 UnlockedDataBuffer = 0;
+    ULONG RspCount, ReqCount, SlotCount, SlotLength, Count;
+    LARGE_INTEGER Timeout;
+    NTSTATUS Result;
+    VOID (*Prepare)(PVOID, PVOID, PVOID);
+
+    if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    RspCount = Params->RspCount;
+    ReqCount = Params->ReqCount;
+
+    if ((0 == RspCount && 0 == ReqCount) ||
+        SPD_IOCTL_TRANSACT_V_CAPACITY < RspCount ||
+        SPD_IOCTL_TRANSACT_V_CAPACITY < ReqCount ||
+        (0 != ReqCount && !Params->DataIndexValid && 0 == Params->DataBuffer))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (IoGetRequestorProcessId(Irp) != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    SlotLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SlotCount = RspCount > ReqCount ? RspCount : ReqCount;
+    if (SlotLength > MAXULONG / SlotCount)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    /*
+     * Registered and kernel mode data buffers need no locking. An unregistered user mode
+     * buffer is locked one slot at a time, only for the slots that this batch uses:
+     * locking all SlotCount * MaxTransferLength bytes on every call would cost more than
+     * the batching saves.
+     */
+    RtlZeroMemory(SlotBuffer, sizeof SlotBuffer);
+    if (Params->DataIndexValid || UserMode != Irp->RequestorMode)
+    {
+        Irp->IoStatus.Status = SpdIoctlGetDataBuffer(DeviceExtension, StorageUnit, Irp,
+            Params->DataBuffer, Params->DataIndexValid, SlotCount, &DataBuffer, &BufferPool);
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+            goto exit;
+        if (0 != DataBuffer)
+            for (ULONG I = 0; SlotCount > I; I++)
+                SlotBuffer[I] = (PUINT8)DataBuffer + I * SlotLength;
+    }
+    else
+        UnlockedDataBuffer = Params->DataBuffer;
+
+    /*
+     * Only read responses carry data, unless the read was zero-copy. Lock their slots
+     * before ending any request, so that a failure leaves all responses unprocessed.
+     */
+    for (ULONG I = 0; RspCount > I; I++)
+        if (0 != Params->Dir[I].Rsp.Hint &&
+            SpdIoctlTransactReadKind == Params->Dir[I].Rsp.Kind &&
+            !SpdIoqIsChunkMapped(StorageUnit->Ioq, Params->Dir[I].Rsp.Hint))
+        {
+            Irp->IoStatus.Status = SpdIoctlGetDataSlot(Irp,
+                UnlockedDataBuffer, SlotLength, I, &SlotBuffer[I]);
+            if (!NT_SUCCESS(Irp->IoStatus.Status))
+                goto exit;
+        }
+
+    for (ULONG I = 0; RspCount > I; I++)
+    {
+        /* a zero Hint marks an unused response entry (e.g. a request completed asynchronously) */
+        if (0 == Params->Dir[I].Rsp.Hint)
+            continue;
+
+        SpdIoqEndProcessingSrb(StorageUnit->Ioq,
+            Params->Dir[I].Rsp.Hint, SpdSrbExecuteScsiComplete, &Params->Dir[I].Rsp,
+            SlotBuffer[I]);
+    }
+
+    Params->RspCount = 0;
+    Params->ReqCount = 0;
+    RtlZeroMemory(Params->Dir, sizeof Params->Dir);
+
+    Prepare = UserMode == Irp->RequestorMode ?
+        SpdSrbExecuteScsiPrepareZeroCopy : SpdSrbExecuteScsiPrepare;
+
+    /*
+     * Wait for the first SRB to arrive; then pick up any other SRB's that are
+     * already pending without waiting. Once we have dequeued at least one SRB
+     * we must return it to user mode, so errors after that point simply end
+     * the batch.
+     */
+    for (Count = 0; ReqCount > Count;)
+    {
+        Result = SpdIoctlGetDataSlot(Irp,
+            UnlockedDataBuffer, SlotLength, Count, &SlotBuffer[Count]);
+        if (!NT_SUCCESS(Result))
+        {
+            if (0 != Count)
+                break;
+            Irp->IoStatus.Status = Result;
+            goto exit;
+        }
+
+        Timeout.QuadPart = 0;
+        Result = SpdIoqStartProcessingSrb(StorageUnit->Ioq,
+            0 == Count ? 0 : &Timeout, Irp,
+            Prepare, &Params->Dir[Count].Req, SlotBuffer[Count]);
+        if (STATUS_SUCCESS == Result)
+        {
+            Params->Dir[Count].Req.PendingDepth = SpdIoqPendingDepth(StorageUnit->Ioq);
+            Count++;
+            continue;
+        }
+
+        if (0 != Count)
+            break;
+
+        if (STATUS_UNSUCCESSFUL == Result)
+        {
+            if (SpdIoqStopped(StorageUnit->Ioq))
+            {
+                Irp->IoStatus.Status = STATUS_CANCELLED;
+                goto exit;
+            }
+            continue;
+        }
+
+        if (!NT_SUCCESS(Result))
+        {
+            Irp->IoStatus.Status = Result;
+            goto exit;
+        }
+
+        /* STATUS_TIMEOUT */
+        break;
+    }
+
+    Params->ReqCount = (UINT16)Count;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof *Params;
+
+exit:;
+    if (0 != BufferPool)
+        SpdBufferPoolDereference(DeviceExtension, BufferPool);
     if (0 != StorageUnit)
         SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 }
@@ -270,6 +559,188 @@ exit:;
         SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 }
 
+static VOID SpdIoctlRegisterBufferPool(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_REGISTER_BUFFER_POOL_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG ProcessId = IoGetRequestorProcessId(Irp);
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdStorageUnitRegisterBufferPool(DeviceExtension, StorageUnit,
+        Params->Buffer, Params->BufferCount, Irp->RequestorMode, ProcessId);
+    Irp->IoStatus.Information = 0;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlRegisterRing(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_REGISTER_RING_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG ProcessId = IoGetRequestorProcessId(Irp);
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdStorageUnitRegisterRing(DeviceExtension, StorageUnit,
+        Params->Buffer, Params->EntryCount, Irp->RequestorMode, ProcessId);
+    Irp->IoStatus.Information = 0;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlEnterRing(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_ENTER_RING_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    SPD_RING *Ring = 0;
+    ULONG ProcessId = IoGetRequestorProcessId(Irp);
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Ring = SpdStorageUnitReferenceRing(DeviceExtension, StorageUnit);
+    if (0 == Ring || ProcessId != Ring->ProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdRingEnter(Ring, StorageUnit->Ioq, Params->Wait, Irp);
+    Irp->IoStatus.Information = 0;
+
+exit:;
+    if (0 != Ring)
+        SpdRingDereference(DeviceExtension, Ring);
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlGetStatistics(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_GET_STATS_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+
+    if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Dir.Par.Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    RtlZeroMemory(Params, sizeof *Params);
+    Params->Base.Size = sizeof *Params;
+    Params->Base.Code = SPD_IOCTL_GET_STATS;
+    SpdIoqGetStats(StorageUnit->Ioq, &Params->Dir.Ret.Stats);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof *Params;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlRegisterAllocationMap(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength,
+    SPD_IOCTL_REGISTER_ALLOCATION_MAP_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG ProcessId = IoGetRequestorProcessId(Irp);
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdStorageUnitRegisterAllocationMap(DeviceExtension, StorageUnit,
+        Params->Buffer, Params->BlockShift, Irp->RequestorMode, ProcessId);
+    Irp->IoStatus.Information = 0;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
 VOID SpdHwProcessServiceRequest(PVOID DeviceExtension, PVOID Irp0)
 {
     SPD_ENTER(ioctl,
@@ -303,9 +774,27 @@ VOID SpdHwProcessServiceRequest(PVOID DeviceExtension, PVOID Irp0)
     case SPD_IOCTL_TRANSACT:
         SpdIoctlTransact(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
         break;
+    case SPD_IOCTL_TRANSACT_V:
+        SpdIoctlTransactV(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
     case SPD_IOCTL_SET_TRANSACT_PID:
         SpdIoctlSetTransactProcessId(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
         break;
+    case SPD_IOCTL_REGISTER_BUFFER_POOL:
+        SpdIoctlRegisterBufferPool(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_REGISTER_RING:
+        SpdIoctlRegisterRing(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_ENTER_RING:
+        SpdIoctlEnterRing(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_GET_STATS:
+        SpdIoctlGetStatistics(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_REGISTER_ALLOCATION_MAP:
+        SpdIoctlRegisterAllocationMap(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
     default:
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
         goto exit;
@@ -332,7 +821,7 @@ VOID SpdHwCompleteServiceIrp(PVOID DeviceExtension0)
 
     for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
     {
-        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_IOCTL_BTL(0, I, 0));
+        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_BTL_FROM_INDEX(I));
         if (0 == StorageUnit)
             continue;
 
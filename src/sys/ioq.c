@@ -21,24 +21,466 @@
 
 #include <sys/driver.h>
 
-NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq)
+ULONG SpdIoqShardCount = 1;
+
+/* fixed point scale of SRB arrival rates (SRB's per performance counter tick) */
+#define SPD_IOQ_RATE_SCALE              (1ULL << 32)
+
+/*
+ * The I/O queue is split into shards. Each shard has its own PendingList, lock, counters,
+ * PendingEvent and part of the slot table; SRB's are posted to the shard of the submitting
+ * processor, so that submitters on different processors do not contend. Dispatchers wait
+ * on the PendingEvent of the shard of their processor (their home shard), start with that
+ * shard and steal from the other shards when theirs is empty. A post wakes a dispatcher
+ * of its shard; if the shard has none waiting, it wakes one of another shard instead.
+ *
+ * Each shard has a PendingList per priority lane. Dispatchers pick lanes by weighted
+ * round robin: a non-empty lane is served while it has credit, and credits are refilled
+ * from the lane weights once no non-empty lane has any. Every weight is at least 1,
+ * so a busy high priority lane cannot starve the others.
+ *
+ * An SRB is processed as one or more chunks; an SRB that exceeds MaxTransferLength is
+ * split, so that different dispatchers can process its chunks concurrently. A chunk is
+ * claimed from the SRB at the head of a PendingList; the SRB leaves the PendingList when
+ * its last chunk is claimed and it completes when its last chunk ends.
+ *
+ * If MergeSequential is set, a dispatcher that claims a whole read or write SRB also
+ * claims the SRB's that follow it in the same PendingList, as long as they continue
+ * it sequentially and the request fits in MaxTransferLength. The merged chunks are
+ * chained to the head chunk in the Merged state and are sent to user mode as one
+ * request under the head's Hint. The owner of the head owns the whole request; a merged
+ * chunk that is aborted while the request is InFlight leaves the request and ends
+ * immediately, while a head that is aborted ends the whole request.
+ *
+ * Claimed and in-flight chunks are kept in a preallocated slot table. The chunks of an
+ * SRB (and of the SRB's merged with it, which come from the same PendingList) always
+ * use slots of the SRB's shard, so the shard lock protects the SRB, its chunks and their
+ * slots; starting and ending a chunk take only that lock. Each SRB also links its chunks
+ * in its ChunkList, so that aborting an SRB does not scan the table. When all shard locks
+ * are needed they are acquired in ascending order.
+ *
+ * The Hint that user mode sees is the slot index in the low 32 bits and the slot
+ * generation in the high 32 bits. The generation changes every time a slot is freed,
+ * so a stale or forged hint fails the lookup.
+ *
+ * A chunk whose data is mapped into user mode (zero-copy) cannot end while the
+ * mapping exists and the mapping can only be removed from within the mapping process.
+ * Aborting such a chunk moves it to AbortedMapped; it ends when the mapping process
+ * responds to it or exits (SpdIoqReleaseMappedChunk).
+ */
+
+static inline
+KIRQL SpdIoqAcquireAll(SPD_IOQ *Ioq)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Ioq->Shards[0].SpinLock, &Irql);
+    for (ULONG I = 1; Ioq->ShardCount > I; I++)
+        KeAcquireSpinLockAtDpcLevel(&Ioq->Shards[I].SpinLock);
+
+    return Irql;
+}
+
+static inline
+VOID SpdIoqReleaseAll(SPD_IOQ *Ioq, KIRQL Irql)
+{
+    for (ULONG I = Ioq->ShardCount - 1; 0 < I; I--)
+        KeReleaseSpinLockFromDpcLevel(&Ioq->Shards[I].SpinLock);
+    KeReleaseSpinLock(&Ioq->Shards[0].SpinLock, Irql);
+}
+
+static inline
+ULONG SpdIoqCurrentShard(SPD_IOQ *Ioq)
+{
+    return KeGetCurrentProcessorNumberEx(0) % Ioq->ShardCount;
+}
+
+static inline
+SPD_IOQ_SHARD *SpdIoqSlotShard(SPD_IOQ *Ioq, UINT64 Hint)
+{
+    ULONG Index = (ULONG)Hint;
+    return Ioq->SlotCount > Index ? &Ioq->Shards[Index / Ioq->ShardSlotCount] : 0;
+}
+
+static inline
+SPD_IOQ_STATS *SpdIoqCurrentStats(SPD_IOQ *Ioq)
+{
+    return &Ioq->Stats[KeGetCurrentProcessorNumberEx(0) % Ioq->StatsCount];
+}
+
+static inline
+UINT64 SpdIoqTime(VOID)
+{
+    return KeQueryPerformanceCounter(0).QuadPart;
+}
+
+static inline
+VOID SpdIoqRecordLatency(SPD_IOQ *Ioq, LONG64 *Histogram, UINT64 StartTime)
+{
+    UINT64 Micros = (SpdIoqTime() - StartTime) * 1000000 / Ioq->PerformanceFrequency;
+    ULONG Index = 0;
+
+    /* bucket 0: under 1us; bucket I: [2^(I-1), 2^I) us */
+    if (0 != Micros)
+    {
+        _BitScanReverse64(&Index, Micros);
+        Index++;
+        if (SPD_IOCTL_STATS_HISTOGRAM_SIZE <= Index)
+            Index = SPD_IOCTL_STATS_HISTOGRAM_SIZE - 1;
+    }
+
+    InterlockedIncrement64(&Histogram[Index]);
+}
+
+static inline
+VOID SpdIoqRecordPostTime(SPD_IOQ *Ioq, SPD_IOQ_SHARD *Shard, UINT64 PostTime)
+{
+    LONG64 LastPostTime, Interval;
+
+    if (0 == Ioq->SpinTimeLimit)
+        return;
+
+    /* moving average (1/8 weight) of the shard's inter-arrival time; called with the shard lock */
+    LastPostTime = Shard->LastPostTime;
+    WriteNoFence64(&Shard->LastPostTime, (LONG64)PostTime);
+    if (0 == LastPostTime || (LONG64)PostTime <= LastPostTime)
+        return;
+    Interval = Shard->PostInterval;
+    WriteNoFence64(&Shard->PostInterval,
+        Interval + ((LONG64)PostTime - LastPostTime - Interval) / 8);
+}
+
+static inline
+UINT64 SpdIoqSpinTime(SPD_IOQ *Ioq)
+{
+    UINT64 Now, Rate = 0, Interval;
+
+    if (0 == Ioq->SpinTimeLimit)
+        return 0;
+
+    /*
+     * SRB's arrive on all shards; the queue's arrival rate is the sum of the shard rates.
+     * A shard that has not seen a post for a while says nothing about the next one.
+     */
+    Now = SpdIoqTime();
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+    {
+        LONG64 LastPostTime = ReadNoFence64(&Ioq->Shards[I].LastPostTime);
+        LONG64 ShardInterval = ReadNoFence64(&Ioq->Shards[I].PostInterval);
+
+        if (0 >= ShardInterval ||
+            ((LONG64)Now > LastPostTime && Now - LastPostTime > 2 * Ioq->SpinTimeLimit))
+            continue;
+        Rate += SPD_IOQ_RATE_SCALE / (UINT64)ShardInterval;
+    }
+    if (0 == Rate)
+        return 0;
+    Interval = SPD_IOQ_RATE_SCALE / Rate;
+    if (0 == Interval)
+        Interval = 1;
+
+    /*
+     * Spin for about twice the recent inter-arrival time, so that a dispatcher that has
+     * just responded picks up the next SRB without sleeping. If SRB's arrive slower than
+     * the limit, spinning would mostly burn CPU; sleep right away.
+     */
+    if (Ioq->SpinTimeLimit < Interval)
+        return 0;
+
+    return Ioq->SpinTimeLimit < 2 * Interval ? Ioq->SpinTimeLimit : 2 * Interval;
+}
+
+static inline
+BOOLEAN SpdIoqShardEmpty(SPD_IOQ_SHARD *Shard)
+{
+    for (ULONG L = 0; SpdIoqLaneCount > L; L++)
+    {
+        PLIST_ENTRY PendingList = &Shard->PendingList[L];
+        if (ReadPointerNoFence(&PendingList->Flink) != PendingList)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN SpdIoqReady(SPD_IOQ *Ioq)
+{
+    /* unlocked peek: is there a chunk that a dispatcher could claim? */
+    if (ReadBooleanNoFence(&Ioq->Stopped))
+        return TRUE;
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+    {
+        SPD_IOQ_SHARD *Shard = &Ioq->Shards[I];
+        if (!SpdIoqShardEmpty(Shard) && SPD_IOQ_SLOT_NONE != ReadULongNoFence(&Shard->SlotFree))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static inline
+VOID SpdIoqSignal(SPD_IOQ *Ioq, ULONG ShardIndex)
+{
+    /*
+     * Wake up a dispatcher of the shard; if none is waiting, wake up one that waits on
+     * another shard, so that it steals. The caller has published the shard's work with
+     * a full barrier; a waiter counts itself before it peeks (SpdIoqWaitSrb). So either
+     * we see the waiter or the waiter sees the work.
+     */
+    if (0 == ReadNoFence(&Ioq->Shards[ShardIndex].WaiterCount))
+        for (ULONG I = 1; Ioq->ShardCount > I; I++)
+        {
+            ULONG J = (ShardIndex + I) % Ioq->ShardCount;
+            if (0 != ReadNoFence(&Ioq->Shards[J].WaiterCount))
+            {
+                ShardIndex = J;
+                break;
+            }
+        }
+
+    SpdQeventSet(&Ioq->Shards[ShardIndex].PendingEvent);
+}
+
+static inline
+VOID SpdIoqSignalAll(SPD_IOQ *Ioq)
+{
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+        SpdQeventSet(&Ioq->Shards[I].PendingEvent);
+}
+
+static inline
+ULONG SpdIoqSelectLane(SPD_IOQ *Ioq, SPD_IOQ_SHARD *Shard)
+{
+    /* weighted round robin; called with the shard lock held */
+    for (ULONG Pass = 0; 2 > Pass; Pass++)
+    {
+        for (ULONG L = 0; SpdIoqLaneCount > L; L++)
+            if (0 < Shard->Credit[L] && !IsListEmpty(&Shard->PendingList[L]))
+                return L;
+
+        /* no non-empty lane has credit (or all lanes are empty); refill */
+        for (ULONG L = 0; SpdIoqLaneCount > L; L++)
+            Shard->Credit[L] = Ioq->LaneWeight[L];
+    }
+
+    return SpdIoqLaneCount;
+}
+
+static inline
+SPD_SRB_CHUNK *SpdIoqAllocSlot(SPD_IOQ *Ioq, SPD_SRB_EXTENSION *SrbExtension)
+{
+    /* called with the lock of the SRB's shard held */
+    SPD_IOQ_SHARD *Shard = &Ioq->Shards[SrbExtension->Shard];
+    ULONG Index = Shard->SlotFree;
+    SPD_IOQ_SLOT *Slot;
+
+    if (SPD_IOQ_SLOT_NONE == Index)
+        return 0;
+
+    Slot = &Ioq->Slots[Index];
+    Shard->SlotFree = Slot->NextFree;
+    Slot->NextFree = SPD_IOQ_SLOT_NONE;
+    RtlZeroMemory(&Slot->Chunk, sizeof Slot->Chunk);
+    Slot->Chunk.SrbExtension = SrbExtension;
+    Slot->Chunk.Hint = ((UINT64)Slot->Generation << 32) | Index;
+    InsertTailList(&SrbExtension->ChunkList, &Slot->Chunk.ChunkEntry);
+
+    return &Slot->Chunk;
+}
+
+static inline
+VOID SpdIoqFreeSlot(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk)
+{
+    ULONG Index = (ULONG)Chunk->Hint;
+    ULONG ShardIndex = Index / Ioq->ShardSlotCount;
+    SPD_IOQ_SHARD *Shard = &Ioq->Shards[ShardIndex];
+    SPD_IOQ_SLOT *Slot = &Ioq->Slots[Index];
+    BOOLEAN WasFull = SPD_IOQ_SLOT_NONE == Shard->SlotFree;
+
+    ASSERT(Ioq->SlotCount > Index && &Slot->Chunk == Chunk);
+    ASSERT(Chunk->SrbExtension->Shard == ShardIndex);
+
+    RemoveEntryList(&Slot->Chunk.ChunkEntry);
+    Slot->Chunk.SrbExtension = 0;
+    if (0 == ++Slot->Generation)
+        Slot->Generation = 1;
+    Slot->NextFree = Shard->SlotFree;
+    Shard->SlotFree = Index;
+
+    if (WasFull && 0 < Shard->PendingCount)
+    {
+        /* SRB's may be waiting for a slot; wake up a waiter */
+        KeMemoryBarrier();
+        SpdIoqSignal(Ioq, ShardIndex);
+    }
+}
+
+static VOID SpdIoqMergeChunks(SPD_IOQ *Ioq, SPD_IOQ_SHARD *Shard,
+    PLIST_ENTRY PendingList, SPD_SRB_CHUNK *Chunk)
+{
+    /* called with the shard lock held; Chunk spans its whole SRB */
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension, *NextSrbExtension;
+    SPD_SRB_CHUNK **PMergeNext = &Chunk->MergeNext, *NextChunk;
+    PLIST_ENTRY NextEntry, Flink;
+    ULONG MergeLength = Chunk->Length;
+
+    for (NextEntry = SrbExtension->ListEntry.Flink; PendingList != NextEntry; NextEntry = Flink)
+    {
+        Flink = NextEntry->Flink;
+
+        NextSrbExtension = CONTAINING_RECORD(NextEntry, SPD_SRB_EXTENSION, ListEntry);
+        ASSERT(SpdSrbPending == NextSrbExtension->State);
+        if (0 != NextSrbExtension->ChunkOffset ||
+            MergeLength + NextSrbExtension->SystemDataLength < MergeLength ||
+            MergeLength + NextSrbExtension->SystemDataLength > Chunk->SrbExtension->ChunkLength ||
+            !SpdSrbCanMerge(SrbExtension, NextSrbExtension))
+            break;
+
+        NextChunk = SpdIoqAllocSlot(Ioq, NextSrbExtension);
+        if (0 == NextChunk)
+            break;
+
+        NextChunk->State = SpdChunkMerged;
+        NextChunk->Offset = 0;
+        NextChunk->Length = NextSrbExtension->SystemDataLength;
+        NextChunk->MergeHead = Chunk;
+        NextChunk->MergeOffset = MergeLength;
+        *PMergeNext = NextChunk;
+        PMergeNext = &NextChunk->MergeNext;
+        MergeLength += NextChunk->Length;
+
+        /* the merged SRB is claimed whole; it leaves the queue */
+        NextSrbExtension->ChunkOffset = NextSrbExtension->SystemDataLength;
+        NextSrbExtension->ChunkCount++;
+        RemoveEntryList(&NextSrbExtension->ListEntry);
+        NextSrbExtension->ListEntry.Flink = NextSrbExtension->ListEntry.Blink = 0;
+        NextSrbExtension->State = SpdSrbDispatched;
+        InterlockedDecrement(&Shard->PendingCount);
+
+        SpdIoqRecordLatency(Ioq,
+            SpdIoqCurrentStats(Ioq)->QueueWaitHistogram, NextSrbExtension->PostTime);
+        InterlockedIncrement64(&SpdIoqCurrentStats(Ioq)->MergeCount);
+        if (++Shard->ProcessCount > Shard->ProcessCountMax)
+            Shard->ProcessCountMax = Shard->ProcessCount;
+
+        SrbExtension = NextSrbExtension;
+    }
+}
+
+static VOID SpdIoqUnmergeChunk(SPD_SRB_CHUNK *Chunk)
+{
+    SPD_SRB_CHUNK **PMergeNext;
+
+    /* called with the shard lock held; the head must be InFlight */
+    for (PMergeNext = &Chunk->MergeHead->MergeNext; Chunk != *PMergeNext;
+        PMergeNext = &(*PMergeNext)->MergeNext)
+        ASSERT(0 != *PMergeNext);
+    *PMergeNext = Chunk->MergeNext;
+    Chunk->MergeHead = 0;
+    Chunk->MergeNext = 0;
+}
+
+static inline
+SPD_SRB_CHUNK *SpdIoqLookupSlot(SPD_IOQ *Ioq, UINT64 Hint)
+{
+    ULONG Index = (ULONG)Hint;
+    SPD_IOQ_SLOT *Slot;
+
+    if (Ioq->SlotCount <= Index)
+        return 0;
+
+    Slot = &Ioq->Slots[Index];
+    if ((ULONG)(Hint >> 32) != Slot->Generation || 0 == Slot->Chunk.SrbExtension)
+        return 0;
+
+    return &Slot->Chunk;
+}
+
+NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
+    SPD_IOQ **PIoq)
 {
     SPD_IOQ *Ioq;
-    ULONG BucketCount = (PAGE_SIZE - sizeof *Ioq) / sizeof Ioq->ProcessBuckets[0];
+    ULONG ShardCount = SpdIoqShardCount;
+    ULONG ShardSlotCount = SPD_IOQ_SLOT_COUNT / ShardCount;
+    ULONG SlotCount;
+    ULONG StatsCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ULONG SpinTimeLimit = StorageUnitParams->SpinTimeLimit;
+    LARGE_INTEGER PerformanceFrequency;
 
     *PIoq = 0;
 
-    Ioq = SpdAllocNonPaged(PAGE_SIZE, SpdTagIoq);
+    if (SPD_IOQ_SHARD_SLOT_MIN > ShardSlotCount)
+        ShardSlotCount = SPD_IOQ_SHARD_SLOT_MIN;
+    SlotCount = ShardCount * ShardSlotCount;
+
+    Ioq = SpdAllocNonPaged(sizeof *Ioq, SpdTagIoq);
     if (0 == Ioq)
         return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(Ioq, PAGE_SIZE);
+    RtlZeroMemory(Ioq, sizeof *Ioq);
+
+    Ioq->Shards = SpdAllocNonPaged(ShardCount * sizeof Ioq->Shards[0], SpdTagIoq);
+    if (0 == Ioq->Shards)
+    {
+        SpdFree(Ioq, SpdTagIoq);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Ioq->Shards, ShardCount * sizeof Ioq->Shards[0]);
+
+    Ioq->Slots = SpdAllocNonPaged(SlotCount * sizeof Ioq->Slots[0], SpdTagIoq);
+    if (0 == Ioq->Slots)
+    {
+        SpdFree(Ioq->Shards, SpdTagIoq);
+        SpdFree(Ioq, SpdTagIoq);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Ioq->Stats = SpdAllocNonPaged(StatsCount * sizeof Ioq->Stats[0], SpdTagIoq);
+    if (0 == Ioq->Stats)
+    {
+        SpdFree(Ioq->Slots, SpdTagIoq);
+        SpdFree(Ioq->Shards, SpdTagIoq);
+        SpdFree(Ioq, SpdTagIoq);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Ioq->Stats, StatsCount * sizeof Ioq->Stats[0]);
+
+    /* each shard has a free list of its own slots */
+    for (ULONG I = 0; SlotCount > I; I++)
+    {
+        Ioq->Slots[I].Chunk.SrbExtension = 0;
+        Ioq->Slots[I].Generation = 1;
+        Ioq->Slots[I].NextFree = 0 != (I + 1) % ShardSlotCount ? I + 1 : SPD_IOQ_SLOT_NONE;
+    }
 
     Ioq->DeviceExtension = DeviceExtension;
-    KeInitializeSpinLock(&Ioq->SpinLock);
-    SpdQeventInitialize(&Ioq->PendingEvent, 0);
-    InitializeListHead(&Ioq->PendingList);
-    InitializeListHead(&Ioq->ProcessList);
-    Ioq->ProcessBucketCount = BucketCount;
+    Ioq->ShardCount = ShardCount;
+    Ioq->MergeSequential = !!StorageUnitParams->MergeSequential;
+    Ioq->LaneWeight[SpdIoqLaneHigh] = 0 != StorageUnitParams->HighPriorityWeight ?
+        StorageUnitParams->HighPriorityWeight : SPD_IOQ_LANE_WEIGHT_HIGH;
+    Ioq->LaneWeight[SpdIoqLaneNormal] = 0 != StorageUnitParams->NormalPriorityWeight ?
+        StorageUnitParams->NormalPriorityWeight : SPD_IOQ_LANE_WEIGHT_NORMAL;
+    Ioq->LaneWeight[SpdIoqLaneLow] = 0 != StorageUnitParams->LowPriorityWeight ?
+        StorageUnitParams->LowPriorityWeight : SPD_IOQ_LANE_WEIGHT_LOW;
+    for (ULONG I = 0; ShardCount > I; I++)
+    {
+        KeInitializeSpinLock(&Ioq->Shards[I].SpinLock);
+        for (ULONG L = 0; SpdIoqLaneCount > L; L++)
+        {
+            InitializeListHead(&Ioq->Shards[I].PendingList[L]);
+            Ioq->Shards[I].Credit[L] = Ioq->LaneWeight[L];
+        }
+        Ioq->Shards[I].SlotFree = I * ShardSlotCount;
+        SpdQeventInitialize(&Ioq->Shards[I].PendingEvent, 0);
+    }
+    Ioq->SlotCount = SlotCount;
+    Ioq->ShardSlotCount = ShardSlotCount;
+    Ioq->StatsCount = StatsCount;
+    KeQueryPerformanceCounter(&PerformanceFrequency);
+    Ioq->PerformanceFrequency = PerformanceFrequency.QuadPart;
+    if (SPD_IOQ_SPIN_TIME_MAX < SpinTimeLimit)
+        SpinTimeLimit = SPD_IOQ_SPIN_TIME_MAX;
+    Ioq->SpinTimeLimit = SpinTimeLimit * Ioq->PerformanceFrequency / 1000000;
 
     *PIoq = Ioq;
 
@@ -48,45 +490,173 @@ NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq)
 VOID SpdIoqDelete(SPD_IOQ *Ioq)
 {
     SpdIoqReset(Ioq, FALSE);
-    SpdQeventFinalize(&Ioq->PendingEvent);
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+        SpdQeventFinalize(&Ioq->Shards[I].PendingEvent);
+    SpdFree(Ioq->Stats, SpdTagIoq);
+    SpdFree(Ioq->Slots, SpdTagIoq);
+    SpdFree(Ioq->Shards, SpdTagIoq);
     SpdFree(Ioq, SpdTagIoq);
 }
 
+static VOID SpdIoqCompleteSrb(SPD_IOQ *Ioq, SPD_SRB_EXTENSION *SrbExtension, UCHAR SrbStatus)
+{
+    SPD_IOQ_STATS *Stats = SpdIoqCurrentStats(Ioq);
+
+    InterlockedIncrement64(&Stats->CompleteCount[SrbExtension->Kind]);
+    switch (SRB_STATUS(SrbStatus))
+    {
+    case SRB_STATUS_SUCCESS:
+        InterlockedAdd64(&Stats->ByteCount[SrbExtension->Kind], SrbExtension->SystemDataLength);
+        break;
+    case SRB_STATUS_ABORTED:
+        InterlockedIncrement64(&Stats->AbortCount);
+        break;
+    default:
+        InterlockedIncrement64(&Stats->ErrorCount);
+        break;
+    }
+
+    /* an SRB that failed or was aborted (e.g. by a reset) may have to undo its effects */
+    if (SRB_STATUS_SUCCESS != SRB_STATUS(SrbStatus))
+        SpdSrbExecuteScsiRollback(SrbExtension);
+
+    if (SrbExtension->SystemDataBufferOwned)
+    {
+        SpdFree(SrbExtension->SystemDataBuffer, SpdTagSrbBuffer);
+        SrbExtension->SystemDataBuffer = 0;
+        SrbExtension->SystemDataBufferOwned = FALSE;
+    }
+
+    SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbStatus);
+}
+
+static VOID SpdIoqEndChunk(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk, UCHAR SrbStatus)
+{
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+
+    /* a request that ends while it still has merged chunks ends as a whole (abort) */
+    while (0 != Chunk->MergeNext)
+    {
+        SPD_SRB_CHUNK *MergedChunk = Chunk->MergeNext;
+        Chunk->MergeNext = MergedChunk->MergeNext;
+        MergedChunk->MergeHead = 0;
+        MergedChunk->MergeNext = 0;
+        SpdIoqEndChunk(Ioq, MergedChunk, SRB_STATUS_ABORTED);
+    }
+
+    SpdIoqFreeSlot(Ioq, Chunk);
+    Ioq->Shards[SrbExtension->Shard].ProcessCount--;
+
+    /* the first error wins; the SRB completes when its last chunk ends */
+    if (SRB_STATUS_SUCCESS != SrbStatus && SRB_STATUS_SUCCESS == SrbExtension->SrbStatus)
+        SrbExtension->SrbStatus = SrbStatus;
+
+    ASSERT(0 < SrbExtension->ChunkCount);
+    if (0 == --SrbExtension->ChunkCount && SpdSrbDispatched == SrbExtension->State)
+        SpdIoqCompleteSrb(Ioq, SrbExtension,
+            SrbExtension->Aborted ? SRB_STATUS_ABORTED : SrbExtension->SrbStatus);
+}
+
+static VOID SpdIoqAbortChunk(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk)
+{
+    /*
+     * A chunk that is Claimed or Completing has its data being copied outside the lock.
+     * We cannot end it here; instead mark it Aborted and let the thread that owns
+     * the copy end it once it reacquires the lock.
+     */
+    switch (Chunk->State)
+    {
+    case SpdChunkClaimed:
+    case SpdChunkCompleting:
+        Chunk->State = SpdChunkAborted;
+        break;
+
+    case SpdChunkInFlight:
+        if (0 != Chunk->MappedDataBuffer)
+            Chunk->State = SpdChunkAbortedMapped;
+        else
+            SpdIoqEndChunk(Ioq, Chunk, SRB_STATUS_ABORTED);
+        break;
+
+    case SpdChunkMerged:
+        /* the owner of the head ends merged chunks; nobody owns an InFlight head */
+        if (SpdChunkInFlight == Chunk->MergeHead->State)
+        {
+            SpdIoqUnmergeChunk(Chunk);
+            SpdIoqEndChunk(Ioq, Chunk, SRB_STATUS_ABORTED);
+        }
+        break;
+    }
+}
+
+static VOID SpdIoqAbortSrb(SPD_IOQ *Ioq, SPD_SRB_EXTENSION *SrbExtension)
+{
+    ULONG ChunkCount = SrbExtension->ChunkCount;
+
+    /* caller has removed the SRB from its PendingList; no more chunks are claimed */
+    SrbExtension->ListEntry.Flink = SrbExtension->ListEntry.Blink = 0;
+    SrbExtension->State = SpdSrbDispatched;
+    SrbExtension->Aborted = TRUE;
+
+    if (0 == ChunkCount)
+    {
+        SpdIoqCompleteSrb(Ioq, SrbExtension, SRB_STATUS_ABORTED);
+        return;
+    }
+
+    /*
+     * The SRB completes when its last chunk ends; this may happen during the loop, so
+     * the loop counts chunks rather than test for the end of the SRB's ChunkList.
+     */
+    for (PLIST_ENTRY ChunkEntry = SrbExtension->ChunkList.Flink, Flink;
+        0 < ChunkCount; ChunkEntry = Flink)
+    {
+        Flink = ChunkEntry->Flink;
+        ChunkCount--;
+        SpdIoqAbortChunk(Ioq, CONTAINING_RECORD(ChunkEntry, SPD_SRB_CHUNK, ChunkEntry));
+    }
+}
+
 VOID SpdIoqReset(SPD_IOQ *Ioq, BOOLEAN Stop)
 {
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    Irql = SpdIoqAcquireAll(Ioq);
 
     if (!Ioq->Stopped)
     {
-        PLIST_ENTRY PendingEntry, ProcessEntry, Flink;
-
-        PendingEntry = Ioq->PendingList.Flink;
-        ProcessEntry = Ioq->ProcessList.Flink;
+        PLIST_ENTRY PendingEntry, Flink;
 
-        InitializeListHead(&Ioq->PendingList);
-        InitializeListHead(&Ioq->ProcessList);
-        RtlZeroMemory(Ioq->ProcessBuckets,
-            Ioq->ProcessBucketCount * sizeof Ioq->ProcessBuckets[0]);
+        for (ULONG I = 0; Ioq->ShardCount > I; I++)
+            Ioq->Shards[I].PendingCount = 0;
 
-        for (; PendingEntry != &Ioq->PendingList; PendingEntry = Flink)
+        for (ULONG I = 0; Ioq->ShardCount * SpdIoqLaneCount > I; I++)
         {
-            /* store Flink now, because *PendingEntry becomes invalid after SpdSrbComplete */
-            Flink = PendingEntry->Flink;
-            SpdSrbComplete(
-                Ioq->DeviceExtension,
-                CONTAINING_RECORD(PendingEntry, SPD_SRB_EXTENSION, ListEntry)->Srb,
-                SRB_STATUS_ABORTED);
+            PLIST_ENTRY PendingList =
+                &Ioq->Shards[I / SpdIoqLaneCount].PendingList[I % SpdIoqLaneCount];
+
+            PendingEntry = PendingList->Flink;
+            InitializeListHead(PendingList);
+
+            for (; PendingEntry != PendingList; PendingEntry = Flink)
+            {
+                /* store Flink now, because *PendingEntry becomes invalid after SpdSrbComplete */
+                Flink = PendingEntry->Flink;
+                SpdIoqAbortSrb(Ioq,
+                    CONTAINING_RECORD(PendingEntry, SPD_SRB_EXTENSION, ListEntry));
+            }
         }
-        for (; ProcessEntry != &Ioq->ProcessList; ProcessEntry = Flink)
+
+        /* the remaining chunks belong to SRB's that are no longer pending */
+        for (ULONG I = 0; Ioq->SlotCount > I; I++)
         {
-            /* store Flink now, because *ProcessEntry becomes invalid after SpdSrbComplete */
-            Flink = ProcessEntry->Flink;
-            SpdSrbComplete(
-                Ioq->DeviceExtension,
-                CONTAINING_RECORD(ProcessEntry, SPD_SRB_EXTENSION, ListEntry)->Srb,
-                SRB_STATUS_ABORTED);
+            SPD_SRB_CHUNK *Chunk = &Ioq->Slots[I].Chunk;
+
+            if (0 != Chunk->SrbExtension)
+            {
+                Chunk->SrbExtension->Aborted = TRUE;
+                SpdIoqAbortChunk(Ioq, Chunk);
+            }
         }
 
         if (Stop)
@@ -94,62 +664,73 @@ VOID SpdIoqReset(SPD_IOQ *Ioq, BOOLEAN Stop)
             Ioq->Stopped = TRUE;
 
             /* we are being stopped, permanently wake up waiters */
-            SpdQeventSetNoLock(&Ioq->PendingEvent);
+            SpdIoqSignalAll(Ioq);
         }
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    SpdIoqReleaseAll(Ioq, Irql);
 }
 
 BOOLEAN SpdIoqStopped(SPD_IOQ *Ioq)
 {
+    SPD_IOQ_SHARD *Shard;
     BOOLEAN Result;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    /* any shard lock will do; take the one that is most likely local */
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    Shard = &Ioq->Shards[SpdIoqCurrentShard(Ioq)];
+    KeAcquireSpinLockAtDpcLevel(&Shard->SpinLock);
 
     Result = Ioq->Stopped;
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    KeReleaseSpinLockFromDpcLevel(&Shard->SpinLock);
+    KeLowerIrql(Irql);
 
     return Result;
 }
 
+UINT32 SpdIoqPendingDepth(SPD_IOQ *Ioq)
+{
+    /* unsynchronized; a hint for user mode dispatchers that size themselves */
+    LONG PendingCount = 0;
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+        PendingCount += ReadNoFence(&Ioq->Shards[I].PendingCount);
+    return 0 < PendingCount ? (UINT32)PendingCount : 0;
+}
+
 NTSTATUS SpdIoqCancelSrb(SPD_IOQ *Ioq, PVOID Srb)
 {
     NTSTATUS Result = STATUS_UNSUCCESSFUL;
+    SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb);
+    SPD_IOQ_SHARD *Shard;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    ASSERT(Ioq->ShardCount > SrbExtension->Shard);
+    Shard = &Ioq->Shards[SrbExtension->Shard];
+
+    /* the SRB and its chunks are protected by the lock of its shard */
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
 
     if (!Ioq->Stopped)
     {
-        SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb);
-        ULONG Index;
-
         ASSERT(Srb == SrbExtension->Srb);
 
-        Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-        for (PVOID *P = &Ioq->ProcessBuckets[Index]; *P; P = &((SPD_SRB_EXTENSION *)(*P))->HashNext)
-            if (*P == SrbExtension)
+        if (!SrbExtension->Aborted)
+        {
+            if (SpdSrbPending == SrbExtension->State)
             {
-                *P = SrbExtension->HashNext;
-                SrbExtension->HashNext = 0;
-
-                break;
+                RemoveEntryList(&SrbExtension->ListEntry);
+                InterlockedDecrement(&Shard->PendingCount);
             }
 
-        RemoveEntryList(&SrbExtension->ListEntry);
-        SrbExtension->ListEntry.Flink = SrbExtension->ListEntry.Blink = 0;
-
-        SrbExtension->Srb = 0;
-
-        SpdSrbComplete(Ioq->DeviceExtension, Srb, SRB_STATUS_ABORTED);
+            SpdIoqAbortSrb(Ioq, SrbExtension);
+        }
 
         Result = STATUS_SUCCESS;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
 
     return Result;
 }
@@ -157,9 +738,17 @@ NTSTATUS SpdIoqCancelSrb(SPD_IOQ *Ioq, PVOID Srb)
 NTSTATUS SpdIoqPostSrb(SPD_IOQ *Ioq, PVOID Srb)
 {
     NTSTATUS Result = STATUS_CANCELLED;
+    SPD_IOQ_SHARD *Shard;
+    ULONG ShardIndex;
+    LONG PendingCount;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    ShardIndex = SpdIoqCurrentShard(Ioq);
+    Shard = &Ioq->Shards[ShardIndex];
+
+    KeAcquireSpinLockAtDpcLevel(&Shard->SpinLock);
 
     if (!Ioq->Stopped)
     {
@@ -167,129 +756,387 @@ NTSTATUS SpdIoqPostSrb(SPD_IOQ *Ioq, PVOID Srb)
 
         ASSERT(0 == SrbExtension->Srb);
         SrbExtension->Srb = Srb;
+        SrbExtension->State = SpdSrbPending;
+        SrbExtension->ChunkOffset = 0;
+        SrbExtension->ChunkCount = 0;
+        InitializeListHead(&SrbExtension->ChunkList);
+        SrbExtension->Aborted = FALSE;
+        SrbExtension->SrbStatus = SRB_STATUS_SUCCESS;
+        SrbExtension->Shard = ShardIndex;
+        SrbExtension->PostTime = SpdIoqTime();
+        SpdIoqRecordPostTime(Ioq, Shard, SrbExtension->PostTime);
 
         ASSERT(0 == SrbExtension->ListEntry.Flink && 0 == SrbExtension->ListEntry.Blink);
-        InsertTailList(&Ioq->PendingList, &SrbExtension->ListEntry);
-
-        /* queue is not empty; wake up a waiter */
-        SpdQeventSetNoLock(&Ioq->PendingEvent);
+        ASSERT(SpdIoqLaneCount > SrbExtension->Lane);
+        InsertTailList(&Shard->PendingList[SrbExtension->Lane], &SrbExtension->ListEntry);
+        PendingCount = InterlockedIncrement(&Shard->PendingCount);
+        if (PendingCount > Shard->PendingCountMax)
+            Shard->PendingCountMax = PendingCount;
+        InterlockedIncrement64(&SpdIoqCurrentStats(Ioq)->PostCount[SrbExtension->Kind]);
 
         Result = STATUS_SUCCESS;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    KeReleaseSpinLockFromDpcLevel(&Shard->SpinLock);
+
+    if (STATUS_SUCCESS == Result)
+        /* queue is not empty; wake up a waiter */
+        SpdIoqSignal(Ioq, ShardIndex);
+
+    KeLowerIrql(Irql);
 
     return Result;
 }
 
-NTSTATUS SpdIoqStartProcessingSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp,
-    VOID (*Prepare)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
-    PVOID Context, PVOID DataBuffer)
+NTSTATUS SpdIoqWaitSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp)
 {
+    SPD_IOQ_SHARD *Shard = &Ioq->Shards[SpdIoqCurrentShard(Ioq)];
     NTSTATUS Result;
-    KIRQL Irql;
 
-    Result = SpdQeventCancellableWait(&Ioq->PendingEvent, Timeout, CancellableIrp);
+    /* count ourselves before we peek; see SpdIoqSignal */
+    InterlockedIncrement(&Shard->WaiterCount);
+    if (!SpdIoqReady(Ioq))
+        Result = SpdQeventCancellableWait(&Shard->PendingEvent,
+            SpdIoqSpinTime(Ioq), Timeout, CancellableIrp);
+    else
+        Result = STATUS_SUCCESS;
+    InterlockedDecrement(&Shard->WaiterCount);
+
     if (STATUS_TIMEOUT == Result)
         return STATUS_TIMEOUT;
     if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
         return STATUS_CANCELLED;
     ASSERT(STATUS_SUCCESS == Result);
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS SpdIoqTryStartProcessingSrb(SPD_IOQ *Ioq,
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer)
+{
+    ASSERT(DISPATCH_LEVEL >= KeGetCurrentIrql());
 
-    if (!Ioq->Stopped)
+    SPD_SRB_CHUNK *Chunk = 0;
+    SPD_STORAGE_UNIT *MappedStorageUnit = 0;
+    SPD_IOQ_SHARD *Shard = 0;
+    BOOLEAN Stopped = FALSE, Signal = FALSE;
+    ULONG HomeIndex, ShardIndex = 0;
+    NTSTATUS Result;
+    KIRQL Irql;
+
+    /*
+     * Start with the shard of the current processor; steal from the others if it is empty.
+     * A shard that is out of slots is skipped; SpdIoqFreeSlot will wake up a waiter.
+     */
+    HomeIndex = SpdIoqCurrentShard(Ioq);
+    for (ULONG I = 0; Ioq->ShardCount > I && 0 == Chunk && !Stopped; I++)
     {
         PLIST_ENTRY PendingEntry;
+        ULONG Lane;
+
+        ShardIndex = (HomeIndex + I) % Ioq->ShardCount;
+        Shard = &Ioq->Shards[ShardIndex];
+
+        /* unlocked peek; a racing post will wake up a waiter */
+        if (0 != I && SpdIoqShardEmpty(Shard))
+            continue;
 
-        PendingEntry = &Ioq->PendingList;
-        if (PendingEntry->Flink != PendingEntry)
+        KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+
+        if (!Ioq->Stopped)
         {
-            SPD_SRB_EXTENSION *SrbExtension =
-                CONTAINING_RECORD(PendingEntry->Flink, SPD_SRB_EXTENSION, ListEntry);
-            BOOLEAN Wake;
-            ULONG Index;
-
-            Wake = !RemoveEntryList(&SrbExtension->ListEntry);
-
-            Prepare(SrbExtension, Context, DataBuffer);
-
-            InsertTailList(&Ioq->ProcessList, &SrbExtension->ListEntry);
-            Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-#if DBG
-            for (PVOID X = Ioq->ProcessBuckets[Index]; X; X = ((SPD_SRB_EXTENSION *)X)->HashNext)
-                ASSERT(X != SrbExtension);
-            ASSERT(0 == SrbExtension->HashNext);
-#endif
-            SrbExtension->HashNext = Ioq->ProcessBuckets[Index];
-            Ioq->ProcessBuckets[Index] = SrbExtension;
-
-            if (Wake)
-                /* queue is not empty; wake up a waiter */
-                SpdQeventSetNoLock(&Ioq->PendingEvent);
-
-            Result = STATUS_SUCCESS;
+            Lane = SpdIoqSelectLane(Ioq, Shard);
+            if (SpdIoqLaneCount != Lane)
+            {
+                PendingEntry = &Shard->PendingList[Lane];
+
+                SPD_SRB_EXTENSION *SrbExtension =
+                    CONTAINING_RECORD(PendingEntry->Flink, SPD_SRB_EXTENSION, ListEntry);
+                ASSERT(SpdSrbPending == SrbExtension->State);
+
+                /* claim the next chunk; it goes into a slot so that reset/cancel can find it */
+                Chunk = SpdIoqAllocSlot(Ioq, SrbExtension);
+                if (0 != Chunk)
+                {
+                    Chunk->State = SpdChunkClaimed;
+                    Shard->Credit[Lane]--;
+                    Chunk->Offset = SrbExtension->ChunkOffset;
+                    Chunk->Length = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
+                    if (0 != SrbExtension->ChunkLength && Chunk->Length > SrbExtension->ChunkLength)
+                        Chunk->Length = SrbExtension->ChunkLength;
+                    SrbExtension->ChunkOffset += Chunk->Length;
+                    SrbExtension->ChunkCount++;
+
+                    if (0 == Chunk->Offset)
+                        SpdIoqRecordLatency(Ioq,
+                            SpdIoqCurrentStats(Ioq)->QueueWaitHistogram, SrbExtension->PostTime);
+                    else
+                        InterlockedIncrement64(&SpdIoqCurrentStats(Ioq)->SplitCount);
+                    if (++Shard->ProcessCount > Shard->ProcessCountMax)
+                        Shard->ProcessCountMax = Shard->ProcessCount;
+
+                    if (Ioq->MergeSequential &&
+                        0 == Chunk->Offset && Chunk->Length == SrbExtension->SystemDataLength)
+                        SpdIoqMergeChunks(Ioq, Shard, PendingEntry, Chunk);
+
+                    if (SrbExtension->ChunkOffset >= SrbExtension->SystemDataLength)
+                    {
+                        /* last chunk claimed; the SRB leaves the queue */
+                        RemoveEntryList(&SrbExtension->ListEntry);
+                        SrbExtension->ListEntry.Flink = SrbExtension->ListEntry.Blink = 0;
+                        SrbExtension->State = SpdSrbDispatched;
+
+                        /* queue is not empty; wake up a waiter */
+                        Signal = 0 < InterlockedDecrement(&Shard->PendingCount);
+                    }
+                    else
+                        /* the SRB stays at the head; wake up a waiter to claim its next chunk */
+                        Signal = TRUE;
+                }
+            }
         }
         else
-            Result = STATUS_UNSUCCESSFUL;
+            Stopped = TRUE;
+
+        KeReleaseSpinLock(&Shard->SpinLock, Irql);
+    }
+
+    if (Stopped)
+        /* queue is stopped; wake up the waiters */
+        SpdIoqSignalAll(Ioq);
+    else if (Signal)
+        SpdIoqSignal(Ioq, ShardIndex);
+
+    if (0 == Chunk)
+        return Stopped ? STATUS_CANCELLED : STATUS_UNSUCCESSFUL;
+
+    /* copy data without holding the lock; the Claimed state keeps the chunk alive */
+    Prepare(Chunk, Context, DataBuffer);
+
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+
+    if (SpdChunkAborted == Chunk->State && 0 != Chunk->MappedDataBuffer)
+    {
+        /* chunk was aborted while we were mapping it; the Aborted state keeps it alive */
+        KeReleaseSpinLock(&Shard->SpinLock, Irql);
+        MappedStorageUnit = Chunk->SrbExtension->StorageUnit;
+        SpdSrbUnmapDataBuffer(Ioq->DeviceExtension, Chunk);
+        KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    }
+
+    if (SpdChunkAborted != Chunk->State)
+    {
+        ASSERT(SpdChunkClaimed == Chunk->State);
+        Chunk->State = SpdChunkInFlight;
+        Chunk->StartTime = SpdIoqTime();
+
+        Result = STATUS_SUCCESS;
     }
     else
     {
-        /* queue is stopped; wake up a waiter */
-        SpdQeventSetNoLock(&Ioq->PendingEvent);
+        /* chunk was aborted while we were preparing it; we own its end */
+        SpdIoqEndChunk(Ioq, Chunk, SRB_STATUS_ABORTED);
 
-        Result = STATUS_CANCELLED;
+        Result = STATUS_UNSUCCESSFUL;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+
+    if (0 != MappedStorageUnit)
+        SpdStorageUnitDereference(Ioq->DeviceExtension, MappedStorageUnit);
 
     return Result;
 }
 
+NTSTATUS SpdIoqStartProcessingSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp,
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer)
+{
+    NTSTATUS Result;
+
+    Result = SpdIoqWaitSrb(Ioq, Timeout, CancellableIrp);
+    if (STATUS_SUCCESS != Result)
+        return Result;
+
+    return SpdIoqTryStartProcessingSrb(Ioq, Prepare, Context, DataBuffer);
+}
+
 VOID SpdIoqEndProcessingSrb(SPD_IOQ *Ioq, UINT64 Hint,
-    UCHAR (*Complete)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
     PVOID Context, PVOID DataBuffer)
 {
+    SPD_IOQ_SHARD *Shard = SpdIoqSlotShard(Ioq, Hint);
+    SPD_SRB_CHUNK *Chunk;
+    SPD_STORAGE_UNIT *MappedStorageUnit = 0;
+    BOOLEAN Aborted = FALSE;
+    UCHAR SrbStatus;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    if (0 == Shard)
+        /* forged hint */
+        return;
+
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+
+    Chunk = SpdIoqLookupSlot(Ioq, Hint);
+    if (0 != Chunk &&
+        (SpdChunkInFlight == Chunk->State || SpdChunkAbortedMapped == Chunk->State) &&
+        0 != Chunk->MappedDataBuffer && PsGetCurrentProcess() != Chunk->MappedProcess)
+        /* only the process that the chunk data is mapped into can remove the mapping */
+        Chunk = 0;
+    else if (0 != Chunk && !Ioq->Stopped && SpdChunkInFlight == Chunk->State)
+        Chunk->State = SpdChunkCompleting;
+    else if (0 != Chunk && SpdChunkAbortedMapped == Chunk->State)
+    {
+        /* chunk was aborted while mapped; we own its unmapping and end */
+        Chunk->State = SpdChunkCompleting;
+        Aborted = TRUE;
+    }
+    else
+        /* stale or forged hint; or chunk is already being completed */
+        Chunk = 0;
 
-    if (!Ioq->Stopped)
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+
+    if (0 == Chunk)
+        return;
+
+    /*
+     * Copy data without holding the lock; the Completing state keeps the chunk alive.
+     * Other chunks of the same SRB may be completing concurrently; each chunk only
+     * touches its own window of the SRB data buffer.
+     */
+    if (!Aborted)
     {
-        SPD_SRB_EXTENSION *SrbExtension = (PVOID)(UINT_PTR)Hint;
-        ULONG Index;
+        SPD_SRB_CHUNK *MergedChunk;
 
-        Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-        for (PVOID *P = &Ioq->ProcessBuckets[Index]; *P; P = &((SPD_SRB_EXTENSION *)(*P))->HashNext)
-            if (*P == SrbExtension)
-            {
-                *P = SrbExtension->HashNext;
+        SpdIoqRecordLatency(Ioq, SpdIoqCurrentStats(Ioq)->ServiceTimeHistogram, Chunk->StartTime);
 
-                RemoveEntryList(&SrbExtension->ListEntry);
+        /* merged chunks complete from their window of the request data buffer */
+        while (0 != (MergedChunk = Chunk->MergeNext))
+        {
+            SrbStatus = Complete(MergedChunk, Context,
+                0 != DataBuffer ? (PUINT8)DataBuffer + MergedChunk->MergeOffset : 0);
+            ASSERT(SRB_STATUS_PENDING != SrbStatus);
+
+            KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+            Chunk->MergeNext = MergedChunk->MergeNext;
+            MergedChunk->MergeHead = 0;
+            MergedChunk->MergeNext = 0;
+            SpdIoqEndChunk(Ioq, MergedChunk, SrbStatus);
+            KeReleaseSpinLock(&Shard->SpinLock, Irql);
+        }
 
-                UCHAR SrbStatus = Complete(SrbExtension, Context, DataBuffer);
-                if (SRB_STATUS_PENDING == SrbStatus)
-                {
-                    /*
-                     * If Complete returns PENDING we need to repost the SRB
-                     * and we will also place it at the queue head, so that it
-                     * gets picked up immediately after.
-                     *
-                     * This functionality supports splitting SRB's into chunks,
-                     * which is required for I/O that exceeds our MaxTransferLength.
-                     * See https://tinyurl.com/ychyv62s
-                     */
-                    InsertHeadList(&Ioq->PendingList, &SrbExtension->ListEntry);
-
-                    /* queue is not empty; wake up a waiter */
-                    SpdQeventSetNoLock(&Ioq->PendingEvent);
-                }
-                else
-                    SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbStatus);
+        SrbStatus = Complete(Chunk, Context, DataBuffer);
+    }
+    else
+        SrbStatus = SRB_STATUS_ABORTED;
+    ASSERT(SRB_STATUS_PENDING != SrbStatus);
 
-                break;
-            }
+    if (0 != Chunk->MappedDataBuffer)
+    {
+        /* the mapping must be gone before the SRB completes */
+        MappedStorageUnit = Chunk->SrbExtension->StorageUnit;
+        SpdSrbUnmapDataBuffer(Ioq->DeviceExtension, Chunk);
+    }
+
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+
+    /* if the chunk was aborted while we were completing it, the SRB completes as aborted */
+    SpdIoqEndChunk(Ioq, Chunk, SrbStatus);
+
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+
+    if (0 != MappedStorageUnit)
+        SpdStorageUnitDereference(Ioq->DeviceExtension, MappedStorageUnit);
+}
+
+BOOLEAN SpdIoqIsChunkMapped(SPD_IOQ *Ioq, UINT64 Hint)
+{
+    SPD_IOQ_SHARD *Shard = SpdIoqSlotShard(Ioq, Hint);
+    SPD_SRB_CHUNK *Chunk;
+    BOOLEAN Result;
+    KIRQL Irql;
+
+    if (0 == Shard)
+        return FALSE;
+
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+
+    Chunk = SpdIoqLookupSlot(Ioq, Hint);
+    Result = 0 != Chunk &&
+        (SpdChunkInFlight == Chunk->State || SpdChunkAbortedMapped == Chunk->State) &&
+        0 != Chunk->MappedDataBuffer;
+
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+
+    return Result;
+}
+
+VOID SpdIoqReleaseMappedChunk(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+    ASSERT(PsGetCurrentProcess() == Chunk->MappedProcess);
+
+    SPD_IOQ_SHARD *Shard = SpdIoqSlotShard(Ioq, Chunk->Hint);
+    BOOLEAN Aborted;
+    KIRQL Irql;
+
+    /*
+     * The mapping process is exiting and cannot respond anymore; nobody else can
+     * end the chunk. Remove the mapping; end the chunk if it was aborted,
+     * otherwise leave it InFlight as we would for an unmapped chunk.
+     */
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    ASSERT(SpdChunkInFlight == Chunk->State || SpdChunkAbortedMapped == Chunk->State);
+    Aborted = SpdChunkAbortedMapped == Chunk->State;
+    Chunk->State = SpdChunkCompleting;
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+
+    SpdSrbUnmapDataBuffer(Ioq->DeviceExtension, Chunk);
+
+    KeAcquireSpinLock(&Shard->SpinLock, &Irql);
+    if (Aborted || SpdChunkAborted == Chunk->State)
+        SpdIoqEndChunk(Ioq, Chunk, SRB_STATUS_ABORTED);
+    else
+        Chunk->State = SpdChunkInFlight;
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
+}
+
+VOID SpdIoqGetStats(SPD_IOQ *Ioq, SPD_IOCTL_STORAGE_UNIT_STATS *Stats)
+{
+    /* counters are not read atomically as a set; this is good enough for monitoring */
+    RtlZeroMemory(Stats, sizeof *Stats);
+    for (ULONG I = 0; Ioq->StatsCount > I; I++)
+    {
+        SPD_IOQ_STATS *CpuStats = &Ioq->Stats[I];
+
+        for (ULONG J = 0; SPD_IOCTL_STATS_KIND_CAPACITY > J; J++)
+        {
+            Stats->PostCount[J] += ReadNoFence64(&CpuStats->PostCount[J]);
+            Stats->CompleteCount[J] += ReadNoFence64(&CpuStats->CompleteCount[J]);
+            Stats->ByteCount[J] += ReadNoFence64(&CpuStats->ByteCount[J]);
+        }
+        Stats->ErrorCount += ReadNoFence64(&CpuStats->ErrorCount);
+        Stats->AbortCount += ReadNoFence64(&CpuStats->AbortCount);
+        Stats->SplitCount += ReadNoFence64(&CpuStats->SplitCount);
+        Stats->MergeCount += ReadNoFence64(&CpuStats->MergeCount);
+        for (ULONG J = 0; SPD_IOCTL_STATS_HISTOGRAM_SIZE > J; J++)
+        {
+            Stats->QueueWaitHistogram[J] += ReadNoFence64(&CpuStats->QueueWaitHistogram[J]);
+            Stats->ServiceTimeHistogram[J] += ReadNoFence64(&CpuStats->ServiceTimeHistogram[J]);
+        }
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    /* depths are summed over the shards; the maxima are the sums of the shard maxima */
+    for (ULONG I = 0; Ioq->ShardCount > I; I++)
+    {
+        SPD_IOQ_SHARD *Shard = &Ioq->Shards[I];
+
+        Stats->PendingDepth += (UINT32)ReadNoFence(&Shard->PendingCount);
+        Stats->PendingDepthMax += (UINT32)ReadNoFence(&Shard->PendingCountMax);
+        Stats->ProcessDepth += (UINT32)ReadNoFence(&Shard->ProcessCount);
+        Stats->ProcessDepthMax += (UINT32)ReadNoFence(&Shard->ProcessCountMax);
+    }
 }
@@ -0,0 +1,347 @@
+/**
+ * @file sys/ring.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * Shared-memory rings are an alternative to SPD_IOCTL_TRANSACT. The dispatcher allocates
+ * a region that holds a request ring, a response ring and one data slot per entry; the
+ * driver locks it and maps it into system space for the lifetime of the ring.
+ *
+ * The driver fills the request ring when an SRB is posted (one request per post) and when
+ * the dispatcher enters the ring. The dispatcher consumes requests without a system call;
+ * it places responses in the response ring and hands them to the driver the next time it
+ * enters the ring.
+ *
+ * The ring lock is never held while request data is copied: a filler claims a free data
+ * slot under the lock, prepares the request into it without the lock and publishes the
+ * request under the lock again. Fillers on different processors prepare concurrently.
+ *
+ * Ring positions, free data slots and the hints that own them are kept in nonpaged pool
+ * and are never read back from the shared region. A dispatcher that scribbles over the
+ * shared region can only confuse itself.
+ */
+
+NTSTATUS SpdStorageUnitRegisterRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG EntryCount,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    ULONG DataLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_RING *Ring = 0, *OldRing;
+    UINT64 RingSize;
+    PVOID SystemBuffer;
+    NTSTATUS Result;
+    KIRQL Irql;
+
+    if (0 != EntryCount)
+    {
+        if (0 == Buffer ||
+            SPD_IOCTL_RING_CAPACITY < EntryCount || 0 != (EntryCount & (EntryCount - 1)))
+        {
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        RingSize = SPD_IOCTL_RING_SIZE((UINT64)EntryCount, (UINT64)DataLength);
+        if (MAXULONG < RingSize)
+        {
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        Ring = SpdAllocNonPaged(sizeof *Ring + EntryCount * (sizeof(UINT64) + sizeof(ULONG)),
+            SpdTagRing);
+        if (0 == Ring)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        RtlZeroMemory(Ring, sizeof *Ring + EntryCount * (sizeof(UINT64) + sizeof(ULONG)));
+        Ring->RefCount = 1;
+        Ring->ProcessId = ProcessId;
+        Ring->EntryCount = EntryCount;
+        Ring->DataLength = DataLength;
+        KeInitializeSpinLock(&Ring->SpinLock);
+        Ring->Hints = (PUINT64)(Ring + 1);
+        Ring->FreeList = (PULONG)(Ring->Hints + EntryCount);
+        for (ULONG I = 0; EntryCount > I; I++)
+            Ring->FreeList[I] = EntryCount - 1 - I;
+        Ring->FreeCount = EntryCount;
+
+        /* the ring stays locked for its lifetime */
+        Result = SpdLockUserBuffer(Buffer, (ULONG)RingSize, AccessMode,
+            &Ring->Mdl, &SystemBuffer);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        Ring->Header = SystemBuffer;
+        Ring->Req = (PVOID)((PUINT8)SystemBuffer + SPD_IOCTL_RING_REQ_OFFSET);
+        Ring->Rsp = (PVOID)((PUINT8)SystemBuffer + SPD_IOCTL_RING_RSP_OFFSET(EntryCount));
+        Ring->Data = (PUINT8)SystemBuffer + SPD_IOCTL_RING_DATA_OFFSET(EntryCount);
+
+        /* the dispatcher starts with empty rings */
+        RtlZeroMemory(Ring->Header, sizeof *Ring->Header);
+    }
+
+    /* swap in the new ring (or none); the old ring goes away when its last user is done */
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    OldRing = StorageUnit->Ring;
+    StorageUnit->Ring = Ring;
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    if (0 != OldRing)
+        SpdRingDereference(DeviceExtension, OldRing);
+
+    Ring = 0;
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != Ring)
+        SpdRingDereference(DeviceExtension, Ring);
+
+    return Result;
+}
+
+SPD_RING *SpdStorageUnitReferenceRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_RING *Ring;
+    KIRQL Irql;
+
+    UNREFERENCED_PARAMETER(DeviceExtension);
+
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    Ring = StorageUnit->Ring;
+    if (0 != Ring)
+        InterlockedIncrement(&Ring->RefCount);
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    return Ring;
+}
+
+VOID SpdRingDereference(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_RING *Ring)
+{
+    UNREFERENCED_PARAMETER(DeviceExtension);
+
+    if (0 == InterlockedDecrement(&Ring->RefCount))
+    {
+        if (0 != Ring->Mdl)
+            SpdUnlockUserBuffer(Ring->Mdl);
+        SpdFree(Ring, SpdTagRing);
+    }
+}
+
+VOID SpdStorageUnitReleaseRings(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId)
+{
+    SPD_RING *Ring;
+    KIRQL Irql;
+
+    /* detach one ring at a time; there can be too many to collect on the stack */
+    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    {
+        Ring = 0;
+
+        KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
+        if (0 != Unit)
+        {
+            KeAcquireSpinLockAtDpcLevel(&Unit->BufferSpinLock);
+            if (0 != Unit->Ring && ProcessId == Unit->Ring->ProcessId)
+            {
+                Ring = Unit->Ring;
+                Unit->Ring = 0;
+            }
+            KeReleaseSpinLockFromDpcLevel(&Unit->BufferSpinLock);
+        }
+        KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+        if (0 != Ring)
+            SpdRingDereference(DeviceExtension, Ring);
+    }
+}
+
+static NTSTATUS SpdRingFill(SPD_RING *Ring, SPD_IOQ *Ioq, ULONG MaxCount, PULONG PCount)
+{
+    SPD_IOCTL_TRANSACT_REQ Request;
+    SPD_IOCTL_RING_REQ *Entry;
+    ULONG Index, Count = 0;
+    NTSTATUS Result = STATUS_SUCCESS;
+    KIRQL Irql;
+
+    /* every request in flight owns a data slot; so the request ring can never overflow */
+    while (MaxCount > Count)
+    {
+        KeAcquireSpinLock(&Ring->SpinLock, &Irql);
+        if (0 == Ring->FreeCount)
+        {
+            KeReleaseSpinLock(&Ring->SpinLock, Irql);
+            break;
+        }
+        Index = Ring->FreeList[--Ring->FreeCount];
+        KeReleaseSpinLock(&Ring->SpinLock, Irql);
+
+        /* prepare into a private copy without the lock; the shared entry is never read back */
+        RtlZeroMemory(&Request, sizeof Request);
+        Result = SpdIoqTryStartProcessingSrb(Ioq,
+            SpdSrbExecuteScsiPrepare, &Request, Ring->Data + (SIZE_T)Index * Ring->DataLength);
+
+        KeAcquireSpinLock(&Ring->SpinLock, &Irql);
+        if (STATUS_SUCCESS == Result)
+        {
+            Ring->Hints[Index] = Request.Hint;
+
+            Entry = &Ring->Req[Ring->ReqHead & (Ring->EntryCount - 1)];
+            RtlCopyMemory(&Entry->Req, &Request, sizeof Request);
+            Entry->DataIndex = Index;
+            Ring->ReqHead++;
+
+            /* the entry must be visible before the new head */
+            KeMemoryBarrier();
+            Ring->Header->ReqHead = Ring->ReqHead;
+        }
+        else
+            Ring->FreeList[Ring->FreeCount++] = Index;
+        KeReleaseSpinLock(&Ring->SpinLock, Irql);
+
+        if (STATUS_SUCCESS != Result)
+            break;
+
+        Count++;
+    }
+
+    *PCount = Count;
+
+    /* STATUS_UNSUCCESSFUL: queue empty, no Ioq slot or SRB aborted while preparing */
+    return STATUS_UNSUCCESSFUL == Result ? STATUS_SUCCESS : Result;
+}
+
+VOID SpdStorageUnitPostRing(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit)
+{
+    SPD_RING *Ring;
+    ULONG Count;
+
+    /* unlocked peek; most storage units do not use a ring */
+    if (0 == ReadPointerNoFence((PVOID *)&StorageUnit->Ring))
+        return;
+
+    Ring = SpdStorageUnitReferenceRing(DeviceExtension, StorageUnit);
+    if (0 == Ring)
+        return;
+
+    /*
+     * Hand over one request, so that the submitter does no more copying than it caused.
+     * Requests that are left over are picked up by a later post or by a dispatcher
+     * waiting in SpdRingEnter, because posting wakes a dispatcher.
+     */
+    SpdRingFill(Ring, StorageUnit->Ioq, 1, &Count);
+
+    SpdRingDereference(DeviceExtension, Ring);
+}
+
+NTSTATUS SpdRingEnter(
+    SPD_RING *Ring,
+    SPD_IOQ *Ioq,
+    BOOLEAN Wait,
+    PIRP CancellableIrp)
+{
+    SPD_IOCTL_RING_RSP Response;
+    ULONG RspHead, Index, Count;
+    BOOLEAN Empty;
+    NTSTATUS Result;
+    KIRQL Irql;
+
+    /* consume responses */
+    RspHead = Ring->Header->RspHead;
+    KeMemoryBarrier();
+
+    KeAcquireSpinLock(&Ring->SpinLock, &Irql);
+
+    if ((LONG)(RspHead - Ring->RspTail) > (LONG)Ring->EntryCount)
+    {
+        KeReleaseSpinLock(&Ring->SpinLock, Irql);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* signed compare: a concurrent enter may have consumed past our RspHead */
+    while (0 < (LONG)(RspHead - Ring->RspTail))
+    {
+        RtlCopyMemory(&Response, &Ring->Rsp[Ring->RspTail & (Ring->EntryCount - 1)],
+            sizeof Response);
+        Ring->RspTail++;
+
+        /* the response must name the data slot of the request that it answers */
+        Index = Response.DataIndex;
+        if (Ring->EntryCount <= Index ||
+            0 == Response.Rsp.Hint || Ring->Hints[Index] != Response.Rsp.Hint)
+            continue;
+        Ring->Hints[Index] = 0;
+
+        /* copy data without holding the ring lock; the data slot is not free yet */
+        KeReleaseSpinLock(&Ring->SpinLock, Irql);
+        SpdIoqEndProcessingSrb(Ioq,
+            Response.Rsp.Hint, SpdSrbExecuteScsiComplete, &Response.Rsp,
+            Ring->Data + (SIZE_T)Index * Ring->DataLength);
+        KeAcquireSpinLock(&Ring->SpinLock, &Irql);
+
+        Ring->FreeList[Ring->FreeCount++] = Index;
+    }
+
+    Ring->Header->RspTail = Ring->RspTail;
+
+    KeReleaseSpinLock(&Ring->SpinLock, Irql);
+
+    /* produce requests; wait for one if asked to and the request ring is empty */
+    for (;;)
+    {
+        Result = SpdRingFill(Ring, Ioq, MAXULONG, &Count);
+
+        KeAcquireSpinLock(&Ring->SpinLock, &Irql);
+        Empty = Ring->ReqHead == Ring->Header->ReqTail;
+        KeReleaseSpinLock(&Ring->SpinLock, Irql);
+
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        if (!Wait || 0 != Count || !Empty)
+            break;
+
+        Result = SpdIoqWaitSrb(Ioq, 0, CancellableIrp);
+        if (STATUS_SUCCESS != Result)
+            return Result;
+
+        if (SpdIoqStopped(Ioq))
+            return STATUS_CANCELLED;
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -21,20 +21,47 @@
 
 #include <sys/driver.h>
 
-static UCHAR SpdScsiReportLuns(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+static ULONG SpdScsiGetTargetLuns(PVOID DeviceExtension, PVOID Srb,
+    UINT8 Luns[SPD_IOCTL_STORAGE_UNIT_LUN_COUNT]);
+static UCHAR SpdScsiReportLuns(PVOID DeviceExtension,
+    PVOID Srb, PCDB Cdb);
+static UCHAR SpdScsiInquiryNoLun(PVOID DeviceExtension,
     PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiModeSense(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb);
+static UCHAR SpdScsiModeSelect(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiReadCapacity(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb);
-static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+static UCHAR SpdScsiPostWriteSameSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
+static VOID SpdScsiSetUnmapAllocated(SPD_STORAGE_UNIT *StorageUnit,
+    PUNMAP_LIST_HEADER DataBuffer, ULONG DescriptorCount, BOOLEAN Allocated);
+static BOOLEAN SpdScsiIsZeroPattern(PVOID Pattern, ULONG Length);
+static UCHAR SpdScsiGetLbaStatus(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
+static UCHAR SpdScsiZeroSrb(PVOID DeviceExtension,
     PVOID Srb, ULONG DataLength);
+static UCHAR SpdScsiPopulateToken(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
+static UCHAR SpdScsiReceiveRodTokenInformation(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
+static UCHAR SpdScsiPostWriteUsingTokenSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb);
+static VOID SpdScsiMakeRodToken(SPD_STORAGE_UNIT *StorageUnit, UINT64 Id, PUINT8 Buffer);
+static VOID SpdScsiInvalidateTokens(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount);
+static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, UINT8 Kind, UINT8 Lane, ULONG DataLength);
+static UCHAR SpdScsiPostSrbEx(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, UINT8 Kind, UINT8 Lane, PVOID OwnedDataBuffer, ULONG DataLength);
+static UINT8 SpdSrbLane(PVOID Srb);
 static UCHAR SpdScsiErrorEx(PVOID Srb,
     UCHAR SenseKey,
     UCHAR AdditionalSenseCode,
@@ -45,6 +72,50 @@ static VOID SpdCdbGetRange(PCDB Cdb,
 
 #define SpdScsiError(S,K,A)             SpdScsiErrorEx(S,K,A,0,0)
 
+/* times StorPortSetDeviceQueueDepth may refuse the configured depth before we give up */
+#define SPD_QUEUE_DEPTH_ATTEMPTS        4
+
+/* WRITE SAME(10/16) flags in CDB byte 1; only UNMAP is supported */
+#define SPD_CDB_WRITE_SAME_UNMAP        0x08
+
+/* GET LBA STATUS (SBC-3) */
+#define SPD_SERVICE_ACTION_GET_LBA_STATUS 0x12
+#define SPD_LBA_STATUS_EXTENT_COUNT     64      /* extents examined per command */
+
+/* offloaded data transfer (SPC-4 ROD tokens) */
+#define SPD_ROD_TYPE_POINT_IN_TIME_COPY 0x00800000
+#define SPD_ROD_TOKEN_LENGTH            512
+#define SPD_ADSENSE_INVALID_TOKEN_OPERATION 0x23
+#define SPD_ADSENSEQ_UNSUPPORTED_TOKEN_TYPE 0x01
+#define SPD_ADSENSEQ_REMOTE_TOKEN_USAGE_NOT_SUPPORTED 0x02
+#define SPD_ADSENSEQ_TOKEN_UNKNOWN      0x04
+#define SPD_TOKEN_TIMEOUT_UNITS         10000000ULL     /* interrupt time units per second */
+
+static inline UINT16 SpdGetBe16(PUINT8 P)
+{
+    return ((UINT16)P[0] << 8) | (UINT16)P[1];
+}
+static inline UINT32 SpdGetBe32(PUINT8 P)
+{
+    return ((UINT32)P[0] << 24) | ((UINT32)P[1] << 16) | ((UINT32)P[2] << 8) | (UINT32)P[3];
+}
+static inline UINT64 SpdGetBe64(PUINT8 P)
+{
+    return ((UINT64)SpdGetBe32(P) << 32) | (UINT64)SpdGetBe32(P + 4);
+}
+static inline VOID SpdPutBe16(PUINT8 P, UINT16 V)
+{
+    P[0] = (V >> 8) & 0xff; P[1] = V & 0xff;
+}
+static inline VOID SpdPutBe32(PUINT8 P, UINT32 V)
+{
+    P[0] = (V >> 24) & 0xff; P[1] = (V >> 16) & 0xff; P[2] = (V >> 8) & 0xff; P[3] = V & 0xff;
+}
+static inline VOID SpdPutBe64(PUINT8 P, UINT64 V)
+{
+    SpdPutBe32(P, (UINT32)(V >> 32)); SpdPutBe32(P + 4, (UINT32)V);
+}
+
 UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb)
 {
     ASSERT(DISPATCH_LEVEL >= KeGetCurrentIrql());
@@ -58,17 +129,43 @@ UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb)
     StorageUnit = SpdStorageUnitReference(DeviceExtension, Srb);
     if (0 == StorageUnit)
     {
+        /* LUN 0 answers discovery commands for a target that only has other LUN's */
         if (SCSIOP_REPORT_LUNS == Cdb->AsByte[0])
-            SrbStatus = SpdScsiReportLuns(DeviceExtension, 0, Srb, Cdb);
+            SrbStatus = SpdScsiReportLuns(DeviceExtension, Srb, Cdb);
+        else if (SCSIOP_INQUIRY == Cdb->AsByte[0])
+            SrbStatus = SpdScsiInquiryNoLun(DeviceExtension, Srb, Cdb);
         else
             SrbStatus = SRB_STATUS_NO_DEVICE;
         goto exit;
     }
 
+    /*
+     * StorPort only accepts a queue depth for a LUN that it has already enumerated.
+     * Any command other than the discovery ones means that the LUN exists; try until
+     * StorPort accepts the depth, but give up after a few refusals.
+     */
+    if (0 != StorageUnit->StorageUnitParams.QueueDepth &&
+        SCSIOP_REPORT_LUNS != Cdb->AsByte[0] &&
+        SCSIOP_INQUIRY != Cdb->AsByte[0] &&
+        SPD_QUEUE_DEPTH_ATTEMPTS > ReadNoFence(&StorageUnit->QueueDepthFailures) &&
+        0 == InterlockedCompareExchange(&StorageUnit->QueueDepthSet, 1, 0))
+    {
+        if (!StorPortSetDeviceQueueDepth(DeviceExtension,
+            SrbGetPathId(Srb), SrbGetTargetId(Srb), SrbGetLun(Srb),
+            StorageUnit->StorageUnitParams.QueueDepth))
+        {
+            DEBUGLOG("StorPortSetDeviceQueueDepth(%u:%u:%u, %lu) failed",
+                SrbGetPathId(Srb), SrbGetTargetId(Srb), SrbGetLun(Srb),
+                StorageUnit->StorageUnitParams.QueueDepth);
+            InterlockedIncrement(&StorageUnit->QueueDepthFailures);
+            InterlockedExchange(&StorageUnit->QueueDepthSet, 0);
+        }
+    }
+
     switch (Cdb->AsByte[0])
     {
     case SCSIOP_REPORT_LUNS:
-        SrbStatus = SpdScsiReportLuns(DeviceExtension, StorageUnit, Srb, Cdb);
+        SrbStatus = SpdScsiReportLuns(DeviceExtension, Srb, Cdb);
         break;
 
     case SCSIOP_TEST_UNIT_READY:
@@ -84,6 +181,11 @@ UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb)
         SrbStatus = SpdScsiModeSense(DeviceExtension, StorageUnit, Srb, Cdb);
         break;
 
+    case SCSIOP_MODE_SELECT:
+    case SCSIOP_MODE_SELECT10:
+        SrbStatus = SpdScsiModeSelect(DeviceExtension, StorageUnit, Srb, Cdb);
+        break;
+
     case SCSIOP_READ_CAPACITY:
         SrbStatus = SpdScsiReadCapacity(DeviceExtension, StorageUnit, Srb, Cdb);
         break;
@@ -105,12 +207,43 @@ UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb)
         SrbStatus = SpdScsiPostUnmapSrb(DeviceExtension, StorageUnit, Srb, Cdb);
         break;
 
+    case SCSIOP_WRITE_SAME:
+    case SCSIOP_WRITE_SAME16:
+        SrbStatus = SpdScsiPostWriteSameSrb(DeviceExtension, StorageUnit, Srb, Cdb);
+        break;
+
+    case SCSIOP_POPULATE_TOKEN:
+        /* same operation code as SCSIOP_WRITE_USING_TOKEN and SCSIOP_EXTENDED_COPY */
+        if (!StorageUnit->StorageUnitParams.CopySupported)
+            SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        else if (SERVICE_ACTION_POPULATE_TOKEN == (Cdb->AsByte[1] & 0x1f))
+            SrbStatus = SpdScsiPopulateToken(StorageUnit, Srb, Cdb);
+        else if (SERVICE_ACTION_WRITE_USING_TOKEN == (Cdb->AsByte[1] & 0x1f))
+            SrbStatus = SpdScsiPostWriteUsingTokenSrb(DeviceExtension, StorageUnit, Srb, Cdb);
+        else
+            SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        break;
+
+    case SCSIOP_RECEIVE_ROD_TOKEN_INFORMATION:
+        /* same operation code as SCSIOP_RECEIVE_COPY_RESULTS */
+        if (StorageUnit->StorageUnitParams.CopySupported &&
+            SERVICE_ACTION_RECEIVE_TOKEN_INFORMATION == (Cdb->AsByte[1] & 0x1f))
+            SrbStatus = SpdScsiReceiveRodTokenInformation(StorageUnit, Srb, Cdb);
+        else
+            SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        break;
+
     case SCSIOP_SERVICE_ACTION_IN16:
         if (SERVICE_ACTION_READ_CAPACITY16 == Cdb->READ_CAPACITY16.ServiceAction)
         {
             SrbStatus = SpdScsiReadCapacity(DeviceExtension, StorageUnit, Srb, Cdb);
             break;
         }
+        if (SPD_SERVICE_ACTION_GET_LBA_STATUS == (Cdb->AsByte[1] & 0x1f))
+        {
+            SrbStatus = SpdScsiGetLbaStatus(StorageUnit, Srb, Cdb);
+            break;
+        }
         /* fall through */
 
     default:
@@ -125,44 +258,53 @@ exit:
     return SrbStatus;
 }
 
-static UCHAR SpdScsiReportLuns(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+static ULONG SpdScsiGetTargetLuns(PVOID DeviceExtension, PVOID Srb,
+    UINT8 Luns[SPD_IOCTL_STORAGE_UNIT_LUN_COUNT])
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    UCHAR PathId, TargetId, Lun;
+    ULONG Count = 0;
+
+    SrbGetPathTargetLun(Srb, &PathId, &TargetId, &Lun);
+    for (ULONG L = 0; SPD_IOCTL_STORAGE_UNIT_LUN_COUNT > L; L++)
+    {
+        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension,
+            SPD_IOCTL_BTL(PathId, TargetId, L));
+        if (0 == StorageUnit)
+            continue;
+
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+
+        Luns[Count++] = (UINT8)L;
+    }
+
+    return Count;
+}
+
+static UCHAR SpdScsiReportLuns(PVOID DeviceExtension,
     PVOID Srb, PCDB Cdb)
 {
     PVOID DataBuffer = SrbGetDataBuffer(Srb);
     ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
     PLUN_LIST LunList;
-    ULONG Length;
+    UINT8 Luns[SPD_IOCTL_STORAGE_UNIT_LUN_COUNT];
+    ULONG Length, Count;
 
     if (0 == DataBuffer)
         return SRB_STATUS_INTERNAL_ERROR;
 
     RtlZeroMemory(DataBuffer, DataTransferLength);
 
-    LunList = DataBuffer;
-    if (0 != StorageUnit)
-    {
-        Length = RTL_FIELD_SIZE(LUN_LIST, Lun[0]);
+    Count = SpdScsiGetTargetLuns(DeviceExtension, Srb, Luns);
+    Length = Count * RTL_FIELD_SIZE(LUN_LIST, Lun[0]);
 
-        if (sizeof(LUN_LIST) + Length > DataTransferLength)
-            return SRB_STATUS_DATA_OVERRUN;
+    if (sizeof(LUN_LIST) + Length > DataTransferLength)
+        return SRB_STATUS_DATA_OVERRUN;
 
-        // Our Lun is always 0. See RtlZeroMemory above.
-        // LunList->Lun[0][0] = 0;
-        // LunList->Lun[0][1] = 0;
-        // LunList->Lun[0][2] = 0;
-        // LunList->Lun[0][3] = 0;
-        // LunList->Lun[0][4] = 0;
-        // LunList->Lun[0][5] = 0;
-        // LunList->Lun[0][6] = 0;
-        // LunList->Lun[0][7] = 0;
-    }
-    else
-    {
-        Length = 0;
-
-        if (sizeof(LUN_LIST) + Length > DataTransferLength)
-            return SRB_STATUS_DATA_OVERRUN;
-    }
+    /* peripheral device addressing; LUN's are below 256. See RtlZeroMemory above. */
+    LunList = DataBuffer;
+    for (ULONG I = 0; Count > I; I++)
+        LunList->Lun[I][1] = Luns[I];
 
     LunList->LunListLength[0] = (Length >> 24) & 0xff;
     LunList->LunListLength[1] = (Length >> 16) & 0xff;
@@ -174,6 +316,43 @@ static UCHAR SpdScsiReportLuns(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageU
     return SRB_STATUS_SUCCESS;
 }
 
+static UCHAR SpdScsiInquiryNoLun(PVOID DeviceExtension,
+    PVOID Srb, PCDB Cdb)
+{
+    PVOID DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    UINT8 Luns[SPD_IOCTL_STORAGE_UNIT_LUN_COUNT];
+
+    /* only LUN 0 of a target with other LUN's answers; it reports that it is not present */
+    if (0 != SrbGetLun(Srb) || 0 == SpdScsiGetTargetLuns(DeviceExtension, Srb, Luns))
+        return SRB_STATUS_NO_DEVICE;
+
+    if (0 == DataBuffer)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    RtlZeroMemory(DataBuffer, DataTransferLength);
+
+    if (0 != Cdb->CDB6INQUIRY3.EnableVitalProductData || 0 != Cdb->CDB6INQUIRY3.PageCode)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+
+    if (INQUIRYDATABUFFERSIZE > DataTransferLength)
+        return SRB_STATUS_DATA_OVERRUN;
+
+    PINQUIRYDATA InquiryData = DataBuffer;
+    InquiryData->DeviceType = LOGICAL_UNIT_NOT_PRESENT_DEVICE;
+    InquiryData->DeviceTypeQualifier = DEVICE_QUALIFIER_NOT_SUPPORTED;
+    InquiryData->Versions = 5;
+    InquiryData->ResponseDataFormat = 2;
+    InquiryData->AdditionalLength = INQUIRYDATABUFFERSIZE -
+        RTL_SIZEOF_THROUGH_FIELD(INQUIRYDATA, AdditionalLength);
+    RtlCopyMemory(InquiryData->VendorId, SPD_IOCTL_VENDOR_ID,
+        sizeof SPD_IOCTL_VENDOR_ID - 1);
+
+    SrbSetDataTransferLength(Srb, INQUIRYDATABUFFERSIZE);
+
+    return SRB_STATUS_SUCCESS;
+}
+
 static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb)
 {
@@ -221,10 +400,12 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
         PVPD_IDENTIFICATION_DESCRIPTOR IdentificationDescriptor;
         PVPD_BLOCK_LIMITS_PAGE BlockLimits;
         PVPD_LOGICAL_BLOCK_PROVISIONING_PAGE LogicalBlockProvisioning;
+        PUINT8 ThirdPartyCopy;
         UINT32 U32;
+        ULONG PageCount, PageIndex;
         enum
         {
-            PageCount = 5,
+            ThirdPartyCopyLength = 4 + 36 + 12,
             Identifier0Length =
                 sizeof SPD_IOCTL_VENDOR_ID - 1 +
                 sizeof StorageUnit->StorageUnitParams.ProductId +
@@ -236,6 +417,7 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
         switch (Cdb->CDB6INQUIRY3.PageCode)
         {
         case VPD_SUPPORTED_PAGES:
+            PageCount = StorageUnit->StorageUnitParams.CopySupported ? 6 : 5;
             if (sizeof(VPD_SUPPORTED_PAGES_PAGE) + PageCount > DataTransferLength)
                 return SRB_STATUS_DATA_OVERRUN;
 
@@ -243,12 +425,16 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
             SupportedPages->DeviceType = StorageUnit->StorageUnitParams.DeviceType;
             SupportedPages->DeviceTypeQualifier = DEVICE_QUALIFIER_ACTIVE;
             SupportedPages->PageCode = VPD_SUPPORTED_PAGES;
-            SupportedPages->PageLength = PageCount;
-            SupportedPages->SupportedPageList[0] = VPD_SUPPORTED_PAGES;
-            SupportedPages->SupportedPageList[1] = VPD_SERIAL_NUMBER;
-            SupportedPages->SupportedPageList[2] = VPD_DEVICE_IDENTIFIERS;
-            SupportedPages->SupportedPageList[3] = VPD_BLOCK_LIMITS;
-            SupportedPages->SupportedPageList[4] = VPD_LOGICAL_BLOCK_PROVISIONING;
+            SupportedPages->PageLength = (UCHAR)PageCount;
+            PageIndex = 0;
+            SupportedPages->SupportedPageList[PageIndex++] = VPD_SUPPORTED_PAGES;
+            SupportedPages->SupportedPageList[PageIndex++] = VPD_SERIAL_NUMBER;
+            SupportedPages->SupportedPageList[PageIndex++] = VPD_DEVICE_IDENTIFIERS;
+            if (StorageUnit->StorageUnitParams.CopySupported)
+                SupportedPages->SupportedPageList[PageIndex++] = VPD_THIRD_PARTY_COPY;
+            SupportedPages->SupportedPageList[PageIndex++] = VPD_BLOCK_LIMITS;
+            SupportedPages->SupportedPageList[PageIndex++] = VPD_LOGICAL_BLOCK_PROVISIONING;
+            ASSERT(PageCount == PageIndex);
 
             SrbSetDataTransferLength(Srb, sizeof(VPD_SUPPORTED_PAGES_PAGE) + PageCount);
 
@@ -363,6 +549,40 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
                 BlockLimits->MaximumUnmapBlockDescriptorCount[3] = U32 & 0xff;
             }
 
+            /*
+             * WRITE SAME is forwarded as a single request regardless of its length.
+             * Older WDK's do not name these fields: WSNZ is bit 0 of byte 4 and
+             * MAXIMUM WRITE SAME LENGTH is bytes 36-43 of the page.
+             */
+            ((PUINT8)BlockLimits)[4] = 0x01;
+            ((PUINT8)BlockLimits)[40] = 0xff;
+            ((PUINT8)BlockLimits)[41] = 0xff;
+            ((PUINT8)BlockLimits)[42] = 0xff;
+            ((PUINT8)BlockLimits)[43] = 0xff;
+
+            /*
+             * OPTIMAL TRANSFER LENGTH GRANULARITY is bytes 6-7, OPTIMAL TRANSFER LENGTH
+             * is bytes 12-15, OPTIMAL UNMAP GRANULARITY is bytes 28-31 and UGAVALID and
+             * UNMAP GRANULARITY ALIGNMENT are bytes 32-35 of the page.
+             */
+            U32 = (0 != StorageUnit->StorageUnitParams.OptimalTransferGranularity ?
+                StorageUnit->StorageUnitParams.OptimalTransferGranularity :
+                StorageUnit->StorageUnitParams.PhysicalBlockLength) /
+                    StorageUnit->StorageUnitParams.BlockLength;
+            SpdPutBe16((PUINT8)BlockLimits + 6, (UINT16)(0xffff < U32 ? 0xffff : U32));
+            SpdPutBe32((PUINT8)BlockLimits + 12,
+                StorageUnit->StorageUnitParams.OptimalTransferLength /
+                    StorageUnit->StorageUnitParams.BlockLength);
+            if (StorageUnit->StorageUnitParams.UnmapSupported &&
+                0 != StorageUnit->StorageUnitParams.UnmapGranularity)
+            {
+                SpdPutBe32((PUINT8)BlockLimits + 28,
+                    StorageUnit->StorageUnitParams.UnmapGranularity /
+                        StorageUnit->StorageUnitParams.BlockLength);
+                SpdPutBe32((PUINT8)BlockLimits + 32,
+                    0x80000000 | StorageUnit->StorageUnitParams.UnmapGranularityAlignment);
+            }
+
             SrbSetDataTransferLength(Srb, sizeof(VPD_BLOCK_LIMITS_PAGE));
 
             return SRB_STATUS_SUCCESS;
@@ -380,6 +600,8 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
             if (StorageUnit->StorageUnitParams.UnmapSupported)
             {
                 LogicalBlockProvisioning->LBPU = 1;
+                LogicalBlockProvisioning->LBPWS = 1;
+                LogicalBlockProvisioning->LBPWS10 = 1;
                 LogicalBlockProvisioning->ProvisioningType = PROVISIONING_TYPE_THIN;
             }
 
@@ -387,6 +609,43 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
 
             return SRB_STATUS_SUCCESS;
 
+        case VPD_THIRD_PARTY_COPY:
+            if (!StorageUnit->StorageUnitParams.CopySupported)
+                return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+            if (ThirdPartyCopyLength > DataTransferLength)
+                return SRB_STATUS_DATA_OVERRUN;
+
+            ThirdPartyCopy = DataBuffer;
+            ThirdPartyCopy[0] = StorageUnit->StorageUnitParams.DeviceType |
+                (DEVICE_QUALIFIER_ACTIVE << 5);
+            ThirdPartyCopy[1] = VPD_THIRD_PARTY_COPY;
+            SpdPutBe16(ThirdPartyCopy + 2, ThirdPartyCopyLength - 4);
+
+            /* Block Device ROD Token Limits descriptor (SBC-3) */
+            SpdPutBe16(ThirdPartyCopy + 4 + 0, 0x0000);
+            SpdPutBe16(ThirdPartyCopy + 4 + 2, 36 - 4);
+            SpdPutBe16(ThirdPartyCopy + 4 + 10, SPD_TOKEN_RANGE_COUNT);
+            SpdPutBe32(ThirdPartyCopy + 4 + 12, SPD_TOKEN_MAXIMUM_TIMEOUT);
+            SpdPutBe32(ThirdPartyCopy + 4 + 16, SPD_TOKEN_DEFAULT_TIMEOUT);
+            SpdPutBe64(ThirdPartyCopy + 4 + 20, 0xffffffff);
+            SpdPutBe64(ThirdPartyCopy + 4 + 28, 0xffffffff);
+
+            /* Supported Commands descriptor (SPC-4) */
+            SpdPutBe16(ThirdPartyCopy + 40 + 0, 0x0001);
+            SpdPutBe16(ThirdPartyCopy + 40 + 2, 12 - 4);
+            ThirdPartyCopy[40 + 4] = 7;
+            ThirdPartyCopy[40 + 5] = SCSIOP_POPULATE_TOKEN;
+            ThirdPartyCopy[40 + 6] = 2;
+            ThirdPartyCopy[40 + 7] = SERVICE_ACTION_POPULATE_TOKEN;
+            ThirdPartyCopy[40 + 8] = SERVICE_ACTION_WRITE_USING_TOKEN;
+            ThirdPartyCopy[40 + 9] = SCSIOP_RECEIVE_ROD_TOKEN_INFORMATION;
+            ThirdPartyCopy[40 + 10] = 1;
+            ThirdPartyCopy[40 + 11] = SERVICE_ACTION_RECEIVE_TOKEN_INFORMATION;
+
+            SrbSetDataTransferLength(Srb, ThirdPartyCopyLength);
+
+            return SRB_STATUS_SUCCESS;
+
         default:
             return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
         }
@@ -406,13 +665,14 @@ static UCHAR SpdScsiModeSense(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUn
 
     PMODE_CACHING_PAGE ModeCachingPage;
     ULONG DataLength;
+    UCHAR Pc;                           /* PC field in place (bits 6-7 of byte 2) */
     if (SCSIOP_MODE_SENSE == Cdb->AsByte[0])
     {
         /* MODE SENSE (6) */
-        if (MODE_SENSE_CHANGEABLE_VALUES == Cdb->MODE_SENSE.Pc ||
-            (MODE_PAGE_CACHING != Cdb->MODE_SENSE.PageCode &&
-            MODE_SENSE_RETURN_ALL != Cdb->MODE_SENSE.PageCode))
+        if (MODE_PAGE_CACHING != Cdb->MODE_SENSE.PageCode &&
+            MODE_SENSE_RETURN_ALL != Cdb->MODE_SENSE.PageCode)
             return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+        Pc = Cdb->AsByte[2] & 0xc0;
 
         DataLength = sizeof(MODE_PARAMETER_HEADER) + sizeof(MODE_CACHING_PAGE);
         if (DataLength > DataTransferLength)
@@ -432,10 +692,10 @@ static UCHAR SpdScsiModeSense(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUn
     else
     {
         /* MODE SENSE (10) */
-        if (MODE_SENSE_CHANGEABLE_VALUES == Cdb->MODE_SENSE10.Pc ||
-            (MODE_PAGE_CACHING != Cdb->MODE_SENSE10.PageCode &&
-            MODE_SENSE_RETURN_ALL != Cdb->MODE_SENSE10.PageCode))
+        if (MODE_PAGE_CACHING != Cdb->MODE_SENSE10.PageCode &&
+            MODE_SENSE_RETURN_ALL != Cdb->MODE_SENSE10.PageCode)
             return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+        Pc = Cdb->AsByte[2] & 0xc0;
 
         DataLength = sizeof(MODE_PARAMETER_HEADER10) + sizeof(MODE_CACHING_PAGE);
         if (DataLength > DataTransferLength)
@@ -459,14 +719,98 @@ static UCHAR SpdScsiModeSense(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUn
     ModeCachingPage->PageSavable = 0;
     ModeCachingPage->PageLength = sizeof(MODE_CACHING_PAGE) -
         RTL_SIZEOF_THROUGH_FIELD(MODE_CACHING_PAGE, PageLength);
-    ModeCachingPage->ReadDisableCache = !StorageUnit->StorageUnitParams.CacheSupported;
-    ModeCachingPage->WriteCacheEnable = !!StorageUnit->StorageUnitParams.CacheSupported;
+    if (MODE_SENSE_CHANGEABLE_VALUES == Pc)
+        /* only WCE is changeable (by MODE SELECT) and only if the unit has a cache */
+        ModeCachingPage->WriteCacheEnable = !!StorageUnit->StorageUnitParams.CacheSupported;
+    else
+    {
+        /* MODE SELECT only toggles the write cache; the read cache is what the unit supports */
+        ModeCachingPage->ReadDisableCache = !StorageUnit->StorageUnitParams.CacheSupported;
+        ModeCachingPage->WriteCacheEnable = MODE_SENSE_DEFAULT_VAULES == Pc ?
+            !!StorageUnit->StorageUnitParams.CacheSupported : !!StorageUnit->WriteCacheEnabled;
+    }
 
     SrbSetDataTransferLength(Srb, DataLength);
 
     return SRB_STATUS_SUCCESS;
 }
 
+static UCHAR SpdScsiModeSelect(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    PUINT8 DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    PMODE_CACHING_PAGE ModeCachingPage, OwnedModeCachingPage;
+    ULONG ParameterListLength, Offset, PageLength;
+
+    /* parameter list: mode parameter header, block descriptors, mode pages */
+    if (SCSIOP_MODE_SELECT == Cdb->AsByte[0])
+    {
+        /* MODE SELECT (6) */
+        ParameterListLength = Cdb->MODE_SELECT.ParameterListLength;
+        Offset = sizeof(MODE_PARAMETER_HEADER);
+    }
+    else
+    {
+        /* MODE SELECT (10) */
+        ParameterListLength = SpdGetBe16(Cdb->MODE_SELECT10.ParameterListLength);
+        Offset = sizeof(MODE_PARAMETER_HEADER10);
+    }
+
+    if (0 == ParameterListLength)
+        return SRB_STATUS_SUCCESS;
+    if (0 == DataBuffer)
+        return SRB_STATUS_INTERNAL_ERROR;
+    if (ParameterListLength > DataTransferLength || Offset > ParameterListLength)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_PARAMETER_LIST_LENGTH);
+
+    Offset += SCSIOP_MODE_SELECT == Cdb->AsByte[0] ?
+        ((PMODE_PARAMETER_HEADER)DataBuffer)->BlockDescriptorLength :
+        SpdGetBe16(((PMODE_PARAMETER_HEADER10)DataBuffer)->BlockDescriptorLength);
+
+    /* only the caching page may be selected; the last copy of it wins */
+    ModeCachingPage = 0;
+    while (ParameterListLength > Offset)
+    {
+        if (Offset + 2 > ParameterListLength)
+            return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_PARAMETER_LIST_LENGTH);
+
+        /* the PS bit is reserved in MODE SELECT; SPF (subpage format) is not supported */
+        PageLength = 2 + DataBuffer[Offset + 1];
+        if (MODE_PAGE_CACHING != (DataBuffer[Offset] & 0x7f) ||
+            sizeof(MODE_CACHING_PAGE) > PageLength)
+            return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+        if (Offset + PageLength > ParameterListLength)
+            return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_PARAMETER_LIST_LENGTH);
+
+        ModeCachingPage = (PVOID)(DataBuffer + Offset);
+        Offset += PageLength;
+    }
+
+    if (0 == ModeCachingPage ||
+        !!ModeCachingPage->WriteCacheEnable == !!StorageUnit->WriteCacheEnabled)
+        return SRB_STATUS_SUCCESS;
+
+    if (!StorageUnit->StorageUnitParams.CacheSupported)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+            SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+
+    /*
+     * The storage unit is notified so that it can switch its write-back machinery (and flush
+     * when the cache is disabled). WriteCacheEnabled changes when the notification completes;
+     * requests prepared afterwards get FUA semantics to match.
+     */
+    OwnedModeCachingPage = SpdAllocNonPaged(sizeof(MODE_CACHING_PAGE), SpdTagSrbBuffer);
+    if (0 == OwnedModeCachingPage)
+        return SRB_STATUS_INTERNAL_ERROR;
+    RtlCopyMemory(OwnedModeCachingPage, ModeCachingPage, sizeof(MODE_CACHING_PAGE));
+
+    return SpdScsiPostSrbEx(DeviceExtension, StorageUnit, Srb,
+        SpdIoctlTransactSetCacheKind, SpdIoqLaneHigh,
+        OwnedModeCachingPage, sizeof(MODE_CACHING_PAGE));
+}
+
 static UCHAR SpdScsiReadCapacity(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb)
 {
@@ -529,6 +873,19 @@ static UCHAR SpdScsiReadCapacity(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         ULONG DataLength;
         if (sizeof(READ_CAPACITY16_DATA) <= DataTransferLength)
         {
+            /*
+             * LOGICAL BLOCKS PER PHYSICAL BLOCK EXPONENT is the low nibble of byte 13;
+             * LOWEST ALIGNED LOGICAL BLOCK ADDRESS (bytes 14-15) is always 0.
+             */
+            UINT8 Exponent = 0;
+            U32 = StorageUnit->StorageUnitParams.PhysicalBlockLength /
+                StorageUnit->StorageUnitParams.BlockLength;
+            while (1 < U32)
+            {
+                U32 >>= 1;
+                Exponent++;
+            }
+            ((PUINT8)ReadCapacityData)[13] = Exponent;
             if (StorageUnit->StorageUnitParams.UnmapSupported)
                 ((PREAD_CAPACITY16_DATA)ReadCapacityData)->LBPME = 1;
             DataLength = sizeof(READ_CAPACITY16_DATA);
@@ -546,8 +903,9 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     PVOID Srb, PCDB Cdb)
 {
     UINT64 BlockAddress, EndBlockAddress;
-    UINT32 BlockCount;
+    UINT32 BlockCount, ForceUnitAccess;
     ULONG DataLength;
+    UINT8 Kind, Lane;
 
     switch (Cdb->AsByte[0])
     {
@@ -555,7 +913,8 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     case SCSIOP_READ:
     case SCSIOP_READ12:
     case SCSIOP_READ16:
-        SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+        Kind = SpdIoctlTransactReadKind;
+        SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, &ForceUnitAccess);
         DataLength = BlockCount * StorageUnit->StorageUnitParams.BlockLength;
         if (SrbGetDataTransferLength(Srb) < DataLength)
             return SRB_STATUS_INTERNAL_ERROR;
@@ -565,9 +924,10 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     case SCSIOP_WRITE:
     case SCSIOP_WRITE12:
     case SCSIOP_WRITE16:
+        Kind = SpdIoctlTransactWriteKind;
         if (StorageUnit->StorageUnitParams.WriteProtected)
             return SpdScsiError(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
-        SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+        SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, &ForceUnitAccess);
         DataLength = BlockCount * StorageUnit->StorageUnitParams.BlockLength;
         if (SrbGetDataTransferLength(Srb) < DataLength)
             return SRB_STATUS_INTERNAL_ERROR;
@@ -575,11 +935,13 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
 
     case SCSIOP_SYNCHRONIZE_CACHE:
     case SCSIOP_SYNCHRONIZE_CACHE16:
+        Kind = SpdIoctlTransactFlushKind;
         if (!StorageUnit->StorageUnitParams.CacheSupported)
             return SRB_STATUS_INVALID_REQUEST;
         if (StorageUnit->StorageUnitParams.WriteProtected)
             return SpdScsiError(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
         SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+        ForceUnitAccess = 1;
         DataLength = 0;
         break;
 
@@ -596,7 +958,24 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
         return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
 
-    return SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb, DataLength);
+    if (SpdIoctlTransactWriteKind == Kind)
+    {
+        SpdScsiInvalidateTokens(StorageUnit, BlockAddress, BlockCount);
+        SpdStorageUnitSetAllocated(StorageUnit, BlockAddress, BlockCount, TRUE);
+    }
+
+    /* blocks that the allocation map reports as unallocated read back as zeroes */
+    if (SpdIoctlTransactReadKind == Kind &&
+        SpdStorageUnitIsUnallocated(StorageUnit, BlockAddress, BlockCount))
+        return SpdScsiZeroSrb(DeviceExtension, Srb, DataLength);
+
+    /*
+     * Flushes and FUA I/O are latency sensitive; they go ahead of normal I/O regardless
+     * of the issuer's priority, because a low priority flush may be holding up others.
+     */
+    Lane = ForceUnitAccess ? SpdIoqLaneHigh : SpdSrbLane(Srb);
+
+    return SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb, Kind, Lane, DataLength);
 }
 
 static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
@@ -610,6 +989,7 @@ static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     PUNMAP_LIST_HEADER DataBuffer = SrbGetDataBuffer(Srb);
     ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
     ULONG DataLength;
+    UCHAR SrbStatus;
 
     if (0 == DataBuffer ||
         DataTransferLength < sizeof(UNMAP_LIST_HEADER) ||
@@ -648,13 +1028,501 @@ static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         if (EndBlockAddress < BlockAddress ||
             EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
             return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+
+        SpdScsiInvalidateTokens(StorageUnit, BlockAddress, BlockCount);
     }
 
-    return SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb, DataLength);
+    /*
+     * Clear the allocation map now rather than on completion, so that it is updated in
+     * the same order as writes set it: a write posted while this UNMAP is in flight must
+     * not have its bits cleared behind its back. An UNMAP that is not posted, fails or is
+     * aborted sets them back (SpdSrbExecuteScsiRollback).
+     */
+    SpdScsiSetUnmapAllocated(StorageUnit, DataBuffer,
+        DataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR), FALSE);
+
+    SrbStatus = SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb,
+        SpdIoctlTransactUnmapKind, SpdIoqLaneLow, DataLength);
+    if (SRB_STATUS_PENDING != SrbStatus)
+        SpdScsiSetUnmapAllocated(StorageUnit, DataBuffer,
+            DataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR), TRUE);
+
+    return SrbStatus;
 }
 
-static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+static UCHAR SpdScsiPostWriteSameSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    if (StorageUnit->StorageUnitParams.WriteProtected)
+        return SpdScsiError(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
+
+    UINT64 BlockAddress, EndBlockAddress;
+    UINT32 BlockCount;
+    ULONG DataLength = StorageUnit->StorageUnitParams.BlockLength;
+    UINT8 Lane;
+    UCHAR SrbStatus;
+
+    /* no ANCHOR, PBDATA, LBDATA, NDOB or WRPROTECT */
+    if (0 != (Cdb->AsByte[1] & ~SPD_CDB_WRITE_SAME_UNMAP))
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+
+    /* WSNZ is reported: a block count of 0 does not mean "to the end of the medium" */
+    SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+    if (0 == BlockCount)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+
+    EndBlockAddress = BlockAddress + BlockCount;
+    if (EndBlockAddress < BlockAddress ||
+        EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+
+    /* the data buffer holds the single block of pattern data */
+    if (0 == SrbGetDataBuffer(Srb) || SrbGetDataTransferLength(Srb) < DataLength)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    /* blocks written with zeroes are as good as unallocated; see SpdScsiPostUnmapSrb */
+    SpdScsiInvalidateTokens(StorageUnit, BlockAddress, BlockCount);
+    SpdStorageUnitSetAllocated(StorageUnit, BlockAddress, BlockCount,
+        !SpdScsiIsZeroPattern(SrbGetDataBuffer(Srb), DataLength));
+
+    /* unmapping through WRITE SAME is background work, same as UNMAP */
+    Lane = SpdSrbLane(Srb);
+    if (0 != (Cdb->AsByte[1] & SPD_CDB_WRITE_SAME_UNMAP))
+        Lane = SpdIoqLaneLow;
+
+    SrbStatus = SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb,
+        SpdIoctlTransactWriteSameKind, Lane, DataLength);
+    if (SRB_STATUS_PENDING != SrbStatus)
+        SpdStorageUnitSetAllocated(StorageUnit, BlockAddress, BlockCount, TRUE);
+
+    return SrbStatus;
+}
+
+static VOID SpdScsiSetUnmapAllocated(SPD_STORAGE_UNIT *StorageUnit,
+    PUNMAP_LIST_HEADER DataBuffer, ULONG DescriptorCount, BOOLEAN Allocated)
+{
+    for (ULONG I = 0; DescriptorCount > I; I++)
+    {
+        PUNMAP_BLOCK_DESCRIPTOR Src = &DataBuffer->Descriptors[I];
+        SpdStorageUnitSetAllocated(StorageUnit,
+            SpdGetBe64(Src->StartingLba), SpdGetBe32(Src->LbaCount), Allocated);
+    }
+}
+
+static BOOLEAN SpdScsiIsZeroPattern(PVOID Pattern, ULONG Length)
+{
+    for (ULONG I = 0; Length > I; I++)
+        if (0 != ((PUINT8)Pattern)[I])
+            return FALSE;
+    return TRUE;
+}
+
+static UCHAR SpdScsiGetLbaStatus(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    PUINT8 DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    UINT64 BlockAddress = SpdGetBe64(&Cdb->AsByte[2]);
+    ULONG AllocationLength = SpdGetBe32(&Cdb->AsByte[10]);
+    UINT64 EndBlockAddress = StorageUnit->StorageUnitParams.BlockCount;
+    UINT64 BlockCount, MaxBlockCount;
+    ULONG DescriptorCapacity, DescriptorCount;
+    PUINT8 Descriptor = 0;
+    BOOLEAN Allocated;
+
+    if (!StorageUnit->StorageUnitParams.UnmapSupported)
+        return SRB_STATUS_INVALID_REQUEST;
+
+    if (BlockAddress >= EndBlockAddress)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+
+    if (0 == DataBuffer)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    if (AllocationLength > DataTransferLength)
+        AllocationLength = DataTransferLength;
+    if (8 + 16 > AllocationLength)
+        return SRB_STATUS_DATA_OVERRUN;
+    DescriptorCapacity = (AllocationLength - 8) / 16;
+
+    /*
+     * Without an allocation map every block is reported as mapped. With one, adjacent
+     * extents of the same status are coalesced into a single descriptor.
+     */
+    RtlZeroMemory(DataBuffer, 8 + DescriptorCapacity * 16);
+    DescriptorCount = 0;
+    for (ULONG I = 0; SPD_LBA_STATUS_EXTENT_COUNT > I && BlockAddress < EndBlockAddress; I++)
+    {
+        MaxBlockCount = EndBlockAddress - BlockAddress;
+        if (0xffffffff < MaxBlockCount)
+            MaxBlockCount = 0xffffffff;
+        SpdStorageUnitGetAllocationExtent(StorageUnit,
+            BlockAddress, MaxBlockCount, &Allocated, &BlockCount);
+
+        if (0 != Descriptor &&
+            (Allocated ? 0x00 : 0x01) == Descriptor[12] &&
+            0xffffffff - SpdGetBe32(Descriptor + 8) >= BlockCount)
+            SpdPutBe32(Descriptor + 8, SpdGetBe32(Descriptor + 8) + (UINT32)BlockCount);
+        else
+        {
+            if (DescriptorCapacity <= DescriptorCount)
+                break;
+            Descriptor = DataBuffer + 8 + DescriptorCount * 16;
+            SpdPutBe64(Descriptor + 0, BlockAddress);
+            SpdPutBe32(Descriptor + 8, (UINT32)BlockCount);
+            Descriptor[12] = Allocated ? 0x00 : 0x01;   /* PROVISIONING STATUS: mapped/deallocated */
+            DescriptorCount++;
+        }
+
+        BlockAddress += BlockCount;
+    }
+
+    SpdPutBe32(DataBuffer + 0, 4 + DescriptorCount * 16);
+    SrbSetDataTransferLength(Srb, 8 + DescriptorCount * 16);
+
+    return SRB_STATUS_SUCCESS;
+}
+
+static UCHAR SpdScsiZeroSrb(PVOID DeviceExtension,
     PVOID Srb, ULONG DataLength)
+{
+    PVOID SystemDataBuffer;
+    ULONG StorResult;
+
+    StorResult = StorPortGetSystemAddress(DeviceExtension, Srb, &SystemDataBuffer);
+    if (STOR_STATUS_SUCCESS != StorResult)
+    {
+        SrbSetSystemStatus(Srb, SpdNtStatusFromStorStatus(StorResult));
+        return SRB_STATUS_INTERNAL_ERROR;
+    }
+
+    RtlZeroMemory(SystemDataBuffer, DataLength);
+
+    return SRB_STATUS_SUCCESS;
+}
+
+static UCHAR SpdScsiPopulateToken(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    PUINT8 DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    ULONG DataLength = SpdGetBe32(&Cdb->AsByte[10]);
+    ULONG RangeLength, RangeCount, Timeout;
+    SPD_TOKEN Token, *Slot;
+    KIRQL Irql;
+
+    /* a parameter list length of 0 is not an error; no token is created */
+    if (0 == DataLength)
+        return SRB_STATUS_SUCCESS;
+
+    if (0 == DataBuffer || DataTransferLength < DataLength)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    /* only synchronous operation (no IMMED) and point-in-time copies are supported */
+    if (16 > DataLength ||
+        0 != (DataBuffer[2] & 0x01))
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+    if (0 != (DataBuffer[2] & 0x02) &&
+        SPD_ROD_TYPE_POINT_IN_TIME_COPY != SpdGetBe32(DataBuffer + 8))
+        return SpdScsiErrorEx(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+            SPD_ADSENSE_INVALID_TOKEN_OPERATION, SPD_ADSENSEQ_UNSUPPORTED_TOKEN_TYPE, 0);
+
+    Timeout = SpdGetBe32(DataBuffer + 4);
+    if (0 == Timeout)
+        Timeout = SPD_TOKEN_DEFAULT_TIMEOUT;
+    RangeLength = SpdGetBe16(DataBuffer + 14);
+    RangeCount = RangeLength / 16;
+    if (SPD_TOKEN_MAXIMUM_TIMEOUT < Timeout ||
+        0 != RangeLength % 16 ||
+        0 == RangeCount || SPD_TOKEN_RANGE_COUNT < RangeCount ||
+        16 + RangeLength > DataLength)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+
+    RtlZeroMemory(&Token, sizeof Token);
+    Token.ListIdentifier = SpdGetBe32(&Cdb->AsByte[6]);
+    Token.Timeout = Timeout;
+    Token.RangeCount = RangeCount;
+    for (ULONG I = 0; RangeCount > I; I++)
+    {
+        PUINT8 Descriptor = DataBuffer + 16 + I * 16;
+        UINT64 BlockAddress = SpdGetBe64(Descriptor);
+        UINT32 BlockCount = SpdGetBe32(Descriptor + 8);
+        UINT64 EndBlockAddress = BlockAddress + BlockCount;
+
+        if (EndBlockAddress < BlockAddress ||
+            EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
+            return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+
+        Token.Ranges[I].BlockAddress = BlockAddress;
+        Token.Ranges[I].BlockCount = BlockCount;
+        Token.BlockCount += BlockCount;
+    }
+
+    KeAcquireSpinLock(&StorageUnit->TokenSpinLock, &Irql);
+
+    /* replace the token of the same list identifier, else use a free slot, else the oldest */
+    Slot = 0;
+    for (ULONG I = 0; SPD_TOKEN_COUNT > I; I++)
+        if (0 != StorageUnit->Tokens[I].Id &&
+            Token.ListIdentifier == StorageUnit->Tokens[I].ListIdentifier)
+        {
+            Slot = &StorageUnit->Tokens[I];
+            break;
+        }
+    if (0 == Slot)
+        for (ULONG I = 0; SPD_TOKEN_COUNT > I; I++)
+            if (0 == Slot || StorageUnit->Tokens[I].Id < Slot->Id)
+                Slot = &StorageUnit->Tokens[I];
+
+    if (0 == Slot->Id)
+        StorageUnit->TokenCount++;
+    Token.Id = ++StorageUnit->TokenGeneration;
+    Token.ExpirationTime = KeQueryInterruptTime() + Timeout * SPD_TOKEN_TIMEOUT_UNITS;
+    *Slot = Token;
+
+    KeReleaseSpinLock(&StorageUnit->TokenSpinLock, Irql);
+
+    return SRB_STATUS_SUCCESS;
+}
+
+static UCHAR SpdScsiReceiveRodTokenInformation(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    PUINT8 DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    UINT32 ListIdentifier = SpdGetBe32(&Cdb->AsByte[2]);
+    UINT64 Id = 0, BlockCount = 0, InterruptTime;
+    KIRQL Irql;
+    enum
+    {
+        ResponseLength = 38 + SPD_ROD_TOKEN_LENGTH,
+    };
+
+    if (0 == DataBuffer)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    if (ResponseLength > DataTransferLength)
+        return SRB_STATUS_DATA_OVERRUN;
+
+    InterruptTime = KeQueryInterruptTime();
+    KeAcquireSpinLock(&StorageUnit->TokenSpinLock, &Irql);
+    for (ULONG I = 0; SPD_TOKEN_COUNT > I; I++)
+        if (0 != StorageUnit->Tokens[I].Id &&
+            ListIdentifier == StorageUnit->Tokens[I].ListIdentifier &&
+            InterruptTime < StorageUnit->Tokens[I].ExpirationTime)
+        {
+            Id = StorageUnit->Tokens[I].Id;
+            BlockCount = StorageUnit->Tokens[I].BlockCount;
+            break;
+        }
+    KeReleaseSpinLock(&StorageUnit->TokenSpinLock, Irql);
+
+    /* WRITE USING TOKEN completes synchronously; only POPULATE TOKEN leaves information */
+    if (0 == Id)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+
+    RtlZeroMemory(DataBuffer, ResponseLength);
+    SpdPutBe32(DataBuffer + 0, ResponseLength - 4);
+    DataBuffer[4] = SERVICE_ACTION_POPULATE_TOKEN;
+    DataBuffer[5] = 0x01;               /* COPY OPERATION STATUS: completed without error */
+    DataBuffer[12] = SCSISTAT_GOOD;
+    DataBuffer[15] = 0xf1;              /* TRANSFER COUNT UNITS: logical blocks */
+    SpdPutBe64(DataBuffer + 16, BlockCount);
+    SpdPutBe32(DataBuffer + 32, 2 + SPD_ROD_TOKEN_LENGTH);
+    SpdScsiMakeRodToken(StorageUnit, Id, DataBuffer + 38);
+
+    SrbSetDataTransferLength(Srb, ResponseLength);
+
+    return SRB_STATUS_SUCCESS;
+}
+
+static UCHAR SpdScsiPostWriteUsingTokenSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, PCDB Cdb)
+{
+    if (StorageUnit->StorageUnitParams.WriteProtected)
+        return SpdScsiError(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
+
+    PUINT8 DataBuffer = SrbGetDataBuffer(Srb);
+    ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
+    ULONG DataLength = SpdGetBe32(&Cdb->AsByte[10]);
+    ULONG RangeLength, RangeCount, DescriptorCount, SourceIndex;
+    UINT64 Offset, Id, InterruptTime;
+    PUINT8 RodToken;
+    SPD_IOCTL_COPY_DESCRIPTOR *Descriptors;
+    SPD_TOKEN Token;
+    KIRQL Irql;
+    enum
+    {
+        HeaderLength = 536,
+        DescriptorCapacity = 2 * SPD_TOKEN_RANGE_COUNT,
+    };
+
+    if (0 == DataLength)
+        return SRB_STATUS_SUCCESS;
+
+    if (0 == DataBuffer || DataTransferLength < DataLength)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    RangeLength = HeaderLength <= DataLength ? SpdGetBe16(DataBuffer + 534) : 0;
+    RangeCount = RangeLength / 16;
+    if (HeaderLength > DataLength ||
+        0 != (DataBuffer[2] & 0x01) ||
+        0 != RangeLength % 16 ||
+        0 == RangeCount || SPD_TOKEN_RANGE_COUNT < RangeCount ||
+        HeaderLength + RangeLength > DataLength)
+        return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+
+    /* tokens from other storage units would need a copy across units; decline them */
+    RodToken = DataBuffer + 16;
+    if (SPD_ROD_TYPE_POINT_IN_TIME_COPY != SpdGetBe32(RodToken))
+        return SpdScsiErrorEx(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+            SPD_ADSENSE_INVALID_TOKEN_OPERATION, SPD_ADSENSEQ_UNSUPPORTED_TOKEN_TYPE, 0);
+    if (!RtlEqualMemory(RodToken + 8, &StorageUnit->StorageUnitParams.Guid, sizeof(GUID)))
+        return SpdScsiErrorEx(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+            SPD_ADSENSE_INVALID_TOKEN_OPERATION, SPD_ADSENSEQ_REMOTE_TOKEN_USAGE_NOT_SUPPORTED, 0);
+    Id = SpdGetBe64(RodToken + 24);
+
+    Token.Id = 0;
+    InterruptTime = KeQueryInterruptTime();
+    KeAcquireSpinLock(&StorageUnit->TokenSpinLock, &Irql);
+    for (ULONG I = 0; SPD_TOKEN_COUNT > I; I++)
+        if (0 != Id && Id == StorageUnit->Tokens[I].Id &&
+            InterruptTime < StorageUnit->Tokens[I].ExpirationTime)
+        {
+            Token = StorageUnit->Tokens[I];
+            if (0 != (DataBuffer[2] & 0x02))
+            {
+                /* DEL_TKN */
+                StorageUnit->Tokens[I].Id = 0;
+                StorageUnit->TokenCount--;
+            }
+            else
+                StorageUnit->Tokens[I].ExpirationTime = InterruptTime +
+                    StorageUnit->Tokens[I].Timeout * SPD_TOKEN_TIMEOUT_UNITS;
+            break;
+        }
+    KeReleaseSpinLock(&StorageUnit->TokenSpinLock, Irql);
+
+    if (0 == Token.Id)
+        return SpdScsiErrorEx(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+            SPD_ADSENSE_INVALID_TOKEN_OPERATION, SPD_ADSENSEQ_TOKEN_UNKNOWN, 0);
+
+    Descriptors = SpdAllocNonPaged(DescriptorCapacity * sizeof *Descriptors, SpdTagSrbBuffer);
+    if (0 == Descriptors)
+        return SRB_STATUS_INTERNAL_ERROR;
+
+    /* pair the destination ranges with the token ranges, starting at the token offset */
+    Offset = SpdGetBe64(DataBuffer + 8);
+    SourceIndex = 0;
+    DescriptorCount = 0;
+    for (ULONG I = 0; RangeCount > I; I++)
+    {
+        PUINT8 Range = DataBuffer + HeaderLength + I * 16;
+        UINT64 BlockAddress = SpdGetBe64(Range);
+        UINT32 BlockCount = SpdGetBe32(Range + 8);
+        UINT64 EndBlockAddress = BlockAddress + BlockCount;
+
+        if (EndBlockAddress < BlockAddress ||
+            EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
+        {
+            SpdFree(Descriptors, SpdTagSrbBuffer);
+            return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+        }
+
+        SpdScsiInvalidateTokens(StorageUnit, BlockAddress, BlockCount);
+        SpdStorageUnitSetAllocated(StorageUnit, BlockAddress, BlockCount, TRUE);
+
+        while (0 < BlockCount)
+        {
+            UINT32 CopyCount;
+
+            while (Token.RangeCount > SourceIndex && Offset >= Token.Ranges[SourceIndex].BlockCount)
+                Offset -= Token.Ranges[SourceIndex++].BlockCount;
+            if (Token.RangeCount <= SourceIndex || DescriptorCapacity <= DescriptorCount)
+            {
+                /* the destination is larger than the data the token represents */
+                SpdFree(Descriptors, SpdTagSrbBuffer);
+                return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                    SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+            }
+
+            CopyCount = (UINT32)(Token.Ranges[SourceIndex].BlockCount - Offset);
+            if (CopyCount > BlockCount)
+                CopyCount = BlockCount;
+
+            Descriptors[DescriptorCount].BlockAddress = BlockAddress;
+            Descriptors[DescriptorCount].SourceBlockAddress =
+                Token.Ranges[SourceIndex].BlockAddress + Offset;
+            Descriptors[DescriptorCount].BlockCount = CopyCount;
+            Descriptors[DescriptorCount].Reserved = 0;
+            DescriptorCount++;
+
+            BlockAddress += CopyCount;
+            BlockCount -= CopyCount;
+            Offset += CopyCount;
+        }
+    }
+
+    if (0 == DescriptorCount ||
+        DescriptorCount * sizeof *Descriptors > StorageUnit->StorageUnitParams.MaxTransferLength)
+    {
+        SpdFree(Descriptors, SpdTagSrbBuffer);
+        return 0 == DescriptorCount ?
+            SRB_STATUS_SUCCESS :
+            SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+    }
+
+    return SpdScsiPostSrbEx(DeviceExtension, StorageUnit, Srb,
+        SpdIoctlTransactCopyKind, SpdSrbLane(Srb),
+        Descriptors, DescriptorCount * sizeof *Descriptors);
+}
+
+static VOID SpdScsiMakeRodToken(SPD_STORAGE_UNIT *StorageUnit, UINT64 Id, PUINT8 Buffer)
+{
+    /* the token is opaque to the initiator; it names this storage unit and a token slot */
+    RtlZeroMemory(Buffer, SPD_ROD_TOKEN_LENGTH);
+    SpdPutBe32(Buffer + 0, SPD_ROD_TYPE_POINT_IN_TIME_COPY);
+    SpdPutBe16(Buffer + 6, SPD_ROD_TOKEN_LENGTH - 8);
+    RtlCopyMemory(Buffer + 8, &StorageUnit->StorageUnitParams.Guid, sizeof(GUID));
+    SpdPutBe64(Buffer + 24, Id);
+}
+
+static VOID SpdScsiInvalidateTokens(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount)
+{
+    KIRQL Irql;
+
+    /* fast path: no tokens, no locking */
+    if (0 == StorageUnit->TokenCount)
+        return;
+
+    /* a token represents a point-in-time copy; writing to its ranges revokes it */
+    KeAcquireSpinLock(&StorageUnit->TokenSpinLock, &Irql);
+    for (ULONG I = 0; SPD_TOKEN_COUNT > I; I++)
+    {
+        SPD_TOKEN *Token = &StorageUnit->Tokens[I];
+        if (0 == Token->Id)
+            continue;
+        for (ULONG J = 0; Token->RangeCount > J; J++)
+            if (BlockAddress < Token->Ranges[J].BlockAddress + Token->Ranges[J].BlockCount &&
+                Token->Ranges[J].BlockAddress < BlockAddress + BlockCount)
+            {
+                Token->Id = 0;
+                StorageUnit->TokenCount--;
+                break;
+            }
+    }
+    KeReleaseSpinLock(&StorageUnit->TokenSpinLock, Irql);
+}
+
+static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, UINT8 Kind, UINT8 Lane, ULONG DataLength)
+{
+    return SpdScsiPostSrbEx(DeviceExtension, StorageUnit, Srb, Kind, Lane, 0, DataLength);
+}
+
+static UCHAR SpdScsiPostSrbEx(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Srb, UINT8 Kind, UINT8 Lane, PVOID OwnedDataBuffer, ULONG DataLength)
 {
     SPD_SRB_EXTENSION *SrbExtension;
     ULONG StorResult;
@@ -663,8 +1531,21 @@ static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
     SrbExtension = SpdSrbExtension(Srb);
     RtlZeroMemory(SrbExtension, sizeof(SPD_SRB_EXTENSION));
     SrbExtension->StorageUnit = StorageUnit;
-
-    if (0 != DataLength)
+    SrbExtension->Kind = Kind;
+    SrbExtension->Lane = Lane;
+    /* I/O that exceeds MaxTransferLength is split into chunks that are dispatched in parallel */
+    SrbExtension->ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    if (SpdIoctlTransactUnmapKind == Kind)
+        SrbExtension->DescriptorCount = DataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
+
+    if (0 != OwnedDataBuffer)
+    {
+        /* data built by the miniport rather than taken from the SRB; freed on completion */
+        SrbExtension->SystemDataBuffer = OwnedDataBuffer;
+        SrbExtension->SystemDataBufferOwned = TRUE;
+        SrbExtension->SystemDataLength = DataLength;
+    }
+    else if (0 != DataLength)
     {
         StorResult = StorPortGetSystemAddress(DeviceExtension, Srb, &SrbExtension->SystemDataBuffer);
         if (STOR_STATUS_SUCCESS != StorResult)
@@ -676,20 +1557,148 @@ static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
     }
 
     Result = SpdIoqPostSrb(StorageUnit->Ioq, Srb);
-    return NT_SUCCESS(Result) ? SRB_STATUS_PENDING : SRB_STATUS_ABORTED;
+    if (!NT_SUCCESS(Result))
+    {
+        if (0 != OwnedDataBuffer)
+            SpdFree(OwnedDataBuffer, SpdTagSrbBuffer);
+        return SRB_STATUS_ABORTED;
+    }
+
+    /* if the dispatcher uses a shared-memory ring, hand it the SRB without a transact */
+    SpdStorageUnitPostRing(DeviceExtension, StorageUnit);
+
+    return SRB_STATUS_PENDING;
 }
 
-VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuffer)
+static UINT8 SpdSrbLane(PVOID Srb)
 {
-    ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
+#if NTDDI_VERSION >= NTDDI_WIN8
+    /* the I/O priority hint is only available in an extended SRB */
+    if (SRB_FUNCTION_STORAGE_REQUEST_BLOCK == ((PSCSI_REQUEST_BLOCK)Srb)->Function)
+    {
+        /* 0 is both IoPriorityVeryLow and "not set"; the latter is far more common */
+        ULONG RequestPriority = ((PSTORAGE_REQUEST_BLOCK)Srb)->RequestPriority;
+        if (IoPriorityHigh <= RequestPriority)
+            return SpdIoqLaneHigh;
+        if (IoPriorityLow == RequestPriority)
+            return SpdIoqLaneLow;
+    }
+#else
+    UNREFERENCED_PARAMETER(Srb);
+#endif
 
-    SPD_SRB_EXTENSION *SrbExtension = SrbExtension0;
+    return SpdIoqLaneNormal;
+}
+
+static BOOLEAN SpdSrbMapDataBuffer(SPD_SRB_CHUNK *Chunk, BOOLEAN ReadOnly)
+{
+    ASSERT(APC_LEVEL >= KeGetCurrentIrql());
+
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+    ULONG ChunkLength = Chunk->Length;
+    SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
+    SPD_DEVICE_EXTENSION *DeviceExtension = StorageUnit->Ioq->DeviceExtension;
+    PVOID Srb = SrbExtension->Srb;
+    PMDL SrbMdl, Mdl;
+    PUINT8 VirtualAddress, MdlVirtualAddress;
+    PVOID MappedDataBuffer;
+    KIRQL Irql;
+
+    if (0 == StorageUnit->StorageUnitParams.ZeroCopyThreshold ||
+        StorageUnit->StorageUnitParams.ZeroCopyThreshold > ChunkLength)
+        return FALSE;
+
+    SrbMdl = 0;
+    if (STOR_STATUS_SUCCESS != StorPortGetOriginalMdl(DeviceExtension, Srb, &SrbMdl) || 0 == SrbMdl)
+        return FALSE;
+
+    /*
+     * Only whole pages of a caller's buffer are mapped. Pool buffers and partial pages
+     * may share their pages with unrelated kernel data, which user mode must never see.
+     */
+    VirtualAddress = (PUINT8)SrbGetDataBuffer(Srb) + Chunk->Offset;
+    MdlVirtualAddress = MmGetMdlVirtualAddress(SrbMdl);
+    if (FlagOn(SrbMdl->MdlFlags, MDL_SOURCE_IS_NONPAGED_POOL) ||
+        0 != BYTE_OFFSET(VirtualAddress) || 0 != BYTE_OFFSET(ChunkLength) ||
+        MdlVirtualAddress > VirtualAddress ||
+        MdlVirtualAddress + MmGetMdlByteCount(SrbMdl) < VirtualAddress + ChunkLength)
+        return FALSE;
+
+    Mdl = IoAllocateMdl(VirtualAddress, ChunkLength, FALSE, FALSE, 0);
+    if (0 == Mdl)
+        return FALSE;
+    IoBuildPartialMdl(SrbMdl, Mdl, VirtualAddress, ChunkLength);
+
+    try
+    {
+        MappedDataBuffer = MmMapLockedPagesSpecifyCache(Mdl, UserMode, MmCached, 0, FALSE,
+            NormalPagePriority | MdlMappingNoExecute | (ReadOnly ? MdlMappingNoWrite : 0));
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        MappedDataBuffer = 0;
+    }
+    if (0 == MappedDataBuffer)
+    {
+        IoFreeMdl(Mdl);
+        return FALSE;
+    }
+
+    Chunk->MappedDataBuffer = MappedDataBuffer;
+    Chunk->MappedMdl = Mdl;
+    Chunk->MappedProcess = PsGetCurrentProcess();
+
+    /* the storage unit and its I/O queue must outlive the mapping */
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+    InterlockedIncrement(&StorageUnit->RefCount);
+    InsertTailList(&DeviceExtension->MappedList, &Chunk->MappedEntry);
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+    return TRUE;
+}
+
+VOID SpdSrbUnmapDataBuffer(PVOID DeviceExtension0, SPD_SRB_CHUNK *Chunk)
+{
+    ASSERT(APC_LEVEL >= KeGetCurrentIrql());
+    ASSERT(PsGetCurrentProcess() == Chunk->MappedProcess);
+
+    SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
+    KIRQL Irql;
+
+    /* caller owns the chunk and must release the storage unit reference taken by the mapping */
+    MmUnmapLockedPages(Chunk->MappedDataBuffer, Chunk->MappedMdl);
+    IoFreeMdl(Chunk->MappedMdl);
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+    RemoveEntryList(&Chunk->MappedEntry);
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+    Chunk->MappedDataBuffer = 0;
+    Chunk->MappedMdl = 0;
+    Chunk->MappedProcess = 0;
+}
+
+static VOID SpdSrbExecuteScsiPrepareEx(PVOID Chunk0, PVOID Context, PVOID DataBuffer,
+    BOOLEAN ZeroCopy)
+{
+    ASSERT(DISPATCH_LEVEL >= KeGetCurrentIrql());
+
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
     SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
     SPD_IOCTL_TRANSACT_REQ *Req = Context;
     PVOID Srb = SrbExtension->Srb;
     PCDB Cdb;
     UINT32 ForceUnitAccess;
-    ULONG ChunkLength;
+    ULONG Length;
+
+    /* a merged request spans the data of all its chunks; it is never mapped */
+    Length = Chunk->Length;
+    for (SPD_SRB_CHUNK *MergedChunk = Chunk->MergeNext; 0 != MergedChunk;
+        MergedChunk = MergedChunk->MergeNext)
+        Length = MergedChunk->MergeOffset + MergedChunk->Length;
+    if (0 != Chunk->MergeNext)
+        ZeroCopy = FALSE;
 
     Cdb = SrbGetCdb(Srb);
     switch (Cdb->AsByte[0])
@@ -698,49 +1707,51 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
     case SCSIOP_READ:
     case SCSIOP_READ12:
     case SCSIOP_READ16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = Chunk->Hint;
         Req->Kind = SpdIoctlTransactReadKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Read.BlockAddress,
             &Req->Op.Read.BlockCount,
             &ForceUnitAccess);
         Req->Op.Read.ForceUnitAccess =
-            StorageUnit->StorageUnitParams.CacheSupported ? ForceUnitAccess : 1;
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+            StorageUnit->WriteCacheEnabled ? ForceUnitAccess : 1;
         Req->Op.Read.BlockAddress +=
-            SrbExtension->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
+            Chunk->Offset / StorageUnit->StorageUnitParams.BlockLength;
         Req->Op.Read.BlockCount =
-            ChunkLength / StorageUnit->StorageUnitParams.BlockLength;
+            Length / StorageUnit->StorageUnitParams.BlockLength;
+        if (ZeroCopy && SpdSrbMapDataBuffer(Chunk, FALSE))
+            Req->MappedDataBuffer = (UINT64)(UINT_PTR)Chunk->MappedDataBuffer;
         return;
 
     case SCSIOP_WRITE6:
     case SCSIOP_WRITE:
     case SCSIOP_WRITE12:
     case SCSIOP_WRITE16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = Chunk->Hint;
         Req->Kind = SpdIoctlTransactWriteKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Write.BlockAddress,
             &Req->Op.Write.BlockCount,
             &ForceUnitAccess);
         Req->Op.Write.ForceUnitAccess =
-            StorageUnit->StorageUnitParams.CacheSupported ? ForceUnitAccess : 1;
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+            StorageUnit->WriteCacheEnabled ? ForceUnitAccess : 1;
         Req->Op.Write.BlockAddress +=
-            SrbExtension->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
+            Chunk->Offset / StorageUnit->StorageUnitParams.BlockLength;
         Req->Op.Write.BlockCount =
-            ChunkLength / StorageUnit->StorageUnitParams.BlockLength;
-        RtlCopyMemory(DataBuffer,
-            (PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset, ChunkLength);
+            Length / StorageUnit->StorageUnitParams.BlockLength;
+        if (ZeroCopy && SpdSrbMapDataBuffer(Chunk, TRUE))
+            Req->MappedDataBuffer = (UINT64)(UINT_PTR)Chunk->MappedDataBuffer;
+        else
+            for (SPD_SRB_CHUNK *MergedChunk = Chunk; 0 != MergedChunk;
+                MergedChunk = MergedChunk->MergeNext)
+                RtlCopyMemory((PUINT8)DataBuffer + MergedChunk->MergeOffset,
+                    (PUINT8)MergedChunk->SrbExtension->SystemDataBuffer + MergedChunk->Offset,
+                    MergedChunk->Length);
         return;
 
     case SCSIOP_SYNCHRONIZE_CACHE:
     case SCSIOP_SYNCHRONIZE_CACHE16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = Chunk->Hint;
         Req->Kind = SpdIoctlTransactFlushKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Flush.BlockAddress,
@@ -749,9 +1760,9 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
         return;
 
     case SCSIOP_UNMAP:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = Chunk->Hint;
         Req->Kind = SpdIoctlTransactUnmapKind;
-        Req->Op.Unmap.Count = SrbExtension->SystemDataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        Req->Op.Unmap.Count = SrbExtension->DescriptorCount;
         for (ULONG I = 0, N = Req->Op.Unmap.Count; N > I; I++)
         {
             PUNMAP_BLOCK_DESCRIPTOR Src = &((PUNMAP_LIST_HEADER)SrbExtension->SystemDataBuffer)->Descriptors[I];
@@ -774,29 +1785,81 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
         }
         return;
 
+    case SCSIOP_WRITE_SAME:
+    case SCSIOP_WRITE_SAME16:
+        Req->Hint = Chunk->Hint;
+        Req->Kind = SpdIoctlTransactWriteSameKind;
+        SpdCdbGetRange(Cdb,
+            &Req->Op.WriteSame.BlockAddress,
+            &Req->Op.WriteSame.BlockCount,
+            0);
+        /* UNMAP is only a hint; without unmap support the blocks are written */
+        Req->Op.WriteSame.Unmap = StorageUnit->StorageUnitParams.UnmapSupported &&
+            0 != (Cdb->AsByte[1] & SPD_CDB_WRITE_SAME_UNMAP);
+        RtlCopyMemory(DataBuffer, SrbExtension->SystemDataBuffer, Chunk->Length);
+        return;
+
+    case SCSIOP_WRITE_USING_TOKEN:
+        /* SystemDataBuffer holds the copy descriptors built when the SRB was posted */
+        Req->Hint = Chunk->Hint;
+        Req->Kind = SpdIoctlTransactCopyKind;
+        Req->Op.Copy.Count = SrbExtension->SystemDataLength / sizeof(SPD_IOCTL_COPY_DESCRIPTOR);
+        RtlCopyMemory(DataBuffer, SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength);
+        return;
+
+    case SCSIOP_MODE_SELECT:
+    case SCSIOP_MODE_SELECT10:
+        /* SystemDataBuffer holds a copy of the caching page made when the SRB was posted */
+        Req->Hint = Chunk->Hint;
+        Req->Kind = SpdIoctlTransactSetCacheKind;
+        Req->Op.SetCache.WriteCacheEnabled =
+            ((PMODE_CACHING_PAGE)SrbExtension->SystemDataBuffer)->WriteCacheEnable;
+        return;
+
     default:
         ASSERT(FALSE);
         return;
     }
 }
 
-UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension0, PVOID Context, PVOID DataBuffer)
+VOID SpdSrbExecuteScsiPrepare(PVOID Chunk, PVOID Context, PVOID DataBuffer)
 {
-    ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
+    SpdSrbExecuteScsiPrepareEx(Chunk, Context, DataBuffer, FALSE);
+}
 
-    SPD_SRB_EXTENSION *SrbExtension = SrbExtension0;
-    SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
+VOID SpdSrbExecuteScsiPrepareZeroCopy(PVOID Chunk, PVOID Context, PVOID DataBuffer)
+{
+    /* must be called in the context of the transact process */
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    SpdSrbExecuteScsiPrepareEx(Chunk, Context, DataBuffer, TRUE);
+}
+
+UCHAR SpdSrbExecuteScsiComplete(PVOID Chunk0, PVOID Context, PVOID DataBuffer)
+{
+    ASSERT(DISPATCH_LEVEL >= KeGetCurrentIrql());
+
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
     SPD_IOCTL_TRANSACT_RSP *Rsp = Context;
     PVOID Srb = SrbExtension->Srb;
     PCDB Cdb;
-    ULONG ChunkLength;
 
     if (SCSISTAT_GOOD != Rsp->Status.ScsiStatus)
+    {
+        /*
+         * Chunks of the same SRB may complete concurrently. Only the first failing chunk
+         * gets to set the sense data; the SRB completes with its status.
+         */
+        if (0 != InterlockedExchange(&SrbExtension->ErrorReported, 1))
+            return SRB_STATUS_SUCCESS;
+
         return SpdScsiErrorEx(Srb,
             Rsp->Status.SenseKey,
             Rsp->Status.ASC,
             Rsp->Status.ASCQ,
             Rsp->Status.InformationValid ? &Rsp->Status.Information : 0);
+    }
 
     Cdb = SrbGetCdb(Srb);
     switch (Cdb->AsByte[0])
@@ -805,35 +1868,34 @@ UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension0, PVOID Context, PVOID DataBu
     case SCSIOP_READ:
     case SCSIOP_READ12:
     case SCSIOP_READ16:
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
-        if (0 != DataBuffer)
-            RtlCopyMemory((PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset,
-                DataBuffer, ChunkLength);
-        else
-            RtlZeroMemory((PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset,
-                ChunkLength);
-        SrbExtension->ChunkOffset += ChunkLength;
-        /* if we are done return SUCCESS; if we have more chunks return PENDING */
-        return SrbExtension->ChunkOffset >= SrbExtension->SystemDataLength ?
-            SRB_STATUS_SUCCESS : SRB_STATUS_PENDING;
+        /* if the chunk is mapped (zero-copy) user mode has already placed the data */
+        if (0 == Chunk->MappedDataBuffer)
+        {
+            if (0 != DataBuffer)
+                RtlCopyMemory((PUINT8)SrbExtension->SystemDataBuffer + Chunk->Offset,
+                    DataBuffer, Chunk->Length);
+            else
+                RtlZeroMemory((PUINT8)SrbExtension->SystemDataBuffer + Chunk->Offset,
+                    Chunk->Length);
+        }
+        return SRB_STATUS_SUCCESS;
+
+    case SCSIOP_MODE_SELECT:
+    case SCSIOP_MODE_SELECT10:
+        InterlockedExchange(&SrbExtension->StorageUnit->WriteCacheEnabled,
+            ((PMODE_CACHING_PAGE)SrbExtension->SystemDataBuffer)->WriteCacheEnable);
+        return SRB_STATUS_SUCCESS;
 
     case SCSIOP_WRITE6:
     case SCSIOP_WRITE:
     case SCSIOP_WRITE12:
     case SCSIOP_WRITE16:
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
-        SrbExtension->ChunkOffset += ChunkLength;
-        /* if we are done return SUCCESS; if we have more chunks return PENDING */
-        return SrbExtension->ChunkOffset >= SrbExtension->SystemDataLength ?
-            SRB_STATUS_SUCCESS : SRB_STATUS_PENDING;
-
     case SCSIOP_SYNCHRONIZE_CACHE:
     case SCSIOP_SYNCHRONIZE_CACHE16:
     case SCSIOP_UNMAP:
+    case SCSIOP_WRITE_SAME:
+    case SCSIOP_WRITE_SAME16:
+    case SCSIOP_WRITE_USING_TOKEN:
         return SRB_STATUS_SUCCESS;
 
     default:
@@ -842,6 +1904,55 @@ UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension0, PVOID Context, PVOID DataBu
     }
 }
 
+VOID SpdSrbExecuteScsiRollback(PVOID SrbExtension0)
+{
+    ASSERT(DISPATCH_LEVEL >= KeGetCurrentIrql());
+
+    SPD_SRB_EXTENSION *SrbExtension = SrbExtension0;
+    PCDB Cdb = SrbGetCdb(SrbExtension->Srb);
+
+    /* allocation bits cleared at post time must be set back if the blocks may have been kept */
+    switch (Cdb->AsByte[0])
+    {
+    case SCSIOP_UNMAP:
+        SpdScsiSetUnmapAllocated(SrbExtension->StorageUnit,
+            SrbExtension->SystemDataBuffer, SrbExtension->DescriptorCount, TRUE);
+        break;
+    case SCSIOP_WRITE_SAME:
+    case SCSIOP_WRITE_SAME16:
+        {
+            UINT64 BlockAddress;
+            UINT32 BlockCount;
+
+            SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+            SpdStorageUnitSetAllocated(SrbExtension->StorageUnit,
+                BlockAddress, BlockCount, TRUE);
+        }
+        break;
+    }
+}
+
+BOOLEAN SpdSrbCanMerge(SPD_SRB_EXTENSION *SrbExtension, SPD_SRB_EXTENSION *NextSrbExtension)
+{
+    UINT64 BlockAddress, NextBlockAddress;
+    UINT32 BlockCount, NextBlockCount;
+    UINT32 ForceUnitAccess, NextForceUnitAccess;
+
+    /* only reads with reads and writes with writes; the FUA bit must also match */
+    if (SrbExtension->Kind != NextSrbExtension->Kind ||
+        (SpdIoctlTransactReadKind != SrbExtension->Kind &&
+            SpdIoctlTransactWriteKind != SrbExtension->Kind))
+        return FALSE;
+
+    SpdCdbGetRange(SrbGetCdb(SrbExtension->Srb),
+        &BlockAddress, &BlockCount, &ForceUnitAccess);
+    SpdCdbGetRange(SrbGetCdb(NextSrbExtension->Srb),
+        &NextBlockAddress, &NextBlockCount, &NextForceUnitAccess);
+
+    return BlockAddress + BlockCount == NextBlockAddress &&
+        ForceUnitAccess == NextForceUnitAccess;
+}
+
 static UCHAR SpdScsiErrorEx(PVOID Srb,
     UCHAR SenseKey,
     UCHAR AdditionalSenseCode,
@@ -893,7 +2004,9 @@ static VOID SpdCdbGetRange(PCDB Cdb,
         SCSIOP_WRITE12 == Cdb->AsByte[0] ||
         SCSIOP_WRITE16 == Cdb->AsByte[0] ||
         SCSIOP_SYNCHRONIZE_CACHE == Cdb->AsByte[0] ||
-        SCSIOP_SYNCHRONIZE_CACHE16 == Cdb->AsByte[0]);
+        SCSIOP_SYNCHRONIZE_CACHE16 == Cdb->AsByte[0] ||
+        SCSIOP_WRITE_SAME == Cdb->AsByte[0] ||
+        SCSIOP_WRITE_SAME16 == Cdb->AsByte[0]);
 
     switch (Cdb->AsByte[0] & 0xE0)
     {
@@ -50,7 +50,13 @@ NTSTATUS SpdDeviceExtensionInit(SPD_DEVICE_EXTENSION *DeviceExtension, PVOID Bus
 
     KeInitializeSpinLock(&DeviceExtension->SpinLock);
     DeviceExtension->DeviceObject = BusInformation;
+    InitializeListHead(&DeviceExtension->MappedList);
+    ExInitializeFastMutex(&DeviceExtension->ProvisionMutex);
     DeviceExtension->StorageUnitCapacity = SpdStorageUnitCapacity;
+    DeviceExtension->StorageUnitRundown =
+        (EX_RUNDOWN_REF *)&DeviceExtension->StorageUnits[SpdStorageUnitCapacity];
+    for (ULONG I = 0; SpdStorageUnitCapacity > I; I++)
+        ExInitializeRundownProtection(&DeviceExtension->StorageUnitRundown[I]);
     SpdGlobalDeviceExtension = DeviceExtension;
 
     Result = STATUS_SUCCESS;
@@ -88,7 +94,7 @@ static VOID SpdDeviceExtensionNotifyRoutine(HANDLE ParentId, HANDLE ProcessId0,
         return;
 
     ULONG ProcessId = (ULONG)(UINT_PTR)ProcessId0;
-    UINT8 Bitmap[32];
+    UINT8 Bitmap[SPD_STORAGE_UNIT_BITMAP_SIZE];
     ULONG Count;
 
     KeEnterCriticalRegion();
@@ -96,6 +102,11 @@ static VOID SpdDeviceExtensionNotifyRoutine(HANDLE ParentId, HANDLE ProcessId0,
 
     ASSERT(0 != SpdGlobalDeviceExtension);
 
+    /* locked pages must be unlocked before the process address space goes away */
+    SpdStorageUnitReleaseBufferPools(SpdGlobalDeviceExtension, ProcessId);
+    SpdStorageUnitReleaseRings(SpdGlobalDeviceExtension, ProcessId);
+    SpdStorageUnitReleaseAllocationMaps(SpdGlobalDeviceExtension, ProcessId);
+
     Count = SpdStorageUnitGetUseBitmap(SpdGlobalDeviceExtension, &ProcessId, Bitmap);
 
     for (ULONG I = 0; 0 < Count && sizeof Bitmap * 8 > I; I++)
@@ -105,6 +116,9 @@ static VOID SpdDeviceExtensionNotifyRoutine(HANDLE ParentId, HANDLE ProcessId0,
             Count--;
         }
 
+    /* zero-copy mappings go last, so that SRB's aborted by unprovisioning complete */
+    SpdStorageUnitReleaseMappedChunks(SpdGlobalDeviceExtension, ProcessId);
+
     ExReleaseResourceLite(&SpdGlobalDeviceResource);
     KeLeaveCriticalRegion();
 }
@@ -154,8 +168,12 @@ NTSTATUS SpdStorageUnitProvision(
 
     RtlZeroMemory(StorageUnit, sizeof *StorageUnit);
     StorageUnit->RefCount = 1;
+    KeInitializeSpinLock(&StorageUnit->BufferSpinLock);
+    KeInitializeSpinLock(&StorageUnit->TokenSpinLock);
+    ExInitializeRundownProtection(&StorageUnit->AllocationMapRundown);
     RtlCopyMemory(&StorageUnit->StorageUnitParams, StorageUnitParams,
         sizeof *StorageUnitParams);
+    StorageUnit->WriteCacheEnabled = StorageUnitParams->CacheSupported;
     /* "left align" ProductId except that we allow all-NUL for testing */
     if ('\0' != StorageUnit->StorageUnitParams.ProductId[0])
         for (UCHAR *P = StorageUnit->StorageUnitParams.ProductId,
@@ -193,10 +211,11 @@ NTSTATUS SpdStorageUnitProvision(
     StorageUnit->OwnerProcessId = ProcessId;
     StorageUnit->TransactProcessId = ProcessId;
 
-    Result = SpdIoqCreate(DeviceExtension, &StorageUnit->Ioq);
+    Result = SpdIoqCreate(DeviceExtension, &StorageUnit->StorageUnitParams, &StorageUnit->Ioq);
     if (!NT_SUCCESS(Result))
         goto exit;
 
+    ExAcquireFastMutex(&DeviceExtension->ProvisionMutex);
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
     DuplicateUnit = 0;
     Btl = (UINT32)-1;
@@ -219,10 +238,13 @@ NTSTATUS SpdStorageUnitProvision(
     }
     if (0 == DuplicateUnit && -1 != Btl)
     {
-        DeviceExtension->StorageUnits[SPD_INDEX_FROM_BTL(Btl)] = StorageUnit;
+        /* publish the fully constructed unit to lock-free lookups */
+        WritePointerRelease((PVOID *)&DeviceExtension->StorageUnits[SPD_INDEX_FROM_BTL(Btl)],
+            StorageUnit);
         DeviceExtension->StorageUnitCount++;
     }
     KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+    ExReleaseFastMutex(&DeviceExtension->ProvisionMutex);
 
     if (0 != DuplicateUnit)
     {
@@ -263,10 +285,13 @@ NTSTATUS SpdStorageUnitUnprovision(
 
     NTSTATUS Result;
     SPD_STORAGE_UNIT *StorageUnit;
+    BOOLEAN Removed;
     KIRQL Irql;
 
+    ExAcquireFastMutex(&DeviceExtension->ProvisionMutex);
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
     StorageUnit = 0;
+    Removed = FALSE;
     if (0 != Guid)
     {
         for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
@@ -292,10 +317,23 @@ NTSTATUS SpdStorageUnitUnprovision(
     if (0 != StorageUnit && ProcessId == StorageUnit->OwnerProcessId)
     {
         DeviceExtension->StorageUnitCount--;
-        DeviceExtension->StorageUnits[Index] = 0;
+        WritePointerRelease((PVOID *)&DeviceExtension->StorageUnits[Index], 0);
+        Removed = TRUE;
     }
     KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
 
+    if (Removed)
+    {
+        /*
+         * Wait for lookups that may have seen the unit to take their reference.
+         * The slot cannot be reused until its rundown protection is reinitialized,
+         * because provisioning is serialized by the ProvisionMutex.
+         */
+        ExWaitForRundownProtectionRelease(&DeviceExtension->StorageUnitRundown[Index]);
+        ExReInitializeRundownProtection(&DeviceExtension->StorageUnitRundown[Index]);
+    }
+    ExReleaseFastMutex(&DeviceExtension->ProvisionMutex);
+
     if (0 == StorageUnit)
     {
         Result = STATUS_OBJECT_NAME_NOT_FOUND;
@@ -319,86 +357,254 @@ exit:
     return Result;
 }
 
-SPD_STORAGE_UNIT *SpdStorageUnitReferenceByBtl(
+static SPD_STORAGE_UNIT *SpdStorageUnitReferenceByIndex(
     SPD_DEVICE_EXTENSION *DeviceExtension,
-    UINT32 Btl)
+    ULONG Index)
 {
+    EX_RUNDOWN_REF *Rundown = &DeviceExtension->StorageUnitRundown[Index];
     SPD_STORAGE_UNIT *StorageUnit;
-    UINT8 B, T, L;
-    KIRQL Irql;
 
-    B = SPD_IOCTL_BTL_B(Btl);
-    T = SPD_IOCTL_BTL_T(Btl);
-    L = SPD_IOCTL_BTL_L(Btl);
-
-    if (0 != B || 0 != L)
+    /*
+     * Lookups do not take the device extension lock. Rundown protection keeps
+     * unprovisioning from dropping the slot reference until we have taken ours.
+     */
+    if (!ExAcquireRundownProtection(Rundown))
         return 0;
-
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit = DeviceExtension->StorageUnitCapacity > T ? DeviceExtension->StorageUnits[T] : 0;
+    StorageUnit = ReadPointerAcquire((PVOID *)&DeviceExtension->StorageUnits[Index]);
     if (0 != StorageUnit)
-        StorageUnit->RefCount++;
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+        InterlockedIncrement(&StorageUnit->RefCount);
+    ExReleaseRundownProtection(Rundown);
 
     return StorageUnit;
 }
 
+SPD_STORAGE_UNIT *SpdStorageUnitReferenceByBtl(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    UINT32 Btl)
+{
+    ULONG Index = SPD_INDEX_FROM_BTL(Btl);
+
+    if (DeviceExtension->StorageUnitCapacity <= Index)
+        return 0;
+
+    return SpdStorageUnitReferenceByIndex(DeviceExtension, Index);
+}
+
 static SPD_STORAGE_UNIT *SpdStorageUnitReferenceByDevice(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PDEVICE_OBJECT DeviceObject)
 {
-    SPD_STORAGE_UNIT *StorageUnit;
-    KIRQL Irql;
-
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit = 0;
     for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
     {
-        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
-        if (0 == Unit)
+        SPD_STORAGE_UNIT *StorageUnit = SpdStorageUnitReferenceByIndex(DeviceExtension, I);
+        if (0 == StorageUnit)
             continue;
 
-        if (DeviceObject == Unit->DeviceObject)
+        if (DeviceObject == StorageUnit->DeviceObject)
+            return StorageUnit;
+
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+    }
+
+    return 0;
+}
+
+VOID SpdStorageUnitDereference(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit)
+{
+    if (0 == InterlockedDecrement(&StorageUnit->RefCount))
+    {
+        if (0 != StorageUnit->BufferPool)
+            SpdBufferPoolDereference(DeviceExtension, StorageUnit->BufferPool);
+        if (0 != StorageUnit->Ring)
+            SpdRingDereference(DeviceExtension, StorageUnit->Ring);
+        SpdStorageUnitDeleteAllocationMap(StorageUnit);
+        SpdIoqDelete(StorageUnit->Ioq);
+        SpdFree(StorageUnit, SpdTagStorageUnit);
+    }
+}
+
+NTSTATUS SpdStorageUnitRegisterBufferPool(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 Buffer, ULONG BufferCount,
+    KPROCESSOR_MODE AccessMode, ULONG ProcessId)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    ULONG BufferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_BUFFER_POOL *BufferPool = 0, *OldBufferPool;
+    NTSTATUS Result;
+    KIRQL Irql;
+
+    if (0 != BufferCount)
+    {
+        if (0 == Buffer || 0 == BufferLength || BufferCount > MAXULONG / BufferLength)
         {
-            StorageUnit = Unit;
-            break;
+            Result = STATUS_INVALID_PARAMETER;
+            goto exit;
         }
+
+        BufferPool = SpdAllocNonPaged(sizeof *BufferPool, SpdTagBufferPool);
+        if (0 == BufferPool)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        RtlZeroMemory(BufferPool, sizeof *BufferPool);
+        BufferPool->RefCount = 1;
+        BufferPool->ProcessId = ProcessId;
+        BufferPool->BufferCount = BufferCount;
+        BufferPool->BufferLength = BufferLength;
+
+        /* the buffers stay locked for the lifetime of the pool */
+        Result = SpdLockUserBuffer(Buffer, BufferCount * BufferLength, AccessMode,
+            &BufferPool->Mdl, &BufferPool->SystemBuffer);
+        if (!NT_SUCCESS(Result))
+            goto exit;
     }
-    if (0 != StorageUnit)
-        StorageUnit->RefCount++;
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
 
-    return StorageUnit;
+    /* swap in the new pool (or none); the old pool goes away when its last user is done */
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    OldBufferPool = StorageUnit->BufferPool;
+    StorageUnit->BufferPool = BufferPool;
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    if (0 != OldBufferPool)
+        SpdBufferPoolDereference(DeviceExtension, OldBufferPool);
+
+    BufferPool = 0;
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != BufferPool)
+        SpdBufferPoolDereference(DeviceExtension, BufferPool);
+
+    return Result;
 }
 
-VOID SpdStorageUnitDereference(
+SPD_BUFFER_POOL *SpdStorageUnitReferenceBufferPool(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     SPD_STORAGE_UNIT *StorageUnit)
 {
-    BOOLEAN Delete;
+    SPD_BUFFER_POOL *BufferPool;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit->RefCount--;
-    Delete = 0 == StorageUnit->RefCount;
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+    UNREFERENCED_PARAMETER(DeviceExtension);
+
+    /* unlocked peek; most storage units do not register a buffer pool */
+    if (0 == ReadPointerNoFence((PVOID *)&StorageUnit->BufferPool))
+        return 0;
+
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    BufferPool = StorageUnit->BufferPool;
+    if (0 != BufferPool)
+        InterlockedIncrement(&BufferPool->RefCount);
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    return BufferPool;
+}
 
-    if (Delete)
+VOID SpdBufferPoolDereference(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_BUFFER_POOL *BufferPool)
+{
+    UNREFERENCED_PARAMETER(DeviceExtension);
+
+    if (0 == InterlockedDecrement(&BufferPool->RefCount))
     {
-        SpdIoqDelete(StorageUnit->Ioq);
-        SpdFree(StorageUnit, SpdTagStorageUnit);
+        if (0 != BufferPool->Mdl)
+            SpdUnlockUserBuffer(BufferPool->Mdl);
+        SpdFree(BufferPool, SpdTagBufferPool);
+    }
+}
+
+VOID SpdStorageUnitReleaseBufferPools(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId)
+{
+    SPD_BUFFER_POOL *BufferPool;
+    KIRQL Irql;
+
+    /* detach one buffer pool at a time; there can be too many to collect on the stack */
+    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    {
+        BufferPool = 0;
+
+        KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
+        if (0 != Unit)
+        {
+            KeAcquireSpinLockAtDpcLevel(&Unit->BufferSpinLock);
+            if (0 != Unit->BufferPool && ProcessId == Unit->BufferPool->ProcessId)
+            {
+                BufferPool = Unit->BufferPool;
+                Unit->BufferPool = 0;
+            }
+            KeReleaseSpinLockFromDpcLevel(&Unit->BufferSpinLock);
+        }
+        KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+        if (0 != BufferPool)
+            SpdBufferPoolDereference(DeviceExtension, BufferPool);
+    }
+}
+
+VOID SpdStorageUnitReleaseMappedChunks(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG ProcessId)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    PEPROCESS Process = PsGetCurrentProcess();
+    SPD_SRB_CHUNK *Chunk;
+    SPD_STORAGE_UNIT *StorageUnit;
+    PLIST_ENTRY MappedEntry;
+    KIRQL Irql;
+
+    /* mappings can only be removed within their process; process exit notifications run there */
+    if (ProcessId != (ULONG)(UINT_PTR)PsGetCurrentProcessId())
+        return;
+
+    for (;;)
+    {
+        Chunk = 0;
+
+        KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+        for (MappedEntry = DeviceExtension->MappedList.Flink;
+            &DeviceExtension->MappedList != MappedEntry;
+            MappedEntry = MappedEntry->Flink)
+        {
+            SPD_SRB_CHUNK *Entry = CONTAINING_RECORD(MappedEntry, SPD_SRB_CHUNK, MappedEntry);
+            if (Process == Entry->MappedProcess)
+            {
+                Chunk = Entry;
+                break;
+            }
+        }
+        KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+        if (0 == Chunk)
+            break;
+
+        /* the mapping holds a reference; the storage unit cannot go away under us */
+        StorageUnit = Chunk->SrbExtension->StorageUnit;
+        SpdIoqReleaseMappedChunk(StorageUnit->Ioq, Chunk);
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
     }
 }
 
 ULONG SpdStorageUnitGetUseBitmap(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PULONG PProcessId,
-    UINT8 Bitmap[32])
+    UINT8 Bitmap[SPD_STORAGE_UNIT_BITMAP_SIZE])
 {
     ULONG Count = 0;
     KIRQL Irql;
 
-    RtlZeroMemory(Bitmap, 32);
+    RtlZeroMemory(Bitmap, SPD_STORAGE_UNIT_BITMAP_SIZE);
 
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
     for (ULONG I = 0;
@@ -125,3 +125,60 @@ NTSTATUS SpdGetScsiAddress(
 
     return STATUS_SUCCESS;
 }
+
+NTSTATUS SpdLockUserBuffer(
+    UINT64 Buffer, ULONG Length,
+    KPROCESSOR_MODE AccessMode,
+    PMDL *PMdl, PVOID *PSystemBuffer)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    PMDL Mdl;
+    PVOID SystemBuffer;
+
+    *PMdl = 0;
+    *PSystemBuffer = 0;
+
+    /* the MDL is not associated with any Irp; it stays locked until SpdUnlockUserBuffer */
+    Mdl = IoAllocateMdl(
+        (PVOID)(UINT_PTR)Buffer,
+        Length,
+        FALSE,
+        FALSE,
+        0);
+    if (0 == Mdl)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    try
+    {
+        if (UserMode == AccessMode)
+            ProbeForWrite((PVOID)(UINT_PTR)Buffer, Length, 1);
+
+        MmProbeAndLockPages(Mdl, AccessMode, IoWriteAccess);
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(Mdl);
+        return GetExceptionCode();
+    }
+
+    SystemBuffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (0 == SystemBuffer)
+    {
+        SpdUnlockUserBuffer(Mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *PMdl = Mdl;
+    *PSystemBuffer = SystemBuffer;
+
+    return STATUS_SUCCESS;
+}
+
+VOID SpdUnlockUserBuffer(
+    PMDL Mdl)
+{
+    if (FlagOn(Mdl->MdlFlags, MDL_PAGES_LOCKED))
+        MmUnlockPages(Mdl);
+    IoFreeMdl(Mdl);
+}
@@ -46,6 +46,7 @@ typedef struct _RAWDISK
     HANDLE Mapping;
     PVOID Pointer;
     BOOLEAN Sparse;
+    BOOLEAN BlockClone;
 } RAWDISK;
 
 static inline BOOLEAN ExceptionFilter(ULONG Code, PEXCEPTION_POINTERS Pointers,
@@ -70,7 +71,7 @@ static VOID CopyBuffer(SPD_STORAGE_UNIT *StorageUnit,
     __try
     {
         if (0 != Src)
-            memcpy(Dst, Src, Length);
+            memmove(Dst, Src, Length);
         else
             memset(Dst, 0, Length);
     }
@@ -203,14 +204,198 @@ static BOOLEAN Unmap(SPD_STORAGE_UNIT *StorageUnit,
     return TRUE;
 }
 
+static BOOLEAN WriteSame(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN UnmapFlag,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.UnmapSupported || !UnmapFlag);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+    PUINT8 FileBuffer = (PUINT8)RawDisk->Pointer + BlockAddress * RawDisk->BlockLength;
+    UINT32 I;
+
+    if (UnmapFlag)
+    {
+        /* unmapped blocks read back as zeroes */
+        for (I = 0; RawDisk->BlockLength > I; I++)
+            if (0 != ((PUINT8)Buffer)[I])
+                break;
+        if (RawDisk->BlockLength == I)
+        {
+            SPD_UNMAP_DESCRIPTOR Descriptor;
+
+            Descriptor.BlockAddress = BlockAddress;
+            Descriptor.BlockCount = BlockCount;
+            Descriptor.Reserved = 0;
+            return Unmap(StorageUnit, &Descriptor, 1, Status);
+        }
+    }
+
+    for (I = 0; BlockCount > I; I++)
+    {
+        CopyBuffer(StorageUnit,
+            FileBuffer + (UINT64)I * RawDisk->BlockLength, Buffer, RawDisk->BlockLength,
+            SCSI_ADSENSE_WRITE_ERROR,
+            Status);
+        if (SCSISTAT_GOOD != Status->ScsiStatus)
+            return TRUE;
+    }
+
+    if (!StorageUnit->WriteCacheEnabled)
+        FlushInternal(StorageUnit, BlockAddress, BlockCount, Status);
+
+    return TRUE;
+}
+
+static BOOLEAN Copy(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_COPY_DESCRIPTOR Descriptors[], UINT32 Count,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.CopySupported);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+    PUINT8 FileBuffer;
+    UINT64 SourceOffset, Offset, Length, CopyLength;
+
+    for (UINT32 I = 0; Count > I; I++)
+    {
+        BOOLEAN Cloned = FALSE;
+
+        SourceOffset = Descriptors[I].SourceBlockAddress * RawDisk->BlockLength;
+        Offset = Descriptors[I].BlockAddress * RawDisk->BlockLength;
+        Length = (UINT64)Descriptors[I].BlockCount * RawDisk->BlockLength;
+
+#if defined(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+        if (RawDisk->BlockClone &&
+            (SourceOffset + Length <= Offset || Offset + Length <= SourceOffset))
+        {
+            /* share the source extents; the file system rejects ranges not cluster aligned */
+            DUPLICATE_EXTENTS_DATA Duplicate;
+            DWORD BytesTransferred;
+
+            FlushViewOfFile((PUINT8)RawDisk->Pointer + SourceOffset, (SIZE_T)Length);
+            FlushViewOfFile((PUINT8)RawDisk->Pointer + Offset, (SIZE_T)Length);
+
+            Duplicate.FileHandle = RawDisk->Handle;
+            Duplicate.SourceFileOffset.QuadPart = SourceOffset;
+            Duplicate.TargetFileOffset.QuadPart = Offset;
+            Duplicate.ByteCount.QuadPart = Length;
+            Cloned = DeviceIoControl(RawDisk->Handle,
+                FSCTL_DUPLICATE_EXTENTS_TO_FILE, &Duplicate, sizeof Duplicate,
+                0, 0, &BytesTransferred, 0);
+        }
+#endif
+
+        if (!Cloned)
+        {
+            FileBuffer = RawDisk->Pointer;
+
+            while (0 < Length)
+            {
+                CopyLength = 0x40000000 < Length ? 0x40000000 : Length;
+                if (SourceOffset < Offset && Offset < SourceOffset + Length)
+                    /* overlapping forward copy: move the tail first */
+                    CopyBuffer(StorageUnit,
+                        FileBuffer + Offset + Length - CopyLength,
+                        FileBuffer + SourceOffset + Length - CopyLength, (ULONG)CopyLength,
+                        SCSI_ADSENSE_WRITE_ERROR,
+                        Status);
+                else
+                {
+                    CopyBuffer(StorageUnit,
+                        FileBuffer + Offset, FileBuffer + SourceOffset, (ULONG)CopyLength,
+                        SCSI_ADSENSE_WRITE_ERROR,
+                        Status);
+                    SourceOffset += CopyLength;
+                    Offset += CopyLength;
+                }
+                if (SCSISTAT_GOOD != Status->ScsiStatus)
+                    return TRUE;
+                Length -= CopyLength;
+            }
+        }
+
+        if (!StorageUnit->WriteCacheEnabled)
+        {
+            FlushInternal(StorageUnit,
+                Descriptors[I].BlockAddress, Descriptors[I].BlockCount, Status);
+            if (SCSISTAT_GOOD != Status->ScsiStatus)
+                return TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
 static SPD_STORAGE_UNIT_INTERFACE RawDiskInterface =
 {
     Read,
     Write,
     Flush,
     Unmap,
+    WriteSame,
+    Copy,
 };
 
+static VOID InitAllocationMap(SPD_STORAGE_UNIT *StorageUnit,
+    HANDLE Handle, PVOID Pointer, BOOLEAN Sparse)
+{
+    UINT64 BlockCount = StorageUnit->StorageUnitParams.BlockCount;
+    UINT32 BlockLength = StorageUnit->StorageUnitParams.BlockLength;
+    UINT32 BlockShift = 0;
+    FILE_ALLOCATED_RANGE_BUFFER Query, Ranges[64];
+    DWORD BytesTransferred, Count;
+    UINT64 Offset, EndOffset;
+    BOOL Success;
+
+    /* one bit per 64KiB; the map is an optimization, so failure to enable it is fine */
+    while (64 * 1024 > ((UINT64)BlockLength << BlockShift))
+        BlockShift++;
+    if (ERROR_SUCCESS != SpdStorageUnitEnableAllocationMap(StorageUnit, BlockShift))
+        return;
+
+    /* only a sparse file knows its holes; otherwise every block stays allocated */
+    if (!Sparse)
+        return;
+
+    /* data written through the mapping may not have been allocated yet */
+    FlushViewOfFile(Pointer, 0);
+
+    SpdStorageUnitSetAllocationMap(StorageUnit, 0, BlockCount, FALSE);
+
+    Query.FileOffset.QuadPart = 0;
+    Query.Length.QuadPart = BlockCount * BlockLength;
+    for (;;)
+    {
+        Success = DeviceIoControl(Handle, FSCTL_QUERY_ALLOCATED_RANGES,
+            &Query, sizeof Query, Ranges, sizeof Ranges, &BytesTransferred, 0);
+        if (!Success && ERROR_MORE_DATA != GetLastError())
+        {
+            SpdStorageUnitSetAllocationMap(StorageUnit, 0, BlockCount, TRUE);
+            return;
+        }
+
+        Count = BytesTransferred / sizeof Ranges[0];
+        for (DWORD I = 0; Count > I; I++)
+        {
+            Offset = Ranges[I].FileOffset.QuadPart;
+            EndOffset = Offset + Ranges[I].Length.QuadPart;
+            SpdStorageUnitSetAllocationMap(StorageUnit,
+                Offset / BlockLength, (EndOffset + BlockLength - 1) / BlockLength - Offset / BlockLength,
+                TRUE);
+        }
+
+        if (Success || 0 == Count)
+            break;
+
+        Offset = Ranges[Count - 1].FileOffset.QuadPart + Ranges[Count - 1].Length.QuadPart;
+        Query.FileOffset.QuadPart = Offset;
+        Query.Length.QuadPart = BlockCount * BlockLength - Offset;
+    }
+}
+
 DWORD RawDiskCreate(PWSTR RawDiskFile,
     UINT64 BlockCount, UINT32 BlockLength,
     PWSTR ProductId, PWSTR ProductRevision,
@@ -226,6 +411,9 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
     PVOID Pointer = 0;
     FILE_SET_SPARSE_BUFFER Sparse;
     DWORD BytesTransferred;
+#if defined(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+    DWORD FileSystemFlags;
+#endif
     LARGE_INTEGER FileSize;
     BOOLEAN ZeroSize;
     SPD_PARTITION Partition;
@@ -259,6 +447,11 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
     StorageUnitParams.WriteProtected = WriteProtected;
     StorageUnitParams.CacheSupported = CacheSupported;
     StorageUnitParams.UnmapSupported = UnmapSupported;
+    StorageUnitParams.CopySupported = 1;
+    StorageUnitParams.OptimalTransferLength = StorageUnitParams.MaxTransferLength;
+    /* sparse files deallocate in 64KiB units */
+    if (UnmapSupported && 0 == 64 * 1024 % BlockLength)
+        StorageUnitParams.UnmapGranularity = 64 * 1024;
 
     RawDisk = malloc(sizeof *RawDisk);
     if (0 == RawDisk)
@@ -321,7 +514,8 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
         Partition.Type = 7;
         Partition.BlockAddress = 4096 >= BlockLength ? 4096 / BlockLength : 1;
         Partition.BlockCount = BlockCount - Partition.BlockAddress;
-        if (ERROR_SUCCESS == SpdDefinePartitionTable(&Partition, 1, Pointer))
+        if (ERROR_SUCCESS == SpdDefinePartitionTableEx(&Partition, 1,
+            SpdPartitionAlignmentBlockCount(&StorageUnitParams), Pointer))
         {
             FlushViewOfFile(Pointer, 0);
             FlushFileBuffers(Handle);
@@ -332,6 +526,10 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
     if (ERROR_SUCCESS != Error)
         goto exit;
 
+    /* unmapped blocks read back as zeroes, which the allocation map requires */
+    if (UnmapSupported)
+        InitAllocationMap(StorageUnit, Handle, Pointer, Sparse.SetSparse);
+
     memset(RawDisk, 0, sizeof *RawDisk);
     RawDisk->StorageUnit = StorageUnit;
     RawDisk->BlockCount = BlockCount;
@@ -340,6 +538,10 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
     RawDisk->Mapping = Mapping;
     RawDisk->Pointer = Pointer;
     RawDisk->Sparse = Sparse.SetSparse;
+#if defined(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+    RawDisk->BlockClone = GetVolumeInformationByHandleW(Handle, 0, 0, 0, 0, &FileSystemFlags, 0, 0) &&
+        0 != (FileSystemFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING);
+#endif
     StorageUnit->UserContext = RawDisk;
 
     *PRawDisk = RawDisk;
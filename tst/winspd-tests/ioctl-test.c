@@ -165,7 +165,7 @@ static void ioctl_provision_toomany_test(void)
         StorageUnitParams.MaxTransferLength = 512;
         Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
         ASSERT(ERROR_SUCCESS == Error);
-        ASSERT(SPD_IOCTL_BTL(0, I, 0) == Btl);
+        ASSERT(SPD_IOCTL_BTL_FROM_INDEX(I) == Btl);
     }
 
     memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
@@ -190,6 +190,204 @@ static void ioctl_provision_toomany_test(void)
     ASSERT(Success);
 }
 
+static void ioctl_provision_lun_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    static UINT32 BtlBuf[SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY];
+    UINT32 BtlBufSize;
+    ULONG Count;
+    CDB Cdb;
+    UINT8 DataBuffer[8 + 8 * SPD_IOCTL_STORAGE_UNIT_LUN_COUNT];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+    DWORD Error;
+    BOOL Success;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* fill every index that the driver's capacity allows; units 64 and up are on LUN's > 0 */
+    for (Count = 0; SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY > Count; Count++)
+    {
+        memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+        StorageUnitParams.Guid.Data1 = Count;
+        StorageUnitParams.Guid.Data2 = 43;
+        StorageUnitParams.BlockCount = 16;
+        StorageUnitParams.BlockLength = 512;
+        StorageUnitParams.MaxTransferLength = 512;
+        Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+        if (ERROR_CANNOT_MAKE == Error)
+            break;
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(SPD_IOCTL_BTL_FROM_INDEX(Count) == Btl);
+    }
+    ASSERT(SPD_IOCTL_STORAGE_UNIT_CAPACITY <= Count);
+
+    BtlBufSize = sizeof BtlBuf;
+    Error = SpdIoctlGetList(DeviceHandle, BtlBuf, &BtlBufSize);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(Count * sizeof(UINT32) == BtlBufSize);
+    for (ULONG I = 0; Count > I; I++)
+        ASSERT(SPD_IOCTL_BTL_FROM_INDEX(I) == BtlBuf[I]);
+
+    if (SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT < Count)
+    {
+        /* unit 64 is LUN 1 of target 0 */
+        ASSERT(SPD_IOCTL_BTL(0, 0, 1) == SPD_IOCTL_BTL_FROM_INDEX(64));
+        ASSERT(64 == SPD_IOCTL_INDEX_FROM_BTL(SPD_IOCTL_BTL(0, 0, 1)));
+
+        Error = SpdIoctlScsiInquiry(DeviceHandle, SPD_IOCTL_BTL(0, 0, 1), 0, 3000);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        /* target 0 reports LUN 0 and every other LUN that has a unit */
+        memset(&Cdb, 0, sizeof Cdb);
+        Cdb.REPORT_LUNS.OperationCode = SCSIOP_REPORT_LUNS;
+        Cdb.REPORT_LUNS.AllocationLength[3] = sizeof DataBuffer;
+
+        memset(DataBuffer, 0, sizeof DataBuffer);
+        DataLength = sizeof DataBuffer;
+        Error = SpdIoctlScsiExecute(DeviceHandle, SPD_IOCTL_BTL(0, 0, 1), &Cdb, +1,
+            DataBuffer, &DataLength, &ScsiStatus, Sense.Buffer);
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(SCSISTAT_GOOD == ScsiStatus);
+        {
+            ULONG LunCount = (Count - 1) / SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT + 1;
+            if (SPD_IOCTL_STORAGE_UNIT_LUN_COUNT < LunCount)
+                LunCount = SPD_IOCTL_STORAGE_UNIT_LUN_COUNT;
+            ASSERT(LunCount * 8 == (ULONG)
+                ((DataBuffer[0] << 24) | (DataBuffer[1] << 16) | (DataBuffer[2] << 8) | DataBuffer[3]));
+            for (ULONG L = 0; LunCount > L; L++)
+                ASSERT(L == DataBuffer[8 + L * 8 + 1]);
+        }
+
+        /* unprovisioning a unit above 64 leaves its index free for the next unit */
+        memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+        StorageUnitParams.Guid.Data1 = 64;
+        StorageUnitParams.Guid.Data2 = 43;
+        Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+        memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+        StorageUnitParams.BlockCount = 16;
+        StorageUnitParams.BlockLength = 512;
+        StorageUnitParams.MaxTransferLength = 512;
+        Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(SPD_IOCTL_BTL(0, 0, 1) == Btl);
+
+        Error = SpdIoctlUnprovision(DeviceHandle, &TestGuid);
+        ASSERT(ERROR_SUCCESS == Error);
+    }
+    else
+        tlib_printf("capacity=%lu ", Count);
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        if (64 == I && SPD_IOCTL_STORAGE_UNIT_TARGET_COUNT < Count)
+            continue;
+        memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+        StorageUnitParams.Guid.Data1 = I;
+        StorageUnitParams.Guid.Data2 = 43;
+        Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+        ASSERT(ERROR_SUCCESS == Error);
+    }
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+}
+
+static unsigned __stdcall ioctl_provision_reuse_test_thread(void *Data)
+{
+    LONG volatile *PStop = Data;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+    HANDLE DeviceHandle;
+    DWORD Error;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    /* look the unit up through an SRB and an ioctl, whether it is there or not */
+    while (!InterlockedCompareExchange(PStop, 0, 0))
+    {
+        SpdIoctlScsiInquiry(DeviceHandle, 0, 0, 0);
+        SpdIoctlGetStatistics(DeviceHandle, 0, &Stats);
+    }
+
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_provision_reuse_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+    INQUIRYDATA InquiryData;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    LONG volatile Stop = 0;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_provision_reuse_test_thread, (PVOID)&Stop, 0, 0);
+    ASSERT(0 != Thread);
+
+    /* two different units take turns in the same slot while it is being looked up */
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+        memcpy(&StorageUnitParams.Guid, 0 == I % 2 ? &TestGuid : &TestGuid2, sizeof TestGuid);
+        StorageUnitParams.BlockCount = 16;
+        StorageUnitParams.BlockLength = 512;
+        StorageUnitParams.MaxTransferLength = 512;
+        memcpy(StorageUnitParams.ProductId, 0 == I % 2 ? "ReuseDisk0      " : "ReuseDisk1      ", 16);
+        Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(0 == Btl);
+
+        Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, &InquiryData, 3000);
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(0 == memcmp(InquiryData.ProductId, StorageUnitParams.ProductId, 16));
+
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_OPERATION_ABORTED == Error);
+    }
+
+    InterlockedExchange(&Stop, 1);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+}
+
 static void ioctl_list_test(void)
 {
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
@@ -453,59 +651,90 @@ static void ioctl_transact_read_chunked_test(void)
     ioctl_transact_read_dotest(3);
 }
 
-static unsigned __stdcall ioctl_transact_write_test_thread(void *Data)
+static void ioctl_transact_v_test(void)
 {
-    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req[4];
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    UINT32 ReqCount;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
     HANDLE DeviceHandle;
+    UINT32 Btl;
     DWORD Error;
-    CDB Cdb;
-    UINT8 DataBuffer[5 * 512];
-    UINT32 DataLength;
-    UCHAR ScsiStatus;
-    union
-    {
-        SENSE_DATA Data;
-        UCHAR Buffer[32];
-    } Sense;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(4 * 5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
 
     Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    ASSERT(ERROR_SUCCESS == Error);
 
-    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
 
-    memset(&Cdb, 0, sizeof Cdb);
-    Cdb.WRITE16.OperationCode = SCSIOP_WRITE16;
-    Cdb.WRITE16.LogicalBlock[7] = 7;
-    Cdb.WRITE16.TransferLength[3] = 5;
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    ReqCount = 4;
+    Error = SpdIoctlTransactV(DeviceHandle, Btl, 0, 0, Req, &ReqCount, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(1 == ReqCount);
+    ASSERT(0 != Req[0].Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req[0].Kind);
+    ASSERT(7 == Req[0].Op.Read.BlockAddress);
+    ASSERT(5 == Req[0].Op.Read.BlockCount);
+    ASSERT(1 == Req[0].Op.Read.ForceUnitAccess);
+    ASSERT(0 == Req[0].Op.Read.Reserved);
 
     FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
 
-    DataLength = sizeof DataBuffer;
-    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
-        &ScsiStatus, Sense.Buffer);
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req[0].Hint;
+    Rsp.Kind = Req[0].Kind;
 
-    CloseHandle(DeviceHandle);
+    ReqCount = 0;
+    Error = SpdIoctlTransactV(DeviceHandle, Btl, &Rsp, 1, 0, &ReqCount, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == ReqCount);
 
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
 
-    if (ScsiStatus != SCSISTAT_GOOD ||
-        sizeof DataBuffer != DataLength)
-    {
-        Error = -'ASRT';
-        goto exit;
-    }
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
 
-    Error = ERROR_SUCCESS;
+    SpdOverlappedFini(&Overlapped);
 
-exit:
-    tlib_printf("thread=%lu ", Error);
+    free(DataBuffer);
 
-    return Error;
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
 }
 
-static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
+static void ioctl_transact_wait_test(void)
 {
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
     SPD_IOCTL_TRANSACT_REQ Req;
@@ -518,8 +747,9 @@ static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
     BOOL Success;
     HANDLE Thread;
     DWORD ExitCode;
+    ULONGLONG StartTime;
 
-    DataBuffer = malloc(MaxBlockCount * 512);
+    DataBuffer = malloc(5 * 512);
     ASSERT(0 != DataBuffer);
 
     Error = SpdOverlappedInit(&Overlapped);
@@ -532,7 +762,7 @@ static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
     memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
     StorageUnitParams.BlockCount = 16;
     StorageUnitParams.BlockLength = 512;
-    StorageUnitParams.MaxTransferLength = MaxBlockCount * 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
     Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
     ASSERT(ERROR_SUCCESS == Error);
     ASSERT(0 == Btl);
@@ -540,23 +770,34 @@ static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
-    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_write_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    /* no request arrives: the transact gives up after WaitTimeout */
+    StartTime = GetTickCount64();
+    memset(&Req, 0xff, sizeof Req);
+    Error = SpdIoctlTransactWait(DeviceHandle, Btl, 0, &Req,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE, 100, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 == Req.Hint);
+    ASSERT(GetTickCount64() - StartTime < 3000);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
     ASSERT(0 != Thread);
 
-    memset(DataBuffer, 0, sizeof DataBuffer);
-    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    Error = SpdIoctlTransactWait(DeviceHandle, Btl, 0, &Req,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE, 3000, &Overlapped);
     ASSERT(ERROR_SUCCESS == Error);
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
     ASSERT(0 != Req.Hint);
-    ASSERT(SpdIoctlTransactWriteKind == Req.Kind);
-    ASSERT(7 == Req.Op.Write.BlockAddress);
-    ASSERT(MaxBlockCount == Req.Op.Write.BlockCount);
-    ASSERT(1 == Req.Op.Write.ForceUnitAccess);
-    ASSERT(0 == Req.Op.Write.Reserved);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(0 == Req.PendingDepth);
+    ASSERT(7 == Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req.Op.Read.BlockCount);
 
-    ASSERT(FillOrTest(DataBuffer, 512, 7, MaxBlockCount, SpdIoctlTransactWriteKind));
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
 
     memset(&Rsp, 0, sizeof Rsp);
     Rsp.Hint = Req.Hint;
@@ -567,33 +808,1035 @@ static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
-    if (5 > MaxBlockCount)
-    {
-        memset(DataBuffer, 0, sizeof DataBuffer);
-        Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
-        ASSERT(ERROR_SUCCESS == Error);
-        Error = ResetEvent(Overlapped.hEvent);
-        ASSERT(ERROR_SUCCESS == Error);
-
-        ASSERT(0 != Req.Hint);
-        ASSERT(SpdIoctlTransactWriteKind == Req.Kind);
-        ASSERT(7 + MaxBlockCount == Req.Op.Write.BlockAddress);
-        ASSERT(5 - MaxBlockCount == Req.Op.Write.BlockCount);
-        ASSERT(1 == Req.Op.Write.ForceUnitAccess);
-        ASSERT(0 == Req.Op.Write.Reserved);
-
-        ASSERT(FillOrTest(DataBuffer, 512, 7 + MaxBlockCount, 5 - MaxBlockCount, SpdIoctlTransactWriteKind));
-
-        memset(&Rsp, 0, sizeof Rsp);
-        Rsp.Hint = Req.Hint;
-        Rsp.Kind = Req.Kind;
-
-        Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
-        ASSERT(ERROR_SUCCESS == Error);
-        Error = ResetEvent(Overlapped.hEvent);
-        ASSERT(ERROR_SUCCESS == Error);
-    }
-
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_spin_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    /* back to back reads: each arrives shortly after the dispatcher has responded */
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        memset(&Cdb, 0, sizeof Cdb);
+        Cdb.READ16.OperationCode = SCSIOP_READ16;
+        Cdb.READ16.LogicalBlock[7] = (UINT8)(I % 16);
+        Cdb.READ16.TransferLength[3] = 1;
+
+        memset(DataBuffer, 0, sizeof DataBuffer);
+        DataLength = sizeof DataBuffer;
+        Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+            &ScsiStatus, Sense.Buffer);
+        if (ERROR_SUCCESS != Error)
+            break;
+
+        if (ScsiStatus != SCSISTAT_GOOD ||
+            512 != DataLength)
+        {
+            Error = -'ASR1';
+            break;
+        }
+
+        if (!FillOrTest(DataBuffer, 512, I % 16, 1, SpdIoctlTransactWriteKind))
+        {
+            Error = -'ASR2';
+            break;
+        }
+    }
+
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_spin_dotest(UINT32 SpinTimeLimit)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 512;
+    StorageUnitParams.SpinTimeLimit = SpinTimeLimit;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_spin_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    /* respond and wait for the next request in one transact, as a dispatcher does */
+    memset(&Rsp, 0, sizeof Rsp);
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0 != Rsp.Hint ? &Rsp : 0, &Req,
+            DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        ASSERT(0 != Req.Hint);
+        ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+        ASSERT(I % 16 == Req.Op.Read.BlockAddress);
+        ASSERT(1 == Req.Op.Read.BlockCount);
+
+        FillOrTest(DataBuffer, 512, Req.Op.Read.BlockAddress, 1, SpdIoctlTransactReservedKind);
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = Req.Kind;
+    }
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(100 == Stats.CompleteCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.PendingDepth);
+    ASSERT(0 == Stats.ProcessDepth);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+}
+
+static void ioctl_transact_spin_test(void)
+{
+    ioctl_transact_spin_dotest(0);
+    ioctl_transact_spin_dotest(50);
+    /* larger than the 1ms maximum: capped, not rejected */
+    ioctl_transact_spin_dotest(1000000);
+}
+
+static void ioctl_transact_read_parallel_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req[4];
+    SPD_IOCTL_TRANSACT_RSP Rsp[2];
+    UINT32 ReqCount;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(4 * 3 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 3 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    /* both chunks of the SRB are outstanding at the same time */
+    ReqCount = 4;
+    Error = SpdIoctlTransactV(DeviceHandle, Btl, 0, 0, Req, &ReqCount, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(2 == ReqCount);
+    ASSERT(0 != Req[0].Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req[0].Kind);
+    ASSERT(7 == Req[0].Op.Read.BlockAddress);
+    ASSERT(3 == Req[0].Op.Read.BlockCount);
+    ASSERT(0 != Req[1].Hint);
+    ASSERT(Req[0].Hint != Req[1].Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req[1].Kind);
+    ASSERT(10 == Req[1].Op.Read.BlockAddress);
+    ASSERT(2 == Req[1].Op.Read.BlockCount);
+
+    /* respond to the chunks in reverse order */
+    FillOrTest((PUINT8)DataBuffer + 0 * 3 * 512, 512, 10, 2, SpdIoctlTransactReservedKind);
+    FillOrTest((PUINT8)DataBuffer + 1 * 3 * 512, 512, 7, 3, SpdIoctlTransactReservedKind);
+
+    memset(Rsp, 0, sizeof Rsp);
+    Rsp[0].Hint = Req[1].Hint;
+    Rsp[0].Kind = Req[1].Kind;
+    Rsp[1].Hint = Req[0].Hint;
+    Rsp[1].Kind = Req[0].Kind;
+
+    ReqCount = 0;
+    Error = SpdIoctlTransactV(DeviceHandle, Btl, Rsp, 2, 0, &ReqCount, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == ReqCount);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_large_parallel_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)((UINT_PTR)Data >> 8);
+    UINT64 BlockAddress = ((UINT_PTR)Data & 0xff) * 256;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    PUINT8 DataBuffer = 0;
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    DataBuffer = malloc(256 * 512);
+    if (0 == DataBuffer)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.WRITE16.OperationCode = SCSIOP_WRITE16;
+    Cdb.WRITE16.LogicalBlock[6] = (UINT8)(BlockAddress >> 8);
+    Cdb.WRITE16.LogicalBlock[7] = (UINT8)BlockAddress;
+    Cdb.WRITE16.TransferLength[2] = 1;
+
+    FillOrTest(DataBuffer, 512, BlockAddress, 256, SpdIoctlTransactReservedKind);
+    DataLength = 256 * 512;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        256 * 512 != DataLength)
+    {
+        Error = -'ASR1';
+        goto close;
+    }
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[6] = (UINT8)(BlockAddress >> 8);
+    Cdb.READ16.LogicalBlock[7] = (UINT8)BlockAddress;
+    Cdb.READ16.TransferLength[2] = 1;
+
+    memset(DataBuffer, 0, 256 * 512);
+    DataLength = 256 * 512;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        256 * 512 != DataLength)
+    {
+        Error = -'ASR2';
+        goto close;
+    }
+
+    if (!FillOrTest(DataBuffer, 512, BlockAddress, 256, SpdIoctlTransactWriteKind))
+    {
+        Error = -'ASR3';
+        goto close;
+    }
+
+    Error = ERROR_SUCCESS;
+
+close:
+    CloseHandle(DeviceHandle);
+
+exit:
+    free(DataBuffer);
+
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_large_parallel_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    UINT64 BlockAddress;
+    UINT32 BlockCount, ReadBlockCount, WriteBlockCount;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Threads[4];
+    DWORD ExitCode;
+
+    DataBuffer = malloc(256 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 4 * 256;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 256 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* data is copied into and out of SRBs while other threads keep posting */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_large_parallel_test_thread,
+            (PVOID)(((UINT_PTR)Btl << 8) | I), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    /* the SRBs may arrive in chunks: count blocks rather than requests */
+    ReadBlockCount = WriteBlockCount = 0;
+    memset(&Rsp, 0, sizeof Rsp);
+    while (4 * 256 > ReadBlockCount || 4 * 256 > WriteBlockCount)
+    {
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0 != Rsp.Hint ? &Rsp : 0, &Req,
+            DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        ASSERT(0 != Req.Hint);
+        if (SpdIoctlTransactWriteKind == Req.Kind)
+        {
+            BlockAddress = Req.Op.Write.BlockAddress;
+            BlockCount = Req.Op.Write.BlockCount;
+            ASSERT(FillOrTest(DataBuffer, 512, BlockAddress, BlockCount,
+                SpdIoctlTransactWriteKind));
+            WriteBlockCount += BlockCount;
+        }
+        else
+        {
+            ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+            BlockAddress = Req.Op.Read.BlockAddress;
+            BlockCount = Req.Op.Read.BlockCount;
+            FillOrTest(DataBuffer, 512, BlockAddress, BlockCount,
+                SpdIoctlTransactReservedKind);
+            ReadBlockCount += BlockCount;
+        }
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = Req.Kind;
+    }
+    ASSERT(4 * 256 == ReadBlockCount);
+    ASSERT(4 * 256 == WriteBlockCount);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_SUCCESS == ExitCode);
+    }
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+}
+
+static void ioctl_transact_buffer_pool_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(2 * 5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlRegisterBufferPool(DeviceHandle, Btl, DataBuffer, 2);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlTransactIndex(DeviceHandle, Btl, 0, &Req, 2, &Overlapped);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+
+    Error = SpdIoctlTransactIndex(DeviceHandle, Btl, 0, &Req, 1, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(7 == Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req.Op.Read.BlockCount);
+
+    FillOrTest((PUINT8)DataBuffer + 5 * 512, 512, 7, 5, SpdIoctlTransactReservedKind);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransactIndex(DeviceHandle, Btl, &Rsp, 0, 1, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlRegisterBufferPool(DeviceHandle, Btl, 0, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static void ioctl_transact_ring_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_RING_HEADER *Header;
+    SPD_IOCTL_RING_REQ *Req;
+    SPD_IOCTL_RING_RSP *Rsp;
+    PUINT8 Data;
+    PVOID RingBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    RingBuffer = VirtualAlloc(0, SPD_IOCTL_RING_SIZE(2, 5 * 512),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != RingBuffer);
+    Header = RingBuffer;
+    Req = (PVOID)((PUINT8)RingBuffer + SPD_IOCTL_RING_REQ_OFFSET);
+    Rsp = (PVOID)((PUINT8)RingBuffer + SPD_IOCTL_RING_RSP_OFFSET(2));
+    Data = (PUINT8)RingBuffer + SPD_IOCTL_RING_DATA_OFFSET(2);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlEnterRing(DeviceHandle, Btl, FALSE, &Overlapped);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+
+    Error = SpdIoctlRegisterRing(DeviceHandle, Btl, RingBuffer, 3);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+
+    Error = SpdIoctlRegisterRing(DeviceHandle, Btl, RingBuffer, 2);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    /* the request may already be in the ring; if not, wait for it */
+    Error = SpdIoctlEnterRing(DeviceHandle, Btl, TRUE, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(1 == Header->ReqHead);
+    ASSERT(0 != Req[0].Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req[0].Req.Kind);
+    ASSERT(7 == Req[0].Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req[0].Req.Op.Read.BlockCount);
+    ASSERT(2 > Req[0].DataIndex);
+    Header->ReqTail = 1;
+
+    FillOrTest(Data + Req[0].DataIndex * 5 * 512, 512, 7, 5, SpdIoctlTransactReservedKind);
+
+    /* a response that names the wrong data slot is ignored */
+    memset(&Rsp[0], 0, sizeof Rsp[0]);
+    Rsp[0].Rsp.Hint = Req[0].Req.Hint;
+    Rsp[0].Rsp.Kind = Req[0].Req.Kind;
+    Rsp[0].DataIndex = Req[0].DataIndex ^ 1;
+    memcpy(&Rsp[1], &Rsp[0], sizeof Rsp[0]);
+    Rsp[1].DataIndex = Req[0].DataIndex;
+    Header->RspHead = 2;
+
+    Error = SpdIoctlEnterRing(DeviceHandle, Btl, FALSE, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(2 == Header->RspTail);
+
+    Error = SpdIoctlRegisterRing(DeviceHandle, Btl, 0, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    VirtualFree(RingBuffer, 0, MEM_RELEASE);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static void ioctl_transact_stale_hint_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+
+    /* a forged hint (wrong generation) must be ignored */
+    memset(DataBuffer, 0, 5 * 512);
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint ^ 0x100000000ULL;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
+
+    Rsp.Hint = Req.Hint;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* a stale hint (already completed) must be ignored */
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_zero_copy_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    PVOID DataBuffer = 0;
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    /* page aligned, so that the driver can map it */
+    DataBuffer = VirtualAlloc(0, 8 * 512, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == DataBuffer)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[7] = 8;
+    Cdb.READ16.TransferLength[3] = 8;
+
+    DataLength = 8 * 512;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        8 * 512 != DataLength)
+    {
+        Error = -'ASR1';
+        goto exit;
+    }
+
+    if (!FillOrTest(DataBuffer, 512, 8, 8, SpdIoctlTransactWriteKind))
+    {
+        Error = -'ASR2';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (0 != DataBuffer)
+        VirtualFree(DataBuffer, 0, MEM_RELEASE);
+
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_zero_copy_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(8 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 8 * 512;
+    StorageUnitParams.ZeroCopyThreshold = 4096;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_zero_copy_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, 8 * 512);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(8 == Req.Op.Read.BlockAddress);
+    ASSERT(8 == Req.Op.Read.BlockCount);
+
+    /* the port driver may still hand us a bounce buffer; then we get the copy path */
+    FillOrTest(0 != Req.MappedDataBuffer ? (PVOID)(UINT_PTR)Req.MappedDataBuffer : DataBuffer,
+        512, 8, 8, SpdIoctlTransactReservedKind);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    /* the response names the mapped buffer, as an asynchronous SendResponse would */
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0,
+        0 != Req.MappedDataBuffer ? (PVOID)(UINT_PTR)Req.MappedDataBuffer : DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_write_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[5 * 512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.WRITE16.OperationCode = SCSIOP_WRITE16;
+    Cdb.WRITE16.LogicalBlock[7] = 7;
+    Cdb.WRITE16.TransferLength[3] = 5;
+
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
+
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        sizeof DataBuffer != DataLength)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(MaxBlockCount * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = MaxBlockCount * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_write_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactWriteKind == Req.Kind);
+    ASSERT(7 == Req.Op.Write.BlockAddress);
+    ASSERT(MaxBlockCount == Req.Op.Write.BlockCount);
+    ASSERT(1 == Req.Op.Write.ForceUnitAccess);
+    ASSERT(0 == Req.Op.Write.Reserved);
+
+    ASSERT(FillOrTest(DataBuffer, 512, 7, MaxBlockCount, SpdIoctlTransactWriteKind));
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    if (5 > MaxBlockCount)
+    {
+        memset(DataBuffer, 0, sizeof DataBuffer);
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        ASSERT(0 != Req.Hint);
+        ASSERT(SpdIoctlTransactWriteKind == Req.Kind);
+        ASSERT(7 + MaxBlockCount == Req.Op.Write.BlockAddress);
+        ASSERT(5 - MaxBlockCount == Req.Op.Write.BlockCount);
+        ASSERT(1 == Req.Op.Write.ForceUnitAccess);
+        ASSERT(0 == Req.Op.Write.Reserved);
+
+        ASSERT(FillOrTest(DataBuffer, 512, 7 + MaxBlockCount, 5 - MaxBlockCount, SpdIoctlTransactWriteKind));
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = Req.Kind;
+
+        Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+    }
+
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
 
@@ -613,20 +1856,1499 @@ static void ioctl_transact_write_dotest(ULONG MaxBlockCount)
 
 static void ioctl_transact_write_test(void)
 {
-    ioctl_transact_write_dotest(5);
+    ioctl_transact_write_dotest(5);
+}
+
+static void ioctl_transact_write_chunked_test(void)
+{
+    ioctl_transact_write_dotest(3);
+}
+
+static unsigned __stdcall ioctl_transact_flush_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.SYNCHRONIZE_CACHE16.OperationCode = SCSIOP_SYNCHRONIZE_CACHE16;
+    Cdb.SYNCHRONIZE_CACHE16.LogicalBlock[7] = 7;
+    Cdb.SYNCHRONIZE_CACHE16.BlockCount[3] = 5;
+
+    DataLength = 0;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, 0, 0, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        0 != DataLength)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_flush_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.CacheSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_flush_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactFlushKind == Req.Kind);
+    ASSERT(7 == Req.Op.Flush.BlockAddress);
+    ASSERT(5 == Req.Op.Flush.BlockCount);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_unmap_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    union
+    {
+        UINT8 Buffer[FIELD_OFFSET(UNMAP_LIST_HEADER, Descriptors) + 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR)];
+        UNMAP_LIST_HEADER List;
+    } UnmapBuffer;
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.UNMAP.OperationCode = SCSIOP_UNMAP;
+    Cdb.UNMAP.AllocationLength[1] = sizeof UnmapBuffer;
+
+    memset(&UnmapBuffer, 0, sizeof UnmapBuffer);
+    UnmapBuffer.List.DataLength[1] = sizeof(UNMAP_LIST_HEADER) - 2 + 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR);
+    UnmapBuffer.List.BlockDescrDataLength[1] = 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR);
+    UnmapBuffer.List.Descriptors[0].StartingLba[7] = 7;
+    UnmapBuffer.List.Descriptors[0].LbaCount[3] = 1;
+    UnmapBuffer.List.Descriptors[1].StartingLba[7] = 6;
+    UnmapBuffer.List.Descriptors[1].LbaCount[3] = 2;
+    UnmapBuffer.List.Descriptors[2].StartingLba[7] = 5;
+    UnmapBuffer.List.Descriptors[2].LbaCount[3] = 3;
+
+    DataLength = sizeof UnmapBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, &UnmapBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        sizeof UnmapBuffer != DataLength)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_unmap_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_unmap_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactUnmapKind == Req.Kind);
+    ASSERT(3 == Req.Op.Unmap.Count);
+
+    ASSERT(7 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].BlockAddress);
+    ASSERT(1 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].BlockCount);
+    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].Reserved);
+    ASSERT(6 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].BlockAddress);
+    ASSERT(2 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].BlockCount);
+    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].Reserved);
+    ASSERT(5 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].BlockAddress);
+    ASSERT(3 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].BlockCount);
+    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].Reserved);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_write_same_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 PatternBuffer[512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    /* WRITE SAME(16) with UNMAP: LBA 3, 9 blocks */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = SCSIOP_WRITE_SAME16;
+    Cdb.AsByte[1] = 0x08;
+    Cdb.AsByte[9] = 3;
+    Cdb.AsByte[13] = 9;
+
+    memset(PatternBuffer, 0xa5, sizeof PatternBuffer);
+
+    DataLength = sizeof PatternBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, PatternBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        sizeof PatternBuffer != DataLength)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_write_same_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_write_same_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, 5 * 512);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* a range of 9 blocks travels as a single request with a single block of data */
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactWriteSameKind == Req.Kind);
+    ASSERT(3 == Req.Op.WriteSame.BlockAddress);
+    ASSERT(9 == Req.Op.WriteSame.BlockCount);
+    ASSERT(1 == Req.Op.WriteSame.Unmap);
+    ASSERT(0xa5 == ((PUINT8)DataBuffer)[0]);
+    ASSERT(0xa5 == ((PUINT8)DataBuffer)[511]);
+    ASSERT(0 == ((PUINT8)DataBuffer)[512]);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_copy_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 PopulateBuffer[32], InformationBuffer[550], WriteBuffer[536 + 16];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    /* POPULATE TOKEN: list identifier 1; LBA 2, 3 blocks */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = 0x83;
+    Cdb.AsByte[1] = 0x10;
+    Cdb.AsByte[9] = 1;
+    Cdb.AsByte[13] = sizeof PopulateBuffer;
+
+    memset(PopulateBuffer, 0, sizeof PopulateBuffer);
+    PopulateBuffer[1] = sizeof PopulateBuffer - 2;
+    PopulateBuffer[15] = 16;
+    PopulateBuffer[23] = 2;
+    PopulateBuffer[27] = 3;
+
+    DataLength = sizeof PopulateBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, PopulateBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    if (ScsiStatus != SCSISTAT_GOOD)
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    /* RECEIVE ROD TOKEN INFORMATION: list identifier 1 */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = 0x84;
+    Cdb.AsByte[1] = 0x07;
+    Cdb.AsByte[5] = 1;
+    Cdb.AsByte[12] = sizeof InformationBuffer >> 8;
+    Cdb.AsByte[13] = sizeof InformationBuffer & 0xff;
+
+    DataLength = sizeof InformationBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, InformationBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        sizeof InformationBuffer != DataLength ||
+        3 != InformationBuffer[23])
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    /* WRITE USING TOKEN: list identifier 2; LBA 10, 3 blocks */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = 0x83;
+    Cdb.AsByte[1] = 0x11;
+    Cdb.AsByte[9] = 2;
+    Cdb.AsByte[12] = sizeof WriteBuffer >> 8;
+    Cdb.AsByte[13] = sizeof WriteBuffer & 0xff;
+
+    memset(WriteBuffer, 0, sizeof WriteBuffer);
+    WriteBuffer[0] = (sizeof WriteBuffer - 2) >> 8;
+    WriteBuffer[1] = (sizeof WriteBuffer - 2) & 0xff;
+    memcpy(WriteBuffer + 16, InformationBuffer + 38, 512);
+    WriteBuffer[535] = 16;
+    WriteBuffer[536 + 7] = 10;
+    WriteBuffer[536 + 11] = 3;
+
+    DataLength = sizeof WriteBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, WriteBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    if (ScsiStatus != SCSISTAT_GOOD)
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    Error = ERROR_SUCCESS;
+
+close:
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_copy_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_IOCTL_COPY_DESCRIPTOR *Descriptors;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.CopySupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_copy_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    memset(DataBuffer, 0, 5 * 512);
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* POPULATE TOKEN stays in the driver; only WRITE USING TOKEN reaches the storage unit */
+    Descriptors = DataBuffer;
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactCopyKind == Req.Kind);
+    ASSERT(1 == Req.Op.Copy.Count);
+    ASSERT(10 == Descriptors[0].BlockAddress);
+    ASSERT(2 == Descriptors[0].SourceBlockAddress);
+    ASSERT(3 == Descriptors[0].BlockCount);
+    ASSERT(0 == Descriptors[0].Reserved);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_set_cache_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+    PMODE_CACHING_PAGE ModeCachingPage;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    /* MODE SELECT (10): caching page with WCE clear */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.MODE_SELECT10.OperationCode = SCSIOP_MODE_SELECT10;
+    Cdb.MODE_SELECT10.PFBit = 1;
+    Cdb.MODE_SELECT10.ParameterListLength[1] =
+        sizeof(MODE_PARAMETER_HEADER10) + sizeof(MODE_CACHING_PAGE);
+
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    ModeCachingPage = (PVOID)(DataBuffer + sizeof(MODE_PARAMETER_HEADER10));
+    ModeCachingPage->PageCode = MODE_PAGE_CACHING;
+    ModeCachingPage->PageLength = sizeof(MODE_CACHING_PAGE) -
+        RTL_SIZEOF_THROUGH_FIELD(MODE_CACHING_PAGE, PageLength);
+    ModeCachingPage->WriteCacheEnable = 0;
+
+    DataLength = sizeof(MODE_PARAMETER_HEADER10) + sizeof(MODE_CACHING_PAGE);
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    if (ScsiStatus != SCSISTAT_GOOD)
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    /* MODE SENSE (10) reports the new setting */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.MODE_SENSE10.OperationCode = SCSIOP_MODE_SENSE10;
+    Cdb.MODE_SENSE10.PageCode = MODE_PAGE_CACHING;
+    Cdb.MODE_SENSE10.AllocationLength[1] = 255;
+
+    DataLength = 255;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    ModeCachingPage = (PVOID)(DataBuffer + sizeof(MODE_PARAMETER_HEADER10));
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        ModeCachingPage->WriteCacheEnable || ModeCachingPage->ReadDisableCache)
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    /* WRITE (10) without FUA */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.CDB10.OperationCode = SCSIOP_WRITE;
+    Cdb.CDB10.TransferBlocksLsb = 1;
+
+    memset(DataBuffer, 0x5a, sizeof DataBuffer);
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+    if (ScsiStatus != SCSISTAT_GOOD)
+    {
+        Error = -'ASRT';
+        goto close;
+    }
+
+    Error = ERROR_SUCCESS;
+
+close:
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_set_cache_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.CacheSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_set_cache_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactSetCacheKind == Req.Kind);
+    ASSERT(0 == Req.Op.SetCache.WriteCacheEnabled);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* with the write cache disabled every write is FUA */
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactWriteKind == Req.Kind);
+    ASSERT(0 == Req.Op.Write.BlockAddress);
+    ASSERT(1 == Req.Op.Write.BlockCount);
+    ASSERT(1 == Req.Op.Write.ForceUnitAccess);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static void ioctl_allocation_map_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    PUINT32 AllocationMap;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    CDB Cdb;
+    UINT8 DataBuffer[4 * 512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    /* blocks 0-7 allocated; blocks 8-15 unallocated */
+    AllocationMap = VirtualAlloc(0, SPD_IOCTL_ALLOCATION_MAP_SIZE(16, 0),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != AllocationMap);
+    AllocationMap[0] = 0x000000ff;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, AllocationMap, 64);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, AllocationMap, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* a read of unallocated blocks completes without a dispatcher */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[7] = 8;
+    Cdb.READ16.TransferLength[3] = 4;
+
+    memset(DataBuffer, 0xa5, sizeof DataBuffer);
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SCSISTAT_GOOD == ScsiStatus);
+    ASSERT(sizeof DataBuffer == DataLength);
+    ASSERT(0 == DataBuffer[0]);
+    ASSERT(0 == DataBuffer[sizeof DataBuffer - 1]);
+
+    /* GET LBA STATUS from block 4: blocks 4-7 mapped, blocks 8-15 deallocated */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = SCSIOP_SERVICE_ACTION_IN16;
+    Cdb.AsByte[1] = 0x12;
+    Cdb.AsByte[9] = 4;
+    Cdb.AsByte[12] = sizeof DataBuffer >> 8;
+    Cdb.AsByte[13] = sizeof DataBuffer & 0xff;
+
+    memset(DataBuffer, 0xa5, sizeof DataBuffer);
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SCSISTAT_GOOD == ScsiStatus);
+    ASSERT(8 + 2 * 16 == DataLength);
+    ASSERT(4 + 2 * 16 == DataBuffer[3]);
+    ASSERT(4 == DataBuffer[8 + 7]);
+    ASSERT(4 == DataBuffer[8 + 11]);
+    ASSERT(0 == DataBuffer[8 + 12]);
+    ASSERT(8 == DataBuffer[24 + 7]);
+    ASSERT(8 == DataBuffer[24 + 11]);
+    ASSERT(1 == DataBuffer[24 + 12]);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, 0, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    VirtualFree(AllocationMap, 0, MEM_RELEASE);
+}
+
+struct ioctl_allocation_map_race_test_data
+{
+    UINT32 Btl;
+    UINT8 OperationCode;
+    UINT8 BlockAddress;
+    UCHAR ScsiStatus;
+};
+
+static unsigned __stdcall ioctl_allocation_map_race_test_thread(void *Data)
+{
+    struct ioctl_allocation_map_race_test_data *TestData = Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    union
+    {
+        UINT8 Buffer[512];
+        UNMAP_LIST_HEADER List;
+    } DataBuffer;
+    UINT32 DataLength;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, TestData->Btl, 0, 3000);
+
+    /* UNMAP 4 blocks or WRITE/READ 1 block at BlockAddress */
+    memset(&Cdb, 0, sizeof Cdb);
+    memset(&DataBuffer, 0, sizeof DataBuffer);
+    if (SCSIOP_READ16 == TestData->OperationCode)
+    {
+        Cdb.READ16.OperationCode = SCSIOP_READ16;
+        Cdb.READ16.LogicalBlock[7] = TestData->BlockAddress;
+        Cdb.READ16.TransferLength[3] = 1;
+        DataLength = sizeof DataBuffer;
+    }
+    else if (SCSIOP_UNMAP == TestData->OperationCode)
+    {
+        Cdb.UNMAP.OperationCode = SCSIOP_UNMAP;
+        Cdb.UNMAP.AllocationLength[1] = sizeof(UNMAP_LIST_HEADER) + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.DataLength[1] = sizeof(UNMAP_LIST_HEADER) - 2 + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.BlockDescrDataLength[1] = sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.Descriptors[0].StartingLba[7] = TestData->BlockAddress;
+        DataBuffer.List.Descriptors[0].LbaCount[3] = 4;
+        DataLength = sizeof(UNMAP_LIST_HEADER) + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+    }
+    else
+    {
+        Cdb.WRITE16.OperationCode = SCSIOP_WRITE16;
+        Cdb.WRITE16.LogicalBlock[7] = TestData->BlockAddress;
+        Cdb.WRITE16.TransferLength[3] = 1;
+        memset(&DataBuffer, 0x5a, sizeof DataBuffer);
+        DataLength = sizeof DataBuffer;
+    }
+
+    Error = SpdIoctlScsiExecute(DeviceHandle, TestData->Btl, &Cdb,
+        SCSIOP_READ16 == TestData->OperationCode ? +1 : -1, &DataBuffer, &DataLength,
+        &TestData->ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS == Error &&
+        SCSIOP_READ16 == TestData->OperationCode &&
+        SCSISTAT_GOOD == TestData->ScsiStatus &&
+        !FillOrTest(DataBuffer.Buffer, 512, TestData->BlockAddress, 1, SpdIoctlTransactWriteKind))
+        Error = -'ASR1';
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_allocation_map_race_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ UnmapReq, WriteReq;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    struct ioctl_allocation_map_race_test_data UnmapData, WriteData;
+    volatile UINT32 *AllocationMap;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE UnmapThread, WriteThread;
+    DWORD ExitCode;
+
+    /* all blocks allocated */
+    AllocationMap = VirtualAlloc(0, SPD_IOCTL_ALLOCATION_MAP_SIZE(16, 0),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != AllocationMap);
+    AllocationMap[0] = 0x0000ffff;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, (PVOID)AllocationMap, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* UNMAP blocks 4-7; the map is cleared as soon as the UNMAP is posted */
+    UnmapData.Btl = Btl;
+    UnmapData.OperationCode = SCSIOP_UNMAP;
+    UnmapData.BlockAddress = 4;
+    UnmapThread = (HANDLE)_beginthreadex(0, 0, ioctl_allocation_map_race_test_thread, &UnmapData, 0, 0);
+    ASSERT(0 != UnmapThread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &UnmapReq, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SpdIoctlTransactUnmapKind == UnmapReq.Kind);
+    ASSERT(1 == UnmapReq.Op.Unmap.Count);
+    ASSERT(0x0000ff0f == AllocationMap[0]);
+
+    /* WRITE block 5 while the UNMAP is in flight */
+    WriteData.Btl = Btl;
+    WriteData.OperationCode = SCSIOP_WRITE16;
+    WriteData.BlockAddress = 5;
+    WriteThread = (HANDLE)_beginthreadex(0, 0, ioctl_allocation_map_race_test_thread, &WriteData, 0, 0);
+    ASSERT(0 != WriteThread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &WriteReq, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SpdIoctlTransactWriteKind == WriteReq.Kind);
+    ASSERT(5 == WriteReq.Op.Write.BlockAddress);
+    ASSERT(0x0000ff2f == AllocationMap[0]);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = WriteReq.Hint;
+    Rsp.Kind = WriteReq.Kind;
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* completing the UNMAP after the WRITE must not clear the WRITE's block */
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = UnmapReq.Hint;
+    Rsp.Kind = UnmapReq.Kind;
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    WaitForSingleObject(WriteThread, INFINITE);
+    GetExitCodeThread(WriteThread, &ExitCode);
+    CloseHandle(WriteThread);
+    ASSERT(ERROR_SUCCESS == ExitCode);
+    ASSERT(SCSISTAT_GOOD == WriteData.ScsiStatus);
+
+    WaitForSingleObject(UnmapThread, INFINITE);
+    GetExitCodeThread(UnmapThread, &ExitCode);
+    CloseHandle(UnmapThread);
+    ASSERT(ERROR_SUCCESS == ExitCode);
+    ASSERT(SCSISTAT_GOOD == UnmapData.ScsiStatus);
+
+    ASSERT(0x0000ff2f == AllocationMap[0]);
+
+    /* a failed UNMAP of blocks 8-11 leaves them allocated */
+    UnmapData.BlockAddress = 8;
+    UnmapThread = (HANDLE)_beginthreadex(0, 0, ioctl_allocation_map_race_test_thread, &UnmapData, 0, 0);
+    ASSERT(0 != UnmapThread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &UnmapReq, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SpdIoctlTransactUnmapKind == UnmapReq.Kind);
+    ASSERT(0x0000f02f == AllocationMap[0]);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = UnmapReq.Hint;
+    Rsp.Kind = UnmapReq.Kind;
+    Rsp.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Rsp.Status.SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+    Rsp.Status.ASC = SCSI_ADSENSE_WRITE_ERROR;
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    WaitForSingleObject(UnmapThread, INFINITE);
+    GetExitCodeThread(UnmapThread, &ExitCode);
+    CloseHandle(UnmapThread);
+    ASSERT(ERROR_SUCCESS == ExitCode);
+    ASSERT(SCSISTAT_CHECK_CONDITION == UnmapData.ScsiStatus);
+
+    ASSERT(0x0000ff2f == AllocationMap[0]);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, 0, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    VirtualFree((PVOID)AllocationMap, 0, MEM_RELEASE);
+}
+
+static void ioctl_allocation_map_unmap_error_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    struct ioctl_allocation_map_race_test_data UnmapData, ReadData;
+    volatile UINT32 *AllocationMap;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    /* all blocks allocated */
+    AllocationMap = VirtualAlloc(0, SPD_IOCTL_ALLOCATION_MAP_SIZE(16, 0),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != AllocationMap);
+    AllocationMap[0] = 0x0000ffff;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, (PVOID)AllocationMap, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* UNMAP blocks 8-11 and fail it */
+    UnmapData.Btl = Btl;
+    UnmapData.OperationCode = SCSIOP_UNMAP;
+    UnmapData.BlockAddress = 8;
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_allocation_map_race_test_thread, &UnmapData, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SpdIoctlTransactUnmapKind == Req.Kind);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+    Rsp.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Rsp.Status.SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+    Rsp.Status.ASC = SCSI_ADSENSE_WRITE_ERROR;
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+    ASSERT(ERROR_SUCCESS == ExitCode);
+    ASSERT(SCSISTAT_CHECK_CONDITION == UnmapData.ScsiStatus);
+
+    ASSERT(0x0000ffff == AllocationMap[0]);
+
+    /* the blocks kept their data: a read goes to the dispatcher rather than return zeroes */
+    ReadData.Btl = Btl;
+    ReadData.OperationCode = SCSIOP_READ16;
+    ReadData.BlockAddress = 9;
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_allocation_map_race_test_thread, &ReadData, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(9 == Req.Op.Read.BlockAddress);
+    ASSERT(1 == Req.Op.Read.BlockCount);
+
+    FillOrTest(DataBuffer, 512, 9, 1, SpdIoctlTransactReservedKind);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+    ASSERT(ERROR_SUCCESS == ExitCode);
+    ASSERT(SCSISTAT_GOOD == ReadData.ScsiStatus);
+
+    Error = SpdIoctlRegisterAllocationMap(DeviceHandle, Btl, 0, 0);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    VirtualFree((PVOID)AllocationMap, 0, MEM_RELEASE);
+}
+
+static unsigned __stdcall ioctl_transact_error_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[5 * 512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[7] = 7;
+    Cdb.READ16.TransferLength[3] = 5;
+
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_CHECK_CONDITION ||
+        Sense.Data.SenseKey != SCSI_SENSE_MEDIUM_ERROR ||
+        Sense.Data.AdditionalSenseCode != SCSI_ADSENSE_SEEK_ERROR ||
+        Sense.Data.AdditionalSenseCodeQualifier != SCSI_SENSEQ_POSITIONING_ERROR_DETECTED_BY_READ_OF_MEDIUM ||
+        Sense.Data.Information[3] != 11 ||
+        Sense.Data.Valid != 1)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void ioctl_transact_error_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_error_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(7 == Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req.Op.Read.BlockCount);
+    ASSERT(1 == Req.Op.Read.ForceUnitAccess);
+    ASSERT(0 == Req.Op.Read.Reserved);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+    Rsp.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Rsp.Status.SenseKey = SCSI_SENSE_MEDIUM_ERROR;
+    Rsp.Status.ASC = SCSI_ADSENSE_SEEK_ERROR;
+    Rsp.Status.ASCQ = SCSI_SENSEQ_POSITIONING_ERROR_DETECTED_BY_READ_OF_MEDIUM;
+    Rsp.Status.Information = 11;
+    Rsp.Status.InformationValid = 1;
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
+static unsigned __stdcall ioctl_transact_cancel_test_thread(void *Data)
+{
+    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[5 * 512];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[7] = 7;
+    Cdb.READ16.TransferLength[3] = 5;
+
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
 }
 
-static void ioctl_transact_write_chunked_test(void)
+static void ioctl_transact_cancel_test(void)
 {
-    ioctl_transact_write_dotest(3);
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_cancel_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(7 == Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req.Op.Read.BlockCount);
+    ASSERT(1 == Req.Op.Read.ForceUnitAccess);
+    ASSERT(0 == Req.Op.Read.Reserved);
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(0 != ExitCode);
 }
 
-static unsigned __stdcall ioctl_transact_flush_test_thread(void *Data)
+static unsigned __stdcall ioctl_transact_shard_test_thread(void *Data)
 {
-    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    UINT32 Btl = (UINT32)((UINT_PTR)Data >> 8);
+    UINT8 BlockAddress = (UINT8)(UINT_PTR)Data;
+    DWORD_PTR ProcessMask, SystemMask, Mask;
+    ULONG Count;
     HANDLE DeviceHandle;
     DWORD Error;
     CDB Cdb;
+    UINT8 DataBuffer[512];
     UINT32 DataLength;
     UCHAR ScsiStatus;
     union
@@ -635,6 +3357,18 @@ static unsigned __stdcall ioctl_transact_flush_test_thread(void *Data)
         UCHAR Buffer[32];
     } Sense;
 
+    /* post from a different processor than the other threads, if there is one */
+    if (GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask))
+    {
+        Count = 0;
+        for (Mask = ProcessMask; 0 != Mask; Mask &= Mask - 1)
+            Count++;
+        Count = BlockAddress % Count;
+        for (Mask = ProcessMask; 0 != Count; Mask &= Mask - 1)
+            Count--;
+        SetThreadAffinityMask(GetCurrentThread(), Mask & ~(Mask - 1));
+    }
+
     Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
     if (ERROR_SUCCESS != Error)
         goto exit;
@@ -642,12 +3376,13 @@ static unsigned __stdcall ioctl_transact_flush_test_thread(void *Data)
     SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
 
     memset(&Cdb, 0, sizeof Cdb);
-    Cdb.SYNCHRONIZE_CACHE16.OperationCode = SCSIOP_SYNCHRONIZE_CACHE16;
-    Cdb.SYNCHRONIZE_CACHE16.LogicalBlock[7] = 7;
-    Cdb.SYNCHRONIZE_CACHE16.BlockCount[3] = 5;
+    Cdb.READ16.OperationCode = SCSIOP_READ16;
+    Cdb.READ16.LogicalBlock[7] = BlockAddress;
+    Cdb.READ16.TransferLength[3] = 1;
 
-    DataLength = 0;
-    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, 0, 0, &DataLength,
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
         &ScsiStatus, Sense.Buffer);
 
     CloseHandle(DeviceHandle);
@@ -656,9 +3391,15 @@ static unsigned __stdcall ioctl_transact_flush_test_thread(void *Data)
         goto exit;
 
     if (ScsiStatus != SCSISTAT_GOOD ||
-        0 != DataLength)
+        512 != DataLength)
     {
-        Error = -'ASRT';
+        Error = -'ASR1';
+        goto exit;
+    }
+
+    if (!FillOrTest(DataBuffer, 512, BlockAddress, 1, SpdIoctlTransactWriteKind))
+    {
+        Error = -'ASR2';
         goto exit;
     }
 
@@ -670,21 +3411,23 @@ exit:
     return Error;
 }
 
-static void ioctl_transact_flush_test(void)
+static void ioctl_transact_shard_test(void)
 {
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
     PVOID DataBuffer = 0;
     OVERLAPPED Overlapped;
     HANDLE DeviceHandle;
     UINT32 Btl;
+    UINT32 SeenMask;
     DWORD Error;
     BOOL Success;
-    HANDLE Thread;
+    HANDLE Threads[8];
     DWORD ExitCode;
 
-    DataBuffer = malloc(5 * 512);
+    DataBuffer = malloc(512);
     ASSERT(0 != DataBuffer);
 
     Error = SpdOverlappedInit(&Overlapped);
@@ -697,8 +3440,7 @@ static void ioctl_transact_flush_test(void)
     memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
     StorageUnitParams.BlockCount = 16;
     StorageUnitParams.BlockLength = 512;
-    StorageUnitParams.CacheSupported = 1;
-    StorageUnitParams.MaxTransferLength = 5 * 512;
+    StorageUnitParams.MaxTransferLength = 512;
     Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
     ASSERT(ERROR_SUCCESS == Error);
     ASSERT(0 == Btl);
@@ -706,57 +3448,120 @@ static void ioctl_transact_flush_test(void)
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
-    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_flush_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
-    ASSERT(0 != Thread);
-
-    memset(DataBuffer, 0, sizeof DataBuffer);
-    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
-    ASSERT(ERROR_SUCCESS == Error);
-    Error = ResetEvent(Overlapped.hEvent);
-    ASSERT(ERROR_SUCCESS == Error);
+    /*
+     * Requests posted on different processors land on different shards (with IoqShardCount
+     * set); a single dispatcher must still receive every one of them.
+     */
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_shard_test_thread,
+            (PVOID)(((UINT_PTR)Btl << 8) | I), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
 
-    ASSERT(0 != Req.Hint);
-    ASSERT(SpdIoctlTransactFlushKind == Req.Kind);
-    ASSERT(7 == Req.Op.Flush.BlockAddress);
-    ASSERT(5 == Req.Op.Flush.BlockCount);
+    for (ULONG J = 0; 300 > J; J++)
+    {
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_SUCCESS == Error);
+        if (8 == Stats.PendingDepth)
+            break;
+        Sleep(10);
+    }
+    ASSERT(8 == Stats.PendingDepth);
 
+    SeenMask = 0;
     memset(&Rsp, 0, sizeof Rsp);
-    Rsp.Hint = Req.Hint;
-    Rsp.Kind = Req.Kind;
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0 != Rsp.Hint ? &Rsp : 0, &Req,
+            DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        ASSERT(0 != Req.Hint);
+        ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+        ASSERT(8 > Req.Op.Read.BlockAddress);
+        ASSERT(1 == Req.Op.Read.BlockCount);
+        ASSERT(0 == (SeenMask & (1 << Req.Op.Read.BlockAddress)));
+        SeenMask |= 1 << Req.Op.Read.BlockAddress;
+
+        FillOrTest(DataBuffer, 512, Req.Op.Read.BlockAddress, 1, SpdIoctlTransactReservedKind);
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = Req.Kind;
+    }
+    ASSERT(0xff == SeenMask);
 
     Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
     ASSERT(ERROR_SUCCESS == Error);
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_SUCCESS == ExitCode);
+    }
+
+    /* unprovisioning cancels the requests pending on every shard */
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_shard_test_thread,
+            (PVOID)(((UINT_PTR)Btl << 8) | I), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG J = 0; 300 > J; J++)
+    {
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_SUCCESS == Error);
+        if (8 == Stats.PendingDepth)
+            break;
+        Sleep(10);
+    }
+    ASSERT(8 == Stats.PendingDepth);
+
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
 
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_SUCCESS != ExitCode);
+    }
+
     Success = CloseHandle(DeviceHandle);
     ASSERT(Success);
 
     SpdOverlappedFini(&Overlapped);
 
     free(DataBuffer);
-
-    WaitForSingleObject(Thread, INFINITE);
-    GetExitCodeThread(Thread, &ExitCode);
-    CloseHandle(Thread);
-
-    ASSERT(ERROR_SUCCESS == ExitCode);
 }
 
-static unsigned __stdcall ioctl_transact_unmap_test_thread(void *Data)
+static void ioctl_transact_queue_depth_test(void)
 {
-    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    OVERLAPPED Overlapped;
     HANDLE DeviceHandle;
+    UINT32 Btl;
+    UINT32 SeenMask;
     DWORD Error;
+    BOOL Success;
+    HANDLE Threads[8];
+    DWORD ExitCode;
     CDB Cdb;
-    union
-    {
-        UINT8 Buffer[FIELD_OFFSET(UNMAP_LIST_HEADER, Descriptors) + 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR)];
-        UNMAP_LIST_HEADER List;
-    } UnmapBuffer;
     UINT32 DataLength;
     UCHAR ScsiStatus;
     union
@@ -765,59 +3570,133 @@ static unsigned __stdcall ioctl_transact_unmap_test_thread(void *Data)
         UCHAR Buffer[32];
     } Sense;
 
+    DataBuffer = malloc(512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+
     Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    ASSERT(ERROR_SUCCESS == Error);
 
-    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 512;
+    StorageUnitParams.QueueDepth = 2;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
 
+    /* the first command other than INQUIRY or REPORT LUNS sets the queue depth */
     memset(&Cdb, 0, sizeof Cdb);
-    Cdb.UNMAP.OperationCode = SCSIOP_UNMAP;
-    Cdb.UNMAP.AllocationLength[1] = sizeof UnmapBuffer;
+    Cdb.CDB6GENERIC.OperationCode = SCSIOP_TEST_UNIT_READY;
+    DataLength = 0;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, 0, 0, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SCSISTAT_GOOD == ScsiStatus);
 
-    memset(&UnmapBuffer, 0, sizeof UnmapBuffer);
-    UnmapBuffer.List.DataLength[1] = sizeof(UNMAP_LIST_HEADER) - 2 + 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR);
-    UnmapBuffer.List.BlockDescrDataLength[1] = 3 * sizeof(UNMAP_BLOCK_DESCRIPTOR);
-    UnmapBuffer.List.Descriptors[0].StartingLba[7] = 7;
-    UnmapBuffer.List.Descriptors[0].LbaCount[3] = 1;
-    UnmapBuffer.List.Descriptors[1].StartingLba[7] = 6;
-    UnmapBuffer.List.Descriptors[1].LbaCount[3] = 2;
-    UnmapBuffer.List.Descriptors[2].StartingLba[7] = 5;
-    UnmapBuffer.List.Descriptors[2].LbaCount[3] = 3;
+    /*
+     * Requests are posted from different processors; with concurrent channels StorPort
+     * may start them concurrently, but it must not hand us more than the queue depth.
+     */
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_shard_test_thread,
+            (PVOID)(((UINT_PTR)Btl << 8) | I), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
 
-    DataLength = sizeof UnmapBuffer;
-    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, &UnmapBuffer, &DataLength,
-        &ScsiStatus, Sense.Buffer);
+    for (ULONG J = 0; 300 > J; J++)
+    {
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_SUCCESS == Error);
+        if (2 == Stats.PendingDepth)
+            break;
+        Sleep(10);
+    }
+    ASSERT(2 == Stats.PendingDepth);
 
-    CloseHandle(DeviceHandle);
+    /* the other requests stay queued in StorPort */
+    Sleep(100);
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(2 == Stats.PendingDepth);
 
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    SeenMask = 0;
+    memset(&Rsp, 0, sizeof Rsp);
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0 != Rsp.Hint ? &Rsp : 0, &Req,
+            DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
 
-    if (ScsiStatus != SCSISTAT_GOOD ||
-        sizeof UnmapBuffer != DataLength)
+        ASSERT(0 != Req.Hint);
+        ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+        ASSERT(8 > Req.Op.Read.BlockAddress);
+        ASSERT(1 == Req.Op.Read.BlockCount);
+        ASSERT(0 == (SeenMask & (1 << Req.Op.Read.BlockAddress)));
+        SeenMask |= 1 << Req.Op.Read.BlockAddress;
+
+        Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+        ASSERT(ERROR_SUCCESS == Error);
+        ASSERT(2 >= Stats.PendingDepth + Stats.ProcessDepth);
+
+        FillOrTest(DataBuffer, 512, Req.Op.Read.BlockAddress, 1, SpdIoctlTransactReservedKind);
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = Req.Kind;
+    }
+    ASSERT(0xff == SeenMask);
+
+    Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = ResetEvent(Overlapped.hEvent);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    for (ULONG I = 0; 8 > I; I++)
     {
-        Error = -'ASRT';
-        goto exit;
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_SUCCESS == ExitCode);
     }
 
-    Error = ERROR_SUCCESS;
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(8 == Stats.CompleteCount[SpdIoctlTransactReadKind]);
 
-exit:
-    tlib_printf("thread=%lu ", Error);
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
 
-    return Error;
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    SpdOverlappedFini(&Overlapped);
+
+    free(DataBuffer);
 }
 
-static void ioctl_transact_unmap_test(void)
+static void ioctl_get_stats_test(void)
 {
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
     PVOID DataBuffer = 0;
     OVERLAPPED Overlapped;
     HANDLE DeviceHandle;
     UINT32 Btl;
+    UINT64 Sum;
     DWORD Error;
     BOOL Success;
     HANDLE Thread;
@@ -836,37 +3715,40 @@ static void ioctl_transact_unmap_test(void)
     memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
     StorageUnitParams.BlockCount = 16;
     StorageUnitParams.BlockLength = 512;
-    StorageUnitParams.UnmapSupported = 1;
     StorageUnitParams.MaxTransferLength = 5 * 512;
     Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
     ASSERT(ERROR_SUCCESS == Error);
     ASSERT(0 == Btl);
 
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Stats.PostCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.PendingDepth);
+    ASSERT(0 == Stats.ProcessDepth);
+
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
-    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_unmap_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
     ASSERT(0 != Thread);
 
-    memset(DataBuffer, 0, sizeof DataBuffer);
     Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
     ASSERT(ERROR_SUCCESS == Error);
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
-    ASSERT(0 != Req.Hint);
-    ASSERT(SpdIoctlTransactUnmapKind == Req.Kind);
-    ASSERT(3 == Req.Op.Unmap.Count);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
 
-    ASSERT(7 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].BlockAddress);
-    ASSERT(1 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].BlockCount);
-    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[0].Reserved);
-    ASSERT(6 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].BlockAddress);
-    ASSERT(2 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].BlockCount);
-    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[1].Reserved);
-    ASSERT(5 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].BlockAddress);
-    ASSERT(3 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].BlockCount);
-    ASSERT(0 == ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)[2].Reserved);
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(1 == Stats.PostCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.CompleteCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.PendingDepth);
+    ASSERT(1 == Stats.PendingDepthMax);
+    ASSERT(1 == Stats.ProcessDepth);
+    ASSERT(1 == Stats.ProcessDepthMax);
+
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
 
     memset(&Rsp, 0, sizeof Rsp);
     Rsp.Hint = Req.Hint;
@@ -877,6 +3759,27 @@ static void ioctl_transact_unmap_test(void)
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(1 == Stats.PostCount[SpdIoctlTransactReadKind]);
+    ASSERT(1 == Stats.CompleteCount[SpdIoctlTransactReadKind]);
+    ASSERT(5 * 512 == Stats.ByteCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.ErrorCount);
+    ASSERT(0 == Stats.AbortCount);
+    ASSERT(0 == Stats.SplitCount);
+    ASSERT(0 == Stats.ProcessDepth);
+    Sum = 0;
+    for (ULONG I = 0; SPD_IOCTL_STATS_HISTOGRAM_SIZE > I; I++)
+        Sum += Stats.QueueWaitHistogram[I];
+    ASSERT(1 == Sum);
+    Sum = 0;
+    for (ULONG I = 0; SPD_IOCTL_STATS_HISTOGRAM_SIZE > I; I++)
+        Sum += Stats.ServiceTimeHistogram[I];
+    ASSERT(1 == Sum);
+
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl + 1, &Stats);
+    ASSERT(ERROR_OPERATION_ABORTED == Error);
+
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
 
@@ -894,9 +3797,11 @@ static void ioctl_transact_unmap_test(void)
     ASSERT(ERROR_SUCCESS == ExitCode);
 }
 
-static unsigned __stdcall ioctl_transact_error_test_thread(void *Data)
+static unsigned __stdcall ioctl_transact_merge_test_thread(void *Data)
 {
-    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    UINT32 Btl = (UINT32)(UINT_PTR)Data >> 16;
+    UINT8 BlockAddress = (UINT8)((UINT_PTR)Data >> 8);
+    UINT8 BlockCount = (UINT8)(UINT_PTR)Data;
     HANDLE DeviceHandle;
     DWORD Error;
     CDB Cdb;
@@ -913,14 +3818,13 @@ static unsigned __stdcall ioctl_transact_error_test_thread(void *Data)
     if (ERROR_SUCCESS != Error)
         goto exit;
 
-    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
-
     memset(&Cdb, 0, sizeof Cdb);
     Cdb.READ16.OperationCode = SCSIOP_READ16;
-    Cdb.READ16.LogicalBlock[7] = 7;
-    Cdb.READ16.TransferLength[3] = 5;
+    Cdb.READ16.LogicalBlock[7] = BlockAddress;
+    Cdb.READ16.TransferLength[3] = BlockCount;
 
-    DataLength = sizeof DataBuffer;
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    DataLength = BlockCount * 512;
     Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
         &ScsiStatus, Sense.Buffer);
 
@@ -929,14 +3833,16 @@ static unsigned __stdcall ioctl_transact_error_test_thread(void *Data)
     if (ERROR_SUCCESS != Error)
         goto exit;
 
-    if (ScsiStatus != SCSISTAT_CHECK_CONDITION ||
-        Sense.Data.SenseKey != SCSI_SENSE_MEDIUM_ERROR ||
-        Sense.Data.AdditionalSenseCode != SCSI_ADSENSE_SEEK_ERROR ||
-        Sense.Data.AdditionalSenseCodeQualifier != SCSI_SENSEQ_POSITIONING_ERROR_DETECTED_BY_READ_OF_MEDIUM ||
-        Sense.Data.Information[3] != 11 ||
-        Sense.Data.Valid != 1)
+    if (ScsiStatus != SCSISTAT_GOOD ||
+        BlockCount * 512u != DataLength)
     {
-        Error = -'ASRT';
+        Error = -'ASR1';
+        goto exit;
+    }
+
+    if (!FillOrTest(DataBuffer, 512, BlockAddress, BlockCount, SpdIoctlTransactWriteKind))
+    {
+        Error = -'ASR2';
         goto exit;
     }
 
@@ -948,9 +3854,10 @@ exit:
     return Error;
 }
 
-static void ioctl_transact_error_test(void)
+static void ioctl_transact_merge_test(void)
 {
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
     PVOID DataBuffer = 0;
@@ -959,7 +3866,7 @@ static void ioctl_transact_error_test(void)
     UINT32 Btl;
     DWORD Error;
     BOOL Success;
-    HANDLE Thread;
+    HANDLE Thread[2];
     DWORD ExitCode;
 
     DataBuffer = malloc(5 * 512);
@@ -976,6 +3883,7 @@ static void ioctl_transact_error_test(void)
     StorageUnitParams.BlockCount = 16;
     StorageUnitParams.BlockLength = 512;
     StorageUnitParams.MaxTransferLength = 5 * 512;
+    StorageUnitParams.MergeSequential = 1;
     Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
     ASSERT(ERROR_SUCCESS == Error);
     ASSERT(0 == Btl);
@@ -983,9 +3891,25 @@ static void ioctl_transact_error_test(void)
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
-    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_error_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
-    ASSERT(0 != Thread);
+    /* queue a read of blocks 7-9 followed by a read of blocks 10-11 */
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        Thread[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_merge_test_thread,
+            (PVOID)(UINT_PTR)((Btl << 16) | (0 == I ? (7 << 8) | 3 : (10 << 8) | 2)), 0, 0);
+        ASSERT(0 != Thread[I]);
+
+        for (ULONG J = 0; 300 > J; J++)
+        {
+            Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+            ASSERT(ERROR_SUCCESS == Error);
+            if (I + 1 == Stats.PendingDepth)
+                break;
+            Sleep(10);
+        }
+        ASSERT(I + 1 == Stats.PendingDepth);
+    }
 
+    /* both reads are dispatched as one request */
     Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
     ASSERT(ERROR_SUCCESS == Error);
     Error = ResetEvent(Overlapped.hEvent);
@@ -995,24 +3919,39 @@ static void ioctl_transact_error_test(void)
     ASSERT(SpdIoctlTransactReadKind == Req.Kind);
     ASSERT(7 == Req.Op.Read.BlockAddress);
     ASSERT(5 == Req.Op.Read.BlockCount);
-    ASSERT(1 == Req.Op.Read.ForceUnitAccess);
-    ASSERT(0 == Req.Op.Read.Reserved);
+
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Stats.PendingDepth);
+    ASSERT(2 == Stats.ProcessDepth);
+    ASSERT(1 == Stats.MergeCount);
+
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
 
     memset(&Rsp, 0, sizeof Rsp);
     Rsp.Hint = Req.Hint;
     Rsp.Kind = Req.Kind;
-    Rsp.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
-    Rsp.Status.SenseKey = SCSI_SENSE_MEDIUM_ERROR;
-    Rsp.Status.ASC = SCSI_ADSENSE_SEEK_ERROR;
-    Rsp.Status.ASCQ = SCSI_SENSEQ_POSITIONING_ERROR_DETECTED_BY_READ_OF_MEDIUM;
-    Rsp.Status.Information = 11;
-    Rsp.Status.InformationValid = 1;
 
     Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
     ASSERT(ERROR_SUCCESS == Error);
     Error = ResetEvent(Overlapped.hEvent);
     ASSERT(ERROR_SUCCESS == Error);
 
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        WaitForSingleObject(Thread[I], INFINITE);
+        GetExitCodeThread(Thread[I], &ExitCode);
+        CloseHandle(Thread[I]);
+
+        ASSERT(ERROR_SUCCESS == ExitCode);
+    }
+
+    Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(2 == Stats.CompleteCount[SpdIoctlTransactReadKind]);
+    ASSERT(5 * 512 == Stats.ByteCount[SpdIoctlTransactReadKind]);
+    ASSERT(0 == Stats.ProcessDepth);
+
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
 
@@ -1022,22 +3961,22 @@ static void ioctl_transact_error_test(void)
     SpdOverlappedFini(&Overlapped);
 
     free(DataBuffer);
-
-    WaitForSingleObject(Thread, INFINITE);
-    GetExitCodeThread(Thread, &ExitCode);
-    CloseHandle(Thread);
-
-    ASSERT(ERROR_SUCCESS == ExitCode);
 }
 
-static unsigned __stdcall ioctl_transact_cancel_test_thread(void *Data)
+static unsigned __stdcall ioctl_transact_lane_test_thread(void *Data)
 {
-    UINT32 Btl = (UINT32)(UINT_PTR)Data;
+    UINT32 Btl = (UINT32)(UINT_PTR)Data >> 16;
+    UINT8 OperationCode = (UINT8)(UINT_PTR)Data;
     HANDLE DeviceHandle;
     DWORD Error;
     CDB Cdb;
-    UINT8 DataBuffer[5 * 512];
+    union
+    {
+        UINT8 Buffer[512];
+        UNMAP_LIST_HEADER List;
+    } DataBuffer;
     UINT32 DataLength;
+    INT DataDirection;
     UCHAR ScsiStatus;
     union
     {
@@ -1051,34 +3990,93 @@ static unsigned __stdcall ioctl_transact_cancel_test_thread(void *Data)
 
     SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
 
+    /* every operation covers block 7 */
     memset(&Cdb, 0, sizeof Cdb);
-    Cdb.READ16.OperationCode = SCSIOP_READ16;
-    Cdb.READ16.LogicalBlock[7] = 7;
-    Cdb.READ16.TransferLength[3] = 5;
-
+    memset(&DataBuffer, 0, sizeof DataBuffer);
     DataLength = sizeof DataBuffer;
-    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+    switch (OperationCode)
+    {
+    case SCSIOP_READ16:
+        Cdb.READ16.OperationCode = SCSIOP_READ16;
+        Cdb.READ16.LogicalBlock[7] = 7;
+        Cdb.READ16.TransferLength[3] = 1;
+        DataDirection = +1;
+        break;
+    case SCSIOP_WRITE16:
+        Cdb.WRITE16.OperationCode = SCSIOP_WRITE16;
+        Cdb.WRITE16.ForceUnitAccess = 1;
+        Cdb.WRITE16.LogicalBlock[7] = 7;
+        Cdb.WRITE16.TransferLength[3] = 1;
+        DataDirection = -1;
+        break;
+    case SCSIOP_SYNCHRONIZE_CACHE16:
+        Cdb.SYNCHRONIZE_CACHE16.OperationCode = SCSIOP_SYNCHRONIZE_CACHE16;
+        Cdb.SYNCHRONIZE_CACHE16.LogicalBlock[7] = 7;
+        Cdb.SYNCHRONIZE_CACHE16.BlockCount[3] = 1;
+        DataLength = 0;
+        DataDirection = 0;
+        break;
+    case SCSIOP_UNMAP:
+        Cdb.UNMAP.OperationCode = SCSIOP_UNMAP;
+        Cdb.UNMAP.AllocationLength[1] = sizeof(UNMAP_LIST_HEADER) + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.DataLength[1] = sizeof(UNMAP_LIST_HEADER) - 2 + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.BlockDescrDataLength[1] = sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataBuffer.List.Descriptors[0].StartingLba[7] = 7;
+        DataBuffer.List.Descriptors[0].LbaCount[3] = 1;
+        DataLength = sizeof(UNMAP_LIST_HEADER) + sizeof(UNMAP_BLOCK_DESCRIPTOR);
+        DataDirection = -1;
+        break;
+    default:
+        Error = -'ASRT';
+        CloseHandle(DeviceHandle);
+        goto exit;
+    }
+
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, DataDirection,
+        0 != DataLength ? &DataBuffer : 0, &DataLength,
         &ScsiStatus, Sense.Buffer);
 
     CloseHandle(DeviceHandle);
 
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (ScsiStatus != SCSISTAT_GOOD)
+    {
+        Error = -'ASRT';
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
 exit:
     tlib_printf("thread=%lu ", Error);
 
     return Error;
 }
 
-static void ioctl_transact_cancel_test(void)
+static void ioctl_transact_lane_test(void)
 {
+    static const UINT8 PostOrder[] =
+    {
+        SCSIOP_UNMAP, SCSIOP_READ16, SCSIOP_SYNCHRONIZE_CACHE16, SCSIOP_WRITE16,
+    };
+    static const UINT8 DispatchOrder[] =
+    {
+        SpdIoctlTransactFlushKind, SpdIoctlTransactWriteKind,
+        SpdIoctlTransactReadKind, SpdIoctlTransactUnmapKind,
+    };
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
-    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_STORAGE_UNIT_STATS Stats;
+    SPD_IOCTL_TRANSACT_REQ Req[4];
+    SPD_IOCTL_TRANSACT_RSP Rsp;
     PVOID DataBuffer = 0;
     OVERLAPPED Overlapped;
     HANDLE DeviceHandle;
     UINT32 Btl;
     DWORD Error;
     BOOL Success;
-    HANDLE Thread;
+    HANDLE Thread[4];
     DWORD ExitCode;
 
     DataBuffer = malloc(5 * 512);
@@ -1094,6 +4092,8 @@ static void ioctl_transact_cancel_test(void)
     memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
     StorageUnitParams.BlockCount = 16;
     StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.CacheSupported = 1;
+    StorageUnitParams.UnmapSupported = 1;
     StorageUnitParams.MaxTransferLength = 5 * 512;
     Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
     ASSERT(ERROR_SUCCESS == Error);
@@ -1102,20 +4102,59 @@ static void ioctl_transact_cancel_test(void)
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
-    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_cancel_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
-    ASSERT(0 != Thread);
+    /*
+     * Queue UNMAP, READ, SYNCHRONIZE CACHE and FUA WRITE in this order. Pass-through
+     * SRB's do not set a priority; they must not end up in the low priority lane.
+     */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Thread[I] = (HANDLE)_beginthreadex(0, 0, ioctl_transact_lane_test_thread,
+            (PVOID)(UINT_PTR)((Btl << 16) | PostOrder[I]), 0, 0);
+        ASSERT(0 != Thread[I]);
+
+        for (ULONG J = 0; 300 > J; J++)
+        {
+            Error = SpdIoctlGetStatistics(DeviceHandle, Btl, &Stats);
+            ASSERT(ERROR_SUCCESS == Error);
+            if (I + 1 == Stats.PendingDepth)
+                break;
+            Sleep(10);
+        }
+        ASSERT(I + 1 == Stats.PendingDepth);
+    }
 
-    Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req, DataBuffer, &Overlapped);
-    ASSERT(ERROR_SUCCESS == Error);
-    Error = ResetEvent(Overlapped.hEvent);
-    ASSERT(ERROR_SUCCESS == Error);
+    /* flush and FUA first, then normal priority I/O, then UNMAP */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Error = SpdIoctlTransact(DeviceHandle, Btl, 0, &Req[I], DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
 
-    ASSERT(0 != Req.Hint);
-    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
-    ASSERT(7 == Req.Op.Read.BlockAddress);
-    ASSERT(5 == Req.Op.Read.BlockCount);
-    ASSERT(1 == Req.Op.Read.ForceUnitAccess);
-    ASSERT(0 == Req.Op.Read.Reserved);
+        ASSERT(0 != Req[I].Hint);
+        ASSERT(DispatchOrder[I] == Req[I].Kind);
+    }
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req[I].Hint;
+        Rsp.Kind = Req[I].Kind;
+
+        Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer, &Overlapped);
+        ASSERT(ERROR_SUCCESS == Error);
+        Error = ResetEvent(Overlapped.hEvent);
+        ASSERT(ERROR_SUCCESS == Error);
+    }
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        WaitForSingleObject(Thread[I], INFINITE);
+        GetExitCodeThread(Thread[I], &ExitCode);
+        CloseHandle(Thread[I]);
+
+        ASSERT(ERROR_SUCCESS == ExitCode);
+    }
 
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
@@ -1126,12 +4165,6 @@ static void ioctl_transact_cancel_test(void)
     SpdOverlappedFini(&Overlapped);
 
     free(DataBuffer);
-
-    WaitForSingleObject(Thread, INFINITE);
-    GetExitCodeThread(Thread, &ExitCode);
-    CloseHandle(Thread);
-
-    ASSERT(0 != ExitCode);
 }
 
 static void ioctl_process_death_test_DO_NOT_RUN_FROM_COMMAND_LINE(void)
@@ -1481,15 +4514,37 @@ void ioctl_tests(void)
     TEST(ioctl_provision_invalid_test);
     TEST(ioctl_provision_multi_test);
     TEST(ioctl_provision_toomany_test);
+    TEST(ioctl_provision_lun_test);
+    TEST(ioctl_provision_reuse_test);
     TEST(ioctl_list_test);
     TEST(ioctl_transact_read_test);
     TEST(ioctl_transact_read_chunked_test);
+    TEST(ioctl_transact_v_test);
+    TEST(ioctl_transact_wait_test);
+    TEST(ioctl_transact_spin_test);
+    TEST(ioctl_transact_read_parallel_test);
+    TEST(ioctl_transact_large_parallel_test);
+    TEST(ioctl_transact_stale_hint_test);
+    TEST(ioctl_transact_buffer_pool_test);
+    TEST(ioctl_transact_ring_test);
+    TEST(ioctl_transact_zero_copy_test);
     TEST(ioctl_transact_write_test);
     TEST(ioctl_transact_write_chunked_test);
     TEST(ioctl_transact_flush_test);
     TEST(ioctl_transact_unmap_test);
+    TEST(ioctl_transact_write_same_test);
+    TEST(ioctl_transact_copy_test);
+    TEST(ioctl_transact_set_cache_test);
+    TEST(ioctl_allocation_map_test);
+    TEST(ioctl_allocation_map_race_test);
+    TEST(ioctl_allocation_map_unmap_error_test);
     TEST(ioctl_transact_error_test);
     TEST(ioctl_transact_cancel_test);
+    TEST(ioctl_transact_shard_test);
+    TEST(ioctl_transact_queue_depth_test);
+    TEST(ioctl_get_stats_test);
+    TEST(ioctl_transact_merge_test);
+    TEST(ioctl_transact_lane_test);
     TEST_OPT(ioctl_process_death_test_DO_NOT_RUN_FROM_COMMAND_LINE);
     TEST(ioctl_process_death_test);
     TEST_OPT(ioctl_process_access_test_DO_NOT_RUN_FROM_COMMAND_LINE);
@@ -448,9 +448,107 @@ static void scsi_read_capacity_test(void)
     scsi_read_capacity_dotest(TRUE);
 }
 
+static void scsi_geometry_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 8 * 512;
+    StorageUnitParams.UnmapSupported = 1;
+    StorageUnitParams.PhysicalBlockLength = 3 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+    ASSERT((UINT32)-1 == Btl);
+
+    StorageUnitParams.PhysicalBlockLength = 8 * 512;
+    StorageUnitParams.OptimalTransferLength = 8 * 512;
+    StorageUnitParams.UnmapGranularity = 4 * 512;
+    StorageUnitParams.UnmapGranularityAlignment = 4;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+    ASSERT((UINT32)-1 == Btl);
+
+    StorageUnitParams.UnmapGranularityAlignment = 1;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    CDB Cdb;
+    UINT8 DataBuffer[VPD_MAX_BUFFER_SIZE];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    {
+        memset(&Cdb, 0, sizeof Cdb);
+        Cdb.READ_CAPACITY16.OperationCode = SCSIOP_SERVICE_ACTION_IN16;
+        Cdb.READ_CAPACITY16.ServiceAction = SERVICE_ACTION_READ_CAPACITY16;
+        Cdb.READ_CAPACITY16.AllocationLength[3] = 255;
+
+        DataLength = 255;
+        Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+            &ScsiStatus, Sense.Buffer);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        /* logical blocks per physical block exponent; lowest aligned block */
+        ASSERT(3 == (DataBuffer[13] & 0x0f));
+        ASSERT(0 == (DataBuffer[14] & 0x3f));
+        ASSERT(0 == DataBuffer[15]);
+    }
+
+    {
+        memset(&Cdb, 0, sizeof Cdb);
+        Cdb.CDB6INQUIRY3.OperationCode = SCSIOP_INQUIRY;
+        Cdb.CDB6INQUIRY3.EnableVitalProductData = 1;
+        Cdb.CDB6INQUIRY3.PageCode = VPD_BLOCK_LIMITS;
+        Cdb.CDB6INQUIRY3.AllocationLength = VPD_MAX_BUFFER_SIZE;
+
+        DataLength = sizeof DataBuffer;
+        Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, +1, DataBuffer, &DataLength,
+            &ScsiStatus, Sense.Buffer);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        /* optimal transfer length granularity defaults to the physical block length */
+        ASSERT(8 == ((DataBuffer[6] << 8) | DataBuffer[7]));
+        ASSERT(8 == (
+            (DataBuffer[12] << 24) | (DataBuffer[13] << 16) |
+            (DataBuffer[14] << 8) | (DataBuffer[15])));
+        ASSERT(4 == (
+            (DataBuffer[28] << 24) | (DataBuffer[29] << 16) |
+            (DataBuffer[30] << 8) | (DataBuffer[31])));
+        ASSERT(0x80000001 == (
+            ((UINT32)DataBuffer[32] << 24) | (DataBuffer[33] << 16) |
+            (DataBuffer[34] << 8) | (DataBuffer[35])));
+    }
+
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+}
+
 void scsi_tests(void)
 {
     TEST(scsi_inquiry_test);
     TEST(scsi_mode_sense_test);
     TEST(scsi_read_capacity_test);
+    TEST(scsi_geometry_test);
 }
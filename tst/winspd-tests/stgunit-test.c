@@ -0,0 +1,712 @@
+/**
+ * @file stgunit-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+
+static const GUID TestGuid =
+    { 0x4112a9a1, 0xf079, 0x4f3d, { 0xba, 0x53, 0x2d, 0x5d, 0xf2, 0x7d, 0x28, 0xb5 } };
+static const GUID TestGuid2 =
+    { 0xd7f5a95d, 0xb9f0, 0x4e47, { 0x87, 0x3b, 0xa, 0xb0, 0xa, 0x89, 0xf9, 0x5a } };
+
+#define STGUNIT_TEST_BLOCK_COUNT        16
+#define STGUNIT_TEST_BLOCK_LENGTH       512
+#define STGUNIT_TEST_THREAD_COUNT       4
+
+/* begin: from stgtest.c */
+static inline UINT64 HashMix64(UINT64 k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+static int FillOrTest(PVOID DataBuffer, UINT32 BlockLength, UINT64 BlockAddress, UINT32 BlockCount,
+    UINT8 FillOrTestOpKind)
+{
+    for (ULONG I = 0, N = BlockCount; N > I; I++)
+    {
+        PUINT64 Buffer = (PVOID)((PUINT8)DataBuffer + I * BlockLength);
+        UINT64 HashAddress = HashMix64(BlockAddress + I + 1);
+        for (ULONG J = 0, M = BlockLength / 8; M > J; J++)
+            if (SpdIoctlTransactReservedKind == FillOrTestOpKind)
+                /* fill buffer */
+                Buffer[J] = HashAddress;
+            else if (SpdIoctlTransactWriteKind == FillOrTestOpKind)
+            {
+                /* test buffer for Write */
+                if (Buffer[J] != HashAddress)
+                    return 0;
+            }
+            else if (SpdIoctlTransactUnmapKind == FillOrTestOpKind)
+            {
+                /* test buffer for Unmap */
+                if (Buffer[J] != 0)
+                    return 0;
+            }
+    }
+    return 1;
+}
+/* end: from stgtest.c */
+
+/*
+ * A storage unit backed by memory. It counts the operations that the dispatcher calls and,
+ * when Async is set, completes reads and writes from the thread pool. When Affinity is set,
+ * it also counts the reads and writes that arrive on a thread that may run elsewhere. When
+ * Delay is set, reads and writes take that many milliseconds; BusyMax records how many ran
+ * at once and OtherThreadCount how many ran on a thread other than the first dispatcher thread.
+ */
+struct stgunit_test_disk
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    PUINT8 Blocks;
+    BOOLEAN Async;
+    const GROUP_AFFINITY *Affinity;
+    LONG ReadCount, WriteCount, FlushCount, UnmapCount, ReadVCount, WriteVCount;
+    LONG AffinityErrorCount;
+    ULONG Delay;
+    LONG BusyCount, BusyMax, OtherThreadCount;
+};
+
+struct stgunit_test_async_op
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    SPD_IOCTL_TRANSACT_RSP *Response;
+    PVOID DataBuffer;
+    PVOID Buffer;
+    UINT64 BlockAddress;
+    UINT32 BlockCount;
+    BOOLEAN Write;
+};
+
+static VOID stgunit_test_copy(struct stgunit_test_disk *Disk,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Write)
+{
+    PUINT8 Block = Disk->Blocks + BlockAddress * STGUNIT_TEST_BLOCK_LENGTH;
+
+    if (Write)
+        memcpy(Block, Buffer, BlockCount * STGUNIT_TEST_BLOCK_LENGTH);
+    else
+        memcpy(Buffer, Block, BlockCount * STGUNIT_TEST_BLOCK_LENGTH);
+}
+
+static VOID CALLBACK stgunit_test_async_callback(PTP_CALLBACK_INSTANCE Instance, PVOID Data)
+{
+    struct stgunit_test_async_op *Op = Data;
+
+    stgunit_test_copy(Op->StorageUnit->UserContext,
+        Op->Buffer, Op->BlockAddress, Op->BlockCount, Op->Write);
+
+    /* the status in the response was cleared by the dispatcher */
+    SpdStorageUnitSendResponse(Op->StorageUnit, Op->Response, Op->DataBuffer);
+
+    free(Op);
+}
+
+static BOOLEAN stgunit_test_io(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Write)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext;
+    struct stgunit_test_async_op *Op;
+    GROUP_AFFINITY Affinity;
+    LONG BusyCount;
+
+    if (GetCurrentThreadId() != StorageUnit->DispatcherThreadId)
+        InterlockedIncrement(&Disk->OtherThreadCount);
+
+    if (0 != Disk->Delay)
+    {
+        BusyCount = InterlockedIncrement(&Disk->BusyCount);
+        for (LONG BusyMax = Disk->BusyMax; BusyMax < BusyCount; BusyMax = Disk->BusyMax)
+            InterlockedCompareExchange(&Disk->BusyMax, BusyCount, BusyMax);
+        Sleep(Disk->Delay);
+        InterlockedDecrement(&Disk->BusyCount);
+    }
+
+    if (0 != Disk->Affinity)
+    {
+        if (!GetThreadGroupAffinity(GetCurrentThread(), &Affinity) ||
+            Disk->Affinity->Group != Affinity.Group ||
+            0 != (Affinity.Mask & ~Disk->Affinity->Mask))
+            InterlockedIncrement(&Disk->AffinityErrorCount);
+    }
+
+    if (Disk->Async)
+    {
+        OperationContext = SpdStorageUnitGetOperationContext();
+        Op = malloc(sizeof *Op);
+        if (0 != OperationContext && 0 != Op)
+        {
+            Op->StorageUnit = StorageUnit;
+            Op->Response = OperationContext->Response;
+            Op->DataBuffer = OperationContext->DataBuffer;
+            Op->Buffer = Buffer;
+            Op->BlockAddress = BlockAddress;
+            Op->BlockCount = BlockCount;
+            Op->Write = Write;
+            if (TrySubmitThreadpoolCallback(stgunit_test_async_callback, Op, 0))
+                return FALSE;
+        }
+        free(Op);
+    }
+
+    stgunit_test_copy(Disk, Buffer, BlockAddress, BlockCount, Write);
+
+    return TRUE;
+}
+
+static BOOLEAN stgunit_test_read(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Flush,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->ReadCount);
+
+    return stgunit_test_io(StorageUnit, Buffer, BlockAddress, BlockCount, FALSE);
+}
+
+static BOOLEAN stgunit_test_write(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Flush,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->WriteCount);
+
+    return stgunit_test_io(StorageUnit, Buffer, BlockAddress, BlockCount, TRUE);
+}
+
+static BOOLEAN stgunit_test_flush(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT32 BlockCount,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->FlushCount);
+
+    return TRUE;
+}
+
+static BOOLEAN stgunit_test_unmap(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->UnmapCount);
+
+    for (UINT32 I = 0; Count > I; I++)
+        memset(Disk->Blocks + Descriptors[I].BlockAddress * STGUNIT_TEST_BLOCK_LENGTH,
+            0, Descriptors[I].BlockCount * STGUNIT_TEST_BLOCK_LENGTH);
+
+    return TRUE;
+}
+
+static VOID stgunit_test_readv(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IO_DESCRIPTOR Descriptors[], UINT32 Count)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->ReadVCount);
+
+    for (UINT32 I = 0; Count > I; I++)
+        stgunit_test_copy(Disk,
+            Descriptors[I].Buffer, Descriptors[I].BlockAddress, Descriptors[I].BlockCount, FALSE);
+}
+
+static VOID stgunit_test_writev(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IO_DESCRIPTOR Descriptors[], UINT32 Count)
+{
+    struct stgunit_test_disk *Disk = StorageUnit->UserContext;
+
+    InterlockedIncrement(&Disk->WriteVCount);
+
+    for (UINT32 I = 0; Count > I; I++)
+        stgunit_test_copy(Disk,
+            Descriptors[I].Buffer, Descriptors[I].BlockAddress, Descriptors[I].BlockCount, TRUE);
+}
+
+static SPD_STORAGE_UNIT_INTERFACE stgunit_test_interface =
+{
+    stgunit_test_read,
+    stgunit_test_write,
+    stgunit_test_flush,
+    stgunit_test_unmap,
+};
+
+static SPD_STORAGE_UNIT_INTERFACE stgunit_test_interface_v =
+{
+    stgunit_test_read,
+    stgunit_test_write,
+    stgunit_test_flush,
+    stgunit_test_unmap,
+    0,
+    0,
+    0,
+    stgunit_test_readv,
+    stgunit_test_writev,
+};
+
+static struct stgunit_test_disk *stgunit_test_disk_create(const GUID *Guid,
+    const SPD_STORAGE_UNIT_INTERFACE *Interface, BOOLEAN Async)
+{
+    SPD_STORAGE_UNIT_PARAMS StorageUnitParams;
+    struct stgunit_test_disk *Disk;
+    DWORD Error;
+
+    Disk = malloc(sizeof *Disk);
+    ASSERT(0 != Disk);
+    memset(Disk, 0, sizeof *Disk);
+    Disk->Blocks = malloc(STGUNIT_TEST_BLOCK_COUNT * STGUNIT_TEST_BLOCK_LENGTH);
+    ASSERT(0 != Disk->Blocks);
+    memset(Disk->Blocks, 0, STGUNIT_TEST_BLOCK_COUNT * STGUNIT_TEST_BLOCK_LENGTH);
+    Disk->Async = Async;
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, Guid, sizeof *Guid);
+    StorageUnitParams.BlockCount = STGUNIT_TEST_BLOCK_COUNT;
+    StorageUnitParams.BlockLength = STGUNIT_TEST_BLOCK_LENGTH;
+    StorageUnitParams.MaxTransferLength = 8 * STGUNIT_TEST_BLOCK_LENGTH;
+    StorageUnitParams.CacheSupported = 1;
+    StorageUnitParams.UnmapSupported = 1;
+    Error = SpdStorageUnitCreate(0, &StorageUnitParams, Interface, &Disk->StorageUnit);
+    ASSERT(ERROR_SUCCESS == Error);
+    Disk->StorageUnit->UserContext = Disk;
+
+    return Disk;
+}
+
+static void stgunit_test_disk_delete(struct stgunit_test_disk *Disk)
+{
+    SpdStorageUnitShutdown(Disk->StorageUnit);
+    SpdStorageUnitWaitDispatcher(Disk->StorageUnit);
+    SpdStorageUnitDelete(Disk->StorageUnit);
+    free(Disk->Blocks);
+    free(Disk);
+}
+
+static DWORD stgunit_test_execute(HANDLE DeviceHandle, UINT32 Btl, UINT8 OperationCode,
+    UINT64 BlockAddress, UINT32 BlockCount, PVOID DataBuffer)
+{
+    DWORD Error;
+    CDB Cdb;
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    /* READ16, WRITE16 and SYNCHRONIZE CACHE(16) have the same LBA and block count fields */
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = OperationCode;
+    for (ULONG I = 0; 8 > I; I++)
+        Cdb.AsByte[2 + I] = (UINT8)(BlockAddress >> (8 * (7 - I)));
+    for (ULONG I = 0; 4 > I; I++)
+        Cdb.AsByte[10 + I] = (UINT8)(BlockCount >> (8 * (3 - I)));
+
+    DataLength = 0 != DataBuffer ? BlockCount * STGUNIT_TEST_BLOCK_LENGTH : 0;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb,
+        SCSIOP_READ16 == OperationCode ? +1 : (SCSIOP_WRITE16 == OperationCode ? -1 : 0),
+        DataBuffer, &DataLength, &ScsiStatus, Sense.Buffer);
+    if (ERROR_SUCCESS != Error)
+        return Error;
+
+    if (SCSISTAT_GOOD != ScsiStatus ||
+        (0 != DataBuffer && BlockCount * STGUNIT_TEST_BLOCK_LENGTH != DataLength))
+        return -'ASRT';
+
+    return ERROR_SUCCESS;
+}
+
+static unsigned __stdcall stgunit_test_io_thread(void *Data)
+{
+    /* each thread writes, flushes and reads back its own part of the storage unit */
+    UINT32 Btl = (UINT32)((UINT_PTR)Data >> 8);
+    UINT64 BlockAddress = ((UINT_PTR)Data & 0xff) *
+        (STGUNIT_TEST_BLOCK_COUNT / STGUNIT_TEST_THREAD_COUNT);
+    UINT32 BlockCount = STGUNIT_TEST_BLOCK_COUNT / STGUNIT_TEST_THREAD_COUNT;
+    HANDLE DeviceHandle;
+    DWORD Error;
+    UINT8 DataBuffer[STGUNIT_TEST_BLOCK_COUNT / STGUNIT_TEST_THREAD_COUNT *
+        STGUNIT_TEST_BLOCK_LENGTH];
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+
+    FillOrTest(DataBuffer, STGUNIT_TEST_BLOCK_LENGTH, BlockAddress, BlockCount,
+        SpdIoctlTransactReservedKind);
+    Error = stgunit_test_execute(DeviceHandle, Btl, SCSIOP_WRITE16,
+        BlockAddress, BlockCount, DataBuffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+
+    Error = stgunit_test_execute(DeviceHandle, Btl, SCSIOP_SYNCHRONIZE_CACHE16,
+        BlockAddress, BlockCount, 0);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+
+    memset(DataBuffer, 0, sizeof DataBuffer);
+    Error = stgunit_test_execute(DeviceHandle, Btl, SCSIOP_READ16,
+        BlockAddress, BlockCount, DataBuffer);
+    if (ERROR_SUCCESS != Error)
+        goto close;
+
+    if (!FillOrTest(DataBuffer, STGUNIT_TEST_BLOCK_LENGTH, BlockAddress, BlockCount,
+        SpdIoctlTransactWriteKind))
+        Error = -'ASR1';
+
+close:
+    CloseHandle(DeviceHandle);
+
+exit:
+    tlib_printf("thread=%lu ", Error);
+
+    return Error;
+}
+
+static void stgunit_test_dotest_io(struct stgunit_test_disk *Disk)
+{
+    HANDLE Threads[STGUNIT_TEST_THREAD_COUNT];
+    DWORD ExitCode;
+    BOOL Success;
+
+    for (ULONG I = 0; STGUNIT_TEST_THREAD_COUNT > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, stgunit_test_io_thread,
+            (PVOID)(((UINT_PTR)Disk->StorageUnit->Btl << 8) | I), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = 0; STGUNIT_TEST_THREAD_COUNT > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        Success = GetExitCodeThread(Threads[I], &ExitCode);
+        ASSERT(Success);
+        ASSERT(ERROR_SUCCESS == ExitCode);
+        CloseHandle(Threads[I]);
+    }
+
+    ASSERT(FillOrTest(Disk->Blocks, STGUNIT_TEST_BLOCK_LENGTH, 0, STGUNIT_TEST_BLOCK_COUNT,
+        SpdIoctlTransactWriteKind));
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->FlushCount);
+}
+
+static void stgunit_dispatcher_async_test(void)
+{
+    struct stgunit_test_disk *Disk;
+    DWORD Error;
+
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, TRUE);
+
+    /* fewer contexts than requests in flight: threads must wait for contexts to come back */
+    SpdStorageUnitSetDispatcherAsyncDepth(Disk->StorageUnit, 2);
+    Error = SpdStorageUnitStartDispatcherEx(Disk->StorageUnit, 1,
+        SPD_STORAGE_UNIT_DISPATCHER_ASYNC);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    stgunit_test_dotest_io(Disk);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->ReadCount);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->WriteCount);
+
+    stgunit_test_disk_delete(Disk);
+}
+
+static void stgunit_dispatcher_shared_test(void)
+{
+    struct stgunit_test_disk *Disk, *Disk2;
+    SPD_DISPATCHER *Dispatcher;
+    DWORD Error;
+
+    Error = SpdDispatcherCreate(2, &Dispatcher);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* one storage unit completes synchronously, the other from the thread pool */
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, FALSE);
+    Disk2 = stgunit_test_disk_create(&TestGuid2, &stgunit_test_interface, TRUE);
+
+    Error = SpdStorageUnitStartDispatcherShared(Disk->StorageUnit, Dispatcher);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = SpdStorageUnitStartDispatcherShared(Disk2->StorageUnit, Dispatcher);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    stgunit_test_dotest_io(Disk);
+    stgunit_test_dotest_io(Disk2);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->ReadCount);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->WriteCount);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk2->ReadCount);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk2->WriteCount);
+
+    /* the shared dispatcher may only go away after its storage units have stopped */
+    stgunit_test_disk_delete(Disk);
+    stgunit_test_disk_delete(Disk2);
+    SpdDispatcherDelete(Dispatcher);
+}
+
+static void stgunit_dispatcher_shared_delete_test(void)
+{
+    struct stgunit_test_disk *Disk, *Disk2;
+    SPD_DISPATCHER *Dispatcher;
+    DWORD Error;
+
+    Error = SpdDispatcherCreate(2, &Dispatcher);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Disk2 = stgunit_test_disk_create(&TestGuid2, &stgunit_test_interface, TRUE);
+    Error = SpdStorageUnitStartDispatcherShared(Disk2->StorageUnit, Dispatcher);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /*
+     * Responses sent from the thread pool must not queue packets to the port of the shared
+     * dispatcher: a packet for a deleted storage unit would outlive it.
+     */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, TRUE);
+        Error = SpdStorageUnitStartDispatcherShared(Disk->StorageUnit, Dispatcher);
+        ASSERT(ERROR_SUCCESS == Error);
+
+        stgunit_test_dotest_io(Disk);
+        ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->ReadCount);
+        ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->WriteCount);
+
+        stgunit_test_disk_delete(Disk);
+
+        /* the shared dispatcher keeps serving the other storage unit */
+        stgunit_test_dotest_io(Disk2);
+    }
+
+    stgunit_test_disk_delete(Disk2);
+    SpdDispatcherDelete(Dispatcher);
+}
+
+static void stgunit_dispatcher_placed_dotest(ULONG Policy)
+{
+    SPD_STORAGE_UNIT_PLACEMENT Placement;
+    struct stgunit_test_disk *Disk;
+    GROUP_AFFINITY Affinity;
+    PROCESSOR_NUMBER ProcessorNumber;
+    USHORT Node;
+    DWORD Error;
+    BOOL Success;
+
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, FALSE);
+
+    memset(&Placement, 0, sizeof Placement);
+    Placement.Policy = Policy;
+    switch (Policy)
+    {
+    case SPD_STORAGE_UNIT_PLACEMENT_NODE:
+        /* the node of the current processor surely has processors */
+        GetCurrentProcessorNumberEx(&ProcessorNumber);
+        Success = GetNumaProcessorNodeEx(&ProcessorNumber, &Node);
+        ASSERT(Success);
+        Placement.Node = Node;
+        break;
+    case SPD_STORAGE_UNIT_PLACEMENT_CPUSET:
+        /* a single entry: every dispatcher thread runs on the processors of this thread */
+        Success = GetThreadGroupAffinity(GetCurrentThread(), &Affinity);
+        ASSERT(Success);
+        Placement.CpuSetCount = 1;
+        Placement.CpuSet = &Affinity;
+        Disk->Affinity = &Affinity;
+        break;
+    }
+
+    Error = SpdStorageUnitStartDispatcherPlaced(Disk->StorageUnit, 2, 0, &Placement);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    stgunit_test_dotest_io(Disk);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->ReadCount);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT <= Disk->WriteCount);
+    ASSERT(0 == Disk->AffinityErrorCount);
+
+    stgunit_test_disk_delete(Disk);
+}
+
+static void stgunit_dispatcher_placed_test(void)
+{
+    stgunit_dispatcher_placed_dotest(SPD_STORAGE_UNIT_PLACEMENT_SPREAD);
+    stgunit_dispatcher_placed_dotest(SPD_STORAGE_UNIT_PLACEMENT_NODE);
+    stgunit_dispatcher_placed_dotest(SPD_STORAGE_UNIT_PLACEMENT_CPUSET);
+}
+
+static void stgunit_dispatcher_vectored_test(void)
+{
+    struct stgunit_test_disk *Disk;
+    DWORD Error;
+
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface_v, FALSE);
+
+    /* with a batch count above 1 all reads and writes go through ReadV and WriteV */
+    SpdStorageUnitSetDispatcherBatchCount(Disk->StorageUnit, 4);
+    Error = SpdStorageUnitStartDispatcher(Disk->StorageUnit, 1);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    stgunit_test_dotest_io(Disk);
+    ASSERT(0 < Disk->ReadVCount);
+    ASSERT(0 < Disk->WriteVCount);
+    ASSERT(0 == Disk->ReadCount);
+    ASSERT(0 == Disk->WriteCount);
+
+    stgunit_test_disk_delete(Disk);
+}
+
+static void stgunit_dispatcher_elastic_test(void)
+{
+    struct stgunit_test_disk *Disk;
+    DWORD Error;
+
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, FALSE);
+
+    /* slow operations keep the dispatcher threads busy while the other requests wait */
+    Disk->Delay = 50;
+    SpdStorageUnitSetDispatcherIdleTimeout(Disk->StorageUnit, 500);
+    Error = SpdStorageUnitStartDispatcherEx(Disk->StorageUnit, STGUNIT_TEST_THREAD_COUNT,
+        SPD_STORAGE_UNIT_DISPATCHER_ELASTIC);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    stgunit_test_dotest_io(Disk);
+    ASSERT(1 < Disk->BusyMax);
+    ASSERT(STGUNIT_TEST_THREAD_COUNT >= Disk->BusyMax);
+    ASSERT(0 < Disk->OtherThreadCount);
+
+    /*
+     * Once idle the added threads exit. Requests issued one at a time leave nothing waiting,
+     * so the dispatcher does not grow again and the first thread serves all of them.
+     */
+    Sleep(4 * 500);
+    Disk->Delay = 0;
+    Disk->OtherThreadCount = 0;
+    Error = stgunit_test_io_thread((PVOID)((UINT_PTR)Disk->StorageUnit->Btl << 8));
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Disk->OtherThreadCount);
+
+    stgunit_test_disk_delete(Disk);
+}
+
+static void stgunit_write_same_fallback_dotest(HANDLE DeviceHandle, UINT32 Btl,
+    UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Unmap, UINT8 Pattern)
+{
+    DWORD Error;
+    CDB Cdb;
+    UINT8 DataBuffer[STGUNIT_TEST_BLOCK_LENGTH];
+    UINT32 DataLength;
+    UCHAR ScsiStatus;
+    union
+    {
+        SENSE_DATA Data;
+        UCHAR Buffer[32];
+    } Sense;
+
+    memset(&Cdb, 0, sizeof Cdb);
+    Cdb.AsByte[0] = SCSIOP_WRITE_SAME16;
+    Cdb.AsByte[1] = Unmap ? 0x08 : 0;
+    Cdb.AsByte[9] = (UINT8)BlockAddress;
+    Cdb.AsByte[13] = (UINT8)BlockCount;
+
+    memset(DataBuffer, Pattern, sizeof DataBuffer);
+    DataLength = sizeof DataBuffer;
+    Error = SpdIoctlScsiExecute(DeviceHandle, Btl, &Cdb, -1, DataBuffer, &DataLength,
+        &ScsiStatus, Sense.Buffer);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SCSISTAT_GOOD == ScsiStatus);
+}
+
+static int stgunit_write_same_fallback_test_blocks(struct stgunit_test_disk *Disk,
+    UINT64 BlockAddress, UINT32 BlockCount, UINT8 Pattern)
+{
+    PUINT8 Block = Disk->Blocks + BlockAddress * STGUNIT_TEST_BLOCK_LENGTH;
+
+    for (ULONG I = 0, N = BlockCount * STGUNIT_TEST_BLOCK_LENGTH; N > I; I++)
+        if (Pattern != Block[I])
+            return 0;
+    return 1;
+}
+
+static void stgunit_write_same_fallback_test(void)
+{
+    struct stgunit_test_disk *Disk;
+    HANDLE DeviceHandle;
+    UINT32 Btl;
+    DWORD Error;
+    BOOL Success;
+
+    /* the test storage unit has no WriteSame: the DLL falls back to Write and Unmap */
+    Disk = stgunit_test_disk_create(&TestGuid, &stgunit_test_interface, FALSE);
+    Btl = Disk->StorageUnit->Btl;
+
+    Error = SpdStorageUnitStartDispatcher(Disk->StorageUnit, 1);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* 9 blocks take two writes of the replicated pattern: 8 blocks (MaxTransferLength) and 1 */
+    stgunit_write_same_fallback_dotest(DeviceHandle, Btl, 3, 9, FALSE, 0xa5);
+    ASSERT(2 == Disk->WriteCount);
+    ASSERT(0 == Disk->UnmapCount);
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 0, 3, 0));
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 3, 9, 0xa5));
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 12, 4, 0));
+
+    /* UNMAP with a pattern that is not all zeroes must still write the pattern */
+    stgunit_write_same_fallback_dotest(DeviceHandle, Btl, 0, 2, TRUE, 0x5a);
+    ASSERT(3 == Disk->WriteCount);
+    ASSERT(0 == Disk->UnmapCount);
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 0, 2, 0x5a));
+
+    /* UNMAP with an all-zeroes pattern becomes a single Unmap */
+    stgunit_write_same_fallback_dotest(DeviceHandle, Btl, 4, 6, TRUE, 0);
+    ASSERT(3 == Disk->WriteCount);
+    ASSERT(1 == Disk->UnmapCount);
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 3, 1, 0xa5));
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 4, 6, 0));
+    ASSERT(stgunit_write_same_fallback_test_blocks(Disk, 10, 2, 0xa5));
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    stgunit_test_disk_delete(Disk);
+}
+
+void stgunit_tests(void)
+{
+    TEST(stgunit_dispatcher_async_test);
+    TEST(stgunit_dispatcher_shared_test);
+    TEST(stgunit_dispatcher_shared_delete_test);
+    TEST(stgunit_dispatcher_placed_test);
+    TEST(stgunit_dispatcher_vectored_test);
+    TEST(stgunit_dispatcher_elastic_test);
+    TEST(stgunit_write_same_fallback_test);
+}